@@ -5,403 +5,2735 @@
  *
  */
 
-#include "hashtable.h"
-#include <pthread.h>
+#include "hashtable_epoch.h"
+#include "hashtable_internal.h"
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
+#include <time.h>
 
-#define FAIL_CODE      -1
-#define SUCCESS_CODE   1
-#define MAX_KEY_LENGTH 256
-#define MAX_TABLE_SIZE 10000
-#define MAX_FILE_SIZE  2048
+/**
+ * @brief Validates a key and calculates its hash with the table's hash function.
+ *
+ * @param hash_table_t p_ht The hash table object.
+ * @param const char * p_key The key to hash.
+ * @param size_t keylen length of the key
+ * @param uint64_t * p_hash Where the hash is stored.
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE on failure
+ */
+static int hash_table_index(hash_table_t * p_ht,
+                            const char *   p_key,
+                            size_t         keylen,
+                            uint64_t *     p_hash)
+{
+    int result = FAIL_CODE;
+    if (NULL == p_ht)
+    {
+        fprintf(stderr, "hash_table_index: p_ht is NULL");
+        goto EXIT;
+    }
+    if (NULL == p_key)
+    {
+        fprintf(stderr, "hash_table_index: p_key is NULL");
+        goto EXIT;
+    }
+    if (keylen > MAX_KEY_LENGTH)
+    {
+        fprintf(stderr, "hash_table_index: p_key is invalid");
+        goto EXIT;
+    }
+
+    *p_hash = ht_hash(p_ht, p_key, keylen);
+    result  = SUCCESS_CODE;
+
+EXIT:
+    return result;
+} /* hash_table_index() */
+
+char * ht_key_dup(const char * p_key, size_t keylen)
+{
+    char * p_copy = malloc(keylen + 1);
+    if (NULL != p_copy)
+    {
+        memcpy(p_copy, p_key, keylen);
+        p_copy[keylen] = '\0';
+    }
+    return p_copy;
+} /* ht_key_dup() */
+
+void ht_lock_all(hash_table_t * p_ht, bool exclusive)
+{
+    if (HT_CONC_GLOBAL == p_ht->concurrency)
+    {
+        ht_hash_lock(p_ht);
+        return;
+    }
+    for (uint32_t i = 0; i < p_ht->stripe_count; i++)
+    {
+        ht_stripe_lock(p_ht, &p_ht->stripes[i], exclusive);
+    }
+} /* ht_lock_all() */
+
+void ht_unlock_all(hash_table_t * p_ht)
+{
+    if (HT_CONC_GLOBAL == p_ht->concurrency)
+    {
+        pthread_mutex_unlock(&p_ht->hash_lock);
+        return;
+    }
+    for (uint32_t i = p_ht->stripe_count; i > 0; i--)
+    {
+        pthread_rwlock_unlock(&p_ht->stripes[i - 1].lock);
+    }
+} /* ht_unlock_all() */
+
+/**
+ * @brief Records entries added to or removed from a stripe. Striped tables
+ * publish to the shared count in batches so writers on different stripes do
+ * not bounce its cache line on every call.
+ */
+static inline void chain_count_add(hash_table_t * p_ht,
+                                   ht_stripe_t *  p_stripe,
+                                   long           delta)
+{
+    p_stripe->count_delta += delta;
+    if ((HT_CONC_GLOBAL == p_ht->concurrency) ||
+        (HT_COUNT_BATCH <= labs(p_stripe->count_delta)))
+    {
+        atomic_fetch_add_explicit(
+            &p_ht->count, (size_t)p_stripe->count_delta, memory_order_relaxed);
+        p_stripe->count_delta = 0;
+    }
+} /* chain_count_add() */
+
+/**
+ * @brief Reads a bucket head or next pointer. Lock-free readers walk chains
+ * while writers relink them, so every link is read with acquire and written
+ * with release ordering, which costs nothing extra on x86.
+ */
+static inline entry * ht_link_load(entry * const * pp_link)
+{
+    return __atomic_load_n(pp_link, __ATOMIC_ACQUIRE);
+} /* ht_link_load() */
+
+static inline void ht_link_store(entry ** pp_link, entry * p_entry)
+{
+    __atomic_store_n(pp_link, p_entry, __ATOMIC_RELEASE);
+} /* ht_link_store() */
+
+/**
+ * @brief Returns the head of the bucket a hash maps to in a bucket array
+ */
+static inline entry ** chain_bucket(entry ** elements, uint32_t size, uint64_t hash)
+{
+    return &elements[ht_mix(hash) & (size - 1)];
+} /* chain_bucket() */
+
+/**
+ * @brief Checks whether an entry holds key. The cached hash and length reject
+ * almost every other entry before the key bytes are compared.
+ */
+static inline bool chain_match(const entry * p_entry,
+                               const char *  p_key,
+                               size_t        keylen,
+                               uint64_t      hash)
+{
+    return (p_entry->hash == hash) && (p_entry->keylength == keylen) &&
+           (0 == memcmp(p_entry->key, p_key, keylen));
+} /* chain_match() */
+
+/**
+ * @brief Walks one chain for key and returns the link pointing at it
+ */
+static inline entry ** chain_walk(entry **     pp_link,
+                                  const char * p_key,
+                                  size_t       keylen,
+                                  uint64_t     hash)
+{
+    for (entry * p_entry = ht_link_load(pp_link); NULL != p_entry;
+         pp_link = &p_entry->next, p_entry = ht_link_load(pp_link))
+    {
+        if (chain_match(p_entry, p_key, keylen, hash))
+        {
+            return pp_link;
+        }
+    }
+    return NULL;
+} /* chain_walk() */
+
+/**
+ * @brief Walks one chain for key without a lock. Writers may relink the chain
+ * meanwhile, so the entry is returned rather than the link to it.
+ */
+static inline entry * chain_search(entry * const * pp_head,
+                                   const char *    p_key,
+                                   size_t          keylen,
+                                   uint64_t        hash)
+{
+    for (entry * p_entry = ht_link_load(pp_head); NULL != p_entry;
+         p_entry         = ht_link_load(&p_entry->next))
+    {
+        if (chain_match(p_entry, p_key, keylen, hash))
+        {
+            return p_entry;
+        }
+    }
+    return NULL;
+} /* chain_search() */
+
+/**
+ * @brief Finds the link that points at the entry holding key
+ *
+ * @param hash_table_t p_ht table to search, both arrays while resizing
+ * @param const char * p_key key to find
+ * @param size_t keylen length of the key
+ * @param uint64_t hash hash of the key
+ * @return entry ** link to the entry on success
+ * @return NULL when the key is not present
+ */
+static entry ** chain_find(hash_table_t * p_ht,
+                           const char *   p_key,
+                           size_t         keylen,
+                           uint64_t       hash)
+{
+    entry ** pp_link = NULL;
+    if ((NULL != p_ht->bloom) && !ht_bloom_maybe(p_ht, hash))
+    {
+        return NULL;
+    }
+    if (NULL != p_ht->old_elements)
+    {
+        pp_link = chain_walk(chain_bucket(p_ht->old_elements, p_ht->old_size, hash),
+                             p_key,
+                             keylen,
+                             hash);
+        if (NULL != pp_link)
+        {
+            return pp_link;
+        }
+    }
+    return chain_walk(
+        chain_bucket(p_ht->elements, p_ht->size, hash), p_key, keylen, hash);
+} /* chain_find() */
+
+/**
+ * @brief ht_reclaim_function for views and bucket arrays
+ */
+static void chain_reclaim_free(void * p_ctx, void * ptr)
+{
+    (void)p_ctx;
+    free(ptr);
+} /* chain_reclaim_free() */
+
+/**
+ * @brief ht_reclaim_function for the entries left behind by chain_copy_bucket,
+ * whose long keys now belong to the copies
+ */
+static void chain_reclaim_shell(void * p_ctx, void * ptr)
+{
+    ht_entry_release(p_ctx, ptr);
+} /* chain_reclaim_shell() */
+
+/**
+ * @brief ht_reclaim_function for an entry taken out by hash_table_remove, the
+ * object itself went back to the caller
+ */
+static void chain_reclaim_entry(void * p_ctx, void * ptr)
+{
+    ht_entry_free(p_ctx, ptr);
+} /* chain_reclaim_entry() */
+
+/**
+ * @brief ht_reclaim_function for an entry taken out by hash_table_delete
+ */
+static void chain_reclaim_delete(void * p_ctx, void * ptr)
+{
+    hash_table_t * p_ht    = p_ctx;
+    entry *        p_entry = ptr;
+    p_ht->cleanup(p_entry->object);
+    ht_entry_free(p_ht, p_entry);
+} /* chain_reclaim_delete() */
 
 /**
- * @brief entry struct
- * @param struct entry *next
- * @NOTE: *next pointer used because external chaining is used
- * which is used when there is a collision of two keys. When
- * there is a collision, the next pointer is used to point to
- * the next entry in the list.
+ * @brief ht_reclaim_function for an object an upsert replaced
  */
-typedef struct entry
+static void chain_reclaim_object(void * p_ctx, void * ptr)
 {
-    char *         key;
-    size_t         keylength;
-    void *         object;
-    struct entry * next; // *next pointer used because external chaining is used.
-} entry;
+    hash_table_t * p_ht = p_ctx;
+    p_ht->cleanup(ptr);
+} /* chain_reclaim_object() */
 
-typedef struct _hash_table
+/**
+ * @brief Returns true once no lock-free reader can still be using the view
+ * from before the current resize, so old buckets may be emptied
+ */
+static bool chain_rehash_ready(hash_table_t * p_ht)
 {
-    uint32_t           size;      // size of the table
-    hashfunction *     hash;      // hash function to use
-    cleanup_function * cleanup;   // cleanup function to use
-    entry **           elements;  // an array of pointers to entries
-    pthread_mutex_t    hash_lock; // mutex lock for the hash table
-} hashtable_t;
+    if (atomic_load_explicit(&p_ht->rehash_ready, memory_order_relaxed))
+    {
+        return true;
+    }
+    if (!ht_epoch_passed(p_ht->rehash_epoch))
+    {
+        return false;
+    }
+    atomic_store_explicit(&p_ht->rehash_ready, true, memory_order_relaxed);
+    return true;
+} /* chain_rehash_ready() */
 
 /**
- * @brief Calculates the index in the hash table for a given key.
+ * @brief Moves one old bucket for a lock-free table. Each entry is copied into
+ * elements and the originals are retired, their next pointers untouched, so
+ * a reader already inside the old chain still walks all of it. Copies are
+ * published before the old bucket is cleared, and every copy is allocated
+ * before anything is published so a failed allocation changes nothing.
  *
- * @param hash_table_t p_ht The hash table object.
- * @param const char * p_key The key to calculate the index for.
- * @return The index in the hash table for the given key.
+ * @param hash_table_t p_ht table being resized
+ * @param uint32_t index old bucket to move
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE when the copies could not be allocated
+ */
+static int chain_copy_bucket(hash_table_t * p_ht, uint32_t index)
+{
+    entry * p_copies = NULL;
+    for (entry * p_entry = p_ht->old_elements[index]; NULL != p_entry;
+         p_entry         = p_entry->next)
+    {
+        entry * p_copy = ht_entry_copy(p_ht, p_entry);
+        if (NULL == p_copy)
+        {
+            fprintf(stderr, "chain_copy_bucket: ht_entry_copy failed\n");
+            while (NULL != p_copies)
+            {
+                p_copy   = p_copies;
+                p_copies = p_copies->next;
+                ht_entry_release(p_ht, p_copy);
+            }
+            return FAIL_CODE;
+        }
+        p_copy->next = p_copies;
+        p_copies     = p_copy;
+    }
+
+    while (NULL != p_copies)
+    {
+        entry *  p_copy  = p_copies;
+        p_copies         = p_copy->next;
+        entry ** pp_head = chain_bucket(p_ht->elements, p_ht->size, p_copy->hash);
+        p_copy->next     = *pp_head;
+        ht_link_store(pp_head, p_copy);
+    }
+    entry * p_entry = p_ht->old_elements[index];
+    ht_link_store(&p_ht->old_elements[index], NULL);
+    while (NULL != p_entry)
+    {
+        entry * p_next = p_entry->next;
+        ht_epoch_retire(p_entry, chain_reclaim_shell, p_ht);
+        p_entry = p_next;
+    }
+    return SUCCESS_CODE;
+} /* chain_copy_bucket() */
+
+/**
+ * @brief Returns true once a stripe has moved all of its old buckets
+ */
+static inline bool chain_stripe_drained(hash_table_t * p_ht, ht_stripe_t * p_stripe)
+{
+    return (NULL == p_ht->old_elements) ||
+           (p_stripe->rehash_index >= (p_ht->old_size / p_ht->stripe_count));
+} /* chain_stripe_drained() */
+
+/**
+ * @brief Moves up to buckets of the stripe's non-empty old buckets into
+ * elements. Empty buckets are cheap to skip, so a larger number of them is
+ * allowed per call. Caller holds the stripe exclusively.
+ *
+ * @param hash_table_t p_ht table being resized
+ * @param ht_stripe_t p_stripe stripe whose buckets are moved
+ * @param uint32_t buckets number of non-empty buckets to move
+ * @return true when this call drained the last stripe and old_elements can
+ * be released with chain_resize_locked
+ */
+static bool chain_rehash_step(hash_table_t * p_ht,
+                              ht_stripe_t *  p_stripe,
+                              uint32_t       buckets)
+{
+    if (chain_stripe_drained(p_ht, p_stripe))
+    {
+        return false;
+    }
+    bool lockfree = (HT_CONC_LOCKFREE_READ == p_ht->concurrency);
+    if (lockfree && !chain_rehash_ready(p_ht))
+    {
+        return false;
+    }
+
+    uint32_t stride       = p_ht->stripe_count;
+    uint32_t first        = (uint32_t)(p_stripe - p_ht->stripes);
+    uint32_t limit        = p_ht->old_size / stride;
+    uint32_t empty_visits = buckets * HT_REHASH_EMPTIES;
+    while ((0 < buckets) && (p_stripe->rehash_index < limit))
+    {
+        uint32_t index   = first + (p_stripe->rehash_index * stride);
+        entry *  p_entry = p_ht->old_elements[index];
+        if (NULL == p_entry)
+        {
+            p_stripe->rehash_index++;
+            if (0 == --empty_visits)
+            {
+                break;
+            }
+            continue;
+        }
+        if (lockfree)
+        {
+            if (SUCCESS_CODE != chain_copy_bucket(p_ht, index))
+            {
+                break;
+            }
+            p_stripe->rehash_index++;
+            buckets--;
+            continue;
+        }
+        while (NULL != p_entry)
+        {
+            entry *  p_next  = p_entry->next;
+            entry ** pp_head = chain_bucket(p_ht->elements, p_ht->size, p_entry->hash);
+            p_entry->next    = *pp_head;
+            *pp_head         = p_entry;
+            p_entry          = p_next;
+        }
+        p_ht->old_elements[index] = NULL;
+        p_stripe->rehash_index++;
+        buckets--;
+    }
+
+    if (p_stripe->rehash_index == limit)
+    {
+        return (1 == atomic_fetch_sub(&p_ht->rehash_pending, 1));
+    }
+    return false;
+} /* chain_rehash_step() */
+
+/**
+ * @brief Picks the bucket count for count entries. Grows once there is more
+ * than one entry per bucket and shrinks once fewer than one bucket in
+ * HT_SHRINK_RATIO is used.
+ */
+static uint32_t chain_target_size(hash_table_t * p_ht, size_t count)
+{
+    if ((count > p_ht->size) && (HT_MAX_BUCKETS > p_ht->size))
+    {
+        return p_ht->size * 2;
+    }
+    if ((p_ht->size > p_ht->min_size) && (count < (p_ht->size / HT_SHRINK_RATIO)))
+    {
+        return p_ht->size / 2;
+    }
+    return p_ht->size;
+} /* chain_target_size() */
+
+/**
+ * @brief Returns true when the caller should run chain_resize_locked: either
+ * its stripe step drained the last old bucket, or the load factor left its
+ * bounds and this stripe has nothing left to move. Caller holds p_stripe.
+ */
+static inline bool chain_needs_resize(hash_table_t * p_ht,
+                                      ht_stripe_t *  p_stripe,
+                                      bool           drained_last)
+{
+    if (drained_last)
+    {
+        return true;
+    }
+    if (!chain_stripe_drained(p_ht, p_stripe))
+    {
+        return false;
+    }
+    size_t count = atomic_load_explicit(&p_ht->count, memory_order_relaxed);
+    return chain_target_size(p_ht, count) != p_ht->size;
+} /* chain_needs_resize() */
+
+/**
+ * @brief Hands the current arrays to lock-free readers in a new view and
+ * retires the previous view along with the array the resize released. Other
+ * modes just free the released array.
+ *
+ * @param hash_table_t p_ht table whose arrays changed
+ * @param ht_view_t p_view preallocated view, NULL outside lock-free mode
+ * @param entry ** p_released drained old array, or NULL
+ * @param bool started a new resize began and its old buckets must wait for
+ * the readers of the previous view
+ */
+static void chain_publish(hash_table_t * p_ht,
+                          ht_view_t *    p_view,
+                          entry **       p_released,
+                          bool           started)
+{
+    if (NULL == p_view)
+    {
+        free(p_released);
+        return;
+    }
+    if ((NULL == p_released) && !started)
+    {
+        free(p_view);
+        return;
+    }
+
+    p_view->elements     = p_ht->elements;
+    p_view->size         = p_ht->size;
+    p_view->old_elements = p_ht->old_elements;
+    p_view->old_size     = p_ht->old_size;
+    ht_view_t * p_prev   = atomic_exchange(&p_ht->view, p_view);
+    ht_epoch_retire(p_prev, chain_reclaim_free, p_ht);
+    if (NULL != p_released)
+    {
+        ht_epoch_retire(p_released, chain_reclaim_free, p_ht);
+    }
+    if (started)
+    {
+        p_ht->rehash_epoch = ht_epoch_now();
+        atomic_store(&p_ht->rehash_ready, false);
+    }
+} /* chain_publish() */
+
+/**
+ * @brief Releases a drained old_elements array and starts a new resize if the
+ * load factor calls for one. A stripe that saw no writes during the last
+ * resize may still hold old buckets, those are moved here first so one idle
+ * stripe cannot hold back growth. Caller holds every lock exclusively.
+ *
+ * @param hash_table_t p_ht table to check
+ */
+static void chain_resize_locked(hash_table_t * p_ht)
+{
+    for (uint32_t i = 0; i < p_ht->stripe_count; i++)
+    {
+        atomic_fetch_add_explicit(
+            &p_ht->count, (size_t)p_ht->stripes[i].count_delta, memory_order_relaxed);
+        p_ht->stripes[i].count_delta = 0;
+    }
+
+    ht_view_t * p_view = NULL;
+    if (HT_CONC_LOCKFREE_READ == p_ht->concurrency)
+    {
+        // Allocated up front so that readers are never left with a stale view
+        p_view = malloc(sizeof(ht_view_t));
+        if (NULL == p_view)
+        {
+            fprintf(stderr, "chain_resize_locked: malloc failed\n");
+            return;
+        }
+    }
+
+    entry ** p_released = NULL;
+    bool     started    = false;
+    size_t   count      = atomic_load_explicit(&p_ht->count, memory_order_relaxed);
+    uint32_t new_size   = chain_target_size(p_ht, count);
+    if ((NULL != p_ht->old_elements) &&
+        ((0 == atomic_load(&p_ht->rehash_pending)) || (new_size != p_ht->size)))
+    {
+        for (uint32_t i = 0; i < p_ht->stripe_count; i++)
+        {
+            while (!chain_stripe_drained(p_ht, &p_ht->stripes[i]))
+            {
+                uint32_t before = p_ht->stripes[i].rehash_index;
+                chain_rehash_step(
+                    p_ht, &p_ht->stripes[i], UINT32_MAX / HT_REHASH_EMPTIES);
+                if (before == p_ht->stripes[i].rehash_index)
+                {
+                    // Lock-free copies could not be allocated, or readers of
+                    // the previous view are still active. Try again later.
+                    goto PUBLISH;
+                }
+            }
+        }
+        p_released         = p_ht->old_elements;
+        p_ht->old_elements = NULL;
+        p_ht->old_size     = 0;
+    }
+    if ((NULL != p_ht->old_elements) || (new_size == p_ht->size))
+    {
+        goto PUBLISH;
+    }
+
+    entry ** p_elements = calloc(new_size, sizeof(entry *));
+    if (NULL == p_elements)
+    {
+        // Not fatal, the table keeps working at its current size
+        fprintf(stderr, "chain_resize_locked: calloc failed\n");
+        goto PUBLISH;
+    }
+    for (uint32_t i = 0; i < p_ht->stripe_count; i++)
+    {
+        p_ht->stripes[i].rehash_index = 0;
+    }
+    atomic_store(&p_ht->rehash_pending, p_ht->stripe_count);
+    p_ht->old_elements = p_ht->elements;
+    p_ht->old_size     = p_ht->size;
+    p_ht->elements     = p_elements;
+    p_ht->size         = new_size;
+    started            = true;
+PUBLISH:
+    chain_publish(p_ht, p_view, p_released, started);
+} /* chain_resize_locked() */
+
+/**
+ * @brief Runs the reclaims the calling thread has queued for a lock-free
+ * table. They may call the table's cleanup, so no lock may be held.
+ */
+static void chain_collect(hash_table_t * p_ht)
+{
+    if (HT_CONC_LOCKFREE_READ == p_ht->concurrency)
+    {
+        ht_epoch_collect(p_ht);
+    }
+} /* chain_collect() */
+
+/**
+ * @brief Finishes a write: publishes any resize work the operation found and
+ * drops the stripe. Striped tables must release the stripe before taking
+ * every lock, GLOBAL tables already hold the only lock. Nodes retired under
+ * the locks are reclaimed once they are all dropped.
+ */
+static void chain_write_done(hash_table_t * p_ht, ht_stripe_t * p_stripe, bool resize)
+{
+    if (HT_CONC_GLOBAL == p_ht->concurrency)
+    {
+        if (resize)
+        {
+            chain_resize_locked(p_ht);
+        }
+        ht_unlock(p_ht, p_stripe);
+        return;
+    }
+    ht_unlock(p_ht, p_stripe);
+    if (resize)
+    {
+        ht_lock_all(p_ht, true);
+        chain_resize_locked(p_ht);
+        ht_unlock_all(p_ht);
+    }
+    chain_collect(p_ht);
+} /* chain_write_done() */
+
+/**
+ * @brief Picks a random seed for the default hash so that keys which collide
+ * in one table do not collide in another. Falls back to the clock and the
+ * address space layout if the kernel cannot supply randomness.
+ *
+ * @return uint64_t seed
  */
-static size_t hash_table_index(hash_table_t * p_ht, const char * p_key)
+uint64_t hash_table_seed(void)
+{
+    uint64_t seed = 0;
+    if (sizeof(seed) != getrandom(&seed, sizeof(seed), GRND_NONBLOCK))
+    {
+        struct timespec now = { 0 };
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        seed = ((uint64_t)now.tv_sec << 32) ^ (uint64_t)now.tv_nsec ^
+               (uint64_t)(uintptr_t)&seed;
+    }
+    return seed;
+} /* hash_table_seed() */
+
+hash_table_t * hash_table_create(uint32_t           size,
+                                 hashfunction *     p_hf,
+                                 cleanup_function * p_cf)
+{
+    return hash_table_create_ex(size, p_hf, p_cf, NULL);
+} /* hash_table_create() */
+
+hash_table_t * hash_table_create_ex(uint32_t                  size,
+                                    hashfunction *            p_hf,
+                                    cleanup_function *        p_cf,
+                                    const hash_table_opts_t * p_opts)
 {
-    size_t result = FAIL_CODE;
+    hash_table_t *    p_ht    = NULL;
+    hash_table_opts_t opts    = { 0 };
+    if (NULL != p_opts)
+    {
+        opts = *p_opts;
+    }
+    if (NULL == p_cf)
+    {
+        fprintf(stderr, "hash_table_create: p_cf is NULL");
+        goto EXIT;
+    }
+
+    p_ht = calloc(1, sizeof(hash_table_t));
     if (NULL == p_ht)
     {
-        fprintf(stderr, "hash_table_index: p_ht is NULL");
+        fprintf(stderr, "hash_table_create: calloc failed");
         goto EXIT;
     }
-    if (NULL == p_key)
+    // initialize pthread mutex hash lock
+    if (pthread_mutex_init(&p_ht->hash_lock, NULL) != 0)
+    {
+        fprintf(stderr, "hash_table_create: pthread_mutex_init failed");
+        goto ERR;
+    }
+    p_ht->bgsave = ht_bgsave_new(p_ht);
+    if (NULL == p_ht->bgsave)
+    {
+        fprintf(stderr, "hash_table_create: ht_bgsave_new failed\n");
+        goto ERR;
+    }
+    if (opts.substring_index)
+    {
+        p_ht->trigram = ht_trigram_new();
+        if (NULL == p_ht->trigram)
+        {
+            fprintf(stderr, "hash_table_create: ht_trigram_new failed\n");
+            goto ERR;
+        }
+    }
+    if (opts.prefix_index)
+    {
+        p_ht->art = ht_art_new();
+        if (NULL == p_ht->art)
+        {
+            fprintf(stderr, "hash_table_create: ht_art_new failed\n");
+            goto ERR;
+        }
+    }
+    if (opts.stats)
+    {
+        p_ht->stats = ht_stats_new();
+        if (NULL == p_ht->stats)
+        {
+            fprintf(stderr, "hash_table_create: ht_stats_new failed\n");
+            goto ERR;
+        }
+    }
+    p_ht->size     = ht_round_size(size);
+    p_ht->min_size = p_ht->size;
+    p_ht->hash     = p_hf;
+    if ((NULL == p_hf) || ((hashfunction *)hash_function == p_hf))
+    {
+        p_ht->hash = NULL;
+        p_ht->seed = hash_table_seed();
+    }
+    p_ht->cleanup     = p_cf;
+    p_ht->encode      = opts.encode;
+    p_ht->decode      = opts.decode;
+    p_ht->backend     = opts.backend;
+    p_ht->concurrency = opts.concurrency;
+    if (HT_BACKEND_OPEN == p_ht->backend)
+    {
+        if (HT_CONC_GLOBAL != p_ht->concurrency)
+        {
+            fprintf(stderr, "hash_table_create: open backend needs HT_CONC_GLOBAL\n");
+            goto ERR;
+        }
+        if ((0 != opts.memory_limit) || (0 != opts.sweep_interval_ms))
+        {
+            fprintf(stderr, "hash_table_create: open backend cannot evict\n");
+            goto ERR;
+        }
+        if (0 != opts.bloom_filter)
+        {
+            // Its control bytes already turn most misses away in one group
+            fprintf(stderr, "hash_table_create: open backend keeps no Bloom filter\n");
+            goto ERR;
+        }
+        if (SUCCESS_CODE != ht_open_init(p_ht, size))
+        {
+            fprintf(stderr, "hash_table_create: ht_open_init failed\n");
+            goto ERR;
+        }
+        goto EXIT;
+    }
+
+    p_ht->inline_key_max = opts.inline_key_max;
+    if (0 == p_ht->inline_key_max)
+    {
+        p_ht->inline_key_max = HT_INLINE_KEY;
+    }
+    if (MAX_KEY_LENGTH < p_ht->inline_key_max)
+    {
+        p_ht->inline_key_max = MAX_KEY_LENGTH;
+    }
+    if ((NULL != p_ht->art) && (HT_CONC_LOCKFREE_READ == p_ht->concurrency))
+    {
+        // Lock-free resizes copy entries and their inline keys but share long
+        // ones, so the prefix index only points at keys that never move
+        p_ht->inline_key_max = 0;
+    }
+    // Rounded so every entry carved out of a slab chunk stays pointer aligned
+    p_ht->entry_size = (sizeof(entry) + p_ht->inline_key_max + 1 + 7) & ~(size_t)7;
+
+    p_ht->stripe_count = 1;
+    if (HT_CONC_GLOBAL != p_ht->concurrency)
+    {
+        // ht_round_size gives a power of two, and the table must never have
+        // fewer buckets than stripes
+        p_ht->stripe_count = ht_round_size(
+            (0 == opts.lock_stripes) ? HT_DEFAULT_STRIPES : opts.lock_stripes);
+        if (p_ht->min_size < p_ht->stripe_count)
+        {
+            p_ht->size     = p_ht->stripe_count;
+            p_ht->min_size = p_ht->stripe_count;
+        }
+    }
+    p_ht->stripes =
+        aligned_alloc(HT_CACHE_LINE, p_ht->stripe_count * sizeof(ht_stripe_t));
+    if (NULL == p_ht->stripes)
+    {
+        fprintf(stderr, "hash_table_create: aligned_alloc failed\n");
+        goto ERR;
+    }
+    memset(p_ht->stripes, 0, p_ht->stripe_count * sizeof(ht_stripe_t));
+    for (uint32_t i = 0; i < p_ht->stripe_count; i++)
+    {
+        if (pthread_rwlock_init(&p_ht->stripes[i].lock, NULL) != 0)
+        {
+            fprintf(stderr, "hash_table_create: pthread_rwlock_init failed\n");
+            goto ERR;
+        }
+        if (SUCCESS_CODE != ht_slab_init(&p_ht->stripes[i].slab))
+        {
+            fprintf(stderr, "hash_table_create: ht_slab_init failed\n");
+            goto ERR;
+        }
+    }
+    p_ht->elements = calloc(sizeof(entry *), p_ht->size);
+    if (NULL == p_ht->elements)
+    {
+        fprintf(stderr, "hash_table_create: calloc failed\n");
+        goto ERR;
+    }
+    if (HT_CONC_LOCKFREE_READ == p_ht->concurrency)
+    {
+        ht_view_t * p_view = calloc(1, sizeof(ht_view_t));
+        if (NULL == p_view)
+        {
+            fprintf(stderr, "hash_table_create: calloc failed\n");
+            goto ERR;
+        }
+        p_view->elements = p_ht->elements;
+        p_view->size     = p_ht->size;
+        atomic_init(&p_ht->view, p_view);
+    }
+    if ((0 != opts.bloom_filter) && (NULL == ht_bloom_new(p_ht)))
+    {
+        fprintf(stderr, "hash_table_create: ht_bloom_new failed\n");
+        goto ERR;
+    }
+    if ((0 != opts.memory_limit) || (0 != opts.sweep_interval_ms))
+    {
+        // Last, the sweeper may start working on the table straight away
+        if (NULL == ht_cache_new(p_ht, &opts))
+        {
+            fprintf(stderr, "hash_table_create: ht_cache_new failed\n");
+            goto ERR;
+        }
+    }
+    goto EXIT;
+
+ERR:
+    ht_cache_free(p_ht->cache);
+    ht_bloom_free(p_ht);
+    ht_bgsave_free(p_ht->bgsave);
+    ht_trigram_free(p_ht->trigram);
+    ht_art_free(p_ht->art);
+    // The view shares elements, only the view itself is freed here
+    free(atomic_load(&p_ht->view));
+    free(p_ht->elements);
+    free(p_ht->stripes);
+    free(p_ht->stats);
+    free(p_ht);
+    p_ht = NULL;
+EXIT:
+    return p_ht;
+} /* hash_table_create_ex() */
+
+void hash_table_destroy(hash_table_t * p_ht)
+{
+    if (NULL == p_ht)
+    {
+        fprintf(stderr, "hash_table_destroy: hash table is NULL\n");
+        goto EXIT;
+    }
+    // The sweeper still writes to the table and its log
+    ht_cache_free(p_ht->cache);
+    p_ht->cache = NULL;
+    // A background dump checkpoints the log once it is installed
+    ht_bgsave_free(p_ht->bgsave);
+    p_ht->bgsave = NULL;
+    ht_wal_close(p_ht->wal);
+    p_ht->wal = NULL;
+    ht_trigram_free(p_ht->trigram);
+    p_ht->trigram = NULL;
+    ht_art_free(p_ht->art);
+    p_ht->art = NULL;
+    if (HT_BACKEND_OPEN == p_ht->backend)
+    {
+        ht_open_destroy(p_ht);
+    }
+    // No reader may still hold the table, so pending reclaims can run now
+    ht_epoch_drain(p_ht);
+    free(atomic_load(&p_ht->view));
+    ht_bloom_free(p_ht);
+    // Entries and keys go back with their slabs, only the objects need a walk
+    for (uint32_t i = 0; (NULL != p_ht->elements) && (i < p_ht->size); i++)
+    {
+        for (entry * temp = p_ht->elements[i]; NULL != temp; temp = temp->next)
+        {
+            p_ht->cleanup(temp->object);
+        }
+    }
+    for (uint32_t i = 0; (NULL != p_ht->old_elements) && (i < p_ht->old_size); i++)
+    {
+        for (entry * temp = p_ht->old_elements[i]; NULL != temp; temp = temp->next)
+        {
+            p_ht->cleanup(temp->object);
+        }
+    }
+
+    pthread_mutex_destroy(&p_ht->hash_lock);
+    for (uint32_t i = 0; (NULL != p_ht->stripes) && (i < p_ht->stripe_count); i++)
+    {
+        pthread_rwlock_destroy(&p_ht->stripes[i].lock);
+        ht_slab_destroy(&p_ht->stripes[i].slab);
+    }
+    free(p_ht->stripes);
+    p_ht->stripes = NULL;
+
+    free(p_ht->elements);
+    p_ht->elements = NULL;
+    free(p_ht->old_elements);
+    p_ht->old_elements = NULL;
+    free(p_ht->stats);
+    p_ht->stats = NULL;
+    free(p_ht);
+    p_ht = NULL;
+
+EXIT:
+    return;
+} /* hash_table_destroy() */
+
+static int walk_buckets(entry ** elements,
+                        uint32_t size,
+                        ht_visit_function * visit,
+                        void * p_ctx)
+{
+    for (uint32_t i = 0; (NULL != elements) && (i < size); i++)
+    {
+        entry * tmp = elements[i];
+        while (NULL != tmp)
+        {
+            entry * next = tmp->next;
+            if (SUCCESS_CODE != visit(tmp, p_ctx))
+            {
+                return FAIL_CODE;
+            }
+            tmp = next;
+        }
+    }
+    return SUCCESS_CODE;
+} /* walk_buckets() */
+
+int ht_walk(hash_table_t * p_ht, ht_visit_function * visit, void * p_ctx)
+{
+    if (HT_BACKEND_OPEN == p_ht->backend)
+    {
+        return ht_open_for_each(p_ht, visit, p_ctx);
+    }
+    if (SUCCESS_CODE != walk_buckets(p_ht->old_elements, p_ht->old_size, visit, p_ctx))
+    {
+        return FAIL_CODE;
+    }
+    return walk_buckets(p_ht->elements, p_ht->size, visit, p_ctx);
+} /* ht_walk() */
+
+static int print_visit(entry * p_entry, void * p_ctx)
+{
+    (void)p_ctx;
+    printf("\t\"%s\"(%p)\n", p_entry->key, p_entry->object);
+    return SUCCESS_CODE;
+} /* print_visit() */
+
+/**
+ * @brief Appends the key and a null byte at the running offset in p_ctx
+ */
+typedef struct key_copy_ctx
+{
+    char * output;
+    size_t index;
+} key_copy_ctx;
+
+static int copy_key_visit(entry * p_entry, void * p_ctx)
+{
+    key_copy_ctx * p_copy     = p_ctx;
+    size_t         key_length = p_entry->keylength;
+    memcpy(p_copy->output + p_copy->index, p_entry->key, key_length);
+    p_copy->index += key_length;
+    p_copy->output[p_copy->index] = '\0'; // Assign null byte directly
+    p_copy->index++;
+    return SUCCESS_CODE;
+} /* copy_key_visit() */
+
+void hash_table_print(hash_table_t * p_ht)
+{
+    if (NULL == p_ht)
+    {
+        fprintf(stderr, "hash_table_print: hash table is NULL\n");
+        goto EXIT;
+    }
+    ht_lock_all(p_ht, false);
+    printf("start table\n");
+
+    if ((HT_BACKEND_OPEN == p_ht->backend) || (NULL != p_ht->old_elements))
+    {
+        // Bucket numbers mean little mid-resize, so list entries flat instead
+        ht_walk(p_ht, print_visit, NULL);
+        goto END;
+    }
+    for (uint32_t i = 0; i < p_ht->size; i++)
+    {
+        if (p_ht->elements[i] != NULL)
+        {
+            printf("\t%i\t", i);
+            entry * tmp = p_ht->elements[i];
+            while (NULL != tmp)
+            {
+                printf("\"%s\"(%p) - ", tmp->key, tmp->object);
+                {
+                    // If object exists call on the objects print
+                    // function
+                    // print_object(tmp->object);
+                }
+                tmp = tmp->next;
+            }
+            printf("\n");
+        }
+    }
+END:
+    printf("end table\n");
+    ht_unlock_all(p_ht);
+
+EXIT:
+    return;
+} /* hash_table_print() */
+
+int copy_keys_to_string(hash_table_t * p_ht, char * output)
+{
+    int ret_code = FAIL_CODE;
+    if (NULL == p_ht)
+    {
+        fprintf(stderr, "copy_keys_to_string: hash table is NULL\n");
+        goto EXIT;
+    }
+
+    if (NULL == output)
+    {
+        fprintf(stderr, "copy_keys_to_string: output char* is NULL\n");
+        goto EXIT;
+    }
+
+    // iterate the entire list and add a null byte between the strings
+    key_copy_ctx copy = { .output = output, .index = 0 };
+    ht_lock_all(p_ht, false);
+    ht_walk(p_ht, copy_key_visit, &copy);
+    ht_unlock_all(p_ht);
+
+    ret_code = SUCCESS_CODE;
+EXIT:
+    return ret_code;
+} /* copy_keys_to_string() */
+
+int hash_table_insert(hash_table_t * p_ht, const char * p_key, void * obj)
+{
+    if (NULL == p_key)
+    {
+        fprintf(stderr, "hash_table_insert: p_key is NULL\n");
+        return FAIL_CODE;
+    }
+    return hash_table_insert_n(p_ht, p_key, strlen(p_key), obj);
+} /* hash_table_insert() */
+
+/**
+ * @brief Adds a new key to the table's secondary indexes, under the lock
+ * that orders writes to it
+ * @param const char* the table's own copy of the key, the prefix index
+ * points at it
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE when an index could not take it, none of them hold it
+ */
+static int ht_index_add(hash_table_t * p_ht, const char * p_key, size_t keylen)
+{
+    if ((NULL != p_ht->trigram) &&
+        (SUCCESS_CODE != ht_trigram_add(p_ht->trigram, p_key, keylen)))
+    {
+        return FAIL_CODE;
+    }
+    if ((NULL != p_ht->art) && (SUCCESS_CODE != ht_art_insert(p_ht->art, p_key, keylen)))
+    {
+        if (NULL != p_ht->trigram)
+        {
+            ht_trigram_remove(p_ht->trigram, p_key, keylen);
+        }
+        return FAIL_CODE;
+    }
+    return SUCCESS_CODE;
+} /* ht_index_add() */
+
+/**
+ * @brief Drops a key from the table's secondary indexes, before the table
+ * frees its copy of the key
+ */
+static void ht_index_remove(hash_table_t * p_ht, const char * p_key, size_t keylen)
+{
+    if (NULL != p_ht->trigram)
+    {
+        ht_trigram_remove(p_ht->trigram, p_key, keylen);
+    }
+    if (NULL != p_ht->art)
+    {
+        ht_art_remove(p_ht->art, p_key, keylen);
+    }
+} /* ht_index_remove() */
+
+/**
+ * @brief Inserts into an open addressing table, indexing and logging the
+ * insert. The caller holds hash_lock.
+ * @param uint64_t * p_lsn receives the log record to commit, 0 when none
+ * @return SUCCESS_CODE on success or when the key already exists
+ * @return FAIL_CODE on failure
+ */
+static int open_insert_logged(hash_table_t * p_ht,
+                              const char *   p_key,
+                              size_t         keylen,
+                              uint64_t       hash,
+                              void *         obj,
+                              uint64_t *     p_lsn)
+{
+    bool indexed = (NULL != p_ht->trigram) || (NULL != p_ht->art);
+    bool fresh   = ((NULL != p_ht->wal) || indexed) &&
+                 (NULL == ht_open_lookup(p_ht, p_key, keylen, hash));
+    int ret_code = ht_open_insert(p_ht, p_key, keylen, hash, obj);
+    if (!fresh || (SUCCESS_CODE != ret_code))
+    {
+        return ret_code;
+    }
+    // Indexed once stored, the prefix index points at the table's copy
+    const char * p_stored = ht_open_key(p_ht, p_key, keylen, hash);
+    if (indexed && (SUCCESS_CODE != ht_index_add(p_ht, p_stored, keylen)))
+    {
+        ret_code = FAIL_CODE;
+    }
+    else if (NULL != p_ht->wal)
+    {
+        *p_lsn = ht_wal_log(p_ht->wal, HT_WAL_INSERT, p_key, keylen, obj);
+        if (0 == *p_lsn)
+        {
+            ht_index_remove(p_ht, p_stored, keylen);
+            ret_code = FAIL_CODE;
+        }
+    }
+    if (SUCCESS_CODE != ret_code)
+    {
+        // Unindexed or unlogged keys would go missing, undo the insert
+        ht_open_remove(p_ht, p_key, keylen, hash);
+    }
+    return ret_code;
+} /* open_insert_logged() */
+
+/**
+ * @brief Links a new entry whose key the caller found absent into the live
+ * array, indexing and logging the insert first. The caller holds the entry's
+ * stripe for writing.
+ * @param uint64_t * p_lsn receives the log record to commit, 0 when none
+ * @return SUCCESS_CODE when linked
+ * @return FAIL_CODE when an index or the log refused it, nothing was changed
+ */
+static int chain_link_locked(hash_table_t * p_ht,
+                             ht_stripe_t *  p_stripe,
+                             entry *        p_entry,
+                             uint64_t *     p_lsn)
+{
+    if (SUCCESS_CODE != ht_index_add(p_ht, p_entry->key, p_entry->keylength))
+    {
+        return FAIL_CODE;
+    }
+    // Logged under the stripe lock so the log orders writes to a key correctly
+    if (NULL != p_ht->wal)
+    {
+        *p_lsn = ht_wal_log(
+            p_ht->wal, HT_WAL_INSERT, p_entry->key, p_entry->keylength, p_entry->object);
+        if (0 == *p_lsn)
+        {
+            ht_index_remove(p_ht, p_entry->key, p_entry->keylength);
+            return FAIL_CODE;
+        }
+    }
+
+    // New entries always go to the live array, even mid-resize
+    entry ** pp_head = chain_bucket(p_ht->elements, p_ht->size, p_entry->hash);
+    p_entry->next    = *pp_head;
+    if (NULL != p_ht->bloom)
+    {
+        // Counted first, so a lock-free reader that finds the entry linked
+        // finds it in the filter too
+        ht_bloom_add(p_ht, p_entry->hash);
+    }
+    ht_link_store(pp_head, p_entry);
+    chain_count_add(p_ht, p_stripe, 1);
+    if (NULL != p_ht->cache)
+    {
+        ht_cache_charge(p_ht, p_stripe, p_entry, 1);
+    }
+    return SUCCESS_CODE;
+} /* chain_link_locked() */
+
+/**
+ * @brief Links a new entry into the live array unless its key is already
+ * present. An expired entry holding the key is unlinked and replaced. The
+ * caller holds the entry's stripe for writing and frees the entry when it
+ * was not linked.
+ * @param bool * p_linked set when the entry went into the table
+ * @param entry ** pp_stale receives the expired entry that was replaced, for
+ * the caller to hand to ht_chain_release once the stripe is released
+ * @param uint64_t * p_lsn receives the log record to commit, 0 when none
+ * @return SUCCESS_CODE when linked or the key already exists
+ * @return FAIL_CODE when the log refused the record
+ */
+static int chain_insert_locked(hash_table_t * p_ht,
+                               ht_stripe_t *  p_stripe,
+                               entry *        p_entry,
+                               bool *         p_linked,
+                               entry **       pp_stale,
+                               uint64_t *     p_lsn)
+{
+    *p_linked        = false;
+    *pp_stale        = NULL;
+    entry ** pp_link = chain_find(p_ht, p_entry->key, p_entry->keylength, p_entry->hash);
+    if ((NULL != pp_link) && ht_entry_expired(*pp_link))
+    {
+        *pp_stale = ht_chain_unlink(p_ht, p_stripe, pp_link, p_lsn);
+        if (NULL == *pp_stale)
+        {
+            return FAIL_CODE;
+        }
+        pp_link = NULL;
+    }
+    if (NULL != pp_link)
+    {
+        fprintf(stderr, "hash_table_insert: entry already exists\n");
+        // We aren't failing here, a fail code will cause our program to shut down
+        // we just can't have a duplicate key
+        return SUCCESS_CODE;
+    }
+    if (SUCCESS_CODE != chain_link_locked(p_ht, p_stripe, p_entry, p_lsn))
+    {
+        return FAIL_CODE;
+    }
+    *p_linked = true;
+    return SUCCESS_CODE;
+} /* chain_insert_locked() */
+
+/**
+ * @brief Frees the expired entry an insert replaced, once its stripe is free
+ */
+static void chain_drop_stale(hash_table_t * p_ht, entry * p_stale)
+{
+    if (NULL == p_stale)
+    {
+        return;
+    }
+    if (NULL != p_ht->cache)
+    {
+        ht_cache_count(p_ht, p_stale->hash, HT_CACHE_EXPIRED);
+    }
+    ht_chain_release(p_ht, p_stale, true);
+    chain_collect(p_ht);
+} /* chain_drop_stale() */
+
+int hash_table_insert_n(hash_table_t * p_ht,
+                        const char *   p_key,
+                        size_t         keylen,
+                        void *         obj)
+{
+    return hash_table_insert_ttl(p_ht, p_key, keylen, obj, 0);
+} /* hash_table_insert_n() */
+
+int hash_table_insert_ttl(hash_table_t * p_ht,
+                          const char *   p_key,
+                          size_t         keylen,
+                          void *         obj,
+                          uint32_t       ttl)
+{
+    int ret_code = FAIL_CODE;
+    if (NULL == p_ht)
+    {
+        fprintf(stderr, "hash_table_insert: p_ht is NULL\n");
+        goto EXIT;
+    }
+    if (NULL == obj)
+    {
+        fprintf(stderr, "hash_table_insert: obj is NULL\n");
+        goto EXIT;
+    }
+
+    uint64_t hash = 0;
+    if (SUCCESS_CODE != hash_table_index(p_ht, p_key, keylen, &hash))
+    {
+        fprintf(stderr, "hash_table_insert: hash_table_index failed\n");
+        goto EXIT;
+    }
+    ret_code = ht_insert_hashed(p_ht, p_key, keylen, hash, obj, ttl);
+EXIT:
+    return ret_code;
+} /* hash_table_insert_ttl() */
+
+int ht_insert_hashed(hash_table_t * p_ht,
+                     const char *   p_key,
+                     size_t         keylen,
+                     uint64_t       hash,
+                     void *         obj,
+                     uint32_t       ttl)
+{
+    int      ret_code = FAIL_CODE;
+    uint64_t lsn      = 0;
+    if (HT_BACKEND_OPEN == p_ht->backend)
+    {
+        if (0 != ttl)
+        {
+            fprintf(stderr, "hash_table_insert: open backend keeps no TTLs\n");
+            goto EXIT;
+        }
+        ht_hash_lock(p_ht);
+        ret_code = open_insert_logged(p_ht, p_key, keylen, hash, obj, &lsn);
+        pthread_mutex_unlock(&p_ht->hash_lock);
+        goto COMMIT;
+    }
+
+    // Allocate before locking so the stripe is held for as short as possible
+    entry * p_entry = ht_entry_new(p_ht, p_key, keylen, hash);
+    if (NULL == p_entry)
+    {
+        fprintf(stderr, "hash_table_insert: ht_entry_new failed\n");
+        goto EXIT;
+    }
+    p_entry->object = obj;
+    if (0 != ttl)
+    {
+        uint32_t now     = ht_clock_now();
+        p_entry->expires = (ttl < UINT32_MAX - now) ? now + ttl : UINT32_MAX;
+    }
+
+    ht_stripe_t * p_stripe = ht_stripe_for(p_ht, hash);
+    ht_write_lock(p_ht, p_stripe);
+    bool    drained_last = chain_rehash_step(p_ht, p_stripe, HT_REHASH_STEP);
+    bool    linked       = false;
+    entry * p_stale      = NULL;
+    ret_code = chain_insert_locked(p_ht, p_stripe, p_entry, &linked, &p_stale, &lsn);
+    chain_write_done(p_ht,
+                     p_stripe,
+                     linked ? chain_needs_resize(p_ht, p_stripe, drained_last)
+                            : drained_last);
+    chain_drop_stale(p_ht, p_stale);
+    if (!linked)
+    {
+        ht_entry_free(p_ht, p_entry);
+        p_entry = NULL;
+    }
+    else if (NULL != p_ht->cache)
+    {
+        ht_cache_evict(p_ht);
+    }
+COMMIT:
+    if ((0 != lsn) && (SUCCESS_CODE != ht_wal_commit(p_ht->wal, lsn, false)))
+    {
+        fprintf(stderr, "hash_table_insert: inserted but not durable\n");
+        ret_code = FAIL_CODE;
+    }
+    if (SUCCESS_CODE == ret_code)
+    {
+        ht_stat_add(p_ht, HT_STAT_INSERT, 1);
+    }
+EXIT:
+    return ret_code;
+} /* ht_insert_hashed() */
+
+/**
+ * @brief Returns the object of an entry a lookup found, or NULL when it has
+ * expired. Caches also mark the entry for the CLOCK hand, only storing when
+ * the mark is clear so hot entries do not dirty their cache line each time.
+ */
+static inline void * chain_live_object(const hash_table_t * p_ht, entry * p_entry)
+{
+    if (ht_entry_expired(p_entry))
+    {
+        return NULL;
+    }
+    if ((NULL != p_ht->cache) &&
+        (0 == __atomic_load_n(&p_entry->referenced, __ATOMIC_RELAXED)))
+    {
+        __atomic_store_n(&p_entry->referenced, 1, __ATOMIC_RELAXED);
+    }
+    // Upserts may swap the object under a lock-free reader
+    return __atomic_load_n(&p_entry->object, __ATOMIC_ACQUIRE);
+} /* chain_live_object() */
+
+/**
+ * @brief Searches both arrays of a view, old buckets first
+ */
+static inline entry * chain_search_view(const ht_view_t * p_view,
+                                        const char *      p_key,
+                                        size_t            keylen,
+                                        uint64_t          hash)
+{
+    entry * p_entry = NULL;
+    if (NULL != p_view->old_elements)
+    {
+        p_entry = chain_search(chain_bucket(p_view->old_elements, p_view->old_size, hash),
+                               p_key,
+                               keylen,
+                               hash);
+    }
+    if (NULL == p_entry)
+    {
+        p_entry = chain_search(
+            chain_bucket(p_view->elements, p_view->size, hash), p_key, keylen, hash);
+    }
+    return p_entry;
+} /* chain_search_view() */
+
+/**
+ * @brief Looks key up under its stripe's shared lock
+ *
+ * @return void * object on success
+ * @return NULL when the key is not present
+ */
+static void * chain_lookup_striped(hash_table_t * p_ht,
+                                   const char *   p_key,
+                                   size_t         keylen,
+                                   uint64_t       hash)
+{
+    void *        object   = NULL;
+    ht_stripe_t * p_stripe = ht_stripe_for(p_ht, hash);
+
+    // A shared stripe cannot move buckets, resizing is left to writers
+    ht_read_lock(p_ht, p_stripe);
+    entry ** pp_link = chain_find(p_ht, p_key, keylen, hash);
+    if (NULL != pp_link)
+    {
+        object = chain_live_object(p_ht, *pp_link);
+    }
+    ht_unlock(p_ht, p_stripe);
+    return object;
+} /* chain_lookup_striped() */
+
+/**
+ * @brief Looks key up without taking any lock. The view is loaded once per
+ * attempt, and a miss is retried if a resize published a new view meanwhile,
+ * since entries inserted after that went only into the new array. A thread
+ * that cannot enter an epoch looks the key up under the stripe lock instead.
+ *
+ * @return void * object on success
+ * @return NULL when the key is not present
+ */
+static void * chain_lookup_lockfree(hash_table_t * p_ht,
+                                    const char *   p_key,
+                                    size_t         keylen,
+                                    uint64_t       hash)
+{
+    void *      object = NULL;
+    ht_view_t * p_view = NULL;
+
+    if (!ht_epoch_enter())
+    {
+        return chain_lookup_striped(p_ht, p_key, keylen, hash);
+    }
+    if ((NULL != p_ht->bloom) && !ht_bloom_maybe(p_ht, hash))
+    {
+        ht_epoch_exit();
+        return NULL;
+    }
+    do
+    {
+        p_view          = atomic_load(&p_ht->view);
+        entry * p_entry = chain_search_view(p_view, p_key, keylen, hash);
+        if (NULL != p_entry)
+        {
+            object = chain_live_object(p_ht, p_entry);
+            break;
+        }
+    } while (p_view != atomic_load(&p_ht->view));
+    ht_epoch_exit();
+    // Deletes alone may not retire enough to collect, so readers help
+    chain_collect(p_ht);
+    return object;
+} /* chain_lookup_lockfree() */
+
+void * hash_table_lookup(hash_table_t * p_ht, const char * p_key)
+{
+    if (NULL == p_key)
+    {
+        fprintf(stderr, "hash_table_lookup: p_key is NULL\n");
+        return NULL;
+    }
+    return hash_table_lookup_n(p_ht, p_key, strlen(p_key));
+} /* hash_table_lookup() */
+
+void * hash_table_lookup_n(hash_table_t * p_ht, const char * p_key, size_t keylen)
+{
+    void * object = NULL;
+    if (NULL == p_ht)
+    {
+        fprintf(stderr, "hash_table_lookup: p_ht is NULL\n");
+        goto EXIT;
+    }
+
+    uint64_t hash = 0;
+    if (SUCCESS_CODE != hash_table_index(p_ht, p_key, keylen, &hash))
+    {
+        fprintf(stderr, "hash_table_lookup: hash_table_index failed\n");
+        goto EXIT;
+    }
+    object = ht_lookup_hashed(p_ht, p_key, keylen, hash);
+EXIT:
+    return object;
+} /* hash_table_lookup_n() */
+
+void * ht_lookup_hashed(hash_table_t * p_ht,
+                        const char *   p_key,
+                        size_t         keylen,
+                        uint64_t       hash)
+{
+    void * object = NULL;
+    if (HT_BACKEND_OPEN == p_ht->backend)
+    {
+        ht_hash_lock(p_ht);
+        object = ht_open_lookup(p_ht, p_key, keylen, hash);
+        pthread_mutex_unlock(&p_ht->hash_lock);
+        goto EXIT;
+    }
+
+    if (HT_CONC_LOCKFREE_READ == p_ht->concurrency)
+    {
+        object = chain_lookup_lockfree(p_ht, p_key, keylen, hash);
+        goto EXIT;
+    }
+
+    if (HT_CONC_STRIPED == p_ht->concurrency)
+    {
+        object = chain_lookup_striped(p_ht, p_key, keylen, hash);
+        goto EXIT;
+    }
+
+    ht_stripe_t * p_stripe = ht_stripe_for(p_ht, hash);
+
+    ht_write_lock(p_ht, p_stripe);
+    bool     drained_last = chain_rehash_step(p_ht, p_stripe, HT_REHASH_STEP);
+    entry ** pp_link      = chain_find(p_ht, p_key, keylen, hash);
+    entry *  p_stale      = NULL;
+    uint64_t lsn          = 0;
+    if ((NULL != pp_link) && ht_entry_expired(*pp_link))
+    {
+        // The table is held for writing anyway, so the expired entry goes now
+        p_stale = ht_chain_unlink(p_ht, p_stripe, pp_link, &lsn);
+    }
+    else if (NULL != pp_link)
+    {
+        object = chain_live_object(p_ht, *pp_link);
+    }
+    chain_write_done(p_ht,
+                     p_stripe,
+                     (NULL != p_stale) ? chain_needs_resize(p_ht, p_stripe, drained_last)
+                                       : drained_last);
+    chain_drop_stale(p_ht, p_stale);
+    if ((0 != lsn) && (SUCCESS_CODE != ht_wal_commit(p_ht->wal, lsn, false)))
+    {
+        fprintf(stderr, "hash_table_lookup: expired entry removed but not durable\n");
+    }
+
+EXIT:
+    if (NULL != p_ht->cache)
+    {
+        ht_cache_count(p_ht, hash, (NULL != object) ? HT_CACHE_HIT : HT_CACHE_MISS);
+    }
+    ht_stat_add(p_ht, (NULL != object) ? HT_STAT_HIT : HT_STAT_MISS, 1);
+    return object;
+} /* ht_lookup_hashed() */
+
+/**
+ * @brief keys of one window of a batch call
+ * @NOTE: order lists the window positions sorted by stripe, so the stripes a
+ * window needs are locked in ascending order like ht_lock_all does.
+ */
+typedef struct ht_batch
+{
+    size_t       count;
+    const char * keys[HT_BATCH_WINDOW];
+    size_t       keylens[HT_BATCH_WINDOW];
+    uint64_t     hashes[HT_BATCH_WINDOW];
+    bool         valid[HT_BATCH_WINDOW];
+    bool         maybe[HT_BATCH_WINDOW]; // lookups: valid and past the filter
+    uint32_t     stripes[HT_BATCH_WINDOW];
+    uint32_t     order[HT_BATCH_WINDOW];
+} ht_batch_t;
+
+/**
+ * @brief Insertion sorts the window positions by stripe, windows are short
+ */
+static void batch_sort(ht_batch_t * p_batch)
+{
+    for (uint32_t i = 0; i < p_batch->count; i++)
+    {
+        uint32_t pos    = i;
+        uint32_t stripe = p_batch->stripes[i];
+        while ((0 < pos) && (p_batch->stripes[p_batch->order[pos - 1]] > stripe))
+        {
+            p_batch->order[pos] = p_batch->order[pos - 1];
+            pos--;
+        }
+        p_batch->order[pos] = i;
+    }
+} /* batch_sort() */
+
+/**
+ * @brief Hashes every key of a window and sorts the window by stripe
+ */
+static void batch_prepare(hash_table_t *       p_ht,
+                          ht_batch_t *         p_batch,
+                          const char * const * keys,
+                          const size_t *       keylens,
+                          size_t               count)
+{
+    p_batch->count = count;
+    for (size_t i = 0; i < count; i++)
+    {
+        p_batch->keys[i]    = keys[i];
+        p_batch->keylens[i] = 0;
+        if (NULL != keys[i])
+        {
+            p_batch->keylens[i] = (NULL == keylens) ? strlen(keys[i]) : keylens[i];
+        }
+        p_batch->valid[i] = (SUCCESS_CODE == hash_table_index(p_ht,
+                                                              p_batch->keys[i],
+                                                              p_batch->keylens[i],
+                                                              &p_batch->hashes[i]));
+        p_batch->stripes[i] = 0;
+        if ((HT_BACKEND_CHAINED == p_ht->backend) && p_batch->valid[i])
+        {
+            p_batch->stripes[i] =
+                (uint32_t)(ht_stripe_for(p_ht, p_batch->hashes[i]) - p_ht->stripes);
+        }
+    }
+    batch_sort(p_batch);
+} /* batch_prepare() */
+
+/**
+ * @brief Takes every stripe a window touches, each once, in ascending order
+ */
+static void batch_lock(hash_table_t * p_ht, const ht_batch_t * p_batch, bool exclusive)
+{
+    for (size_t i = 0; i < p_batch->count; i++)
+    {
+        uint32_t stripe = p_batch->stripes[p_batch->order[i]];
+        if ((0 < i) && (stripe == p_batch->stripes[p_batch->order[i - 1]]))
+        {
+            continue;
+        }
+        if (exclusive)
+        {
+            ht_write_lock(p_ht, &p_ht->stripes[stripe]);
+        }
+        else
+        {
+            ht_read_lock(p_ht, &p_ht->stripes[stripe]);
+        }
+    }
+} /* batch_lock() */
+
+/**
+ * @brief Releases the stripes of a window except the last one, which is
+ * returned for chain_write_done
+ */
+static ht_stripe_t * batch_unlock_but_last(hash_table_t *     p_ht,
+                                           const ht_batch_t * p_batch)
+{
+    for (size_t i = 0; i + 1 < p_batch->count; i++)
+    {
+        uint32_t stripe = p_batch->stripes[p_batch->order[i]];
+        if (stripe != p_batch->stripes[p_batch->order[i + 1]])
+        {
+            ht_unlock(p_ht, &p_ht->stripes[stripe]);
+        }
+    }
+    return &p_ht->stripes[p_batch->stripes[p_batch->order[p_batch->count - 1]]];
+} /* batch_unlock_but_last() */
+
+/**
+ * @brief Prefetches the bucket of every wanted key, then the first entry of
+ * every bucket, so the cache misses of a whole window overlap instead of
+ * being paid one key at a time
+ * @param const bool* wanted keys, valid for inserts and maybe for lookups
+ */
+static void batch_prefetch(const ht_batch_t * p_batch,
+                           const ht_view_t *  p_view,
+                           const bool *       wanted)
+{
+    for (size_t i = 0; i < p_batch->count; i++)
+    {
+        uint64_t hash = p_batch->hashes[i];
+        if (!wanted[i])
+        {
+            continue;
+        }
+        __builtin_prefetch(chain_bucket(p_view->elements, p_view->size, hash));
+        if (NULL != p_view->old_elements)
+        {
+            __builtin_prefetch(
+                chain_bucket(p_view->old_elements, p_view->old_size, hash));
+        }
+    }
+    for (size_t i = 0; i < p_batch->count; i++)
+    {
+        if (!wanted[i])
+        {
+            continue;
+        }
+        entry * p_head = ht_link_load(
+            chain_bucket(p_view->elements, p_view->size, p_batch->hashes[i]));
+        if (NULL != p_head)
+        {
+            __builtin_prefetch(p_head);
+        }
+    }
+} /* batch_prefetch() */
+
+/**
+ * @brief Runs the valid keys of a window past the table's filters, all blocks
+ * prefetched first. The caller holds the stripes or is in a read section.
+ */
+static void batch_filter(const hash_table_t * p_ht, ht_batch_t * p_batch)
+{
+    for (size_t i = 0; (NULL != p_ht->bloom) && (i < p_batch->count); i++)
+    {
+        if (p_batch->valid[i])
+        {
+            ht_bloom_prefetch(p_ht, p_batch->hashes[i]);
+        }
+    }
+    for (size_t i = 0; i < p_batch->count; i++)
+    {
+        p_batch->maybe[i] =
+            p_batch->valid[i] &&
+            ((NULL == p_ht->bloom) || ht_bloom_maybe(p_ht, p_batch->hashes[i]));
+    }
+} /* batch_filter() */
+
+/**
+ * @brief Copies the arrays of a locked table into a view for the batch helpers
+ */
+static inline ht_view_t batch_view(const hash_table_t * p_ht)
+{
+    ht_view_t view = { .elements     = p_ht->elements,
+                       .size         = p_ht->size,
+                       .old_elements = p_ht->old_elements,
+                       .old_size     = p_ht->old_size };
+    return view;
+} /* batch_view() */
+
+/**
+ * @brief Looks up one window of keys
+ * @return size_t number of keys found
+ */
+static size_t batch_lookup_window(hash_table_t * p_ht,
+                                  ht_batch_t *   p_batch,
+                                  void **        objects)
+{
+    size_t found = 0;
+    if (HT_BACKEND_OPEN == p_ht->backend)
+    {
+        ht_hash_lock(p_ht);
+        for (size_t i = 0; i < p_batch->count; i++)
+        {
+            if (p_batch->valid[i])
+            {
+                ht_open_prefetch(p_ht, p_batch->hashes[i]);
+            }
+        }
+        for (size_t i = 0; i < p_batch->count; i++)
+        {
+            objects[i] = NULL;
+            if (p_batch->valid[i])
+            {
+                objects[i] = ht_open_lookup(
+                    p_ht, p_batch->keys[i], p_batch->keylens[i], p_batch->hashes[i]);
+            }
+            found += (NULL != objects[i]);
+        }
+        pthread_mutex_unlock(&p_ht->hash_lock);
+        return found;
+    }
+
+    ht_view_t   view         = { 0 };
+    ht_view_t * p_view       = &view;
+    bool        drained_last = false;
+    // Without an epoch the batch falls back to the stripe locks
+    bool lockfree = (HT_CONC_LOCKFREE_READ == p_ht->concurrency) && ht_epoch_enter();
+    if (lockfree)
+    {
+        p_view = atomic_load(&p_ht->view);
+    }
+    else
+    {
+        // GLOBAL lookups take the table for writing and help the resize along
+        bool exclusive = (HT_CONC_GLOBAL == p_ht->concurrency);
+        batch_lock(p_ht, p_batch, exclusive);
+        if (exclusive)
+        {
+            drained_last = chain_rehash_step(p_ht, p_ht->stripes, HT_REHASH_STEP);
+        }
+        view = batch_view(p_ht);
+    }
+
+    batch_filter(p_ht, p_batch);
+    batch_prefetch(p_batch, p_view, p_batch->maybe);
+    for (size_t i = 0; i < p_batch->count; i++)
+    {
+        objects[i] = NULL;
+        if (!p_batch->valid[i])
+        {
+            continue;
+        }
+        entry * p_entry = NULL;
+        if (p_batch->maybe[i])
+        {
+            p_entry = chain_search_view(
+                p_view, p_batch->keys[i], p_batch->keylens[i], p_batch->hashes[i]);
+        }
+        if (NULL != p_entry)
+        {
+            objects[i] = chain_live_object(p_ht, p_entry);
+        }
+        else if (lockfree && (p_view != atomic_load(&p_ht->view)))
+        {
+            // A resize was published meanwhile, look again the slow way
+            objects[i] = chain_lookup_lockfree(
+                p_ht, p_batch->keys[i], p_batch->keylens[i], p_batch->hashes[i]);
+        }
+        if (NULL != p_ht->cache)
+        {
+            ht_cache_count(p_ht,
+                           p_batch->hashes[i],
+                           (NULL != objects[i]) ? HT_CACHE_HIT : HT_CACHE_MISS);
+        }
+        found += (NULL != objects[i]);
+    }
+
+    if (lockfree)
+    {
+        ht_epoch_exit();
+        chain_collect(p_ht);
+    }
+    else if (HT_CONC_GLOBAL == p_ht->concurrency)
+    {
+        chain_write_done(p_ht, p_ht->stripes, drained_last);
+    }
+    else
+    {
+        ht_unlock(p_ht, batch_unlock_but_last(p_ht, p_batch));
+    }
+    return found;
+} /* batch_lookup_window() */
+
+size_t hash_table_lookup_batch(hash_table_t *       p_ht,
+                               const char * const * keys,
+                               const size_t *       keylens,
+                               size_t               count,
+                               void **              objects)
+{
+    size_t     found = 0;
+    ht_batch_t batch;
+    if ((NULL == p_ht) || (NULL == keys) || (NULL == objects))
+    {
+        fprintf(stderr, "hash_table_lookup_batch: p_ht, keys or objects is NULL\n");
+        goto EXIT;
+    }
+    for (size_t base = 0; base < count; base += HT_BATCH_WINDOW)
+    {
+        size_t window = (count - base < HT_BATCH_WINDOW) ? count - base : HT_BATCH_WINDOW;
+        batch_prepare(
+            p_ht, &batch, keys + base, (NULL == keylens) ? NULL : keylens + base, window);
+        found += batch_lookup_window(p_ht, &batch, objects + base);
+    }
+    ht_stat_add(p_ht, HT_STAT_HIT, found);
+    ht_stat_add(p_ht, HT_STAT_MISS, count - found);
+EXIT:
+    return found;
+} /* hash_table_lookup_batch() */
+
+/**
+ * @brief Inserts one window of keys in order, stopping at the first failure
+ * @param uint64_t * p_lsn receives the last log record to commit, 0 when none
+ * @return size_t number of keys stored or already present
+ */
+static size_t batch_insert_window(hash_table_t * p_ht,
+                                  ht_batch_t *   p_batch,
+                                  void * const * objs,
+                                  uint64_t *     p_lsn)
+{
+    size_t done = 0;
+    if (HT_BACKEND_OPEN == p_ht->backend)
+    {
+        ht_hash_lock(p_ht);
+        for (size_t i = 0; i < p_batch->count; i++)
+        {
+            if (p_batch->valid[i])
+            {
+                ht_open_prefetch(p_ht, p_batch->hashes[i]);
+            }
+        }
+        for (; done < p_batch->count; done++)
+        {
+            uint64_t lsn = 0;
+            if (!p_batch->valid[done] || (NULL == objs[done]) ||
+                (SUCCESS_CODE != open_insert_logged(p_ht,
+                                                    p_batch->keys[done],
+                                                    p_batch->keylens[done],
+                                                    p_batch->hashes[done],
+                                                    objs[done],
+                                                    &lsn)))
+            {
+                break;
+            }
+            *p_lsn = (0 != lsn) ? lsn : *p_lsn;
+        }
+        pthread_mutex_unlock(&p_ht->hash_lock);
+        return done;
+    }
+
+    // Allocate before locking so the stripes are held for as short as possible
+    entry * p_entries[HT_BATCH_WINDOW] = { NULL };
+    size_t  ready                      = 0;
+    for (; ready < p_batch->count; ready++)
+    {
+        if (!p_batch->valid[ready] || (NULL == objs[ready]))
+        {
+            break;
+        }
+        p_entries[ready] = ht_entry_new(
+            p_ht, p_batch->keys[ready], p_batch->keylens[ready], p_batch->hashes[ready]);
+        if (NULL == p_entries[ready])
+        {
+            fprintf(stderr, "hash_table_insert_batch: ht_entry_new failed\n");
+            break;
+        }
+        p_entries[ready]->object = objs[ready];
+    }
+    if (0 == ready)
+    {
+        return 0;
+    }
+    if (ready < p_batch->count)
+    {
+        p_batch->count = ready;
+        batch_sort(p_batch);
+    }
+
+    batch_lock(p_ht, p_batch, true);
+    bool drained_last = false;
+    for (size_t i = 0; i < ready; i++)
+    {
+        uint32_t stripe = p_batch->stripes[p_batch->order[i]];
+        if ((0 == i) || (stripe != p_batch->stripes[p_batch->order[i - 1]]))
+        {
+            drained_last |=
+                chain_rehash_step(p_ht, &p_ht->stripes[stripe], HT_REHASH_STEP);
+        }
+    }
+    ht_view_t view = batch_view(p_ht);
+    batch_prefetch(p_batch, &view, p_batch->valid);
+
+    bool    resize                   = drained_last;
+    bool    any_linked               = false;
+    entry * p_stale[HT_BATCH_WINDOW] = { NULL };
+    for (; done < ready; done++)
+    {
+        ht_stripe_t * p_stripe = &p_ht->stripes[p_batch->stripes[done]];
+        bool          linked   = false;
+        uint64_t      lsn      = 0;
+        entry **      pp_stale = &p_stale[done];
+        if (SUCCESS_CODE !=
+            chain_insert_locked(p_ht, p_stripe, p_entries[done], &linked, pp_stale, &lsn))
+        {
+            break;
+        }
+        any_linked = any_linked || linked;
+        if (linked)
+        {
+            p_entries[done] = NULL;
+            resize          = resize || chain_needs_resize(p_ht, p_stripe, false);
+        }
+        *p_lsn = (0 != lsn) ? lsn : *p_lsn;
+    }
+    chain_write_done(p_ht, batch_unlock_but_last(p_ht, p_batch), resize);
+
+    for (size_t i = 0; i < ready; i++)
+    {
+        chain_drop_stale(p_ht, p_stale[i]);
+        if (NULL != p_entries[i])
+        {
+            ht_entry_free(p_ht, p_entries[i]);
+        }
+    }
+    if (any_linked && (NULL != p_ht->cache))
+    {
+        ht_cache_evict(p_ht);
+    }
+    return done;
+} /* batch_insert_window() */
+
+size_t hash_table_insert_batch(hash_table_t *       p_ht,
+                               const char * const * keys,
+                               const size_t *       keylens,
+                               void * const *       objs,
+                               size_t               count)
+{
+    size_t     done = 0;
+    ht_batch_t batch;
+    if ((NULL == p_ht) || (NULL == keys) || (NULL == objs))
+    {
+        fprintf(stderr, "hash_table_insert_batch: p_ht, keys or objs is NULL\n");
+        goto EXIT;
+    }
+    while (done < count)
+    {
+        size_t   left   = count - done;
+        size_t   window = (left < HT_BATCH_WINDOW) ? left : HT_BATCH_WINDOW;
+        uint64_t lsn    = 0;
+        batch_prepare(
+            p_ht, &batch, keys + done, (NULL == keylens) ? NULL : keylens + done, window);
+        size_t stored = batch_insert_window(p_ht, &batch, objs + done, &lsn);
+        // One wait covers the whole window, the log syncs it in one batch
+        if ((0 != lsn) && (SUCCESS_CODE != ht_wal_commit(p_ht->wal, lsn, false)))
+        {
+            fprintf(stderr, "hash_table_insert_batch: inserted but not durable\n");
+            goto EXIT;
+        }
+        done += stored;
+        ht_stat_add(p_ht, HT_STAT_INSERT, stored);
+        if (stored < window)
+        {
+            fprintf(stderr, "hash_table_insert_batch: insert failed\n");
+            goto EXIT;
+        }
+    }
+EXIT:
+    return done;
+} /* hash_table_insert_batch() */
+
+void * hash_table_remove(hash_table_t * p_ht, const char * key)
+{
+    if (NULL == key)
+    {
+        fprintf(stderr, "hash_table_remove: key is NULL\n");
+        return NULL;
+    }
+    return hash_table_remove_n(p_ht, key, strlen(key));
+} /* hash_table_remove() */
+
+/**
+ * @brief Unlinks key from the table and frees its entry, after the grace
+ * period in lock-free mode
+ *
+ * @param hash_table_t p_ht table to remove from
+ * @param const char * key key to remove
+ * @param size_t keylen length of the key
+ * @param uint64_t hash hash of the key from hash_table_index
+ * @param bool destroy pass the object to the cleanup function as well
+ * @param void ** p_object receives the object when destroy is false
+ * @return SUCCESS_CODE when the key was found
+ * @return FAIL_CODE otherwise
+ */
+int ht_take_hashed(hash_table_t * p_ht,
+                   const char *   key,
+                   size_t         keylen,
+                   uint64_t       hash,
+                   bool           destroy,
+                   void **        p_object)
+{
+    int      ret_code       = FAIL_CODE;
+    void *   removed_object = NULL;
+    uint64_t lsn            = 0;
+
+    if (HT_BACKEND_OPEN == p_ht->backend)
+    {
+        ht_hash_lock(p_ht);
+        bool logged = true;
+        if ((NULL != p_ht->wal) && (NULL != ht_open_lookup(p_ht, key, keylen, hash)))
+        {
+            lsn    = ht_wal_log(p_ht->wal, HT_WAL_REMOVE, key, keylen, NULL);
+            logged = (0 != lsn);
+        }
+        const char * p_stored = NULL;
+        if (logged && ((NULL != p_ht->trigram) || (NULL != p_ht->art)))
+        {
+            p_stored = ht_open_key(p_ht, key, keylen, hash);
+        }
+        if (NULL != p_stored)
+        {
+            ht_index_remove(p_ht, p_stored, keylen);
+        }
+        if (logged)
+        {
+            removed_object = ht_open_remove(p_ht, key, keylen, hash);
+        }
+        pthread_mutex_unlock(&p_ht->hash_lock);
+        goto FOUND;
+    }
+
+    ht_stripe_t * p_stripe = ht_stripe_for(p_ht, hash);
+    ht_write_lock(p_ht, p_stripe);
+    bool     drained_last  = chain_rehash_step(p_ht, p_stripe, HT_REHASH_STEP);
+    entry ** pp_link       = chain_find(p_ht, key, keylen, hash);
+    entry *  current_entry = NULL;
+    bool     expired       = false;
+    if (NULL != pp_link)
+    {
+        expired       = ht_entry_expired(*pp_link);
+        current_entry = ht_chain_unlink(p_ht, p_stripe, pp_link, &lsn);
+    }
+    chain_write_done(p_ht, p_stripe, chain_needs_resize(p_ht, p_stripe, drained_last));
+    if (expired)
+    {
+        // Callers could no longer see it, so it is dropped as not found
+        chain_drop_stale(p_ht, current_entry);
+        goto EXIT;
+    }
+    if (NULL == current_entry)
+    {
+        goto EXIT;
+    }
+
+    removed_object = current_entry->object;
+    ht_chain_release(p_ht, current_entry, destroy);
+    chain_collect(p_ht);
+    current_entry = NULL;
+    if (destroy)
+    {
+        removed_object = NULL;
+    }
+    ret_code = SUCCESS_CODE;
+    goto EXIT;
+FOUND:
+    if (NULL == removed_object)
+    {
+        goto EXIT;
+    }
+    if (destroy)
+    {
+        p_ht->cleanup(removed_object);
+        removed_object = NULL;
+    }
+    ret_code = SUCCESS_CODE;
+EXIT:
+    if ((0 != lsn) && (SUCCESS_CODE != ht_wal_commit(p_ht->wal, lsn, false)))
+    {
+        fprintf(stderr, "hash_table_remove: removed but not durable\n");
+    }
+    if ((NULL != p_object) && !destroy)
+    {
+        *p_object = removed_object;
+    }
+    if (SUCCESS_CODE == ret_code)
+    {
+        ht_stat_add(p_ht, HT_STAT_REMOVE, 1);
+    }
+    return ret_code;
+} /* ht_take_hashed() */
+
+entry * ht_chain_unlink(hash_table_t * p_ht,
+                        ht_stripe_t *  p_stripe,
+                        entry **       pp_link,
+                        uint64_t *     p_lsn)
+{
+    entry * p_entry = *pp_link;
+    if (NULL != p_ht->wal)
+    {
+        uint64_t lsn =
+            ht_wal_log(p_ht->wal, HT_WAL_REMOVE, p_entry->key, p_entry->keylength, NULL);
+        if (0 == lsn)
+        {
+            return NULL; // an unlogged remove would come back on restart
+        }
+        *p_lsn = lsn;
+    }
+    // Unlink the entry by pointing whatever referenced it at its successor.
+    // A lock-free reader standing on it still finds the rest of the chain.
+    ht_link_store(pp_link, p_entry->next);
+    chain_count_add(p_ht, p_stripe, -1);
+    if (NULL != p_ht->bloom)
+    {
+        ht_bloom_remove(p_ht, p_entry->hash);
+    }
+    ht_index_remove(p_ht, p_entry->key, p_entry->keylength);
+    if (NULL != p_ht->cache)
+    {
+        ht_cache_charge(p_ht, p_stripe, p_entry, -1);
+    }
+    return p_entry;
+} /* ht_chain_unlink() */
+
+void ht_chain_release(hash_table_t * p_ht, entry * p_entry, bool destroy)
+{
+    if (HT_CONC_LOCKFREE_READ == p_ht->concurrency)
+    {
+        ht_epoch_retire(
+            p_entry, destroy ? chain_reclaim_delete : chain_reclaim_entry, p_ht);
+        return;
+    }
+    if (destroy)
+    {
+        p_ht->cleanup(p_entry->object);
+    }
+    ht_entry_free(p_ht, p_entry);
+} /* ht_chain_release() */
+
+void * hash_table_remove_n(hash_table_t * p_ht, const char * key, size_t keylen)
+{
+    void * removed_object = NULL;
+
+    if (NULL == p_ht)
     {
-        fprintf(stderr, "hash_table_index: p_key is NULL");
+        fprintf(stderr, "hash_table_remove: hash table is NULL\n");
         goto EXIT;
     }
-    if ((strlen(p_key) > MAX_KEY_LENGTH))
+    uint64_t hash = 0;
+    if (SUCCESS_CODE != hash_table_index(p_ht, key, keylen, &hash))
     {
-        fprintf(stderr, "hash_table_index: p_key is invalid");
+        fprintf(stderr, "hash_table_remove: hash_table_index failed\n");
         goto EXIT;
     }
-
-    result = (p_ht->hash(p_key, strlen(p_key))) % p_ht->size;
-
+    ht_take_hashed(p_ht, key, keylen, hash, false, &removed_object);
 EXIT:
-    return result;
-} /* hash_table_index() */
+    return removed_object;
+} /* hash_table_remove_n() */
 
-hash_table_t * hash_table_create(uint32_t           size,
-                                 hashfunction *     p_hf,
-                                 cleanup_function * p_cf)
+int hash_table_delete(hash_table_t * p_ht, const char * key)
 {
-    hash_table_t * p_ht = NULL;
-    if (MAX_TABLE_SIZE < size)
+    int ret_code = FAIL_CODE;
+    if (NULL == p_ht)
     {
-        fprintf(stderr, "hash_table_create: size is too large");
+        fprintf(stderr, "hash_table_delete: hash table is NULL\n");
         goto EXIT;
     }
-    if (NULL == p_hf)
+    if (NULL == key)
     {
-        fprintf(stderr, "hash_table_create: p_hf is NULL");
+        fprintf(stderr, "hash_table_delete: key is NULL\n");
         goto EXIT;
     }
-    if (NULL == p_cf)
+    size_t   keylen = strlen(key);
+    uint64_t hash   = 0;
+    if (SUCCESS_CODE != hash_table_index(p_ht, key, keylen, &hash))
     {
-        fprintf(stderr, "hash_table_create: p_cf is NULL");
+        fprintf(stderr, "hash_table_delete: hash_table_index failed\n");
         goto EXIT;
     }
+    ret_code = ht_take_hashed(p_ht, key, keylen, hash, true, NULL);
+EXIT:
+    return ret_code;
+} /* hash_table_delete() */
 
-    p_ht = calloc(1, sizeof(hash_table_t));
-    if (NULL == p_ht)
+int hash_table_upsert(hash_table_t *    p_ht,
+                      const char *      key,
+                      upsert_function * fn,
+                      void *            p_ctx)
+{
+    if (NULL == key)
     {
-        fprintf(stderr, "hash_table_create: calloc failed");
-        goto EXIT;
+        fprintf(stderr, "hash_table_upsert: key is NULL\n");
+        return FAIL_CODE;
     }
-    // initialize pthread mutex hash lock
-    if (pthread_mutex_init(&p_ht->hash_lock, NULL) != 0)
+    return hash_table_upsert_n(p_ht, key, strlen(key), fn, p_ctx);
+} /* hash_table_upsert() */
+
+int hash_table_upsert_n(hash_table_t *    p_ht,
+                        const char *      key,
+                        size_t            keylen,
+                        upsert_function * fn,
+                        void *            p_ctx)
+{
+    int      ret_code = FAIL_CODE;
+    uint64_t hash     = 0;
+    if (NULL == fn)
     {
-        fprintf(stderr, "hash_table_create: pthread_mutex_init failed");
-        goto ERR;
+        fprintf(stderr, "hash_table_upsert: fn is NULL\n");
+        goto EXIT;
     }
-    p_ht->size     = size;
-    p_ht->hash     = p_hf;
-    p_ht->cleanup  = p_cf;
-    p_ht->elements = calloc(sizeof(entry *), p_ht->size);
-    if (NULL == p_ht->elements)
+    if (SUCCESS_CODE != hash_table_index(p_ht, key, keylen, &hash))
     {
-        fprintf(stderr, "hash_table_create: calloc failed\n");
-        goto ERR;
+        fprintf(stderr, "hash_table_upsert: hash_table_index failed\n");
+        goto EXIT;
     }
-    goto EXIT;
-
-ERR:
-    free(p_ht);
-    p_ht = NULL;
+    ret_code = ht_upsert_hashed(p_ht, key, keylen, hash, fn, p_ctx);
 EXIT:
-    return p_ht;
-} /* hash_table_create() */
+    return ret_code;
+} /* hash_table_upsert_n() */
 
-void hash_table_destroy(hash_table_t * p_ht)
+/**
+ * @brief Runs fn for a key of an open table and stores what it returned. The
+ * caller holds hash_lock.
+ * @param void ** pp_replaced receives the object fn replaced
+ * @param void ** pp_unstored receives the object fn returned when it could
+ * not be stored
+ * @param uint64_t * p_lsn receives the log record to commit, 0 when none
+ */
+static int open_upsert_locked(hash_table_t *    p_ht,
+                              const char *      p_key,
+                              size_t            keylen,
+                              uint64_t          hash,
+                              upsert_function * fn,
+                              void *            p_ctx,
+                              void **           pp_replaced,
+                              void **           pp_unstored,
+                              uint64_t *        p_lsn)
 {
-    if (NULL == p_ht)
+    entry * p_slot  = ht_open_find(p_ht, p_key, keylen, hash);
+    void *  current = (NULL == p_slot) ? NULL : p_slot->object;
+    void *  updated = fn(p_key, keylen, current, p_ctx);
+    if (NULL == updated)
     {
-        fprintf(stderr, "hash_table_destroy: hash table is NULL\n");
-        goto EXIT;
+        return SUCCESS_CODE;
     }
-    for (uint32_t i = 0; i < p_ht->size; i++)
+    if (NULL == p_slot)
     {
-        while (NULL != p_ht->elements[i])
+        if (SUCCESS_CODE != open_insert_logged(p_ht, p_key, keylen, hash, updated, p_lsn))
         {
-            entry * temp      = p_ht->elements[i];
-            p_ht->elements[i] = temp->next;
-            free(temp->key);
-            temp->key = NULL;
-            p_ht->cleanup(temp->object);
-            temp->object = NULL;
-            free(temp);
-            temp = NULL;
+            *pp_unstored = updated;
+            return FAIL_CODE;
         }
+        ht_stat_add(p_ht, HT_STAT_INSERT, 1);
+        return SUCCESS_CODE;
     }
-
-    pthread_mutex_destroy(&p_ht->hash_lock);
-
-    free(p_ht->elements);
-    p_ht->elements = NULL;
-    free(p_ht);
-    p_ht = NULL;
-
-EXIT:
-    return;
-} /* hash_table_destroy() */
-
-void hash_table_print(hash_table_t * p_ht)
-{
-    if (NULL == p_ht)
+    if (NULL != p_ht->wal)
     {
-        fprintf(stderr, "hash_table_print: hash table is NULL\n");
-        goto EXIT;
+        *p_lsn = ht_wal_log(p_ht->wal, HT_WAL_INSERT, p_key, keylen, updated);
+        if (0 == *p_lsn)
+        {
+            *pp_unstored = (updated != current) ? updated : NULL;
+            return FAIL_CODE;
+        }
     }
-    printf("start table\n");
+    p_slot->object = updated;
+    *pp_replaced   = (updated != current) ? current : NULL;
+    return SUCCESS_CODE;
+} /* open_upsert_locked() */
 
-    for (uint32_t i = 0; i < p_ht->size; i++)
+/**
+ * @brief open_upsert_locked for a chained table. The caller holds the key's
+ * stripe for writing.
+ * @param entry* p_new entry for the key, linked when the key is absent and
+ * fn returns an object, otherwise left for the caller to free
+ * @param entry ** pp_stale receives the expired entry fn was not shown, for
+ * chain_drop_stale once the stripe is released
+ * @param bool * p_linked set when a new entry went into the table
+ */
+static int chain_upsert_locked(hash_table_t *    p_ht,
+                               ht_stripe_t *     p_stripe,
+                               const char *      p_key,
+                               size_t            keylen,
+                               uint64_t          hash,
+                               upsert_function * fn,
+                               void *            p_ctx,
+                               entry *           p_new,
+                               entry **          pp_stale,
+                               bool *            p_linked,
+                               void **           pp_replaced,
+                               void **           pp_unstored,
+                               uint64_t *        p_lsn)
+{
+    entry ** pp_link = chain_find(p_ht, p_key, keylen, hash);
+    if ((NULL != pp_link) && ht_entry_expired(*pp_link))
     {
-        if (p_ht->elements[i] != NULL)
+        *pp_stale = ht_chain_unlink(p_ht, p_stripe, pp_link, p_lsn);
+        if (NULL == *pp_stale)
         {
-            printf("\t%i\t", i);
-            entry * tmp = p_ht->elements[i];
-            while (NULL != tmp)
-            {
-                printf("\"%s\"(%p) - ", tmp->key, tmp->object);
-                {
-                    // If object exists call on the objects print
-                    // function
-                    // print_object(tmp->object);
-                }
-                tmp = tmp->next;
-            }
-            printf("\n");
+            return FAIL_CODE;
         }
+        pp_link = NULL;
     }
-    printf("end table\n");
-
-EXIT:
-    return;
-} /* hash_table_print() */
-
-int copy_keys_to_string(hash_table_t * p_ht, char * output)
-{
-    int ret_code = FAIL_CODE;
-    if (NULL == p_ht)
+    entry * p_entry = (NULL == pp_link) ? NULL : *pp_link;
+    void *  current = (NULL == p_entry) ? NULL : p_entry->object;
+    if ((NULL != p_entry) && (NULL != p_ht->cache))
     {
-        fprintf(stderr, "copy_keys_to_string: hash table is NULL\n");
-        goto EXIT;
+        // Charged again once fn is done, it may change what the object holds
+        ht_cache_charge(p_ht, p_stripe, p_entry, -1);
     }
+    void * updated = fn(p_key, keylen, current, p_ctx);
 
-    if (NULL == output)
+    if (NULL == p_entry)
     {
-        fprintf(stderr, "copy_keys_to_string: output char* is NULL\n");
-        goto EXIT;
+        if (NULL == updated)
+        {
+            return SUCCESS_CODE;
+        }
+        // The key is known to be absent, so p_new is linked without a second
+        // chain_find
+        uint64_t lsn  = 0;
+        p_new->object = updated;
+        if (SUCCESS_CODE != chain_link_locked(p_ht, p_stripe, p_new, &lsn))
+        {
+            *pp_unstored = updated;
+            return FAIL_CODE;
+        }
+        *p_lsn    = (0 != lsn) ? lsn : *p_lsn;
+        *p_linked = true;
+        return SUCCESS_CODE;
     }
 
-    // iterate the entire list and add a null byte between the strings
-    size_t index = 0;
-    for (uint32_t i = 0; i < p_ht->size; i++)
+    int ret_code = SUCCESS_CODE;
+    if ((NULL != updated) && (NULL != p_ht->wal))
     {
-        if (p_ht->elements[i] != NULL)
+        uint64_t lsn = ht_wal_log(p_ht->wal, HT_WAL_INSERT, p_key, keylen, updated);
+        if (0 == lsn)
         {
-            entry * tmp = p_ht->elements[i];
-            while (NULL != tmp)
-            {
-                size_t key_length = strlen(tmp->key);
-                for (size_t j = 0; j < key_length; j++)
-                {
-                    output[index] = tmp->key[j];
-                    index++;
-                }
-                output[index] = '\0'; // Assign null byte directly
-                index++;
-                tmp = tmp->next;
-            }
+            *pp_unstored = (updated != current) ? updated : NULL;
+            updated      = NULL;
+            ret_code     = FAIL_CODE;
         }
+        *p_lsn = (0 != lsn) ? lsn : *p_lsn;
+    }
+    if ((NULL != updated) && (updated != current))
+    {
+        __atomic_store_n(&p_entry->object, updated, __ATOMIC_RELEASE);
+        *pp_replaced = current;
+    }
+    if (NULL != p_ht->cache)
+    {
+        ht_cache_charge(p_ht, p_stripe, p_entry, +1);
     }
-
-    ret_code = SUCCESS_CODE;
-EXIT:
     return ret_code;
-} /* copy_keys_to_string() */
+} /* chain_upsert_locked() */
 
-int hash_table_insert(hash_table_t * p_ht, const char * p_key, void * obj)
+/**
+ * @brief ht_upsert_hashed that hands back an object fn returned but the table
+ * could not store, instead of cleaning it up
+ */
+static int upsert_hashed(hash_table_t *    p_ht,
+                         const char *      p_key,
+                         size_t            keylen,
+                         uint64_t          hash,
+                         upsert_function * fn,
+                         void *            p_ctx,
+                         void **           pp_unstored)
 {
-    int ret_code = FAIL_CODE;
-    if (NULL == p_ht)
+    int      ret_code   = FAIL_CODE;
+    uint64_t lsn        = 0;
+    void *   p_replaced = NULL;
+    if (HT_BACKEND_OPEN == p_ht->backend)
     {
-        fprintf(stderr, "hash_table_insert: p_ht is NULL\n");
-        goto EXIT;
+        ht_hash_lock(p_ht);
+        ret_code = open_upsert_locked(
+            p_ht, p_key, keylen, hash, fn, p_ctx, &p_replaced, pp_unstored, &lsn);
+        pthread_mutex_unlock(&p_ht->hash_lock);
+        if (NULL != p_replaced)
+        {
+            p_ht->cleanup(p_replaced);
+        }
+        goto COMMIT;
     }
-    if (NULL == p_key)
+
+    // Allocated before locking as for inserts, freed below if the key exists
+    entry * p_new = ht_entry_new(p_ht, p_key, keylen, hash);
+    if (NULL == p_new)
     {
-        fprintf(stderr, "hash_table_insert: p_key is NULL\n");
+        fprintf(stderr, "hash_table_upsert: ht_entry_new failed\n");
         goto EXIT;
     }
-    if (NULL == obj)
+
+    ht_stripe_t * p_stripe = ht_stripe_for(p_ht, hash);
+    ht_write_lock(p_ht, p_stripe);
+    bool    drained_last = chain_rehash_step(p_ht, p_stripe, HT_REHASH_STEP);
+    bool    linked       = false;
+    entry * p_stale      = NULL;
+    ret_code = chain_upsert_locked(p_ht,
+                                   p_stripe,
+                                   p_key,
+                                   keylen,
+                                   hash,
+                                   fn,
+                                   p_ctx,
+                                   p_new,
+                                   &p_stale,
+                                   &linked,
+                                   &p_replaced,
+                                   pp_unstored,
+                                   &lsn);
+    chain_write_done(p_ht,
+                     p_stripe,
+                     (linked || (NULL != p_stale))
+                         ? chain_needs_resize(p_ht, p_stripe, drained_last)
+                         : drained_last);
+    chain_drop_stale(p_ht, p_stale);
+    if (!linked)
     {
-        fprintf(stderr, "hash_table_insert: obj is NULL\n");
-        goto EXIT;
+        ht_entry_free(p_ht, p_new);
+        p_new = NULL;
     }
-
-    size_t index       = hash_table_index(p_ht, p_key);
-    size_t check_index = -1;
-    if (check_index == index)
+    if ((NULL != p_replaced) && (HT_CONC_LOCKFREE_READ == p_ht->concurrency))
     {
-        fprintf(stderr, "hash_table_insert: hash_table_index failed\n");
-        goto EXIT;
+        // Lookups that loaded the old object may still be using it
+        ht_epoch_retire(p_replaced, chain_reclaim_object, p_ht);
+        chain_collect(p_ht);
     }
-
-    void * entry_check = (hash_table_lookup(p_ht, p_key));
-    if (NULL != entry_check)
+    else if (NULL != p_replaced)
     {
-        fprintf(stderr, "hash_table_insert: entry already exists\n");
-        // We aren't failing here, a fail code will cause our program to shut down
-        // we just can't have a duplicate key
-        ret_code = SUCCESS_CODE;
-        goto EXIT;
+        p_ht->cleanup(p_replaced);
     }
-
-    entry * p_entry = calloc(1, sizeof(entry));
-    if (NULL == p_entry)
+    if (linked)
     {
-        fprintf(stderr, "hash_table_insert: calloc failed\n");
-        goto EXIT;
+        ht_stat_add(p_ht, HT_STAT_INSERT, 1);
     }
-    p_entry->object = obj;
-    p_entry->next   = NULL;
-    p_entry->key    = strdup(p_key);
-    if (NULL == p_entry->key)
+    if (NULL != p_ht->cache)
     {
-        fprintf(stderr, "hash_table_insert: strdup failed\n");
-        goto ERR;
+        ht_cache_evict(p_ht);
+    }
+COMMIT:
+    if ((0 != lsn) && (SUCCESS_CODE != ht_wal_commit(p_ht->wal, lsn, false)))
+    {
+        fprintf(stderr, "hash_table_upsert: updated but not durable\n");
+        ret_code = FAIL_CODE;
     }
-
-    p_entry->next         = p_ht->elements[index];
-    p_ht->elements[index] = p_entry;
-    ret_code              = SUCCESS_CODE;
-    goto EXIT;
-ERR:
-    free(p_entry);
-    p_entry = NULL;
 EXIT:
     return ret_code;
-} /* hash_table_insert() */
+} /* upsert_hashed() */
 
-void * hash_table_lookup(hash_table_t * p_ht, const char * p_key)
+int ht_upsert_hashed(hash_table_t *    p_ht,
+                     const char *      p_key,
+                     size_t            keylen,
+                     uint64_t          hash,
+                     upsert_function * fn,
+                     void *            p_ctx)
 {
-    void * object = NULL;
-    if (NULL == p_ht)
+    void * p_unstored = NULL;
+    int    ret_code   = upsert_hashed(p_ht, p_key, keylen, hash, fn, p_ctx, &p_unstored);
+    if (NULL != p_unstored)
     {
-        fprintf(stderr, "hash_table_lookup: p_ht is NULL\n");
-        goto EXIT;
+        p_ht->cleanup(p_unstored);
     }
-    if (NULL == p_key)
+    return ret_code;
+} /* ht_upsert_hashed() */
+
+/**
+ * @brief upsert context of hash_table_cas
+ */
+typedef struct cas_ctx
+{
+    void * expected;
+    void * desired;
+    bool   swapped;
+} cas_ctx_t;
+
+static void * cas_apply(const char * p_key, size_t keylen, void * obj, void * p_ctx)
+{
+    (void)p_key;
+    (void)keylen;
+    cas_ctx_t * p_cas = p_ctx;
+    p_cas->swapped    = (obj == p_cas->expected);
+    return p_cas->swapped ? p_cas->desired : NULL;
+} /* cas_apply() */
+
+int ht_cas_hashed(hash_table_t * p_ht,
+                  const char *   p_key,
+                  size_t         keylen,
+                  uint64_t       hash,
+                  void *         expected,
+                  void *         desired)
+{
+    if (NULL == desired)
     {
-        fprintf(stderr, "hash_table_lookup: p_key is NULL\n");
-        goto EXIT;
+        fprintf(stderr, "hash_table_cas: desired is NULL\n");
+        return FAIL_CODE;
+    }
+    cas_ctx_t cas        = { .expected = expected, .desired = desired, .swapped = false };
+    void *    p_unstored = NULL;
+    // An object the table could not store was desired, which stays the caller's
+    if (SUCCESS_CODE !=
+        upsert_hashed(p_ht, p_key, keylen, hash, cas_apply, &cas, &p_unstored))
+    {
+        return FAIL_CODE;
     }
+    return cas.swapped ? SUCCESS_CODE : 0;
+} /* ht_cas_hashed() */
 
-    size_t index       = hash_table_index(p_ht, p_key);
-    size_t check_index = -1;
-    if (check_index == index)
+int hash_table_cas(hash_table_t * p_ht, const char * key, void * expected, void * desired)
+{
+    int      ret_code = FAIL_CODE;
+    uint64_t hash     = 0;
+    if (NULL == key)
     {
-        fprintf(stderr, "hash_table_lookup: hash_table_index failed\n");
+        fprintf(stderr, "hash_table_cas: key is NULL\n");
         goto EXIT;
     }
-
-    entry * p_entry = p_ht->elements[index];
-    while (NULL != p_entry)
+    size_t keylen = strlen(key);
+    if (SUCCESS_CODE != hash_table_index(p_ht, key, keylen, &hash))
     {
-        if (0 == strcmp(p_entry->key, p_key))
-        {
-            object = p_entry->object;
-            goto EXIT;
-        }
-        p_entry = p_entry->next;
+        fprintf(stderr, "hash_table_cas: hash_table_index failed\n");
+        goto EXIT;
     }
-
+    ret_code = ht_cas_hashed(p_ht, key, keylen, hash, expected, desired);
 EXIT:
-    return object;
-} /* hash_table_lookup() */
+    return ret_code;
+} /* hash_table_cas() */
 
-void * hash_table_remove(hash_table_t * p_ht, const char * key)
+int hash_table_read_begin(void)
 {
-    void * removed_object = NULL;
-
-    if (NULL == p_ht)
+    if (!ht_epoch_enter())
     {
-        fprintf(stderr, "hash_table_remove: hash table is NULL\n");
-        goto EXIT;
+        fprintf(stderr, "hash_table_read_begin: ht_epoch_enter failed\n");
+        return FAIL_CODE;
     }
+    return SUCCESS_CODE;
+} /* hash_table_read_begin() */
 
-    uint32_t hash_value     = hash_function(key, strlen(key)) % p_ht->size;
-    entry *  current_entry  = p_ht->elements[hash_value];
-    entry *  previous_entry = NULL;
+void hash_table_read_end(void)
+{
+    ht_epoch_exit();
+} /* hash_table_read_end() */
 
-    while (NULL != current_entry)
-    {
-        if (strcmp(current_entry->key, key) == 0)
-        {
-            pthread_mutex_lock(&p_ht->hash_lock);
-            if (previous_entry == NULL)
-            {
-                // Entry is the first element in the linked list
-                p_ht->elements[hash_value] = current_entry->next;
-            }
-            else
-            {
-                // Entry is not the first element, update the previous entry's next
-                // pointer
-                previous_entry->next = current_entry->next;
-            }
+/*
+ * The built-in hash follows the structure of wyhash (public domain, Wang Yi):
+ * each step folds 16 bytes of input into the state with a 64x64->128 bit
+ * multiply, and long keys run three such lanes in parallel.
+ */
+static const uint64_t hash_secret[4] = { 0xa0761d6478bd642fULL,
+                                         0xe7037ed1a0b428dbULL,
+                                         0x8ebc6af09c88c6e3ULL,
+                                         0x589965cc75374cc3ULL };
 
-            removed_object = current_entry->object;
-            free(current_entry->key);
-            current_entry->key = NULL;
-            free(current_entry);
-            current_entry = NULL;
-            pthread_mutex_unlock(&p_ht->hash_lock);
-            break;
-        }
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+} /* hash_mix() */
 
-        previous_entry = current_entry;
-        current_entry  = current_entry->next;
-    }
-EXIT:
-    return removed_object;
-} /* hash_table_remove() */
+static inline uint64_t hash_read8(const uint8_t * p)
+{
+    uint64_t value = 0;
+    memcpy(&value, p, sizeof(value));
+    return value;
+} /* hash_read8() */
 
-uint64_t hash_function(const char * p_key, unsigned long length)
+static inline uint64_t hash_read4(const uint8_t * p)
+{
+    uint32_t value = 0;
+    memcpy(&value, p, sizeof(value));
+    return value;
+} /* hash_read4() */
+
+uint64_t hash_function_seeded(const char * p_key, size_t length, uint64_t seed)
 {
     if (NULL == p_key)
     {
         fprintf(stderr, "hash_function: name is NULL\n");
         return 0;
     }
-    if (MAX_KEY_LENGTH < length)
+
+    const uint8_t * p = (const uint8_t *)p_key;
+    uint64_t        a = 0;
+    uint64_t        b = 0;
+
+    seed ^= hash_mix(seed ^ hash_secret[0], hash_secret[1]);
+    if (16 >= length)
     {
-        fprintf(stderr, "hash_function: length is too long\n");
-        return 0;
+        if (4 <= length)
+        {
+            // two overlapping 4 byte reads from each end cover 4..16 bytes
+            size_t shift = (length >> 3) << 2;
+            a = (hash_read4(p) << 32) | hash_read4(p + shift);
+            b = (hash_read4(p + length - 4) << 32) | hash_read4(p + length - 4 - shift);
+        }
+        else if (0 < length)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) |
+                p[length - 1];
+        }
     }
-
-    uint64_t hash_value = 0;
-    for (size_t i = 0; i < length; i++)
+    else
     {
-        hash_value += p_key[i];
-        hash_value = hash_value * p_key[i];
+        size_t remaining = length;
+        if (48 < remaining)
+        {
+            uint64_t lane1 = seed;
+            uint64_t lane2 = seed;
+            do
+            {
+                seed  = hash_mix(hash_read8(p) ^ hash_secret[1],
+                                 hash_read8(p + 8) ^ seed);
+                lane1 = hash_mix(hash_read8(p + 16) ^ hash_secret[2],
+                                 hash_read8(p + 24) ^ lane1);
+                lane2 = hash_mix(hash_read8(p + 32) ^ hash_secret[3],
+                                 hash_read8(p + 40) ^ lane2);
+                p += 48;
+                remaining -= 48;
+            } while (48 < remaining);
+            seed ^= lane1 ^ lane2;
+        }
+        while (16 < remaining)
+        {
+            seed = hash_mix(hash_read8(p) ^ hash_secret[1], hash_read8(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        // the last 16 bytes, overlapping earlier input when remaining < 16
+        a = hash_read8(p + remaining - 16);
+        b = hash_read8(p + remaining - 8);
     }
-    return hash_value;
+
+    a ^= hash_secret[1];
+    b ^= seed;
+    __uint128_t product = (__uint128_t)a * b;
+    a                   = (uint64_t)product;
+    b                   = (uint64_t)(product >> 64);
+    return hash_mix(a ^ hash_secret[0] ^ length, b ^ hash_secret[1]);
+} /* hash_function_seeded() */
+
+uint64_t hash_function(const char * p_key, unsigned long length)
+{
+    return hash_function_seeded(p_key, length, 0);
 } /* hash_function() */
 
+/**
+ * @brief State for return_all_matching_keys, matching keys are copied via copy
+ */
+typedef struct match_ctx
+{
+    key_copy_ctx copy;
+    char *       key_to_find;
+    size_t       find_length;
+    int          user_privilege; // objects carry no permission to check yet
+} match_ctx;
+
+static int copy_match_visit(const char * p_key, size_t keylen, void * p_ctx)
+{
+    key_copy_ctx * p_copy = &((match_ctx *)p_ctx)->copy;
+    memcpy(p_copy->output + p_copy->index, p_key, keylen);
+    p_copy->index += keylen;
+    p_copy->output[p_copy->index++] = '\0';
+    return SUCCESS_CODE;
+} /* copy_match_visit() */
+
+static int match_key_visit(entry * p_entry, void * p_ctx)
+{
+    match_ctx * p_match = p_ctx;
+    const char * p_found = ht_substr_find(
+        p_entry->key, p_entry->keylength, p_match->key_to_find, p_match->find_length);
+    if (NULL != p_found)
+    {
+        copy_key_visit(p_entry, &p_match->copy);
+    }
+    return SUCCESS_CODE;
+} /* match_key_visit() */
+
 int return_all_matching_keys(hash_table_t * p_ht,
                              char *         store_keys,
                              char *         key_to_find,
@@ -424,35 +2756,20 @@ int return_all_matching_keys(hash_table_t * p_ht,
         goto EXIT;
     }
 
-    int    key_match = FAIL_CODE;
-    size_t index     = 0;
-    for (uint32_t i = 0; i < p_ht->size; i++)
+    match_ctx match = { .copy           = { .output = store_keys, .index = 0 },
+                        .key_to_find    = key_to_find,
+                        .find_length    = strlen(key_to_find),
+                        .user_privilege = user_privilege };
+    if (NULL != p_ht->trigram)
     {
-        if (p_ht->elements[i] != NULL)
-        {
-            entry * tmp = p_ht->elements[i];
-            while (NULL != tmp)
-            {
-                void * object = hash_table_lookup(p_ht, tmp->key);
-                // Provide a function that can check the match of the key
-                // key_match     = check_match(object, key_to_find, user_privilege);
-                if (SUCCESS_CODE == key_match)
-                {
-                    size_t key_length = strlen(tmp->key);
-                    for (size_t j = 0; j < key_length; j++)
-                    {
-                        store_keys[index] = tmp->key[j];
-                        index++;
-                    }
-                    // Assign null byte directly after each key
-                    store_keys[index] = '\0';
-                    index++;
-                }
-                tmp    = tmp->next;
-                object = NULL;
-            }
-        }
+        // The index is updated under the table's write locks and has its own lock
+        ret_code = ht_trigram_search(
+            p_ht->trigram, key_to_find, match.find_length, copy_match_visit, &match);
+        goto EXIT;
     }
+    ht_lock_all(p_ht, false);
+    ht_walk(p_ht, match_key_visit, &match);
+    ht_unlock_all(p_ht);
     ret_code = SUCCESS_CODE;
 EXIT:
     return ret_code;
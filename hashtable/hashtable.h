@@ -20,15 +20,185 @@ typedef uint64_t hashfunction(const char *, size_t);
 // function pointer for cleaning up object
 typedef void cleanup_function(void * obj);
 
+/**
+ * @brief serialises an object for a snapshot
+ * @param const void* object to serialise
+ * @param void* buffer to write to, may be NULL when buf_len is 0
+ * @param size_t size of the buffer
+ * @return size_t bytes the object needs, written only when they fit in buf
+ */
+typedef size_t encode_function(const void * obj, void * buf, size_t buf_len);
+
+/**
+ * @brief rebuilds an object from the bytes encode_function wrote
+ * @param const void* serialised bytes, 8 byte aligned
+ * @param size_t number of bytes
+ * @return void* new object to hand to the table, NULL on failure
+ */
+typedef void * decode_function(const void * data, size_t len);
+
+/**
+ * @brief computes the object hash_table_upsert stores for a key. It runs with
+ * the key's stripe held for writing, so it must not call into the table.
+ * @param const char* key being updated, not null terminated
+ * @param size_t length of the key
+ * @param void* object stored for the key, NULL when there is none
+ * @param void* context given to hash_table_upsert
+ * @return void* obj after changing it in place, a new object to replace obj
+ * with, or NULL to leave the table as it was
+ */
+typedef void * upsert_function(const char * key, size_t keylen, void * obj, void * p_ctx);
+
+/**
+ * @brief reports the bytes an object holds, for a cache's memory_limit. It
+ * must return the same size for an object every time it is called.
+ * @param const void* object to measure
+ * @return size_t bytes owned by the object
+ */
+typedef size_t size_function(const void * obj);
+
+/**
+ * @brief counters of a table created with a memory_limit or a sweeper
+ */
+typedef struct ht_cache_stats
+{
+    uint64_t hits;         // lookups that found a live entry
+    uint64_t misses;       // lookups that found nothing or an expired entry
+    uint64_t expired;      // entries dropped because their TTL ran out
+    uint64_t evicted;      // live entries dropped to stay within memory_limit
+    size_t   memory_used;  // bytes charged for entries, keys and objects
+    size_t   memory_limit; // as configured, 0 for none
+} ht_cache_stats_t;
+
+#define HT_STATS_HISTOGRAM 16 // lengths counted one by one, the last slot counts longer
+
+/**
+ * @brief shape and counters of a table, see hash_table_stats
+ * @NOTE: for a chained table histogram[n] counts the buckets holding n entries
+ * and longest is the longest chain. For the open backend histogram[n] counts
+ * the entries found n + 1 groups into their probe sequence and longest is the
+ * most groups a lookup of a stored key probes.
+ */
+typedef struct ht_stats
+{
+    size_t   count;        // entries stored
+    size_t   buckets;      // chained: buckets in both arrays, open: slots
+    double   load_factor;  // count / buckets
+    uint64_t histogram[HT_STATS_HISTOGRAM];
+    uint32_t longest;
+    uint64_t inserts;      // inserts that succeeded, duplicates included. These
+                           // counters are only kept when opts.stats was set
+    uint64_t hits;         // lookups that found the key
+    uint64_t misses;       // lookups that did not
+    uint64_t removes;      // keys removed or deleted
+    uint64_t lock_waits;   // lock acquisitions that had to block
+    uint64_t lock_wait_ns; // time spent blocked in them
+} ht_stats_t;
+
+/**
+ * @brief read-only view of a snapshot file, see hash_table_snapshot_open
+ */
+typedef struct ht_snapshot ht_snapshot_t;
+
+#define HT_SNAP_VERIFY     0x1 // hash_table_snapshot_open: check the body checksum too
+#define HT_DUMP_BACKGROUND 0x1 // dump_keys_to_file_ex: write from a forked child
+
+/**
+ * @brief state of the last background dump of a table
+ */
+typedef enum ht_dump_state
+{
+    HT_DUMP_IDLE = 0, // no background dump has been started
+    HT_DUMP_RUNNING,
+    HT_DUMP_DONE,     // the last dump was installed
+    HT_DUMP_FAILED,   // the last dump was discarded
+} ht_dump_state_t;
+
+/**
+ * @brief progress of the running or last background dump
+ */
+typedef struct ht_dump_progress
+{
+    ht_dump_state_t state;
+    uint64_t        entries_total;   // entries in the dump, 0 until counted
+    uint64_t        entries_written; // updated every few thousand entries
+    uint64_t        bytes_written;   // after the header
+    uint64_t        pause_us;        // writers were held while the table forked
+    uint64_t        duration_us;     // so far, or in total once finished
+} ht_dump_progress_t;
+
+/**
+ * @brief settings for hash_table_wal_open, zero initialise for defaults
+ */
+typedef struct hash_table_wal_opts
+{
+    uint32_t flush_interval_us; // how long a batch gathers records before it is
+                                // synced, 0 to sync as soon as the last sync ends
+    int      sync_commit;       // nonzero: inserts and removes return only once
+                                // their record is on disk
+} hash_table_wal_opts_t;
+
 /**
  * @brief struct that will hold the hash table
  */
 typedef struct _hash_table hash_table_t;
 
+/**
+ * @brief storage layout used by a hash table
+ */
+typedef enum ht_backend
+{
+    HT_BACKEND_CHAINED = 0, // bucket array with external chaining (default)
+    HT_BACKEND_OPEN,        // open addressing with SIMD control-byte probing
+} ht_backend_t;
+
+/**
+ * @brief how a hash table protects itself from concurrent callers
+ */
+typedef enum ht_concurrency
+{
+    HT_CONC_GLOBAL = 0,    // every call holds the table's hash_lock (default)
+    HT_CONC_STRIPED,       // reader/writer locks over stripes of buckets, chained only
+    HT_CONC_LOCKFREE_READ, // writers lock stripes, lookups take no lock and removed
+                           // entries are freed after a grace period, chained only
+} ht_concurrency_t;
+
+/**
+ * @brief optional settings for hash_table_create_ex, zero initialise for defaults
+ */
+typedef struct hash_table_opts
+{
+    ht_backend_t      backend;           // storage layout
+    ht_concurrency_t  concurrency;       // locking scheme
+    uint32_t          lock_stripes;      // striped and lock-free modes: stripe count,
+                                         // rounded up to a power of two, 0 for 64
+    uint32_t          inline_key_max;    // chained: keys up to this many bytes live
+                                         // inside their entry, 0 for the default of 24
+    encode_function * encode;            // snapshots: serialises objects, optional
+    decode_function * decode;            // snapshots: rebuilds objects, optional
+    int               substring_index;   // keep a trigram index of the keys so
+                                         // return_all_matching_keys skips the scan
+    int               prefix_index;      // keep the keys ordered for
+                                         // hash_table_prefix_iter and range_iter
+    size_t            memory_limit;      // chained: bytes the table may hold before
+                                         // it evicts with a CLOCK sweep, 0 for none
+    size_function *   object_size;       // memory_limit: bytes each object holds,
+                                         // optional, NULL to count keys only
+    uint32_t          sweep_interval_ms; // chained: how often a thread drops
+                                         // expired entries, 0 for no sweeper
+    int               stats;             // count operations and lock waits per
+                                         // thread for hash_table_stats
+    int               bloom_filter;      // chained: keep counting Bloom filters
+                                         // so most lookups of absent keys skip
+                                         // the buckets, for miss-heavy tables
+} hash_table_opts_t;
+
 /**
  * @brief Creates the hash table of size amount by using hashfunction
- * @param uint32_t size of the hash table
- * @param hashfunction* pointer to the hash function
+ * @param uint32_t initial size of the hash table, rounded up to a power of two.
+ * The table grows and shrinks with its load and never drops below this size.
+ * @param hashfunction* pointer to the hash function. NULL or hash_function
+ * selects the built-in hash keyed with a random per-table seed.
  * @param cleanup_function* pointer to the cleanup function
  * @return SUCCESS_CODE on success
  * @return FAILURE_CODE on failure
@@ -37,6 +207,20 @@ hash_table_t * hash_table_create(uint32_t           size,
                                  hashfunction *     hf,
                                  cleanup_function * cleanup);
 
+/**
+ * @brief Creates the hash table with the settings in opts
+ * @param uint32_t initial size of the hash table, see hash_table_create
+ * @param hashfunction* pointer to the hash function
+ * @param cleanup_function* pointer to the cleanup function
+ * @param const hash_table_opts_t* settings, NULL for the defaults
+ * @return hash_table_t* on success
+ * @return NULL on failure
+ */
+hash_table_t * hash_table_create_ex(uint32_t                  size,
+                                    hashfunction *            hf,
+                                    cleanup_function *        cleanup,
+                                    const hash_table_opts_t * opts);
+
 /**
  * @brief Deletes the hash table
  * @param hash_table* pointer to the hash table
@@ -49,6 +233,23 @@ void hash_table_destroy(hash_table_t * ht);
  */
 void hash_table_print(hash_table_t * ht);
 
+/**
+ * @brief Measures chain or probe lengths and collects the operation and lock
+ * wait counters. The table is walked one stripe and a few hundred buckets at
+ * a time, so writers running meanwhile can skew the figures slightly.
+ * @param hash_table* table to measure
+ * @param ht_stats_t* receives the figures
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE when an argument is NULL
+ */
+int hash_table_stats(hash_table_t * ht, ht_stats_t * p_stats);
+
+/**
+ * @brief Zeroes the operation and lock wait counters of a table
+ * @param hash_table* table created with opts.stats
+ */
+void hash_table_stats_reset(hash_table_t * ht);
+
 /**
  * @brief inserts they key and object into the hash table
  * @param hash_table* pointer to the hash table
@@ -58,29 +259,204 @@ void hash_table_print(hash_table_t * ht);
  */
 int hash_table_insert(hash_table_t * ht, const char * key, void * obj);
 
+/**
+ * @brief inserts a key of known length, saving the strlen of hash_table_insert
+ * @param hash_table* pointer to the hash table
+ * @param const char* key to be stored, need not be null terminated
+ * @param size_t length of the key
+ * @param void* object to be stored
+ * @return SUCCESS_CODE on success or when the key already exists
+ * @return FAIL_CODE on failure
+ */
+int hash_table_insert_n(hash_table_t * ht,
+                        const char *   key,
+                        size_t         keylen,
+                        void *         obj);
+
+/**
+ * @brief Inserts a key that expires ttl seconds from now. Expired entries are
+ * never returned. They are freed with the cleanup function when a write
+ * meets them, when the CLOCK hand or the sweeper passes them, and by GLOBAL
+ * mode lookups. Iterations, scans and dumps may still list them until then.
+ * TTLs are not kept by snapshots or the write-ahead log.
+ * @param hash_table* pointer to a chained hash table
+ * @param const char* key to be stored, need not be null terminated
+ * @param size_t length of the key
+ * @param void* object to be stored
+ * @param uint32_t ttl seconds the entry lives, to the second, 0 for ever
+ * @return SUCCESS_CODE on success or when a live entry has the key already
+ * @return FAIL_CODE on failure
+ */
+int hash_table_insert_ttl(hash_table_t * ht,
+                          const char *   key,
+                          size_t         keylen,
+                          void *         obj,
+                          uint32_t       ttl);
+
+/**
+ * @brief Reads the hit, expiry and eviction counters of a cache. Rates are
+ * the difference between two reads over the time between them.
+ * @param hash_table* table created with a memory_limit or sweep_interval_ms
+ * @param ht_cache_stats_t* receives the counters
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE when the table is not a cache
+ */
+int hash_table_cache_stats(hash_table_t * ht, ht_cache_stats_t * p_stats);
+
 /**
  * @brief Looks up the key in the hash table
  * @param hash_table* pointer to the hash table
  * @param const char key to searched for
  */
 void * hash_table_lookup(hash_table_t * ht, const char * key);
-// void *hash_table_lookup(hash_table *ht, const char *key, size_t keylen);
 
 /**
- * @brief Finds an object and deletes it from the hash table
+ * @brief Looks up a key of known length
+ * @param hash_table* pointer to the hash table
+ * @param const char* key to searched for, need not be null terminated
+ * @param size_t length of the key
+ * @return void* object on success
+ * @return NULL when the key is not present
+ */
+void * hash_table_lookup_n(hash_table_t * ht, const char * key, size_t keylen);
+
+/**
+ * @brief Looks up many keys at once. Keys are hashed a window at a time and
+ * every bucket of the window is prefetched before any chain is walked, so
+ * the cache misses of the window overlap instead of adding up, and the locks
+ * a window needs are taken once.
+ * @param hash_table* pointer to the hash table
+ * @param const char * const * keys to look up
+ * @param const size_t* length of each key, NULL to use strlen
+ * @param size_t number of keys
+ * @param void** receives the object of each key, NULL where it is missing
+ * @return size_t number of keys found
+ */
+size_t hash_table_lookup_batch(hash_table_t *       ht,
+                               const char * const * keys,
+                               const size_t *       keylens,
+                               size_t               count,
+                               void **              objects);
+
+/**
+ * @brief Inserts many keys at once, in order, with the prefetching and
+ * locking of hash_table_lookup_batch. With a write-ahead log attached, each
+ * window waits for the log once.
+ * @param hash_table* pointer to the hash table
+ * @param const char * const * keys to store
+ * @param const size_t* length of each key, NULL to use strlen
+ * @param void * const * object of each key
+ * @param size_t number of keys
+ * @return size_t number of keys stored or already present. When it is less
+ * than count, keys[return] failed and the objects from there on were not
+ * stored.
+ */
+size_t hash_table_insert_batch(hash_table_t *       ht,
+                               const char * const * keys,
+                               const size_t *       keylens,
+                               void * const *       objs,
+                               size_t               count);
+
+/**
+ * @brief Finds an object and deletes it from the hash table, passing the
+ * object to the table's cleanup function. In HT_CONC_LOCKFREE_READ mode the
+ * cleanup runs only after every lookup that could still see the object has
+ * finished.
  * @param hash_table* pointer to the hash table
  * @param const char key to searched for
+ * @return SUCCESS_CODE when the key was found and deleted
+ * @return FAIL_CODE otherwise
  */
-void * hash_table_delete(hash_table_t * ht, const char * key);
+int hash_table_delete(hash_table_t * ht, const char * key);
 
 /**
- * @brief hash function that will be used to hash the key
+ * @brief Reads, changes and writes back the object of a key in one step. The
+ * key is hashed and found once and fn runs under the lock of its stripe, so
+ * concurrent upserts of a key never lose an update.
+ * @NOTE: an object fn replaces goes to the table's cleanup function, after
+ * every lookup that could still see it has finished in HT_CONC_LOCKFREE_READ
+ * mode. An object changed in place may be read by lock-free lookups while fn
+ * changes it. A log attached to the table records the object fn returns.
+ * @param hash_table* pointer to the hash table
+ * @param const char* key to update
+ * @param upsert_function* fn computes the object to store
+ * @param void* p_ctx passed to fn
+ * @return SUCCESS_CODE when fn ran, whatever it returned
+ * @return FAIL_CODE on failure, the object fn returned is cleaned up unless
+ * it was the one already stored
+ */
+int hash_table_upsert(hash_table_t *    ht,
+                      const char *      key,
+                      upsert_function * fn,
+                      void *            p_ctx);
+
+/**
+ * @brief hash_table_upsert with a key of known length
+ */
+int hash_table_upsert_n(hash_table_t *    ht,
+                        const char *      key,
+                        size_t            keylen,
+                        upsert_function * fn,
+                        void *            p_ctx);
+
+/**
+ * @brief Replaces the object of a key with desired if it is still expected.
+ * An expected of NULL inserts desired when the key is not present.
+ * @NOTE: on success the table owns desired and passes expected to its
+ * cleanup function like hash_table_upsert does. Otherwise desired still
+ * belongs to the caller.
+ * @NOTE: objects are compared by address. A replaced object that was freed
+ * and whose address malloc handed out again matches expected, as does an
+ * object an upsert changed in place. Only HT_CONC_LOCKFREE_READ tables rule
+ * the first out, for a caller that reads expected and calls hash_table_cas
+ * within one hash_table_read_begin / hash_table_read_end section.
+ * @param hash_table* pointer to the hash table
+ * @param const char* key to update
+ * @param void* expected object the caller last read for the key
+ * @param void* desired object to store, not NULL
+ * @return SUCCESS_CODE when desired was stored
+ * @return 0 when the key holds another object, or none
+ * @return FAIL_CODE on failure
+ */
+int hash_table_cas(hash_table_t * ht, const char * key, void * expected, void * desired);
+
+/**
+ * @brief Starts a read section. In HT_CONC_LOCKFREE_READ mode an object
+ * returned by hash_table_lookup is only guaranteed to stay alive until the
+ * lookup returns. Wrapping the lookup and every use of the object in
+ * hash_table_read_begin / hash_table_read_end keeps hash_table_delete from
+ * cleaning it up in between. Sections nest. Keep them short, an open section
+ * holds back both reclamation and resizing of lock-free tables.
+ * @return SUCCESS_CODE when the section started
+ * @return FAIL_CODE when it could not, then hash_table_read_end must not be
+ * called and an object looked up may be cleaned up at any time
+ */
+int hash_table_read_begin(void);
+
+/**
+ * @brief Ends a read section started by hash_table_read_begin
+ */
+void hash_table_read_end(void);
+
+/**
+ * @brief hash function that will be used to hash the key. Same as
+ * hash_function_seeded with a seed of 0.
  * @param char * name of the key
  * @param size_t length of the key
  * @return uint64_t hash value
  */
 uint64_t hash_function(const char * key, unsigned long length);
 
+/**
+ * @brief wyhash style hash that consumes 16 to 48 bytes per step and keys the
+ * result with seed, so tables with different seeds collide on different keys
+ * @param char * key bytes to hash, need not be null terminated
+ * @param size_t length of the key
+ * @param uint64_t seed to key the hash with
+ * @return uint64_t hash value
+ */
+uint64_t hash_function_seeded(const char * key, size_t length, uint64_t seed);
+
 /**
  * @brief function that will be used to clean up the object
  *
@@ -91,20 +467,35 @@ uint64_t hash_function(const char * key, unsigned long length);
 void * hash_table_remove(hash_table_t * p_ht, const char * key);
 
 /**
- * @brief Read the File data and if it's valid creates a hash table of objects
+ * @brief Removes a key of known length
  *
- * @param fp to binary file
- * @param hash_table_t  hashtable to build
+ * @param hash_table_t hasthable
+ * @param const char* key to remove, need not be null terminated
+ * @param size_t length of the key
+ * @return void* to an object the caller must free
+ */
+void * hash_table_remove_n(hash_table_t * p_ht, const char * key, size_t keylen);
+
+/**
+ * @brief Read the File data and if it's valid creates a hash table of objects.
+ * The file is a snapshot written by write_hash_to_file, it is mapped and
+ * every entry is promoted into p_ht with hash_table_snapshot_promote.
+ *
+ * @param fp to binary file, must be a regular file
+ * @param hash_table_t  hashtable to build, needs a decode function
  * @return int SUCCESS_CODE on success
  * @return int FAILURE_CODE on failure
  */
 int load_file_to_hash(FILE * fp, hash_table_t * p_ht);
 
 /**
- * @brief Write the hash table to a binary file
+ * @brief Write the hash table to a binary file as a snapshot: a header, a
+ * bucket index, fixed size records and the key and value blobs, laid out so
+ * hash_table_snapshot_open can serve it straight from a read-only mapping.
+ * Writers are blocked while the snapshot is written.
  *
- * @param fp file to write to
- * @param hash_table_t hashtable to write
+ * @param fp file to write to, written sequentially from its current position
+ * @param hash_table_t hashtable to write, needs an encode function
  * @return int SUCCESS_CODE on success
  * @return int FAILURE_CODE on failure
  */
@@ -117,16 +508,22 @@ int write_hash_to_file(FILE * fp, hash_table_t * p_ht);
  * @param hash_table_t hasthtable to get the items from
  * @param char *output string to be sent as the data
  * @return int
+ * @NOTE: output is not bounded and every stripe is held for the whole copy,
+ * hash_table_scan does the same a bounded buffer at a time.
  */
 int copy_keys_to_string(hash_table_t * p_ht, char * output);
 
 /**
  * @brief search hashtable for all matching keys or keys that contain the string in them.
+ * Keys are copied into store_keys each followed by a null byte. A table created
+ * with opts.substring_index answers from its trigram index in time roughly
+ * proportional to the matches, any other table is scanned in full.
  *
  * @param hash_table_t
  * @param char *store_keys
  * @param char * key_to_find
- * @param int user_permission  to check against the key
+ * @param int user_permission  to check against the key, objects carry no
+ * permission yet so it is not used
  * @return int
  */
 int return_all_matching_keys(hash_table_t * p_ht,
@@ -135,12 +532,357 @@ int return_all_matching_keys(hash_table_t * p_ht,
                              int            user_permission);
 
 /**
- * @brief dump all objects from the hashtable into a binary file
+ * @brief callback of hash_table_prefix_iter and hash_table_range_iter
+ * @param const char* key being visited, not null terminated
+ * @param size_t length of the key
+ * @param void* caller supplied context
+ * @return SUCCESS_CODE to keep iterating, FAIL_CODE to stop
+ */
+typedef int ht_key_function(const char * key, size_t keylen, void * p_ctx);
+
+/**
+ * @brief Calls visit on every key starting with prefix, in ascending byte
+ * order, without scanning the rest of the table. Needs opts.prefix_index.
+ * Writers wait while visit runs, so it must not modify the table.
+ *
+ * @param hash_table_t* table to iterate
+ * @param const char* prefix the keys start with, need not be null terminated
+ * @param size_t length of the prefix, 0 visits every key
+ * @param ht_key_function* called on each key
+ * @param void* context passed to visit
+ * @return SUCCESS_CODE when every such key was visited
+ * @return FAIL_CODE when visit stopped the iteration or there is no index
+ */
+int hash_table_prefix_iter(hash_table_t *    p_ht,
+                           const char *      prefix,
+                           size_t            prefix_len,
+                           ht_key_function * visit,
+                           void *            p_ctx);
+
+/**
+ * @brief Calls visit on every key k with start <= k < end, in ascending byte
+ * order, like hash_table_prefix_iter
+ *
+ * @param hash_table_t* table to iterate
+ * @param const char* first key of the range, need not be present
+ * @param size_t length of start
+ * @param const char* first key past the range, NULL to run to the last key
+ * @param size_t length of end
+ * @param ht_key_function* called on each key
+ * @param void* context passed to visit
+ * @return SUCCESS_CODE when every such key was visited
+ * @return FAIL_CODE when visit stopped the iteration or there is no index
+ */
+int hash_table_range_iter(hash_table_t *    p_ht,
+                          const char *      start,
+                          size_t            start_len,
+                          const char *      end,
+                          size_t            end_len,
+                          ht_key_function * visit,
+                          void *            p_ctx);
+
+/**
+ * @brief callback of hash_table_scan_parallel
+ * @param const char* key being visited, not null terminated
+ * @param size_t length of the key
+ * @param void* object stored under the key
+ * @param void* caller supplied context
+ * @return SUCCESS_CODE to keep scanning, FAIL_CODE to stop every worker
+ */
+typedef int ht_scan_function(const char * key, size_t keylen, void * obj, void * p_ctx);
+
+/**
+ * @brief Copies the next keys of a scan into buf, each followed by a null
+ * byte. Start with *p_cursor at 0 and call again with the returned cursor
+ * until it is 0 again. Writers keep running between and during calls: a key
+ * present for the whole scan is returned at least once and may be returned
+ * more than once, keys added or removed meanwhile may or may not be.
+ *
+ * @param hash_table_t* table to scan
+ * @param uint64_t* cursor to resume from, receives the next one
+ * @param char* buffer to fill
+ * @param size_t size of buf
+ * @param size_t* receives the number of bytes used in buf
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE when buf cannot hold the keys of a single bucket
+ */
+int hash_table_scan(hash_table_t * p_ht,
+                    uint64_t *     p_cursor,
+                    char *         buf,
+                    size_t         buf_len,
+                    size_t *       p_used);
+
+/**
+ * @brief Calls visit on every key of the table from several threads at once,
+ * with the same guarantees as hash_table_scan. Each thread holds one stripe
+ * for reading while it visits it, so visit may run concurrently with itself
+ * and must not modify the table.
+ *
+ * @param hash_table_t* table to scan
+ * @param uint32_t number of threads, 0 for one per online CPU
+ * @param ht_scan_function* called on each key
+ * @param void* context passed to visit
+ * @return SUCCESS_CODE when every key was visited
+ * @return FAIL_CODE when visit stopped the scan or it could not start
+ */
+int hash_table_scan_parallel(hash_table_t *     p_ht,
+                             uint32_t           threads,
+                             ht_scan_function * visit,
+                             void *             p_ctx);
+
+/**
+ * @brief dump all objects from the hashtable into a binary file. The snapshot
+ * is written next to the file and renamed over it once it is on disk, so a
+ * crash never leaves a partial dump behind.
  *
  * @param char * dump_file_name
  * @param hash_table_t p_ht
- * @return int
+ * @return int SUCCESS_CODE on success
+ * @return int FAILURE_CODE on failure
  */
 int dump_keys_to_file(char * dump_file_name, hash_table_t * p_ht);
 
+/**
+ * @brief dump_keys_to_file with options. HT_DUMP_BACKGROUND forks the
+ * process while writers are held, which takes about as long as copying the
+ * page tables, and returns. The child writes the point in time copy while
+ * the table keeps serving inserts and lookups, and a thread installs the file
+ * once the child exits. That thread also trims the log, with writers only
+ * held while it appends the records logged during the trim, and the dump is
+ * reported done after that. Pages the parent writes meanwhile are copied by
+ * the kernel, so expect up to twice the memory with a heavy write load. One
+ * background dump runs per table at a time. The caller must not reap the
+ * child itself.
+ *
+ * @param char * dump_file_name
+ * @param hash_table_t p_ht
+ * @param int flags 0 or HT_DUMP_BACKGROUND
+ * @return int SUCCESS_CODE when the dump was written, or started in the
+ * background
+ * @return int FAILURE_CODE on failure
+ */
+int dump_keys_to_file_ex(char * dump_file_name, hash_table_t * p_ht, int flags);
+
+/**
+ * @brief Reports the progress of the running background dump, or how the
+ * last one went. A duration growing past the interval between dumps means
+ * checkpoints no longer keep up.
+ *
+ * @param hash_table_t p_ht table being dumped
+ * @param ht_dump_progress_t * p_progress receives the progress
+ * @return int SUCCESS_CODE on success
+ * @return int FAILURE_CODE on failure
+ */
+int hash_table_dump_progress(hash_table_t * p_ht, ht_dump_progress_t * p_progress);
+
+/**
+ * @brief Waits for the running background dump, if any, to be installed
+ * @param hash_table_t p_ht table being dumped
+ * @return int SUCCESS_CODE unless the last background dump failed
+ */
+int hash_table_dump_wait(hash_table_t * p_ht);
+
+/**
+ * @brief Maps a snapshot read-only. Only the header is read, so opening takes
+ * the same time whatever the size of the file. Lookups then read the mapping
+ * in place.
+ *
+ * @param const char * path snapshot written by write_hash_to_file
+ * @param int flags HT_SNAP_VERIFY to check the checksum of the whole file
+ * @return ht_snapshot_t* on success
+ * @return NULL when the file is missing, truncated, corrupt or of another
+ * version
+ */
+ht_snapshot_t * hash_table_snapshot_open(const char * path, int flags);
+
+/**
+ * @brief Finds the serialised object stored under key
+ *
+ * @param ht_snapshot_t* open snapshot
+ * @param const char * key to look up
+ * @param size_t keylen length of the key
+ * @param size_t * p_len receives the length of the value, may be NULL
+ * @return const void* bytes written by the encode function, 8 byte aligned,
+ * valid until hash_table_snapshot_close
+ * @return NULL when the key is not present
+ */
+const void * hash_table_snapshot_lookup(const ht_snapshot_t * p_snap,
+                                        const char *          key,
+                                        size_t                keylen,
+                                        size_t *              p_len);
+
+/**
+ * @brief Returns the sequence number of the last log record a snapshot holds,
+ * to pass to hash_table_wal_open. 0 when the table had no log attached.
+ */
+uint64_t hash_table_snapshot_lsn(const ht_snapshot_t * p_snap);
+
+/**
+ * @brief Returns the number of entries in a snapshot
+ */
+size_t hash_table_snapshot_count(const ht_snapshot_t * p_snap);
+
+/**
+ * @brief Copies every snapshot entry the live table does not already hold
+ * into it, decoding values with the table's decode function. Meant for
+ * startup, before other threads write to the table.
+ *
+ * @param ht_snapshot_t* open snapshot
+ * @param hash_table_t p_ht live table to fill
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE on failure, entries promoted so far stay in the table
+ */
+int hash_table_snapshot_promote(const ht_snapshot_t * p_snap, hash_table_t * p_ht);
+
+/**
+ * @brief Unmaps a snapshot
+ * @param ht_snapshot_t* snapshot to close
+ */
+void hash_table_snapshot_close(ht_snapshot_t * p_snap);
+
+/**
+ * @brief Replays a write-ahead log into the table and then attaches it, so
+ * every later insert and remove is appended to it. Records from all threads
+ * are written and synced in batches by a background thread, one fdatasync
+ * per batch. A record torn by a crash ends the replay and is cut off. Once
+ * attached, dump_keys_to_file drops the records its snapshot holds. Call at
+ * startup, after the snapshot has been promoted and before other threads use
+ * the table. The log is closed by hash_table_destroy.
+ *
+ * @param hash_table_t p_ht table to log, needs encode and decode functions
+ * @param const char * path log file, created when missing
+ * @param uint64_t after_lsn records up to this one are already in the table,
+ * see hash_table_snapshot_lsn, 0 to replay everything
+ * @param const hash_table_wal_opts_t* settings, NULL for the defaults
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE on failure, records replayed so far stay in the table
+ */
+int hash_table_wal_open(hash_table_t *                p_ht,
+                        const char *                  path,
+                        uint64_t                      after_lsn,
+                        const hash_table_wal_opts_t * p_opts);
+
+/**
+ * @brief Waits until every insert and remove logged so far is on disk
+ * @param hash_table_t p_ht table with a log attached
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE when there is no log or it failed to write
+ */
+int hash_table_wal_sync(hash_table_t * p_ht);
+
+/**
+ * @brief independent hash tables behind one insert, lookup and remove API
+ */
+typedef struct hash_shards hash_shards_t;
+
+/**
+ * @brief Creates a sharded table. Each shard is a full hash table with its
+ * own locks, so threads on different shards never contend. Shards are spread
+ * over the NUMA nodes and each one's arrays are first written from its home
+ * node, which places them there.
+ *
+ * @param uint32_t shard_count rounded up to a power of two, 0 for one per
+ * online CPU
+ * @param uint32_t size initial size of all shards together
+ * @param hashfunction* pointer to the hash function, see hash_table_create
+ * @param cleanup_function* pointer to the cleanup function
+ * @param const hash_table_opts_t* settings of every shard, NULL for defaults
+ * @return hash_shards_t* on success
+ * @return NULL on failure
+ */
+hash_shards_t * hash_shards_create(uint32_t                  shard_count,
+                                   uint32_t                  size,
+                                   hashfunction *            hf,
+                                   cleanup_function *        cleanup,
+                                   const hash_table_opts_t * opts);
+
+/**
+ * @brief Destroys every shard and the front-end
+ */
+void hash_shards_destroy(hash_shards_t * p_hs);
+
+/**
+ * @brief hash_table_insert on the shard of key
+ */
+int hash_shards_insert(hash_shards_t * p_hs, const char * key, void * obj);
+
+/**
+ * @brief hash_table_insert_n on the shard of key
+ */
+int hash_shards_insert_n(hash_shards_t * p_hs,
+                         const char *    key,
+                         size_t          keylen,
+                         void *          obj);
+
+/**
+ * @brief hash_table_lookup on the shard of key
+ */
+void * hash_shards_lookup(hash_shards_t * p_hs, const char * key);
+
+/**
+ * @brief hash_table_lookup_n on the shard of key
+ */
+void * hash_shards_lookup_n(hash_shards_t * p_hs, const char * key, size_t keylen);
+
+/**
+ * @brief hash_table_remove on the shard of key
+ */
+void * hash_shards_remove(hash_shards_t * p_hs, const char * key);
+
+/**
+ * @brief hash_table_remove_n on the shard of key
+ */
+void * hash_shards_remove_n(hash_shards_t * p_hs, const char * key, size_t keylen);
+
+/**
+ * @brief hash_table_delete on the shard of key
+ */
+int hash_shards_delete(hash_shards_t * p_hs, const char * key);
+
+/**
+ * @brief hash_table_upsert_n on the shard of key
+ */
+int hash_shards_upsert_n(hash_shards_t *   p_hs,
+                         const char *      key,
+                         size_t            keylen,
+                         upsert_function * fn,
+                         void *            p_ctx);
+
+/**
+ * @brief hash_table_cas on the shard of key
+ */
+int hash_shards_cas(hash_shards_t * p_hs,
+                    const char *    key,
+                    void *          expected,
+                    void *          desired);
+
+/**
+ * @brief Returns the number of shards
+ */
+uint32_t hash_shards_count(const hash_shards_t * p_hs);
+
+/**
+ * @brief Returns a shard, for the calls the front-end does not wrap such as
+ * dumps, scans and logs. Keys inserted straight into a shard must belong to
+ * it, see hash_shards_index.
+ * @return hash_table_t* on success
+ * @return NULL when index is out of range
+ */
+hash_table_t * hash_shards_at(hash_shards_t * p_hs, uint32_t index);
+
+/**
+ * @brief Returns the index of the shard key belongs to
+ * @return int shard index on success
+ * @return FAIL_CODE when the key is invalid
+ */
+int hash_shards_index(hash_shards_t * p_hs, const char * key, size_t keylen);
+
+/**
+ * @brief Returns the NUMA node a shard's memory was placed on. Handing a key
+ * to a worker running on that node keeps its shard's cache lines and pages
+ * on one socket.
+ * @return int node number, -1 when the machine reports no NUMA layout
+ */
+int hash_shards_node(hash_shards_t * p_hs, uint32_t index);
+
 #endif /* HSH_TABLE_H */
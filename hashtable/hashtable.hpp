@@ -0,0 +1,701 @@
+/* @file hashtable.hpp
+ * Header-only C++ hash map specialised at compile time for its key type
+ *
+ * HashMap follows the open addressing backend of hashtable_open.c: a flat
+ * slot array next to one control byte per slot, 7 bits of the hash in every
+ * full control byte, groups of 16 slots filtered with one SSE2 compare and
+ * triangular probing over the groups. Keys and values live in the slots, so
+ * a lookup touches the control bytes and one slot and nothing else.
+ *
+ * The default hash and equality are picked with if constexpr:
+ *   - integral, enum and pointer keys hash to their own value and compare
+ *     with ==, so looking up an integer costs one mix and a few compares;
+ *   - other trivially copyable keys without padding hash their bytes with the
+ *     same wyhash structure as hash_function and compare with memcmp;
+ *   - anything else needs a Hash, and an Equal when it has no ==.
+ * Every hash is finalised like ht_mix, so a Hash only has to be unique, not
+ * well distributed.
+ *
+ * Unlike hash_table_t the map takes no lock and keeps no seed: it is meant to
+ * be owned by one thread, or guarded by its owner, and keyed by IDs the
+ * program chose itself.
+ */
+
+#ifndef HSH_TABLE_HPP
+#define HSH_TABLE_HPP
+
+#if __cplusplus < 201703L
+#    error "hashtable.hpp needs C++17"
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#if defined(__SSE2__)
+#    include <emmintrin.h>
+#endif
+
+namespace ht
+{
+
+namespace detail
+{
+
+constexpr uint8_t CTRL_EMPTY   = 0x80;
+constexpr uint8_t CTRL_DELETED = 0xFE;
+constexpr size_t  GROUP_WIDTH  = 16;
+constexpr size_t  MIN_CAPACITY = 16; // a whole group, like HT_MIN_BUCKETS
+
+/**
+ * @brief bitmask with one bit per slot of a group
+ */
+using group_mask_t = uint32_t;
+
+/**
+ * @brief Finalises a hash so the low and high bits both depend on every
+ * input bit, see ht_mix
+ */
+inline uint64_t mix(uint64_t hash) noexcept
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+} /* mix() */
+
+inline group_mask_t group_match(const uint8_t * p_group, uint8_t h2) noexcept
+{
+#if defined(__SSE2__)
+    __m128i ctrl = _mm_load_si128(reinterpret_cast<const __m128i *>(p_group));
+    return static_cast<group_mask_t>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(static_cast<char>(h2)))));
+#else
+    group_mask_t mask = 0;
+    for (size_t i = 0; i < GROUP_WIDTH; i++)
+    {
+        if (p_group[i] == h2)
+        {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+#endif
+} /* group_match() */
+
+inline group_mask_t group_match_empty(const uint8_t * p_group) noexcept
+{
+    return group_match(p_group, CTRL_EMPTY);
+} /* group_match_empty() */
+
+inline group_mask_t group_match_free(const uint8_t * p_group) noexcept
+{
+#if defined(__SSE2__)
+    // EMPTY and DELETED are the only control bytes with the high bit set
+    __m128i ctrl = _mm_load_si128(reinterpret_cast<const __m128i *>(p_group));
+    return static_cast<group_mask_t>(_mm_movemask_epi8(ctrl));
+#else
+    group_mask_t mask = 0;
+    for (size_t i = 0; i < GROUP_WIDTH; i++)
+    {
+        if (p_group[i] & 0x80)
+        {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+#endif
+} /* group_match_free() */
+
+inline uint64_t fold(uint64_t a, uint64_t b) noexcept
+{
+    __uint128_t product = static_cast<__uint128_t>(a) * b;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+} /* fold() */
+
+inline uint64_t read8(const uint8_t * p) noexcept
+{
+    uint64_t value = 0;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+} /* read8() */
+
+inline uint64_t read4(const uint8_t * p) noexcept
+{
+    uint32_t value = 0;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+} /* read4() */
+
+/**
+ * @brief Hashes length bytes the way hash_function does, without its three
+ * lane loop. Keys are sizeof(K) long, so the branches fold away.
+ */
+inline uint64_t hash_bytes(const void * p_key, size_t length) noexcept
+{
+    constexpr uint64_t secret[4] = { 0xa0761d6478bd642fULL,
+                                     0xe7037ed1a0b428dbULL,
+                                     0x8ebc6af09c88c6e3ULL,
+                                     0x589965cc75374cc3ULL };
+    const uint8_t *    p         = static_cast<const uint8_t *>(p_key);
+    uint64_t           seed      = fold(secret[0], secret[1]);
+    uint64_t           a         = 0;
+    uint64_t           b         = 0;
+    if (16 >= length)
+    {
+        if (4 <= length)
+        {
+            // two overlapping 4 byte reads from each end cover 4..16 bytes
+            size_t shift = (length >> 3) << 2;
+            a            = (read4(p) << 32) | read4(p + shift);
+            b            = (read4(p + length - 4) << 32) | read4(p + length - 4 - shift);
+        }
+        else if (0 < length)
+        {
+            a = (static_cast<uint64_t>(p[0]) << 16) |
+                (static_cast<uint64_t>(p[length >> 1]) << 8) | p[length - 1];
+        }
+    }
+    else
+    {
+        size_t remaining = length;
+        while (16 < remaining)
+        {
+            seed = fold(read8(p) ^ secret[1], read8(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        // the last 16 bytes, overlapping earlier input when remaining < 16
+        a = read8(p + remaining - 16);
+        b = read8(p + remaining - 8);
+    }
+    a ^= secret[1];
+    b ^= seed;
+    __uint128_t product = static_cast<__uint128_t>(a) * b;
+    a                   = static_cast<uint64_t>(product);
+    b                   = static_cast<uint64_t>(product >> 64);
+    return fold(a ^ secret[0] ^ length, b ^ secret[1]);
+} /* hash_bytes() */
+
+template <typename K>
+constexpr bool is_scalar_key = std::is_integral_v<K> || std::is_enum_v<K> ||
+                               std::is_pointer_v<K>;
+
+template <typename K>
+constexpr bool is_bytes_key = std::is_trivially_copyable_v<K> &&
+                              std::has_unique_object_representations_v<K>;
+
+} // namespace detail
+
+/**
+ * @brief default hash of HashMap, see the file comment for what it accepts
+ */
+template <typename K>
+struct Hash
+{
+    uint64_t operator()(const K & key) const noexcept
+    {
+        if constexpr (std::is_pointer_v<K>)
+        {
+            return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(key));
+        }
+        else if constexpr (detail::is_scalar_key<K>)
+        {
+            return static_cast<uint64_t>(key);
+        }
+        else
+        {
+            static_assert(detail::is_bytes_key<K>,
+                          "ht::Hash: key has padding or is not trivially copyable, "
+                          "give HashMap a Hash for it");
+            return detail::hash_bytes(&key, sizeof(K));
+        }
+    }
+};
+
+/**
+ * @brief default key equality of HashMap
+ */
+template <typename K>
+struct Equal
+{
+    bool operator()(const K & a, const K & b) const noexcept
+    {
+        if constexpr (!detail::is_scalar_key<K> && detail::is_bytes_key<K>)
+        {
+            return 0 == std::memcmp(&a, &b, sizeof(K));
+        }
+        else
+        {
+            return a == b;
+        }
+    }
+};
+
+/**
+ * @brief open addressing hash map storing keys and values inline
+ * @NOTE: pointers returned by find, emplace and operator[] stay valid until
+ * the next insertion that grows the map, erase of that key, or clear.
+ * Duplicate inserts leave the stored value in place, like hash_table_insert.
+ */
+template <typename K, typename V, typename H = Hash<K>, typename E = Equal<K>>
+class HashMap
+{
+    static_assert(std::is_nothrow_move_constructible_v<K> &&
+                      std::is_nothrow_move_constructible_v<V>,
+                  "ht::HashMap: keys and values are moved while growing and "
+                  "must not throw doing so");
+
+public:
+    /**
+     * @brief key and value as stored in a slot
+     */
+    struct Slot
+    {
+        K key;
+        V value;
+    };
+
+    /**
+     * @brief Creates a map that holds capacity entries before it first grows.
+     * A capacity of 0 allocates nothing until the first insert.
+     */
+    explicit HashMap(size_t capacity = 0, const H & hash = H(), const E & equal = E())
+        : hash_(hash), equal_(equal)
+    {
+        if (0 != capacity)
+        {
+            reserve(capacity);
+        }
+    }
+
+    HashMap(const HashMap & other) : hash_(other.hash_), equal_(other.equal_)
+    {
+        if (0 == other.size_)
+        {
+            return;
+        }
+        // Same capacity and hash, so every entry keeps its slot
+        allocate(other.capacity_);
+        size_t index = 0;
+        try
+        {
+            for (; index < capacity_; index++)
+            {
+                if (!(other.ctrl_[index] & 0x80))
+                {
+                    new (&slots_[index]) Slot(other.slots_[index]);
+                    ctrl_[index] = other.ctrl_[index];
+                }
+            }
+        }
+        catch (...)
+        {
+            destroy_slots();
+            release();
+            throw;
+        }
+        size_        = other.size_;
+        growth_left_ = other.growth_left_;
+    }
+
+    HashMap(HashMap && other) noexcept
+        : ctrl_(std::exchange(other.ctrl_, nullptr)),
+          slots_(std::exchange(other.slots_, nullptr)),
+          capacity_(std::exchange(other.capacity_, 0)),
+          size_(std::exchange(other.size_, 0)),
+          growth_left_(std::exchange(other.growth_left_, 0)),
+          hash_(std::move(other.hash_)),
+          equal_(std::move(other.equal_))
+    {
+    }
+
+    HashMap & operator=(HashMap other) noexcept
+    {
+        swap(other);
+        return *this;
+    }
+
+    ~HashMap()
+    {
+        destroy_slots();
+        release();
+    }
+
+    void swap(HashMap & other) noexcept
+    {
+        std::swap(ctrl_, other.ctrl_);
+        std::swap(slots_, other.slots_);
+        std::swap(capacity_, other.capacity_);
+        std::swap(size_, other.size_);
+        std::swap(growth_left_, other.growth_left_);
+        std::swap(hash_, other.hash_);
+        std::swap(equal_, other.equal_);
+    }
+
+    size_t size() const noexcept
+    {
+        return size_;
+    }
+
+    bool empty() const noexcept
+    {
+        return 0 == size_;
+    }
+
+    /**
+     * @brief Returns the slot count, of which 7/8 may be used before a rehash
+     */
+    size_t capacity() const noexcept
+    {
+        return capacity_;
+    }
+
+    /**
+     * @brief Returns the value stored for key or nullptr when there is none
+     */
+    V * find(const K & key) noexcept
+    {
+        size_t index = find_index(key, detail::mix(hash_(key)));
+        return (index < capacity_) ? &slots_[index].value : nullptr;
+    }
+
+    const V * find(const K & key) const noexcept
+    {
+        return const_cast<HashMap *>(this)->find(key);
+    }
+
+    bool contains(const K & key) const noexcept
+    {
+        return nullptr != find(key);
+    }
+
+    /**
+     * @brief Builds a value from args in a free slot unless key is present
+     * @return the stored value and true when it was inserted, or the value
+     * already stored and false
+     */
+    template <typename... Args>
+    std::pair<V *, bool> emplace(const K & key, Args &&... args)
+    {
+        uint64_t mixed = detail::mix(hash_(key));
+        size_t   index = find_index(key, mixed);
+        if (index < capacity_)
+        {
+            return { &slots_[index].value, false };
+        }
+        if (0 == growth_left_)
+        {
+            // Grow when at least half of the load is live, otherwise the map
+            // is mostly DELETED markers and rebuilding at the same size is enough
+            size_t new_capacity = (0 == capacity_) ? detail::MIN_CAPACITY : capacity_;
+            if (size_ >= max_load(capacity_) / 2)
+            {
+                new_capacity *= 2;
+            }
+            rehash(new_capacity);
+        }
+        index = find_free(ctrl_, capacity_, mixed);
+        new (&slots_[index]) Slot{ key, V(std::forward<Args>(args)...) };
+        growth_left_ -= (detail::CTRL_EMPTY == ctrl_[index]);
+        ctrl_[index] = h2(mixed);
+        size_++;
+        return { &slots_[index].value, true };
+    }
+
+    /**
+     * @brief Stores value under key unless key is present
+     * @return true when stored, false when the key already had a value
+     */
+    bool insert(const K & key, const V & value)
+    {
+        return emplace(key, value).second;
+    }
+
+    bool insert(const K & key, V && value)
+    {
+        return emplace(key, std::move(value)).second;
+    }
+
+    /**
+     * @brief Returns the value of key, value-initialising it when absent
+     */
+    V & operator[](const K & key)
+    {
+        return *emplace(key).first;
+    }
+
+    /**
+     * @brief Removes key and destroys its value
+     * @return true when the key was present
+     */
+    bool erase(const K & key) noexcept
+    {
+        size_t index = find_index(key, detail::mix(hash_(key)));
+        if (index >= capacity_)
+        {
+            return false;
+        }
+        remove_at(index);
+        return true;
+    }
+
+    /**
+     * @brief Removes key and hands its value back
+     * @return the value, empty when the key was not present
+     */
+    std::optional<V> take(const K & key)
+    {
+        std::optional<V> value;
+        size_t           index = find_index(key, detail::mix(hash_(key)));
+        if (index < capacity_)
+        {
+            value.emplace(std::move(slots_[index].value));
+            remove_at(index);
+        }
+        return value;
+    }
+
+    /**
+     * @brief Destroys every entry but keeps the slots for reuse
+     */
+    void clear() noexcept
+    {
+        destroy_slots();
+        if (0 != capacity_)
+        {
+            std::memset(ctrl_, detail::CTRL_EMPTY, capacity_);
+        }
+        size_        = 0;
+        growth_left_ = max_load(capacity_);
+    }
+
+    /**
+     * @brief Makes room for count entries so inserting them never rehashes
+     */
+    void reserve(size_t count)
+    {
+        size_t new_capacity = detail::MIN_CAPACITY;
+        while (max_load(new_capacity) < count)
+        {
+            new_capacity <<= 1;
+        }
+        if (new_capacity > capacity_)
+        {
+            rehash(new_capacity);
+        }
+    }
+
+    /**
+     * @brief Calls visit(key, value) on every entry, in slot order. visit must
+     * not insert into or erase from the map.
+     */
+    template <typename F>
+    void for_each(F && visit)
+    {
+        for (size_t index = 0; index < capacity_; index++)
+        {
+            if (!(ctrl_[index] & 0x80))
+            {
+                visit(static_cast<const K &>(slots_[index].key), slots_[index].value);
+            }
+        }
+    }
+
+    template <typename F>
+    void for_each(F && visit) const
+    {
+        for (size_t index = 0; index < capacity_; index++)
+        {
+            if (!(ctrl_[index] & 0x80))
+            {
+                visit(static_cast<const K &>(slots_[index].key),
+                      static_cast<const V &>(slots_[index].value));
+            }
+        }
+    }
+
+private:
+    static uint8_t h2(uint64_t mixed) noexcept
+    {
+        return static_cast<uint8_t>(mixed & 0x7F);
+    }
+
+    static size_t h1(uint64_t mixed) noexcept
+    {
+        return static_cast<size_t>(mixed >> 7);
+    }
+
+    static size_t max_load(size_t capacity) noexcept
+    {
+        return capacity - (capacity / 8);
+    }
+
+    /**
+     * @brief Returns the slot holding key, or capacity_ when it is not present
+     */
+    size_t find_index(const K & key, uint64_t mixed) const noexcept
+    {
+        size_t group_count = capacity_ / detail::GROUP_WIDTH;
+        size_t group_mask  = group_count - 1;
+        size_t group       = h1(mixed) & group_mask;
+        for (size_t step = 1; step <= group_count; step++)
+        {
+            const uint8_t *      p_group = ctrl_ + (group * detail::GROUP_WIDTH);
+            detail::group_mask_t match   = detail::group_match(p_group, h2(mixed));
+            while (0 != match)
+            {
+                size_t index = (group * detail::GROUP_WIDTH) +
+                               static_cast<size_t>(__builtin_ctz(match));
+                if (equal_(slots_[index].key, key))
+                {
+                    return index;
+                }
+                match &= match - 1;
+            }
+            if (0 != detail::group_match_empty(p_group))
+            {
+                break;
+            }
+            group = (group + step) & group_mask;
+        }
+        return capacity_;
+    }
+
+    /**
+     * @brief Finds the first EMPTY or DELETED slot on the probe sequence of
+     * mixed. The map is never full, so the probe always ends.
+     */
+    static size_t find_free(const uint8_t * p_ctrl,
+                            size_t          capacity,
+                            uint64_t        mixed) noexcept
+    {
+        size_t group_mask = (capacity / detail::GROUP_WIDTH) - 1;
+        size_t group      = h1(mixed) & group_mask;
+        for (size_t step = 1;; step++)
+        {
+            detail::group_mask_t free_mask =
+                detail::group_match_free(p_ctrl + (group * detail::GROUP_WIDTH));
+            if (0 != free_mask)
+            {
+                return (group * detail::GROUP_WIDTH) +
+                       static_cast<size_t>(__builtin_ctz(free_mask));
+            }
+            group = (group + step) & group_mask;
+        }
+    }
+
+    void remove_at(size_t index) noexcept
+    {
+        slots_[index].~Slot();
+        // A group that still has an EMPTY slot was never full, so no probe ever
+        // continued past it and the slot can go straight back to EMPTY
+        const uint8_t * p_group =
+            ctrl_ + ((index / detail::GROUP_WIDTH) * detail::GROUP_WIDTH);
+        if (0 != detail::group_match_empty(p_group))
+        {
+            ctrl_[index] = detail::CTRL_EMPTY;
+            growth_left_++;
+        }
+        else
+        {
+            ctrl_[index] = detail::CTRL_DELETED;
+        }
+        size_--;
+    }
+
+    /**
+     * @brief Points the map at fresh arrays of capacity slots, all EMPTY
+     */
+    void allocate(size_t capacity)
+    {
+        uint8_t * p_ctrl = static_cast<uint8_t *>(
+            ::operator new(capacity, std::align_val_t(detail::GROUP_WIDTH)));
+        try
+        {
+            slots_ = static_cast<Slot *>(
+                ::operator new(capacity * sizeof(Slot), std::align_val_t(alignof(Slot))));
+        }
+        catch (...)
+        {
+            ::operator delete(p_ctrl, std::align_val_t(detail::GROUP_WIDTH));
+            throw;
+        }
+        std::memset(p_ctrl, detail::CTRL_EMPTY, capacity);
+        ctrl_        = p_ctrl;
+        capacity_    = capacity;
+        growth_left_ = max_load(capacity);
+    }
+
+    void release() noexcept
+    {
+        if (nullptr != ctrl_)
+        {
+            ::operator delete(ctrl_, std::align_val_t(detail::GROUP_WIDTH));
+            ::operator delete(slots_, std::align_val_t(alignof(Slot)));
+        }
+        ctrl_     = nullptr;
+        slots_    = nullptr;
+        capacity_ = 0;
+    }
+
+    void destroy_slots() noexcept
+    {
+        if constexpr (!std::is_trivially_destructible_v<Slot>)
+        {
+            for (size_t index = 0; index < capacity_; index++)
+            {
+                if (!(ctrl_[index] & 0x80))
+                {
+                    slots_[index].~Slot();
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Moves every entry into fresh arrays of new_capacity. Also used at
+     * the same capacity to clear out DELETED markers.
+     */
+    void rehash(size_t new_capacity)
+    {
+        uint8_t * p_old_ctrl     = ctrl_;
+        Slot *    p_old_slots    = slots_;
+        size_t    old_capacity   = capacity_;
+        allocate(new_capacity); // leaves the map untouched when it throws
+        for (size_t index = 0; index < old_capacity; index++)
+        {
+            if (p_old_ctrl[index] & 0x80)
+            {
+                continue;
+            }
+            Slot &   old   = p_old_slots[index];
+            uint64_t mixed = detail::mix(hash_(old.key));
+            size_t   free  = find_free(ctrl_, capacity_, mixed);
+            new (&slots_[free]) Slot{ std::move(old.key), std::move(old.value) };
+            ctrl_[free] = h2(mixed);
+            old.~Slot();
+        }
+        growth_left_ -= size_;
+        if (nullptr != p_old_ctrl)
+        {
+            ::operator delete(p_old_ctrl, std::align_val_t(detail::GROUP_WIDTH));
+            ::operator delete(p_old_slots, std::align_val_t(alignof(Slot)));
+        }
+    }
+
+    uint8_t * ctrl_        = nullptr;
+    Slot *    slots_       = nullptr;
+    size_t    capacity_    = 0;
+    size_t    size_        = 0;
+    size_t    growth_left_ = 0; // inserts into EMPTY slots left before a rehash
+    H         hash_;
+    E         equal_;
+};
+
+} // namespace ht
+
+#endif /* HSH_TABLE_HPP */
@@ -0,0 +1,982 @@
+/* @file hashtable_art.c
+ *
+ * Ordered index of a table's keys for prefix and range iteration, kept as an
+ * adaptive radix tree (Leis et al., ICDE 2013).
+ *
+ * Inner nodes hold 4, 16, 48 or 256 children depending on how many they
+ * need and skip runs of bytes shared by their whole subtree (path
+ * compression). Only the first ART_PREFIX skipped bytes are stored, the rest
+ * are read from any leaf below. A key that ends where a node starts
+ * branching is that node's terminal, so keys may be prefixes of each other.
+ *
+ * Leaves point at the key bytes the table already stores instead of copying
+ * them. The table keeps those bytes in place for as long as the key is
+ * present, see hash_table_create_ex.
+ *
+ */
+
+#include "hashtable_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#    include <emmintrin.h>
+#endif
+
+#define ART_PREFIX 10 // skipped bytes stored in the node itself
+
+#define ART_IS_LEAF(p) (0 != ((uintptr_t)(p)&1))
+#define ART_LEAF(p)    ((art_leaf_t *)((uintptr_t)(p) & ~(uintptr_t)1))
+#define ART_TAG(p)     ((void *)((uintptr_t)(p) | 1))
+
+typedef enum art_type
+{
+    ART_NODE4 = 1,
+    ART_NODE16,
+    ART_NODE48,
+    ART_NODE256,
+} art_type_t;
+
+/**
+ * @brief a key of the table, child pointers to leaves have their low bit set
+ */
+typedef struct art_leaf
+{
+    const char * key; // owned by the table
+    size_t       keylen;
+} art_leaf_t;
+
+typedef struct art_node
+{
+    uint8_t      type;
+    uint16_t     count;              // children, the terminal is not counted
+    uint32_t     prefix_len;         // bytes skipped before branching
+    uint8_t      prefix[ART_PREFIX]; // the first of them
+    art_leaf_t * terminal;           // key ending right after the prefix
+} art_node_t;
+
+typedef struct art_node4
+{
+    art_node_t node;
+    uint8_t    keys[4]; // ascending
+    void *     children[4];
+} art_node4_t;
+
+typedef struct art_node16
+{
+    art_node_t node;
+    uint8_t    keys[16]; // ascending
+    void *     children[16];
+} art_node16_t;
+
+typedef struct art_node48
+{
+    art_node_t node;
+    uint8_t    index[256]; // slot + 1 of each byte's child, 0 for none
+    void *     children[48];
+} art_node48_t;
+
+typedef struct art_node256
+{
+    art_node_t node;
+    void *     children[256];
+} art_node256_t;
+
+struct ht_art
+{
+    pthread_rwlock_t lock; // writers insert and remove, iterations read
+    void *           root;
+};
+
+/**
+ * @brief iteration in progress, see art_emit
+ */
+typedef struct art_iter
+{
+    ht_key_function * visit;
+    void *            p_ctx;
+    const char *      end;     // first key not to visit, NULL for none
+    size_t            end_len;
+    bool              stopped; // visit returned FAIL_CODE
+} art_iter_t;
+
+static int art_key_cmp(const char * p_a, size_t a_len, const char * p_b, size_t b_len)
+{
+    int diff = memcmp(p_a, p_b, (a_len < b_len) ? a_len : b_len);
+    if (0 != diff)
+    {
+        return diff;
+    }
+    return (a_len < b_len) ? -1 : (a_len > b_len);
+} /* art_key_cmp() */
+
+static art_node_t * art_node_new(art_type_t type)
+{
+    static const size_t sizes[] = { 0,
+                                    sizeof(art_node4_t),
+                                    sizeof(art_node16_t),
+                                    sizeof(art_node48_t),
+                                    sizeof(art_node256_t) };
+    art_node_t * p_node = calloc(1, sizes[type]);
+    if (NULL == p_node)
+    {
+        fprintf(stderr, "art_node_new: calloc failed\n");
+        return NULL;
+    }
+    p_node->type = (uint8_t)type;
+    return p_node;
+} /* art_node_new() */
+
+/**
+ * @brief Returns the child after position *p_pos in byte order, NULL when
+ * there is none. Start with *p_pos at -1.
+ */
+static void * art_next_child(const art_node_t * p_node, int * p_pos, uint8_t * p_byte)
+{
+    int pos = *p_pos + 1;
+    switch (p_node->type)
+    {
+        case ART_NODE4:
+        case ART_NODE16:
+        {
+            if (pos >= p_node->count)
+            {
+                return NULL;
+            }
+            *p_pos = pos;
+            if (ART_NODE4 == p_node->type)
+            {
+                *p_byte = ((const art_node4_t *)p_node)->keys[pos];
+                return ((const art_node4_t *)p_node)->children[pos];
+            }
+            *p_byte = ((const art_node16_t *)p_node)->keys[pos];
+            return ((const art_node16_t *)p_node)->children[pos];
+        }
+        case ART_NODE48:
+        {
+            const art_node48_t * p_48 = (const art_node48_t *)p_node;
+            for (; pos < 256; pos++)
+            {
+                if (0 != p_48->index[pos])
+                {
+                    *p_pos  = pos;
+                    *p_byte = (uint8_t)pos;
+                    return p_48->children[p_48->index[pos] - 1];
+                }
+            }
+            return NULL;
+        }
+        default:
+        {
+            const art_node256_t * p_256 = (const art_node256_t *)p_node;
+            for (; pos < 256; pos++)
+            {
+                if (NULL != p_256->children[pos])
+                {
+                    *p_pos  = pos;
+                    *p_byte = (uint8_t)pos;
+                    return p_256->children[pos];
+                }
+            }
+            return NULL;
+        }
+    }
+} /* art_next_child() */
+
+static void art_node_free(void * p_child)
+{
+    if ((NULL == p_child) || ART_IS_LEAF(p_child))
+    {
+        free(ART_LEAF(p_child));
+        return;
+    }
+    art_node_t * p_node = p_child;
+    int          pos    = -1;
+    uint8_t      byte   = 0;
+    void *       p_next;
+    while (NULL != (p_next = art_next_child(p_node, &pos, &byte)))
+    {
+        art_node_free(p_next);
+    }
+    free(p_node->terminal);
+    free(p_node);
+} /* art_node_free() */
+
+/**
+ * @brief Returns the slot of the child for byte, NULL when there is none
+ */
+static void ** art_find_child(art_node_t * p_node, uint8_t byte)
+{
+    switch (p_node->type)
+    {
+        case ART_NODE4:
+        {
+            art_node4_t * p_4 = (art_node4_t *)p_node;
+            for (int i = 0; i < p_node->count; i++)
+            {
+                if (p_4->keys[i] == byte)
+                {
+                    return &p_4->children[i];
+                }
+            }
+            return NULL;
+        }
+        case ART_NODE16:
+        {
+            art_node16_t * p_16 = (art_node16_t *)p_node;
+#if defined(__SSE2__)
+            // All 16 keys in one compare, masked down to the used ones
+            __m128i  keys = _mm_loadu_si128((const __m128i *)p_16->keys);
+            uint32_t mask = (uint32_t)_mm_movemask_epi8(
+                                _mm_cmpeq_epi8(keys, _mm_set1_epi8((char)byte))) &
+                            ((1u << p_node->count) - 1);
+            return (0 == mask) ? NULL : &p_16->children[__builtin_ctz(mask)];
+#else
+            for (int i = 0; i < p_node->count; i++)
+            {
+                if (p_16->keys[i] == byte)
+                {
+                    return &p_16->children[i];
+                }
+            }
+            return NULL;
+#endif
+        }
+        case ART_NODE48:
+        {
+            art_node48_t * p_48 = (art_node48_t *)p_node;
+            uint8_t        slot = p_48->index[byte];
+            return (0 == slot) ? NULL : &p_48->children[slot - 1];
+        }
+        default:
+        {
+            art_node256_t * p_256 = (art_node256_t *)p_node;
+            return (NULL == p_256->children[byte]) ? NULL : &p_256->children[byte];
+        }
+    }
+} /* art_find_child() */
+
+/**
+ * @brief Returns any leaf below a child, the one with the smallest key
+ */
+static art_leaf_t * art_min_leaf(const void * p_child)
+{
+    while (!ART_IS_LEAF(p_child))
+    {
+        const art_node_t * p_node = p_child;
+        if (NULL != p_node->terminal)
+        {
+            return p_node->terminal;
+        }
+        int     pos  = -1;
+        uint8_t byte = 0;
+        p_child      = art_next_child(p_node, &pos, &byte);
+    }
+    return ART_LEAF(p_child);
+} /* art_min_leaf() */
+
+/**
+ * @brief Returns byte i of a node's prefix, which starts at depth in its keys
+ */
+static inline uint8_t art_prefix_byte(const art_node_t * p_node, size_t depth, uint32_t i)
+{
+    if (i < ART_PREFIX)
+    {
+        return p_node->prefix[i];
+    }
+    return (uint8_t)art_min_leaf(p_node)->key[depth + i];
+} /* art_prefix_byte() */
+
+/**
+ * @brief Counts how many bytes of a node's prefix key matches from depth on
+ */
+static uint32_t art_prefix_match(const art_node_t * p_node,
+                                 const char *       p_key,
+                                 size_t             keylen,
+                                 size_t             depth)
+{
+    uint32_t i = 0;
+    for (; (i < p_node->prefix_len) && (depth + i < keylen); i++)
+    {
+        if (art_prefix_byte(p_node, depth, i) != (uint8_t)p_key[depth + i])
+        {
+            break;
+        }
+    }
+    return i;
+} /* art_prefix_match() */
+
+static void art_copy_header(art_node_t * p_to, const art_node_t * p_from)
+{
+    p_to->count      = p_from->count;
+    p_to->prefix_len = p_from->prefix_len;
+    p_to->terminal   = p_from->terminal;
+    memcpy(p_to->prefix, p_from->prefix, ART_PREFIX);
+} /* art_copy_header() */
+
+/**
+ * @brief Inserts a child into a sorted node4 or node16 with room for it
+ */
+static void art_insert_sorted(uint8_t * keys,
+                              void **   children,
+                              uint16_t  count,
+                              uint8_t   byte,
+                              void *    p_child)
+{
+    uint16_t at = 0;
+    while ((at < count) && (keys[at] < byte))
+    {
+        at++;
+    }
+    memmove(keys + at + 1, keys + at, count - at);
+    memmove(children + at + 1, children + at, (count - at) * sizeof(void *));
+    keys[at]     = byte;
+    children[at] = p_child;
+} /* art_insert_sorted() */
+
+/**
+ * @brief Adds a child for byte, replacing the node in *pp_ref with a larger
+ * one when it is full
+ */
+static int art_add_child(void **      pp_ref,
+                         art_node_t * p_node,
+                         uint8_t      byte,
+                         void *       p_child)
+{
+    switch (p_node->type)
+    {
+        case ART_NODE4:
+        {
+            art_node4_t * p_4 = (art_node4_t *)p_node;
+            if (p_node->count < 4)
+            {
+                art_insert_sorted(p_4->keys, p_4->children, p_node->count, byte, p_child);
+                p_node->count++;
+                return SUCCESS_CODE;
+            }
+            art_node16_t * p_16 = (art_node16_t *)art_node_new(ART_NODE16);
+            if (NULL == p_16)
+            {
+                return FAIL_CODE;
+            }
+            art_copy_header(&p_16->node, p_node);
+            memcpy(p_16->keys, p_4->keys, sizeof(p_4->keys));
+            memcpy(p_16->children, p_4->children, sizeof(p_4->children));
+            *pp_ref = p_16;
+            free(p_node);
+            return art_add_child(pp_ref, &p_16->node, byte, p_child);
+        }
+        case ART_NODE16:
+        {
+            art_node16_t * p_16 = (art_node16_t *)p_node;
+            if (p_node->count < 16)
+            {
+                art_insert_sorted(
+                    p_16->keys, p_16->children, p_node->count, byte, p_child);
+                p_node->count++;
+                return SUCCESS_CODE;
+            }
+            art_node48_t * p_48 = (art_node48_t *)art_node_new(ART_NODE48);
+            if (NULL == p_48)
+            {
+                return FAIL_CODE;
+            }
+            art_copy_header(&p_48->node, p_node);
+            for (int i = 0; i < 16; i++)
+            {
+                p_48->children[i]          = p_16->children[i];
+                p_48->index[p_16->keys[i]] = (uint8_t)(i + 1);
+            }
+            *pp_ref = p_48;
+            free(p_node);
+            return art_add_child(pp_ref, &p_48->node, byte, p_child);
+        }
+        case ART_NODE48:
+        {
+            art_node48_t * p_48 = (art_node48_t *)p_node;
+            if (p_node->count < 48)
+            {
+                int slot = 0;
+                while (NULL != p_48->children[slot])
+                {
+                    slot++;
+                }
+                p_48->children[slot] = p_child;
+                p_48->index[byte]    = (uint8_t)(slot + 1);
+                p_node->count++;
+                return SUCCESS_CODE;
+            }
+            art_node256_t * p_256 = (art_node256_t *)art_node_new(ART_NODE256);
+            if (NULL == p_256)
+            {
+                return FAIL_CODE;
+            }
+            art_copy_header(&p_256->node, p_node);
+            for (int i = 0; i < 256; i++)
+            {
+                if (0 != p_48->index[i])
+                {
+                    p_256->children[i] = p_48->children[p_48->index[i] - 1];
+                }
+            }
+            *pp_ref = p_256;
+            free(p_node);
+            return art_add_child(pp_ref, &p_256->node, byte, p_child);
+        }
+        default:
+            ((art_node256_t *)p_node)->children[byte] = p_child;
+            p_node->count++;
+            return SUCCESS_CODE;
+    }
+} /* art_add_child() */
+
+/**
+ * @brief Hangs a leaf off a fresh node4 whose prefix ends at depth
+ */
+static void art_place(art_node_t * p_node, art_leaf_t * p_leaf, size_t depth)
+{
+    if (p_leaf->keylen == depth)
+    {
+        p_node->terminal = p_leaf;
+        return;
+    }
+    art_node4_t * p_4  = (art_node4_t *)p_node;
+    uint8_t       byte = (uint8_t)p_leaf->key[depth];
+    art_insert_sorted(p_4->keys, p_4->children, p_node->count, byte, ART_TAG(p_leaf));
+    p_node->count++;
+} /* art_place() */
+
+static int art_insert(void ** pp_ref, art_leaf_t * p_leaf, size_t depth)
+{
+    void * p_child = *pp_ref;
+    if (NULL == p_child)
+    {
+        *pp_ref = ART_TAG(p_leaf);
+        return SUCCESS_CODE;
+    }
+    if (ART_IS_LEAF(p_child))
+    {
+        // Two keys meet, branch where they first differ
+        art_leaf_t * p_other = ART_LEAF(p_child);
+        size_t       limit   = p_other->keylen;
+        size_t       split   = depth;
+        if (p_leaf->keylen < limit)
+        {
+            limit = p_leaf->keylen;
+        }
+        while ((split < limit) && (p_other->key[split] == p_leaf->key[split]))
+        {
+            split++;
+        }
+        if ((split == p_other->keylen) && (split == p_leaf->keylen))
+        {
+            fprintf(stderr, "ht_art_insert: key already indexed\n");
+            return FAIL_CODE;
+        }
+        art_node_t * p_node = art_node_new(ART_NODE4);
+        if (NULL == p_node)
+        {
+            return FAIL_CODE;
+        }
+        p_node->prefix_len = (uint32_t)(split - depth);
+        memcpy(p_node->prefix,
+               p_leaf->key + depth,
+               (p_node->prefix_len < ART_PREFIX) ? p_node->prefix_len : ART_PREFIX);
+        art_place(p_node, p_other, split);
+        art_place(p_node, p_leaf, split);
+        *pp_ref = p_node;
+        return SUCCESS_CODE;
+    }
+
+    art_node_t * p_node = p_child;
+    uint32_t     same   = art_prefix_match(p_node, p_leaf->key, p_leaf->keylen, depth);
+    if (same < p_node->prefix_len)
+    {
+        // The key leaves the prefix early, split it with a node4 on top
+        art_node_t * p_top = art_node_new(ART_NODE4);
+        if (NULL == p_top)
+        {
+            return FAIL_CODE;
+        }
+        p_top->prefix_len = same;
+        memcpy(p_top->prefix, p_node->prefix, (same < ART_PREFIX) ? same : ART_PREFIX);
+        uint8_t      byte  = art_prefix_byte(p_node, depth, same);
+        const char * p_src = (const char *)p_node->prefix + same + 1;
+        if (p_node->prefix_len > ART_PREFIX)
+        {
+            p_src = art_min_leaf(p_node)->key + depth + same + 1;
+        }
+        p_node->prefix_len -= same + 1;
+        memmove(p_node->prefix,
+                p_src,
+                (p_node->prefix_len < ART_PREFIX) ? p_node->prefix_len : ART_PREFIX);
+        art_node4_t * p_4 = (art_node4_t *)p_top;
+        p_4->keys[0]      = byte;
+        p_4->children[0]  = p_node;
+        p_top->count      = 1;
+        art_place(p_top, p_leaf, depth + same);
+        *pp_ref = p_top;
+        return SUCCESS_CODE;
+    }
+    depth += p_node->prefix_len;
+    if (p_leaf->keylen == depth)
+    {
+        if (NULL != p_node->terminal)
+        {
+            fprintf(stderr, "ht_art_insert: key already indexed\n");
+            return FAIL_CODE;
+        }
+        p_node->terminal = p_leaf;
+        return SUCCESS_CODE;
+    }
+    uint8_t byte    = (uint8_t)p_leaf->key[depth];
+    void ** pp_next = art_find_child(p_node, byte);
+    if (NULL != pp_next)
+    {
+        return art_insert(pp_next, p_leaf, depth + 1);
+    }
+    return art_add_child(pp_ref, p_node, byte, ART_TAG(p_leaf));
+} /* art_insert() */
+
+static void art_remove_child(art_node_t * p_node, uint8_t byte, void ** pp_slot)
+{
+    switch (p_node->type)
+    {
+        case ART_NODE4:
+        case ART_NODE16:
+        {
+            uint8_t * keys     = ((art_node16_t *)p_node)->keys;
+            void **   children = ((art_node16_t *)p_node)->children;
+            if (ART_NODE4 == p_node->type)
+            {
+                keys     = ((art_node4_t *)p_node)->keys;
+                children = ((art_node4_t *)p_node)->children;
+            }
+            size_t at   = (size_t)(pp_slot - children);
+            size_t tail = p_node->count - at - 1;
+            memmove(keys + at, keys + at + 1, tail);
+            memmove(children + at, children + at + 1, tail * sizeof(void *));
+            break;
+        }
+        case ART_NODE48:
+            *pp_slot                             = NULL;
+            ((art_node48_t *)p_node)->index[byte] = 0;
+            break;
+        default:
+            *pp_slot = NULL;
+            break;
+    }
+    p_node->count--;
+} /* art_remove_child() */
+
+/**
+ * @brief Replaces a node that lost a key with something smaller: the one key
+ * or child it has left, or a node of the next size down once it is sparse
+ */
+static void art_shrink(void ** pp_ref, art_node_t * p_node)
+{
+    if (0 == p_node->count)
+    {
+        *pp_ref = (NULL == p_node->terminal) ? NULL : ART_TAG(p_node->terminal);
+        free(p_node);
+        return;
+    }
+    if ((1 == p_node->count) && (NULL == p_node->terminal))
+    {
+        int     pos     = -1;
+        uint8_t byte    = 0;
+        void *  p_child = art_next_child(p_node, &pos, &byte);
+        if (!ART_IS_LEAF(p_child))
+        {
+            // Join the prefixes around the branch byte into the child's
+            art_node_t * p_below = p_child;
+            uint8_t      prefix[ART_PREFIX];
+            uint32_t     len = (p_node->prefix_len < ART_PREFIX) ? p_node->prefix_len
+                                                                 : ART_PREFIX;
+            memcpy(prefix, p_node->prefix, len);
+            if (len < ART_PREFIX)
+            {
+                prefix[len++] = byte;
+            }
+            for (uint32_t i = 0; (len < ART_PREFIX) && (i < p_below->prefix_len); i++)
+            {
+                prefix[len++] = p_below->prefix[i];
+            }
+            memcpy(p_below->prefix, prefix, len);
+            p_below->prefix_len += p_node->prefix_len + 1;
+        }
+        *pp_ref = p_child;
+        free(p_node);
+        return;
+    }
+
+    art_node_t * p_small = NULL;
+    if ((ART_NODE16 == p_node->type) && (p_node->count <= 3))
+    {
+        p_small = art_node_new(ART_NODE4);
+    }
+    else if ((ART_NODE48 == p_node->type) && (p_node->count <= 12))
+    {
+        p_small = art_node_new(ART_NODE16);
+    }
+    else if ((ART_NODE256 == p_node->type) && (p_node->count <= 37))
+    {
+        p_small = art_node_new(ART_NODE48);
+    }
+    if (NULL == p_small)
+    {
+        return; // still dense enough, or keep the larger node if out of memory
+    }
+    art_copy_header(p_small, p_node);
+    p_small->count = 0;
+    int     pos    = -1;
+    uint8_t byte   = 0;
+    void *  p_child;
+    while (NULL != (p_child = art_next_child(p_node, &pos, &byte)))
+    {
+        // Children come in byte order and the smaller node has room for all
+        void * p_ref = p_small;
+        art_add_child(&p_ref, p_small, byte, p_child);
+    }
+    *pp_ref = p_small;
+    free(p_node);
+} /* art_shrink() */
+
+static art_leaf_t * art_delete(void **       pp_ref,
+                               const char * p_key,
+                               size_t       keylen,
+                               size_t       depth)
+{
+    void * p_child = *pp_ref;
+    if (NULL == p_child)
+    {
+        return NULL;
+    }
+    if (ART_IS_LEAF(p_child))
+    {
+        art_leaf_t * p_leaf = ART_LEAF(p_child);
+        if (0 != art_key_cmp(p_leaf->key, p_leaf->keylen, p_key, keylen))
+        {
+            return NULL;
+        }
+        *pp_ref = NULL;
+        return p_leaf;
+    }
+
+    art_node_t * p_node = p_child;
+    if (art_prefix_match(p_node, p_key, keylen, depth) != p_node->prefix_len)
+    {
+        return NULL;
+    }
+    depth += p_node->prefix_len;
+    art_leaf_t * p_found = NULL;
+    if (keylen == depth)
+    {
+        p_found = p_node->terminal;
+        if (NULL == p_found)
+        {
+            return NULL;
+        }
+        p_node->terminal = NULL;
+    }
+    else
+    {
+        uint8_t byte    = (uint8_t)p_key[depth];
+        void ** pp_next = art_find_child(p_node, byte);
+        if (NULL == pp_next)
+        {
+            return NULL;
+        }
+        if (!ART_IS_LEAF(*pp_next))
+        {
+            // The node below keeps at least one key, this one is unchanged
+            return art_delete(pp_next, p_key, keylen, depth + 1);
+        }
+        p_found = ART_LEAF(*pp_next);
+        if (0 != art_key_cmp(p_found->key, p_found->keylen, p_key, keylen))
+        {
+            return NULL;
+        }
+        art_remove_child(p_node, byte, pp_next);
+    }
+    art_shrink(pp_ref, p_node);
+    return p_found;
+} /* art_delete() */
+
+ht_art_t * ht_art_new(void)
+{
+    ht_art_t * p_art = calloc(1, sizeof(ht_art_t));
+    if (NULL == p_art)
+    {
+        fprintf(stderr, "ht_art_new: calloc failed\n");
+        return NULL;
+    }
+    if (pthread_rwlock_init(&p_art->lock, NULL) != 0)
+    {
+        fprintf(stderr, "ht_art_new: pthread_rwlock_init failed\n");
+        free(p_art);
+        return NULL;
+    }
+    return p_art;
+} /* ht_art_new() */
+
+void ht_art_free(ht_art_t * p_art)
+{
+    if (NULL == p_art)
+    {
+        return;
+    }
+    art_node_free(p_art->root);
+    pthread_rwlock_destroy(&p_art->lock);
+    free(p_art);
+} /* ht_art_free() */
+
+int ht_art_insert(ht_art_t * p_art, const char * p_key, size_t keylen)
+{
+    art_leaf_t * p_leaf = malloc(sizeof(art_leaf_t));
+    if (NULL == p_leaf)
+    {
+        fprintf(stderr, "ht_art_insert: malloc failed\n");
+        return FAIL_CODE;
+    }
+    p_leaf->key    = (0 == keylen) ? "" : p_key;
+    p_leaf->keylen = keylen;
+    pthread_rwlock_wrlock(&p_art->lock);
+    int ret_code = art_insert(&p_art->root, p_leaf, 0);
+    pthread_rwlock_unlock(&p_art->lock);
+    if (SUCCESS_CODE != ret_code)
+    {
+        free(p_leaf);
+    }
+    return ret_code;
+} /* ht_art_insert() */
+
+void ht_art_remove(ht_art_t * p_art, const char * p_key, size_t keylen)
+{
+    pthread_rwlock_wrlock(&p_art->lock);
+    art_leaf_t * p_leaf = art_delete(&p_art->root, p_key, keylen, 0);
+    pthread_rwlock_unlock(&p_art->lock);
+    free(p_leaf);
+} /* ht_art_remove() */
+
+/**
+ * @brief Passes a key to the visitor unless it is past the end of the range
+ * @return SUCCESS_CODE to keep going, FAIL_CODE to stop the iteration
+ */
+static int art_emit(art_iter_t * p_iter, const art_leaf_t * p_leaf)
+{
+    if ((NULL != p_iter->end) &&
+        (0 <= art_key_cmp(p_leaf->key, p_leaf->keylen, p_iter->end, p_iter->end_len)))
+    {
+        return FAIL_CODE;
+    }
+    if (SUCCESS_CODE != p_iter->visit(p_leaf->key, p_leaf->keylen, p_iter->p_ctx))
+    {
+        p_iter->stopped = true;
+        return FAIL_CODE;
+    }
+    return SUCCESS_CODE;
+} /* art_emit() */
+
+/**
+ * @brief Visits every key below a child in ascending order
+ */
+static int art_walk(const void * p_child, art_iter_t * p_iter)
+{
+    if (ART_IS_LEAF(p_child))
+    {
+        return art_emit(p_iter, ART_LEAF(p_child));
+    }
+    const art_node_t * p_node = p_child;
+    // A terminal is a prefix of every other key below, so it sorts first
+    if ((NULL != p_node->terminal) &&
+        (SUCCESS_CODE != art_emit(p_iter, p_node->terminal)))
+    {
+        return FAIL_CODE;
+    }
+    int     pos  = -1;
+    uint8_t byte = 0;
+    void *  p_next;
+    while (NULL != (p_next = art_next_child(p_node, &pos, &byte)))
+    {
+        if (SUCCESS_CODE != art_walk(p_next, p_iter))
+        {
+            return FAIL_CODE;
+        }
+    }
+    return SUCCESS_CODE;
+} /* art_walk() */
+
+/**
+ * @brief Visits the keys below a child that are >= start, in ascending order.
+ * Every key below shares start's first depth bytes.
+ */
+static int art_walk_from(const void * p_child,
+                         const char * p_start,
+                         size_t       start_len,
+                         size_t       depth,
+                         art_iter_t * p_iter)
+{
+    if (ART_IS_LEAF(p_child))
+    {
+        const art_leaf_t * p_leaf = ART_LEAF(p_child);
+        if (0 > art_key_cmp(p_leaf->key, p_leaf->keylen, p_start, start_len))
+        {
+            return SUCCESS_CODE;
+        }
+        return art_emit(p_iter, p_leaf);
+    }
+    const art_node_t * p_node = p_child;
+    for (uint32_t i = 0; i < p_node->prefix_len; i++)
+    {
+        if (depth + i == start_len)
+        {
+            return art_walk(p_node, p_iter); // start is a prefix of them all
+        }
+        uint8_t byte  = art_prefix_byte(p_node, depth, i);
+        uint8_t bound = (uint8_t)p_start[depth + i];
+        if (byte != bound)
+        {
+            return (byte < bound) ? SUCCESS_CODE : art_walk(p_node, p_iter);
+        }
+    }
+    depth += p_node->prefix_len;
+    if (depth == start_len)
+    {
+        return art_walk(p_node, p_iter);
+    }
+    // The terminal is a proper prefix of start here, so it sorts before it
+    int     pos   = -1;
+    uint8_t byte  = 0;
+    uint8_t bound = (uint8_t)p_start[depth];
+    void *  p_next;
+    while (NULL != (p_next = art_next_child(p_node, &pos, &byte)))
+    {
+        int result = SUCCESS_CODE;
+        if (byte == bound)
+        {
+            result = art_walk_from(p_next, p_start, start_len, depth + 1, p_iter);
+        }
+        else if (byte > bound)
+        {
+            result = art_walk(p_next, p_iter);
+        }
+        if (SUCCESS_CODE != result)
+        {
+            return FAIL_CODE;
+        }
+    }
+    return SUCCESS_CODE;
+} /* art_walk_from() */
+
+int ht_art_prefix(ht_art_t *        p_art,
+                  const char *      p_prefix,
+                  size_t            prefix_len,
+                  ht_key_function * visit,
+                  void *            p_ctx)
+{
+    art_iter_t iter = { .visit = visit, .p_ctx = p_ctx };
+    pthread_rwlock_rdlock(&p_art->lock);
+    const void * p_child = p_art->root;
+    size_t       depth   = 0;
+    // Follow the prefix down to the subtree holding exactly the keys it starts
+    while ((NULL != p_child) && !ART_IS_LEAF(p_child) && (depth < prefix_len))
+    {
+        const art_node_t * p_node = p_child;
+        uint32_t           same   = art_prefix_match(p_node, p_prefix, prefix_len, depth);
+        if ((same < p_node->prefix_len) && (depth + same < prefix_len))
+        {
+            p_child = NULL; // the prefix leaves this node's prefix
+            break;
+        }
+        depth += p_node->prefix_len;
+        if (depth >= prefix_len)
+        {
+            break;
+        }
+        void ** pp_next = art_find_child((art_node_t *)p_node, (uint8_t)p_prefix[depth]);
+        p_child         = (NULL == pp_next) ? NULL : *pp_next;
+        depth++;
+    }
+    if (NULL != p_child)
+    {
+        if (ART_IS_LEAF(p_child))
+        {
+            const art_leaf_t * p_leaf = ART_LEAF(p_child);
+            if ((p_leaf->keylen >= prefix_len) &&
+                (0 == memcmp(p_leaf->key, p_prefix, prefix_len)))
+            {
+                art_emit(&iter, p_leaf);
+            }
+        }
+        else
+        {
+            art_walk(p_child, &iter);
+        }
+    }
+    pthread_rwlock_unlock(&p_art->lock);
+    return iter.stopped ? FAIL_CODE : SUCCESS_CODE;
+} /* ht_art_prefix() */
+
+int ht_art_range(ht_art_t *        p_art,
+                 const char *      p_start,
+                 size_t            start_len,
+                 const char *      p_end,
+                 size_t            end_len,
+                 ht_key_function * visit,
+                 void *            p_ctx)
+{
+    art_iter_t iter = {
+        .visit = visit, .p_ctx = p_ctx, .end = p_end, .end_len = end_len
+    };
+    pthread_rwlock_rdlock(&p_art->lock);
+    if (NULL != p_art->root)
+    {
+        art_walk_from(p_art->root, p_start, start_len, 0, &iter);
+    }
+    pthread_rwlock_unlock(&p_art->lock);
+    return iter.stopped ? FAIL_CODE : SUCCESS_CODE;
+} /* ht_art_range() */
+
+int hash_table_prefix_iter(hash_table_t *    p_ht,
+                           const char *      prefix,
+                           size_t            prefix_len,
+                           ht_key_function * visit,
+                           void *            p_ctx)
+{
+    if ((NULL == p_ht) || (NULL == visit) || ((NULL == prefix) && (0 != prefix_len)))
+    {
+        fprintf(stderr, "hash_table_prefix_iter: an argument is NULL\n");
+        return FAIL_CODE;
+    }
+    if (NULL == p_ht->art)
+    {
+        fprintf(stderr, "hash_table_prefix_iter: table has no prefix index\n");
+        return FAIL_CODE;
+    }
+    prefix = (NULL == prefix) ? "" : prefix;
+    return ht_art_prefix(p_ht->art, prefix, prefix_len, visit, p_ctx);
+} /* hash_table_prefix_iter() */
+
+int hash_table_range_iter(hash_table_t *    p_ht,
+                          const char *      start,
+                          size_t            start_len,
+                          const char *      end,
+                          size_t            end_len,
+                          ht_key_function * visit,
+                          void *            p_ctx)
+{
+    if ((NULL == p_ht) || (NULL == visit) || ((NULL == start) && (0 != start_len)))
+    {
+        fprintf(stderr, "hash_table_range_iter: an argument is NULL\n");
+        return FAIL_CODE;
+    }
+    if (NULL == p_ht->art)
+    {
+        fprintf(stderr, "hash_table_range_iter: table has no prefix index\n");
+        return FAIL_CODE;
+    }
+    start = (NULL == start) ? "" : start;
+    return ht_art_range(p_ht->art, start, start_len, end, end_len, visit, p_ctx);
+} /* hash_table_range_iter() */
+
+/*** end of file ***/
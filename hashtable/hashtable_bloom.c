@@ -0,0 +1,257 @@
+/* @file hashtable_bloom.c
+ *
+ * Counting Bloom filters in front of the buckets of a chained table.
+ *
+ * Every lock stripe has its own blocked filter. A key maps to one 64 byte
+ * block and BLOOM_PROBES four bit counters inside it, so a lookup for a key
+ * that was never stored usually stops after reading a single cache line and
+ * never touches the bucket array or an entry.
+ *
+ * Counters are raised before an entry is linked and lowered after it is
+ * unlinked, so the filter never denies a key a reader could find. Only
+ * writers holding the stripe change its filter, which lets them update a
+ * counter with a plain store instead of an atomic read-modify-write. A
+ * counter that reaches 15 stays there, as its true count is lost.
+ *
+ * A stripe's filter is sized for the keys it held when last built. Once it
+ * holds more than BLOOM_KEYS_PER_BLOCK keys per block it is rebuilt twice as
+ * large from the hashes the stripe's entries already store. Lock-free readers
+ * may still be reading the old blocks, so those go through the epoch.
+ *
+ */
+
+#include "hashtable_epoch.h"
+#include "hashtable_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOOM_BLOCK_WORDS    8  // uint64_t per block, one cache line
+#define BLOOM_PROBES         5  // counters per key
+#define BLOOM_KEYS_PER_BLOCK 12 // keys per block before the filter is rebuilt
+#define BLOOM_COUNTER_MAX    15 // saturated, never lowered again
+
+/**
+ * @brief blocks of one stripe's filter, replaced whole when it is rebuilt
+ */
+typedef struct bloom_array
+{
+    uint64_t                         block_mask; // blocks - 1, a power of two
+    _Alignas(HT_CACHE_LINE) uint64_t words[];    // sixteen counters per word
+} bloom_array_t;
+
+struct ht_bloom
+{
+    _Atomic(bloom_array_t *) array;    // read by lock-free lookups
+    size_t                   count;    // keys counted in array
+    size_t                   capacity; // count that triggers a rebuild
+} __attribute__((aligned(HT_CACHE_LINE)));
+
+static inline ht_bloom_t * bloom_part(const hash_table_t * p_ht, uint64_t mixed)
+{
+    return &p_ht->bloom[mixed & (p_ht->stripe_count - 1)];
+} /* bloom_part() */
+
+static inline uint64_t * bloom_block(const bloom_array_t * p_array, uint64_t mixed)
+{
+    // The stripe and bucket come from the low bits, the block from the high ones
+    uint64_t block = (mixed >> 32) & p_array->block_mask;
+    return (uint64_t *)&p_array->words[block * BLOOM_BLOCK_WORDS];
+} /* bloom_block() */
+
+/**
+ * @brief Returns the counter number, 0 to 127, of one probe of a key
+ */
+static inline uint32_t bloom_probe(uint64_t bits, uint32_t probe)
+{
+    return (uint32_t)(bits >> (64 - (7 * (probe + 1)))) & 127;
+} /* bloom_probe() */
+
+static inline uint64_t bloom_bits(uint64_t mixed)
+{
+    return mixed * 0x9e3779b97f4a7c15ULL;
+} /* bloom_bits() */
+
+/**
+ * @brief Moves the counters of a key up or down by one
+ * @param int delta 1 or -1
+ */
+static void bloom_update(bloom_array_t * p_array, uint64_t mixed, int delta)
+{
+    uint64_t * p_block = bloom_block(p_array, mixed);
+    uint64_t   bits    = bloom_bits(mixed);
+    for (uint32_t probe = 0; probe < BLOOM_PROBES; probe++)
+    {
+        uint32_t   counter = bloom_probe(bits, probe);
+        uint64_t * p_word  = &p_block[counter / 16];
+        uint32_t   shift   = (counter % 16) * 4;
+        uint64_t   word    = __atomic_load_n(p_word, __ATOMIC_RELAXED);
+        uint64_t   value   = (word >> shift) & 0xf;
+        // A saturated counter may undercount, and an empty one means the key
+        // was never counted
+        if ((BLOOM_COUNTER_MAX == value) || ((0 == value) && (delta < 0)))
+        {
+            continue;
+        }
+        word = (word & ~((uint64_t)0xf << shift)) | ((value + delta) << shift);
+        __atomic_store_n(p_word, word, __ATOMIC_RELAXED);
+    }
+} /* bloom_update() */
+
+static bloom_array_t * bloom_array_new(uint64_t blocks)
+{
+    size_t          bytes   = blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+    bloom_array_t * p_array = aligned_alloc(HT_CACHE_LINE, sizeof(bloom_array_t) + bytes);
+    if (NULL == p_array)
+    {
+        fprintf(stderr, "bloom_array_new: aligned_alloc failed\n");
+        return NULL;
+    }
+    memset(p_array, 0, sizeof(bloom_array_t) + bytes);
+    p_array->block_mask = blocks - 1;
+    return p_array;
+} /* bloom_array_new() */
+
+static void bloom_reclaim(void * p_ctx, void * ptr)
+{
+    (void)p_ctx;
+    free(ptr);
+} /* bloom_reclaim() */
+
+static void bloom_count_chain(bloom_array_t * p_array, const entry * p_entry)
+{
+    for (; NULL != p_entry; p_entry = p_entry->next)
+    {
+        bloom_update(p_array, ht_mix(p_entry->hash), 1);
+    }
+} /* bloom_count_chain() */
+
+/**
+ * @brief Rebuilds a stripe's filter twice as large from the entries the
+ * stripe holds. Keeps the old filter when the new one cannot be allocated.
+ * The caller holds the stripe for writing.
+ */
+static void bloom_grow(hash_table_t * p_ht, ht_bloom_t * p_part, uint64_t first)
+{
+    bloom_array_t * p_old   = atomic_load_explicit(&p_part->array, memory_order_relaxed);
+    uint64_t        blocks  = (p_old->block_mask + 1) * 2;
+    bloom_array_t * p_array = (blocks <= UINT32_MAX) ? bloom_array_new(blocks) : NULL;
+    if (NULL == p_array)
+    {
+        p_part->capacity = SIZE_MAX; // stop trying, the filter only gets less exact
+        return;
+    }
+
+    uint64_t stride = p_ht->stripe_count;
+    for (uint64_t bucket = first; bucket < p_ht->size; bucket += stride)
+    {
+        bloom_count_chain(p_array, p_ht->elements[bucket]);
+    }
+    for (uint64_t bucket = first;
+         (NULL != p_ht->old_elements) && (bucket < p_ht->old_size);
+         bucket += stride)
+    {
+        bloom_count_chain(p_array, p_ht->old_elements[bucket]);
+    }
+    // Published with a release store so a lock-free reader sees the counters
+    atomic_store_explicit(&p_part->array, p_array, memory_order_release);
+    p_part->capacity = blocks * BLOOM_KEYS_PER_BLOCK;
+    if (HT_CONC_LOCKFREE_READ == p_ht->concurrency)
+    {
+        ht_epoch_retire(p_old, bloom_reclaim, p_ht);
+    }
+    else
+    {
+        free(p_old);
+    }
+} /* bloom_grow() */
+
+ht_bloom_t * ht_bloom_new(hash_table_t * p_ht)
+{
+    ht_bloom_t * p_bloom =
+        aligned_alloc(HT_CACHE_LINE, p_ht->stripe_count * sizeof(ht_bloom_t));
+    if (NULL == p_bloom)
+    {
+        fprintf(stderr, "ht_bloom_new: aligned_alloc failed\n");
+        return NULL;
+    }
+    memset(p_bloom, 0, p_ht->stripe_count * sizeof(ht_bloom_t));
+
+    // Sized for as many keys as the table has buckets to start with
+    uint64_t blocks = 1;
+    while (blocks * BLOOM_KEYS_PER_BLOCK * p_ht->stripe_count < p_ht->min_size)
+    {
+        blocks <<= 1;
+    }
+    for (uint32_t i = 0; i < p_ht->stripe_count; i++)
+    {
+        bloom_array_t * p_array = bloom_array_new(blocks);
+        if (NULL == p_array)
+        {
+            p_ht->bloom = p_bloom;
+            ht_bloom_free(p_ht);
+            return NULL;
+        }
+        atomic_init(&p_bloom[i].array, p_array);
+        p_bloom[i].capacity = blocks * BLOOM_KEYS_PER_BLOCK;
+    }
+    p_ht->bloom = p_bloom;
+    return p_bloom;
+} /* ht_bloom_new() */
+
+void ht_bloom_free(hash_table_t * p_ht)
+{
+    for (uint32_t i = 0; (NULL != p_ht->bloom) && (i < p_ht->stripe_count); i++)
+    {
+        free(atomic_load(&p_ht->bloom[i].array));
+    }
+    free(p_ht->bloom);
+    p_ht->bloom = NULL;
+} /* ht_bloom_free() */
+
+void ht_bloom_add(hash_table_t * p_ht, uint64_t hash)
+{
+    uint64_t     mixed  = ht_mix(hash);
+    ht_bloom_t * p_part = bloom_part(p_ht, mixed);
+    if (p_part->capacity < ++p_part->count)
+    {
+        bloom_grow(p_ht, p_part, mixed & (p_ht->stripe_count - 1));
+    }
+    bloom_update(atomic_load_explicit(&p_part->array, memory_order_relaxed), mixed, 1);
+} /* ht_bloom_add() */
+
+void ht_bloom_remove(hash_table_t * p_ht, uint64_t hash)
+{
+    uint64_t     mixed  = ht_mix(hash);
+    ht_bloom_t * p_part = bloom_part(p_ht, mixed);
+    p_part->count--;
+    bloom_update(atomic_load_explicit(&p_part->array, memory_order_relaxed), mixed, -1);
+} /* ht_bloom_remove() */
+
+bool ht_bloom_maybe(const hash_table_t * p_ht, uint64_t hash)
+{
+    uint64_t        mixed = ht_mix(hash);
+    bloom_array_t * p_array =
+        atomic_load_explicit(&bloom_part(p_ht, mixed)->array, memory_order_acquire);
+    const uint64_t * p_block = bloom_block(p_array, mixed);
+    uint64_t         bits    = bloom_bits(mixed);
+    for (uint32_t probe = 0; probe < BLOOM_PROBES; probe++)
+    {
+        uint32_t counter = bloom_probe(bits, probe);
+        uint64_t word    = __atomic_load_n(&p_block[counter / 16], __ATOMIC_RELAXED);
+        if (0 == ((word >> ((counter % 16) * 4)) & 0xf))
+        {
+            return false;
+        }
+    }
+    return true;
+} /* ht_bloom_maybe() */
+
+void ht_bloom_prefetch(const hash_table_t * p_ht, uint64_t hash)
+{
+    uint64_t        mixed = ht_mix(hash);
+    bloom_array_t * p_array =
+        atomic_load_explicit(&bloom_part(p_ht, mixed)->array, memory_order_acquire);
+    __builtin_prefetch(bloom_block(p_array, mixed));
+} /* ht_bloom_prefetch() */
+
+/*** end of file ***/
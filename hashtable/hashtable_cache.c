@@ -0,0 +1,402 @@
+/* @file hashtable_cache.c
+ *
+ * Expiry and memory-bounded eviction for chained tables used as caches.
+ *
+ * Every linked entry is charged its slab bytes and, when an object_size
+ * function is configured, the bytes its object holds. Stripes publish their
+ * charges in batches, like the entry count, so writers on different stripes
+ * rarely share the total's cache line.
+ *
+ * Once an insert takes the table over its memory_limit, the inserting thread
+ * moves a CLOCK hand over the buckets until the table fits again. Lookups
+ * mark the entries they return as referenced. The hand drops expired entries
+ * and clears the mark of referenced ones, and only evicts entries the hand
+ * finds unmarked, so an entry looked up since the hand last passed gets a
+ * second chance. The hand is shared, so concurrent evictors work on
+ * different buckets, and each bucket is visited holding only its stripe.
+ *
+ * A sweeper thread, when configured, drops expired entries that are never
+ * looked up or written again.
+ *
+ */
+
+#include "hashtable_epoch.h"
+#include "hashtable_internal.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_BYTES_BATCH 4096 // bytes a stripe charges before publishing them
+#define CACHE_SWEEP_CHUNK 256  // buckets the sweeper visits per lock hold
+
+/**
+ * @brief counters and unpublished charges of one lock stripe
+ */
+typedef struct cache_stripe
+{
+    atomic_uint_fast64_t events[HT_CACHE_EVENTS]; // see ht_cache_event_t
+    long                 memory_delta;            // charged, not yet published
+} __attribute__((aligned(HT_CACHE_LINE))) cache_stripe_t;
+
+struct ht_cache
+{
+    hash_table_t *   p_ht;
+    size_t           memory_limit; // 0 when only expiring
+    size_function *  object_size;  // NULL to charge entries and keys only
+    atomic_size_t    memory_used;  // published charges
+    long             memory_batch; // bytes a stripe charges before publishing
+    _Atomic uint64_t hand;         // next bucket of the CLOCK sweep
+    cache_stripe_t * stripes;      // one per lock stripe of the table
+    uint32_t         interval_ms;  // between sweeps, 0 for no sweeper
+    pthread_t        sweeper;
+    bool             sweeping;     // the sweeper thread was started
+    pthread_mutex_t  lock;         // guards stop for the sweeper's waits
+    pthread_cond_t   wake;         // the sweeper must stop
+    atomic_bool      stop;
+};
+
+static inline cache_stripe_t * cache_stripe(ht_cache_t * p_cache, ht_stripe_t * p_stripe)
+{
+    return &p_cache->stripes[p_stripe - p_cache->p_ht->stripes];
+} /* cache_stripe() */
+
+static inline bool cache_over(ht_cache_t * p_cache)
+{
+    return (0 != p_cache->memory_limit) &&
+           (atomic_load_explicit(&p_cache->memory_used, memory_order_relaxed) >
+            p_cache->memory_limit);
+} /* cache_over() */
+
+/**
+ * @brief Adds a stripe's unpublished charges to the total. The caller holds
+ * the stripe for writing.
+ */
+static void cache_publish(ht_cache_t * p_cache, cache_stripe_t * p_counts)
+{
+    atomic_fetch_add_explicit(
+        &p_cache->memory_used, (size_t)p_counts->memory_delta, memory_order_relaxed);
+    p_counts->memory_delta = 0;
+} /* cache_publish() */
+
+void ht_cache_charge(hash_table_t * p_ht,
+                     ht_stripe_t *  p_stripe,
+                     const entry *  p_entry,
+                     long           sign)
+{
+    ht_cache_t *     p_cache  = p_ht->cache;
+    cache_stripe_t * p_counts = cache_stripe(p_cache, p_stripe);
+    size_t           bytes    = ht_entry_bytes(p_ht, p_entry->keylength);
+    if (NULL != p_cache->object_size)
+    {
+        bytes += p_cache->object_size(p_entry->object);
+    }
+    p_counts->memory_delta += sign * (long)bytes;
+    if ((HT_CONC_GLOBAL == p_ht->concurrency) ||
+        (p_cache->memory_batch <= labs(p_counts->memory_delta)))
+    {
+        cache_publish(p_cache, p_counts);
+    }
+} /* ht_cache_charge() */
+
+void ht_cache_count(hash_table_t * p_ht, uint64_t hash, ht_cache_event_t event)
+{
+    cache_stripe_t * p_counts = cache_stripe(p_ht->cache, ht_stripe_for(p_ht, hash));
+    atomic_fetch_add_explicit(&p_counts->events[event], 1, memory_order_relaxed);
+} /* ht_cache_count() */
+
+/**
+ * @brief Frees the entries a bucket visit unlinked, with no lock held, and
+ * waits for their log records when the log syncs every commit. Lock-free
+ * tables reclaim what the visit retired instead.
+ */
+static void cache_release(hash_table_t * p_ht, entry * p_dead, uint64_t lsn)
+{
+    while (NULL != p_dead)
+    {
+        entry * p_next = p_dead->next;
+        ht_chain_release(p_ht, p_dead, true);
+        p_dead = p_next;
+    }
+    if (HT_CONC_LOCKFREE_READ == p_ht->concurrency)
+    {
+        ht_epoch_collect(p_ht);
+    }
+    if ((0 != lsn) && (SUCCESS_CODE != ht_wal_commit(p_ht->wal, lsn, false)))
+    {
+        fprintf(stderr, "ht_cache_evict: removed but not durable\n");
+    }
+} /* cache_release() */
+
+/**
+ * @brief Drops the expired entries of one chain and, when evict is set and the
+ * table is over budget, the entries not referenced since the hand last
+ * passed. Caller holds the stripe for writing.
+ *
+ * @param entry ** pp_link head of the chain
+ * @param entry ** pp_dead collects unlinked entries for cache_release,
+ * lock-free tables retire them straight away instead
+ * @param uint64_t * p_lsn receives the last log record written
+ */
+static void cache_visit_bucket(hash_table_t * p_ht,
+                               ht_stripe_t *  p_stripe,
+                               entry **       pp_link,
+                               bool           evict,
+                               entry **       pp_dead,
+                               uint64_t *     p_lsn)
+{
+    ht_cache_t *     p_cache  = p_ht->cache;
+    cache_stripe_t * p_counts = cache_stripe(p_cache, p_stripe);
+    uint32_t         now      = ht_clock_now();
+    entry *          p_entry  = NULL;
+    while (NULL != (p_entry = *pp_link))
+    {
+        bool expired = (0 != p_entry->expires) && (p_entry->expires <= now);
+        if (!expired)
+        {
+            if (!evict || !cache_over(p_cache))
+            {
+                pp_link = &p_entry->next;
+                continue;
+            }
+            if (0 != __atomic_load_n(&p_entry->referenced, __ATOMIC_RELAXED))
+            {
+                __atomic_store_n(&p_entry->referenced, 0, __ATOMIC_RELAXED);
+                pp_link = &p_entry->next;
+                continue;
+            }
+        }
+        if (NULL == ht_chain_unlink(p_ht, p_stripe, pp_link, p_lsn))
+        {
+            return; // the log refused the record, leave the rest for later
+        }
+        // Published now so the next entry sees whether the table still needs room
+        cache_publish(p_cache, p_counts);
+        atomic_fetch_add_explicit(&p_counts->events[expired ? HT_CACHE_EXPIRED
+                                                            : HT_CACHE_EVICTED],
+                                  1,
+                                  memory_order_relaxed);
+        if (HT_CONC_LOCKFREE_READ == p_ht->concurrency)
+        {
+            ht_chain_release(p_ht, p_entry, true);
+            continue;
+        }
+        // No reader can reach it any more, so its link is free for the list
+        p_entry->next = *pp_dead;
+        *pp_dead      = p_entry;
+    }
+} /* cache_visit_bucket() */
+
+void ht_cache_evict(hash_table_t * p_ht)
+{
+    ht_cache_t * p_cache = p_ht->cache;
+    uint64_t     limit   = UINT64_MAX;
+    // Two passes over the table clear every mark, so the hand always ends
+    for (uint64_t visited = 0; (visited < limit) && cache_over(p_cache); visited++)
+    {
+        uint64_t      hand     = atomic_fetch_add(&p_cache->hand, 1);
+        ht_stripe_t * p_stripe = &p_ht->stripes[hand & (p_ht->stripe_count - 1)];
+        entry *       p_dead   = NULL;
+        uint64_t      lsn      = 0;
+        ht_write_lock(p_ht, p_stripe);
+        if (UINT64_MAX == limit)
+        {
+            limit = 2 * ((uint64_t)p_ht->size + p_ht->old_size);
+        }
+        // Buckets and stripes share their low bits, so both are this stripe's
+        entry ** pp_head = &p_ht->elements[hand & (p_ht->size - 1)];
+        cache_visit_bucket(p_ht, p_stripe, pp_head, true, &p_dead, &lsn);
+        if (NULL != p_ht->old_elements)
+        {
+            cache_visit_bucket(p_ht,
+                               p_stripe,
+                               &p_ht->old_elements[hand & (p_ht->old_size - 1)],
+                               true,
+                               &p_dead,
+                               &lsn);
+        }
+        ht_unlock(p_ht, p_stripe);
+        cache_release(p_ht, p_dead, lsn);
+    }
+} /* ht_cache_evict() */
+
+/**
+ * @brief Drops every expired entry of the table, one stripe and a few
+ * hundred buckets at a time so writers are never held up for long
+ */
+static void cache_sweep(hash_table_t * p_ht)
+{
+    ht_cache_t * p_cache = p_ht->cache;
+    uint64_t     stride  = p_ht->stripe_count;
+    for (uint64_t first = 0; first < stride; first++)
+    {
+        ht_stripe_t * p_stripe = &p_ht->stripes[first];
+        bool          more     = true;
+        for (uint64_t run = 0; more && !atomic_load(&p_cache->stop);
+             run += CACHE_SWEEP_CHUNK)
+        {
+            entry *  p_dead = NULL;
+            uint64_t lsn    = 0;
+            more            = false;
+            ht_write_lock(p_ht, p_stripe);
+            for (uint64_t i = run; i < run + CACHE_SWEEP_CHUNK; i++)
+            {
+                uint64_t bucket = first + (i * stride);
+                if (bucket < p_ht->size)
+                {
+                    entry ** pp_head = &p_ht->elements[bucket];
+                    cache_visit_bucket(p_ht, p_stripe, pp_head, false, &p_dead, &lsn);
+                    more = true;
+                }
+                if ((NULL != p_ht->old_elements) && (bucket < p_ht->old_size))
+                {
+                    entry ** pp_head = &p_ht->old_elements[bucket];
+                    cache_visit_bucket(p_ht, p_stripe, pp_head, false, &p_dead, &lsn);
+                    more = true;
+                }
+            }
+            ht_unlock(p_ht, p_stripe);
+            cache_release(p_ht, p_dead, lsn);
+        }
+    }
+} /* cache_sweep() */
+
+/**
+ * @brief Sweeper thread, sweeps once per interval until the table goes
+ */
+static void * cache_sweeper(void * arg)
+{
+    ht_cache_t * p_cache = arg;
+    pthread_mutex_lock(&p_cache->lock);
+    while (!atomic_load(&p_cache->stop))
+    {
+        struct timespec deadline = { 0 };
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += p_cache->interval_ms / 1000;
+        deadline.tv_nsec += (long)(p_cache->interval_ms % 1000) * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        int wait_code = 0;
+        while (!atomic_load(&p_cache->stop) && (ETIMEDOUT != wait_code))
+        {
+            wait_code = pthread_cond_timedwait(&p_cache->wake, &p_cache->lock, &deadline);
+        }
+        if (atomic_load(&p_cache->stop))
+        {
+            break;
+        }
+        pthread_mutex_unlock(&p_cache->lock);
+        cache_sweep(p_cache->p_ht);
+        pthread_mutex_lock(&p_cache->lock);
+    }
+    pthread_mutex_unlock(&p_cache->lock);
+    return NULL;
+} /* cache_sweeper() */
+
+ht_cache_t * ht_cache_new(hash_table_t * p_ht, const hash_table_opts_t * p_opts)
+{
+    ht_cache_t * p_cache = calloc(1, sizeof(ht_cache_t));
+    if (NULL == p_cache)
+    {
+        fprintf(stderr, "ht_cache_new: calloc failed\n");
+        goto EXIT;
+    }
+    p_cache->p_ht         = p_ht;
+    p_cache->memory_limit = p_opts->memory_limit;
+    p_cache->object_size  = p_opts->object_size;
+    p_cache->interval_ms  = p_opts->sweep_interval_ms;
+    // Unpublished charges may add up to a quarter of the budget at most
+    p_cache->memory_batch = CACHE_BYTES_BATCH;
+    if ((0 != p_cache->memory_limit) &&
+        ((size_t)CACHE_BYTES_BATCH * 4 * p_ht->stripe_count > p_cache->memory_limit))
+    {
+        p_cache->memory_batch =
+            (long)(p_cache->memory_limit / (4 * (size_t)p_ht->stripe_count)) + 1;
+    }
+    atomic_init(&p_cache->memory_used, 0);
+    atomic_init(&p_cache->hand, 0);
+    atomic_init(&p_cache->stop, false);
+    p_cache->stripes =
+        aligned_alloc(HT_CACHE_LINE, p_ht->stripe_count * sizeof(cache_stripe_t));
+    if (NULL == p_cache->stripes)
+    {
+        fprintf(stderr, "ht_cache_new: aligned_alloc failed\n");
+        free(p_cache);
+        p_cache = NULL;
+        goto EXIT;
+    }
+    memset(p_cache->stripes, 0, p_ht->stripe_count * sizeof(cache_stripe_t));
+    if ((0 != pthread_mutex_init(&p_cache->lock, NULL)) ||
+        (0 != pthread_cond_init(&p_cache->wake, NULL)))
+    {
+        fprintf(stderr, "ht_cache_new: pthread init failed\n");
+        free(p_cache->stripes);
+        free(p_cache);
+        p_cache = NULL;
+        goto EXIT;
+    }
+    // Attached before the sweeper starts, which reaches it through the table
+    p_ht->cache = p_cache;
+    if (0 != p_cache->interval_ms)
+    {
+        if (0 != pthread_create(&p_cache->sweeper, NULL, cache_sweeper, p_cache))
+        {
+            fprintf(stderr, "ht_cache_new: starting the sweeper failed\n");
+            p_ht->cache = NULL;
+            ht_cache_free(p_cache);
+            p_cache = NULL;
+            goto EXIT;
+        }
+        p_cache->sweeping = true;
+    }
+EXIT:
+    return p_cache;
+} /* ht_cache_new() */
+
+void ht_cache_free(ht_cache_t * p_cache)
+{
+    if (NULL == p_cache)
+    {
+        return;
+    }
+    if (p_cache->sweeping)
+    {
+        pthread_mutex_lock(&p_cache->lock);
+        atomic_store(&p_cache->stop, true);
+        pthread_cond_signal(&p_cache->wake);
+        pthread_mutex_unlock(&p_cache->lock);
+        pthread_join(p_cache->sweeper, NULL);
+    }
+    pthread_cond_destroy(&p_cache->wake);
+    pthread_mutex_destroy(&p_cache->lock);
+    free(p_cache->stripes);
+    free(p_cache);
+} /* ht_cache_free() */
+
+int hash_table_cache_stats(hash_table_t * p_ht, ht_cache_stats_t * p_stats)
+{
+    if ((NULL == p_ht) || (NULL == p_stats) || (NULL == p_ht->cache))
+    {
+        fprintf(stderr, "hash_table_cache_stats: not a cache or p_stats is NULL\n");
+        return FAIL_CODE;
+    }
+    ht_cache_t * p_cache = p_ht->cache;
+    uint64_t     sums[HT_CACHE_EVENTS] = { 0 };
+    for (uint32_t i = 0; i < p_ht->stripe_count; i++)
+    {
+        for (int event = 0; event < HT_CACHE_EVENTS; event++)
+        {
+            sums[event] += atomic_load_explicit(&p_cache->stripes[i].events[event],
+                                                memory_order_relaxed);
+        }
+    }
+    p_stats->hits    = sums[HT_CACHE_HIT];
+    p_stats->misses  = sums[HT_CACHE_MISS];
+    p_stats->expired = sums[HT_CACHE_EXPIRED];
+    p_stats->evicted = sums[HT_CACHE_EVICTED];
+    p_stats->memory_used =
+        atomic_load_explicit(&p_cache->memory_used, memory_order_relaxed);
+    p_stats->memory_limit = p_cache->memory_limit;
+    return SUCCESS_CODE;
+} /* hash_table_cache_stats() */
+
+/*** end of file ***/
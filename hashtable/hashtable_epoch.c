@@ -0,0 +1,461 @@
+/* @file hashtable_epoch.c
+ *
+ * Epoch based reclamation. Readers announce the global epoch they started in,
+ * writers tag each unlinked node with the epoch it was retired in. The global
+ * epoch only moves forward once every active reader has announced the current
+ * value, so a node retired in epoch e can no longer be seen by anyone once the
+ * global epoch reaches e + 2.
+ *
+ * Retired nodes wait in limbo lists kept per thread and per context, split
+ * into one bucket per epoch, so nothing on the retire path is shared with
+ * other threads. Retiring never reclaims: callers retire while holding their
+ * table's locks and run the reclaims later with ht_epoch_collect, once they
+ * hold none, so a context's callbacks only run on that context's own paths.
+ * Reclaiming takes whole buckets whose epoch is old enough and never walks
+ * nodes that still have to wait. It scans the records to move the epoch on
+ * at once for a full batch, and at most once per EPOCH_RETRY_NS for fewer
+ * nodes, so a thread that retires a handful still gets them freed.
+ *
+ */
+
+#include "hashtable_epoch.h"
+#include "hashtable_internal.h"
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define EPOCH_IDLE         0  // announced by threads outside a read section
+#define EPOCH_RETIRE_BATCH 64 // retired nodes queued before trying to reclaim
+#define EPOCH_BUCKETS      3  // a bucket is reused three epochs on, once it is safe
+#define EPOCH_RETRY_NS     1000000 // least time between record scans for a few nodes
+
+/**
+ * @brief node waiting for its grace period to pass
+ */
+typedef struct retired_node
+{
+    void *                ptr;
+    ht_reclaim_function * reclaim;
+    struct retired_node * next;
+} retired_node_t;
+
+/**
+ * @brief nodes retired in one epoch
+ */
+typedef struct epoch_bucket
+{
+    uint64_t         epoch; // epoch every node in the bucket was retired in
+    retired_node_t * head;
+    retired_node_t * tail;
+} epoch_bucket_t;
+
+/**
+ * @brief nodes one thread retired for one context, bucketed by epoch
+ */
+typedef struct epoch_limbo
+{
+    _Atomic(void *)      p_ctx;      // context of the nodes, NULL while unused
+    epoch_bucket_t       buckets[EPOCH_BUCKETS]; // indexed by epoch % EPOCH_BUCKETS
+    retired_node_t *     p_ready;    // nodes known to be past their grace period
+    size_t               count;      // nodes queued in buckets and p_ready
+    size_t               collect_at; // count at which ht_epoch_collect scans at once
+    uint64_t             retry_at;   // monotonic ns until which fewer wait
+    struct epoch_limbo * next;       // never changes once the limbo is published
+} epoch_limbo_t;
+
+/**
+ * @brief per-thread announcement, reused once its thread exits along with
+ * the nodes that thread left queued
+ */
+typedef struct epoch_record
+{
+    _Atomic uint64_t         epoch;   // epoch announced while reading, else EPOCH_IDLE
+    atomic_bool              in_use;  // owned by a live thread
+    uint32_t                 nesting; // read sections the owner has entered
+    _Atomic(epoch_limbo_t *) limbos;  // only the owner adds to it
+    struct epoch_record *    next;    // never changes once the record is published
+} __attribute__((aligned(HT_CACHE_LINE))) epoch_record_t;
+
+static _Atomic uint64_t          g_epoch    = 1;
+static _Atomic(epoch_record_t *) g_records  = NULL;
+static pthread_once_t            g_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t             g_record_key;
+static __thread epoch_record_t * t_record = NULL;
+static __thread epoch_limbo_t *  t_limbo  = NULL; // limbo the thread used last
+
+static void epoch_record_release(void * arg)
+{
+    epoch_record_t * p_record = arg;
+    p_record->nesting         = 0;
+    atomic_store(&p_record->epoch, EPOCH_IDLE);
+    atomic_store(&p_record->in_use, false);
+} /* epoch_record_release() */
+
+static void epoch_key_init(void)
+{
+    pthread_key_create(&g_record_key, epoch_record_release);
+} /* epoch_key_init() */
+
+/**
+ * @brief Returns the calling thread's record, claiming a free one or
+ * publishing a new one on first use
+ * @return epoch_record_t* on success
+ * @return NULL when no record could be allocated
+ */
+static epoch_record_t * epoch_record_get(void)
+{
+    epoch_record_t * p_record = t_record;
+    if (NULL != p_record)
+    {
+        return p_record;
+    }
+    pthread_once(&g_key_once, epoch_key_init);
+
+    for (p_record = atomic_load(&g_records); NULL != p_record; p_record = p_record->next)
+    {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&p_record->in_use, &expected, true))
+        {
+            goto FOUND;
+        }
+    }
+
+    p_record = aligned_alloc(HT_CACHE_LINE, sizeof(*p_record));
+    if (NULL == p_record)
+    {
+        fprintf(stderr, "epoch_record_get: aligned_alloc failed\n");
+        return NULL;
+    }
+    atomic_init(&p_record->epoch, EPOCH_IDLE);
+    atomic_init(&p_record->in_use, true);
+    atomic_init(&p_record->limbos, NULL);
+    p_record->nesting = 0;
+    p_record->next    = atomic_load(&g_records);
+    while (!atomic_compare_exchange_weak(&g_records, &p_record->next, p_record))
+    {
+    }
+
+FOUND:
+    pthread_setspecific(g_record_key, p_record);
+    t_record = p_record;
+    t_limbo  = NULL;
+    return p_record;
+} /* epoch_record_get() */
+
+bool ht_epoch_enter(void)
+{
+    epoch_record_t * p_record = epoch_record_get();
+    if (NULL == p_record)
+    {
+        // A reader without a record would not be protected at all
+        return false;
+    }
+    if (0 != p_record->nesting++)
+    {
+        return true;
+    }
+
+    // Re-read the global epoch after announcing so that it cannot have moved
+    // on twice before this thread became visible to epoch_try_advance
+    uint64_t epoch = 0;
+    do
+    {
+        epoch = atomic_load(&g_epoch);
+        atomic_store(&p_record->epoch, epoch);
+    } while (epoch != atomic_load(&g_epoch));
+    return true;
+} /* ht_epoch_enter() */
+
+void ht_epoch_exit(void)
+{
+    epoch_record_t * p_record = t_record;
+    if ((NULL == p_record) || (0 == p_record->nesting))
+    {
+        fprintf(stderr, "ht_epoch_exit: not in a read section\n");
+        return;
+    }
+    if (0 == --p_record->nesting)
+    {
+        atomic_store_explicit(&p_record->epoch, EPOCH_IDLE, memory_order_release);
+    }
+} /* ht_epoch_exit() */
+
+/**
+ * @brief Moves the global epoch forward if every active reader has seen it
+ * @return uint64_t the global epoch after the attempt
+ */
+static uint64_t epoch_try_advance(void)
+{
+    uint64_t epoch = atomic_load(&g_epoch);
+    for (epoch_record_t * p_record = atomic_load(&g_records); NULL != p_record;
+         p_record                  = p_record->next)
+    {
+        uint64_t seen = atomic_load(&p_record->epoch);
+        if ((EPOCH_IDLE != seen) && (seen != epoch))
+        {
+            return epoch;
+        }
+    }
+    atomic_compare_exchange_strong(&g_epoch, &epoch, epoch + 1);
+    return atomic_load(&g_epoch);
+} /* epoch_try_advance() */
+
+/**
+ * @brief Returns the calling thread's limbo for p_ctx, taking over an unused
+ * one of its record or publishing a new one on first use
+ * @return epoch_limbo_t* on success
+ * @return NULL when no limbo could be allocated
+ */
+static epoch_limbo_t * epoch_limbo_get(epoch_record_t * p_record, void * p_ctx)
+{
+    epoch_limbo_t * p_limbo = t_limbo;
+    if ((NULL != p_limbo) && (p_ctx == atomic_load(&p_limbo->p_ctx)))
+    {
+        return p_limbo;
+    }
+    epoch_limbo_t * p_free = NULL;
+    for (p_limbo = atomic_load(&p_record->limbos); NULL != p_limbo;
+         p_limbo = p_limbo->next)
+    {
+        void * p_owner = atomic_load(&p_limbo->p_ctx);
+        if (p_owner == p_ctx)
+        {
+            goto FOUND;
+        }
+        p_free = ((NULL == p_free) && (NULL == p_owner)) ? p_limbo : p_free;
+    }
+    // Only ht_epoch_drain empties a limbo, and it does so for a context no
+    // thread uses any more, so nothing else can claim p_free meanwhile
+    p_limbo = p_free;
+    if (NULL == p_limbo)
+    {
+        p_limbo = calloc(1, sizeof(*p_limbo));
+        if (NULL == p_limbo)
+        {
+            fprintf(stderr, "epoch_limbo_get: calloc failed\n");
+            return NULL;
+        }
+        p_limbo->collect_at = EPOCH_RETIRE_BATCH;
+        p_limbo->next       = atomic_load(&p_record->limbos);
+        atomic_store(&p_limbo->p_ctx, p_ctx);
+        atomic_store(&p_record->limbos, p_limbo);
+    }
+    else
+    {
+        atomic_store(&p_limbo->p_ctx, p_ctx);
+    }
+FOUND:
+    t_limbo = p_limbo;
+    return p_limbo;
+} /* epoch_limbo_get() */
+
+/**
+ * @brief Returns the calling thread's limbo for p_ctx without creating one
+ * @return epoch_limbo_t* when the thread has retired nodes with p_ctx
+ * @return NULL otherwise
+ */
+static epoch_limbo_t * epoch_limbo_find(epoch_record_t * p_record, void * p_ctx)
+{
+    epoch_limbo_t * p_limbo = t_limbo;
+    if ((NULL != p_limbo) && (p_ctx == atomic_load(&p_limbo->p_ctx)))
+    {
+        return p_limbo;
+    }
+    for (p_limbo = atomic_load(&p_record->limbos); NULL != p_limbo;
+         p_limbo = p_limbo->next)
+    {
+        if (p_ctx == atomic_load(&p_limbo->p_ctx))
+        {
+            t_limbo = p_limbo;
+            return p_limbo;
+        }
+    }
+    return NULL;
+} /* epoch_limbo_find() */
+
+/**
+ * @brief Appends the nodes of a bucket to the ready list and empties it
+ */
+static void epoch_bucket_ready(epoch_limbo_t * p_limbo, epoch_bucket_t * p_bucket)
+{
+    if (NULL == p_bucket->head)
+    {
+        return;
+    }
+    p_bucket->tail->next = p_limbo->p_ready;
+    p_limbo->p_ready     = p_bucket->head;
+    p_bucket->head       = NULL;
+    p_bucket->tail       = NULL;
+} /* epoch_bucket_ready() */
+
+/**
+ * @brief Takes every node of a limbo retired before safe_epoch, whole
+ * buckets at a time, and runs their reclaim callbacks
+ */
+static void epoch_limbo_reclaim(epoch_limbo_t * p_limbo, uint64_t safe_epoch)
+{
+    void * p_ctx = atomic_load_explicit(&p_limbo->p_ctx, memory_order_relaxed);
+    for (int i = 0; i < EPOCH_BUCKETS; i++)
+    {
+        if (p_limbo->buckets[i].epoch < safe_epoch)
+        {
+            epoch_bucket_ready(p_limbo, &p_limbo->buckets[i]);
+        }
+    }
+    retired_node_t * p_ready = p_limbo->p_ready;
+    p_limbo->p_ready         = NULL;
+    while (NULL != p_ready)
+    {
+        retired_node_t * p_next = p_ready->next;
+        p_ready->reclaim(p_ctx, p_ready->ptr);
+        free(p_ready);
+        p_limbo->count--;
+        p_ready = p_next;
+    }
+} /* epoch_limbo_reclaim() */
+
+void ht_epoch_retire(void * ptr, ht_reclaim_function * reclaim, void * p_ctx)
+{
+    epoch_record_t * p_record = epoch_record_get();
+    epoch_limbo_t *  p_limbo  = NULL;
+    retired_node_t * p_node   = NULL;
+    if (NULL != p_record)
+    {
+        p_limbo = epoch_limbo_get(p_record, p_ctx);
+    }
+    if (NULL != p_limbo)
+    {
+        p_node = malloc(sizeof(*p_node));
+    }
+    if (NULL == p_node)
+    {
+        // Reclaiming here would run the callback under the caller's locks
+        fprintf(stderr, "ht_epoch_retire: no limbo for the node, it is leaked\n");
+        return;
+    }
+    p_node->ptr     = ptr;
+    p_node->reclaim = reclaim;
+    p_node->next    = NULL;
+
+    uint64_t         epoch    = atomic_load(&g_epoch);
+    epoch_bucket_t * p_bucket = &p_limbo->buckets[epoch % EPOCH_BUCKETS];
+    if (p_bucket->epoch != epoch)
+    {
+        // Its nodes are at least EPOCH_BUCKETS epochs old, so already safe
+        epoch_bucket_ready(p_limbo, p_bucket);
+        p_bucket->epoch = epoch;
+    }
+    if (NULL == p_bucket->head)
+    {
+        p_bucket->tail = p_node;
+    }
+    p_node->next   = p_bucket->head;
+    p_bucket->head = p_node;
+    p_limbo->count++;
+} /* ht_epoch_retire() */
+
+/**
+ * @brief Returns the epoch of the oldest node waiting in a bucket of a limbo
+ */
+static uint64_t epoch_limbo_oldest(const epoch_limbo_t * p_limbo)
+{
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < EPOCH_BUCKETS; i++)
+    {
+        if ((NULL != p_limbo->buckets[i].head) && (p_limbo->buckets[i].epoch < oldest))
+        {
+            oldest = p_limbo->buckets[i].epoch;
+        }
+    }
+    return oldest;
+} /* epoch_limbo_oldest() */
+
+/**
+ * @brief Returns CLOCK_MONOTONIC in nanoseconds
+ */
+static uint64_t epoch_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+} /* epoch_now_ns() */
+
+void ht_epoch_collect(void * p_ctx)
+{
+    if (NULL == t_record)
+    {
+        return;
+    }
+    // Lookups collect too, they must not leave a limbo behind for p_ctx
+    epoch_limbo_t * p_limbo = epoch_limbo_find(t_record, p_ctx);
+    if ((NULL == p_limbo) || (0 == p_limbo->count))
+    {
+        return;
+    }
+    uint64_t epoch  = atomic_load(&g_epoch);
+    uint64_t oldest = epoch_limbo_oldest(p_limbo);
+    if ((NULL == p_limbo->p_ready) && (epoch < oldest + 2))
+    {
+        // Scanning the records is the costly part, so while fewer than a
+        // batch of nodes wait it is retried once per EPOCH_RETRY_NS at most
+        uint64_t now = epoch_now_ns();
+        if ((p_limbo->count < p_limbo->collect_at) && (now < p_limbo->retry_at))
+        {
+            return;
+        }
+        // Up to twice, so with no reader active the nodes retired by the
+        // call that got here are freed before it returns
+        for (int i = 0; (i < 2) && (epoch < oldest + 2); i++)
+        {
+            uint64_t advanced = epoch_try_advance();
+            if (advanced == epoch)
+            {
+                break;
+            }
+            epoch = advanced;
+        }
+        p_limbo->retry_at = now + EPOCH_RETRY_NS;
+    }
+    // epoch + 2 <= global  <=>  epoch < global - 1
+    epoch_limbo_reclaim(p_limbo, epoch - 1);
+    // A reader pinning the epoch keeps nodes queued, so wait for another
+    // batch before scanning the records regardless of the time
+    p_limbo->collect_at = p_limbo->count + EPOCH_RETIRE_BATCH;
+} /* ht_epoch_collect() */
+
+uint64_t ht_epoch_now(void)
+{
+    return atomic_load(&g_epoch);
+} /* ht_epoch_now() */
+
+bool ht_epoch_passed(uint64_t since)
+{
+    uint64_t epoch = atomic_load(&g_epoch);
+    if (epoch < since + 2)
+    {
+        epoch = epoch_try_advance();
+    }
+    return (epoch >= since + 2);
+} /* ht_epoch_passed() */
+
+void ht_epoch_drain(void * p_ctx)
+{
+    for (epoch_record_t * p_record = atomic_load(&g_records); NULL != p_record;
+         p_record                  = p_record->next)
+    {
+        for (epoch_limbo_t * p_limbo = atomic_load(&p_record->limbos); NULL != p_limbo;
+             p_limbo                 = p_limbo->next)
+        {
+            if (p_ctx != atomic_load(&p_limbo->p_ctx))
+            {
+                continue;
+            }
+            epoch_limbo_reclaim(p_limbo, UINT64_MAX);
+            p_limbo->collect_at = EPOCH_RETIRE_BATCH;
+            // Free for its record's owner to take for another context
+            atomic_store(&p_limbo->p_ctx, NULL);
+        }
+    }
+} /* ht_epoch_drain() */
+
+/*** end of file ***/
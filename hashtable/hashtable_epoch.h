@@ -0,0 +1,79 @@
+/* @file hashtable_epoch.h
+ * Epoch based reclamation used by the lock-free read path of the hash table
+ */
+
+#ifndef HSH_TABLE_EPOCH_H
+#define HSH_TABLE_EPOCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief callback that finally frees something handed to ht_epoch_retire
+ * @param void* context given at retire time, usually the owning table
+ * @param void* pointer that was retired
+ */
+typedef void ht_reclaim_function(void * p_ctx, void * ptr);
+
+/**
+ * @brief Marks the calling thread as reading shared nodes. Calls nest, and the
+ * thread stays protected until the matching number of ht_epoch_exit calls.
+ *
+ * @return true when the thread is protected
+ * @return false when its record could not be allocated; the caller must not
+ * read shared nodes and must not call ht_epoch_exit
+ */
+bool ht_epoch_enter(void);
+
+/**
+ * @brief Ends a read section started by ht_epoch_enter
+ */
+void ht_epoch_exit(void);
+
+/**
+ * @brief Hands ptr to reclaim once every thread that could still see it has
+ * left its read section. The caller must already have unlinked ptr so that
+ * no new reader can reach it. Never runs a reclaim itself, so it is safe to
+ * call with the table's locks held; the node waits for ht_epoch_collect.
+ *
+ * @param void* ptr unlinked node
+ * @param ht_reclaim_function* reclaim called with p_ctx and ptr after the grace period
+ * @param void* p_ctx passed to reclaim
+ */
+void ht_epoch_retire(void * ptr, ht_reclaim_function * reclaim, void * p_ctx);
+
+/**
+ * @brief Reclaims the nodes the calling thread retired with p_ctx whose grace
+ * period has passed. A full batch is collected at once, fewer nodes at most
+ * once a millisecond, so even a few retires are freed soon. Reclaims run the
+ * callbacks given at retire time, so call it without holding any lock.
+ *
+ * @param void* p_ctx context the nodes were retired with
+ */
+void ht_epoch_collect(void * p_ctx);
+
+/**
+ * @brief Returns the current global epoch, for use with ht_epoch_passed
+ * @return uint64_t epoch
+ */
+uint64_t ht_epoch_now(void);
+
+/**
+ * @brief Checks, without blocking, whether every read section that was active
+ * at epoch since has ended. Tries to move the global epoch forward first.
+ *
+ * @param uint64_t since value returned by ht_epoch_now
+ * @return true once a full grace period has passed since that epoch
+ */
+bool ht_epoch_passed(uint64_t since);
+
+/**
+ * @brief Runs every pending reclaim registered with p_ctx right away. Only
+ * valid once no thread can be reading anything retired with p_ctx, such as
+ * when the owning table is destroyed.
+ *
+ * @param void* p_ctx context whose nodes are reclaimed
+ */
+void ht_epoch_drain(void * p_ctx);
+
+#endif /* HSH_TABLE_EPOCH_H */
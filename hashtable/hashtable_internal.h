@@ -0,0 +1,945 @@
+/* @file hashtable_internal.h
+ * Private definitions shared by the hash table translation units
+ */
+
+#ifndef HSH_TABLE_INTERNAL_H
+#define HSH_TABLE_INTERNAL_H
+
+#include "hashtable.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define FAIL_CODE      -1
+#define SUCCESS_CODE   1
+#define MAX_KEY_LENGTH 256
+#define MAX_FILE_SIZE  2048
+
+#define HT_MIN_BUCKETS    16        // smallest bucket array, always a power of two
+#define HT_MAX_BUCKETS    (1u << 31) // largest bucket array a uint32_t size can hold
+#define HT_SHRINK_RATIO   8         // shrink once fewer than size / 8 entries remain
+#define HT_REHASH_STEP    4         // non-empty buckets moved per operation
+#define HT_REHASH_EMPTIES 10        // empty buckets skipped per bucket budget
+#define HT_DEFAULT_STRIPES 64       // lock stripes when opts.lock_stripes is 0
+#define HT_COUNT_BATCH     32       // entries a stripe counts before publishing
+#define HT_CACHE_LINE      64
+#define HT_INLINE_KEY      24       // default longest key kept inside its entry
+#define HT_KEY_CLASSES     ((MAX_KEY_LENGTH / 32) + 1) // size classes of long keys
+#define HT_BATCH_WINDOW    16       // keys hashed and prefetched together by batch calls
+#define HT_STATS_SLOTS     64       // per-thread counter slots, later threads share
+
+/**
+ * @brief entry struct
+ * @param struct entry *next
+ * @NOTE: *next pointer used because external chaining is used
+ * which is used when there is a collision of two keys. When
+ * there is a collision, the next pointer is used to point to
+ * the next entry in the list. The open addressing backend stores
+ * entries directly in its slot array and leaves next unused.
+ * @NOTE: chained entries come from the stripe's slab and are
+ * hash_table_t.entry_size bytes long. A key of up to inline_key_max bytes is
+ * stored right after the struct and key points there.
+ */
+typedef struct entry
+{
+    char *         key;
+    size_t         keylength; // length of key, compared before the key bytes
+    uint64_t       hash;      // full hash of key, compared before the length
+    void *         object;
+    struct entry * next; // *next pointer used because external chaining is used.
+    uint32_t       expires;    // ht_clock_now() second it expires at, 0 for never
+    uint8_t        referenced; // CLOCK: looked up since the hand last passed it
+} entry;
+
+/**
+ * @brief entry allocator of one lock stripe, see hashtable_slab.c
+ */
+typedef struct ht_slab
+{
+    pthread_mutex_t lock;                      // taken by allocations and frees only
+    void *          chunks;                    // every chunk malloc'ed, linked by word 0
+    void *          free_entries;              // freed entries, linked by word 0
+    char *          entry_bump;                // next unused entry in the current chunk
+    size_t          entry_left;                // bytes left at entry_bump
+    void *          free_keys[HT_KEY_CLASSES]; // freed long keys per size class
+    char *          key_bump;                  // next unused long key byte
+    size_t          key_left;                  // bytes left at key_bump
+} ht_slab_t;
+
+/**
+ * @brief lock stripe of a chained table
+ * @NOTE: bucket i belongs to stripe i % stripe_count. Buckets and stripes are
+ * both picked from the low bits of the mixed hash and a table never has fewer
+ * buckets than stripes, so a key stays in the same stripe across resizes and
+ * a stripe can move its own old buckets while holding only its own lock.
+ */
+typedef struct ht_stripe
+{
+    pthread_rwlock_t lock;         // guards this stripe's buckets in both arrays
+    long             count_delta;  // entries added or removed but not yet published
+    uint32_t         rehash_index; // next of this stripe's old buckets to move
+    ht_slab_t        slab;         // entries of this stripe's keys
+} __attribute__((aligned(HT_CACHE_LINE))) ht_stripe_t;
+
+/**
+ * @brief bucket arrays as seen by lock-free readers
+ * @NOTE: in HT_CONC_LOCKFREE_READ mode the four array fields of the table are
+ * copied into a fresh view whenever they change. Readers load the view once
+ * and the old one is retired, so a reader never sees a torn mix of arrays.
+ */
+typedef struct ht_view
+{
+    entry ** elements;
+    uint32_t size;
+    entry ** old_elements;
+    uint32_t old_size;
+} ht_view_t;
+
+/**
+ * @brief write-ahead log attached to a table, see hashtable_wal.c
+ */
+typedef struct ht_wal ht_wal_t;
+
+/**
+ * @brief background dump state of a table, see hashtable_snapshot.c
+ */
+typedef struct ht_bgsave ht_bgsave_t;
+
+/**
+ * @brief substring index of a table's keys, see hashtable_trigram.c
+ */
+typedef struct ht_trigram ht_trigram_t;
+
+/**
+ * @brief ordered index of a table's keys, see hashtable_art.c
+ */
+typedef struct ht_art ht_art_t;
+
+/**
+ * @brief byte budget, sweeper and hit counters of a cache, see hashtable_cache.c
+ */
+typedef struct ht_cache ht_cache_t;
+
+/**
+ * @brief counting Bloom filter of one lock stripe, see hashtable_bloom.c
+ */
+typedef struct ht_bloom ht_bloom_t;
+
+/**
+ * @brief operation and lock wait counters, see hashtable_stats.c
+ */
+typedef enum ht_stat
+{
+    HT_STAT_INSERT = 0,
+    HT_STAT_HIT,
+    HT_STAT_MISS,
+    HT_STAT_REMOVE,
+    HT_STAT_LOCK_WAIT,    // acquisitions that found the lock taken
+    HT_STAT_LOCK_WAIT_NS, // nanoseconds spent blocked in them
+    HT_STATS
+} ht_stat_t;
+
+/**
+ * @brief counters of the threads that map to one slot, on a line of their own
+ */
+typedef struct ht_stats_slot
+{
+    atomic_uint_fast64_t counts[HT_STATS];
+} __attribute__((aligned(HT_CACHE_LINE))) ht_stats_slot_t;
+
+#define HT_WAL_INSERT 1 // record holds a key and its encoded object
+#define HT_WAL_REMOVE 2 // record holds a key
+
+/**
+ * @NOTE: a chained table resizes incrementally. While old_elements is set,
+ * entries live in either array and operations move a few more buckets from
+ * old_elements into elements. Each stripe drains its own old buckets and
+ * rehash_pending counts the stripes that still have some.
+ *
+ * elements, size, old_elements and old_size only change while every stripe
+ * is held exclusively (hash_lock in HT_CONC_GLOBAL mode), so holding any one
+ * stripe is enough to read them.
+ *
+ * In HT_CONC_LOCKFREE_READ mode lookups hold no lock. Writers still lock
+ * stripes but publish every link with a release store, and old buckets are
+ * only moved once every reader that may still use the previous view has
+ * finished (rehash_ready). Moved entries are copied rather than relinked so a
+ * reader part way down an old chain still reaches the rest of it.
+ */
+typedef struct _hash_table
+{
+    uint32_t             size;           // size of the table
+    hashfunction *       hash;           // hash function, NULL for the seeded default
+    uint64_t             seed;           // per-table seed for the default hash
+    cleanup_function *   cleanup;        // cleanup function to use
+    entry **             elements;       // an array of pointers to entries
+    pthread_mutex_t      hash_lock;      // mutex lock for the hash table
+    ht_backend_t         backend;        // storage layout selected at create time
+    ht_concurrency_t     concurrency;    // locking scheme selected at create time
+    atomic_size_t        count;          // entries stored, see ht_stripe_t.count_delta
+    uint32_t             min_size;       // the table never shrinks below this
+    ht_stripe_t *        stripes;        // chained: lock stripes, one in GLOBAL mode
+    uint32_t             stripe_count;   // chained: power of two <= min_size
+    entry **             old_elements;   // chained: buckets still being drained
+    uint32_t             old_size;       // chained: size of old_elements
+    atomic_uint          rehash_pending; // chained: stripes with old buckets left
+    _Atomic(ht_view_t *) view;           // lock-free: arrays published to readers
+    uint64_t             rehash_epoch;   // lock-free: epoch the current resize began in
+    atomic_bool          rehash_ready;   // lock-free: old buckets may now be moved
+    size_t               entry_size;     // chained: bytes per entry incl. inline key
+    size_t               inline_key_max; // chained: longest key stored inline
+    encode_function *    encode;         // snapshots: serialises objects
+    decode_function *    decode;         // snapshots: rebuilds objects
+    ht_wal_t *           wal;            // log of mutations, NULL when not attached
+    ht_bgsave_t *        bgsave;         // background dump state
+    ht_trigram_t *       trigram;        // substring index, NULL when not kept
+    ht_art_t *           art;            // prefix index, NULL when not kept
+    ht_cache_t *         cache;          // chained: eviction state, NULL unless a cache
+    ht_stats_slot_t *    stats;          // HT_STATS_SLOTS counters, NULL unless kept
+    ht_bloom_t *         bloom;          // chained: a filter per stripe, NULL unless kept
+    uint8_t *            ctrl;           // open addressing: one control byte per slot
+    entry *              slots;          // open addressing: flat slot array
+    size_t               growth_left;    // open addressing: inserts left before a rehash
+} hashtable_t;
+
+/**
+ * @brief Finalises a user hash so the low bits used for bucket and group
+ * selection depend on every input bit, even with a weak hash function
+ * @param uint64_t hash returned by the table's hash function
+ * @return uint64_t mixed hash
+ */
+static inline uint64_t ht_mix(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+} /* ht_mix() */
+
+/**
+ * @brief Hashes a key with the table's hash function, or with the built-in
+ * hash and the table's seed when no custom function was configured
+ * @param hash_table_t* table the key belongs to
+ * @param const char* key to hash
+ * @param size_t length of the key
+ * @return uint64_t hash value
+ */
+static inline uint64_t ht_hash(hash_table_t * p_ht, const char * p_key, size_t keylen)
+{
+    if (NULL == p_ht->hash)
+    {
+        return hash_function_seeded(p_key, keylen, p_ht->seed);
+    }
+    return p_ht->hash(p_key, keylen);
+} /* ht_hash() */
+
+/**
+ * @brief Returns the clock entry expiry times are kept in, whole seconds that
+ * never go backwards and start above 0
+ */
+static inline uint32_t ht_clock_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint32_t)now.tv_sec + 1;
+} /* ht_clock_now() */
+
+/**
+ * @brief Returns true when an entry's TTL has run out. The clock is only read
+ * for entries that have one.
+ */
+static inline bool ht_entry_expired(const entry * p_entry)
+{
+    return (0 != p_entry->expires) && (p_entry->expires <= ht_clock_now());
+} /* ht_entry_expired() */
+
+/**
+ * @brief Rounds a requested size up to a power of two within the table limits
+ * @param size_t requested number of buckets or slots
+ * @return uint32_t power of two to allocate
+ */
+static inline uint32_t ht_round_size(size_t size)
+{
+    uint32_t rounded = HT_MIN_BUCKETS;
+    while ((rounded < size) && (rounded < HT_MAX_BUCKETS))
+    {
+        rounded <<= 1;
+    }
+    return rounded;
+} /* ht_round_size() */
+
+/**
+ * @brief Copies keylen bytes of key into a new null terminated string
+ * @param const char* key bytes
+ * @param size_t number of bytes
+ * @return char* copy to free with free() on success
+ * @return NULL on failure
+ */
+char * ht_key_dup(const char * p_key, size_t keylen);
+
+/**
+ * @brief Returns the stripe guarding the buckets a hash maps to
+ */
+static inline ht_stripe_t * ht_stripe_for(hash_table_t * p_ht, uint64_t hash)
+{
+    return &p_ht->stripes[ht_mix(hash) & (p_ht->stripe_count - 1)];
+} /* ht_stripe_for() */
+
+/**
+ * @brief kind of lock ht_stats_wait blocks on
+ */
+typedef enum ht_wait
+{
+    HT_WAIT_MUTEX = 0,
+    HT_WAIT_READ,
+    HT_WAIT_WRITE,
+} ht_wait_t;
+
+extern __thread uint32_t t_ht_stats_slot; // 1 + the thread's slot, 0 until numbered
+
+/**
+ * @brief Numbers the calling thread and returns 1 + its counter slot. Threads
+ * are numbered in turn, so the first HT_STATS_SLOTS threads each count alone.
+ */
+uint32_t ht_stats_claim(void);
+
+/**
+ * @brief Returns the calling thread's counter slot
+ */
+static inline uint32_t ht_stats_slot(void)
+{
+    uint32_t slot = t_ht_stats_slot;
+    if (0 == slot)
+    {
+        slot = ht_stats_claim();
+    }
+    return slot - 1;
+} /* ht_stats_slot() */
+
+/**
+ * @brief Adds n to a counter of a table that keeps them
+ */
+static inline void ht_stat_add(hash_table_t * p_ht, ht_stat_t stat, uint64_t n)
+{
+    if (NULL != p_ht->stats)
+    {
+        atomic_fetch_add_explicit(
+            &p_ht->stats[ht_stats_slot()].counts[stat], n, memory_order_relaxed);
+    }
+} /* ht_stat_add() */
+
+/**
+ * @brief Allocates the zeroed counter slots of a table created with opts.stats
+ * @return ht_stats_slot_t* HT_STATS_SLOTS slots to free with free() on success
+ * @return NULL on failure
+ */
+ht_stats_slot_t * ht_stats_new(void);
+
+/**
+ * @brief Blocks on a lock a try-lock found taken, adding the wait to the
+ * table's counters
+ * @param hash_table_t* table keeping statistics
+ * @param ht_wait_t how to take p_lock
+ * @param void* pthread_mutex_t or pthread_rwlock_t to take
+ */
+void ht_stats_wait(hash_table_t * p_ht, ht_wait_t kind, void * p_lock);
+
+/**
+ * @brief Takes hash_lock. Tables keeping statistics try it first and only
+ * read the clock when they have to wait.
+ */
+static inline void ht_hash_lock(hash_table_t * p_ht)
+{
+    if (NULL == p_ht->stats)
+    {
+        pthread_mutex_lock(&p_ht->hash_lock);
+    }
+    else if (0 != pthread_mutex_trylock(&p_ht->hash_lock))
+    {
+        ht_stats_wait(p_ht, HT_WAIT_MUTEX, &p_ht->hash_lock);
+    }
+} /* ht_hash_lock() */
+
+/**
+ * @brief Takes a stripe's reader/writer lock, timed like ht_hash_lock
+ */
+static inline void ht_stripe_lock(hash_table_t * p_ht,
+                                  ht_stripe_t *  p_stripe,
+                                  bool           exclusive)
+{
+    if (NULL == p_ht->stats)
+    {
+        if (exclusive)
+        {
+            pthread_rwlock_wrlock(&p_stripe->lock);
+        }
+        else
+        {
+            pthread_rwlock_rdlock(&p_stripe->lock);
+        }
+    }
+    else if (0 != (exclusive ? pthread_rwlock_trywrlock(&p_stripe->lock)
+                             : pthread_rwlock_tryrdlock(&p_stripe->lock)))
+    {
+        ht_stats_wait(p_ht, exclusive ? HT_WAIT_WRITE : HT_WAIT_READ, &p_stripe->lock);
+    }
+} /* ht_stripe_lock() */
+
+/**
+ * @brief Takes the lock guarding a stripe for reading, hash_lock in
+ * HT_CONC_GLOBAL mode
+ */
+static inline void ht_read_lock(hash_table_t * p_ht, ht_stripe_t * p_stripe)
+{
+    if (HT_CONC_GLOBAL != p_ht->concurrency)
+    {
+        ht_stripe_lock(p_ht, p_stripe, false);
+    }
+    else
+    {
+        ht_hash_lock(p_ht);
+    }
+} /* ht_read_lock() */
+
+/**
+ * @brief Takes the lock guarding a stripe for writing
+ */
+static inline void ht_write_lock(hash_table_t * p_ht, ht_stripe_t * p_stripe)
+{
+    if (HT_CONC_GLOBAL != p_ht->concurrency)
+    {
+        ht_stripe_lock(p_ht, p_stripe, true);
+    }
+    else
+    {
+        ht_hash_lock(p_ht);
+    }
+} /* ht_write_lock() */
+
+/**
+ * @brief Releases a lock taken by ht_read_lock or ht_write_lock
+ */
+static inline void ht_unlock(hash_table_t * p_ht, ht_stripe_t * p_stripe)
+{
+    if (HT_CONC_GLOBAL != p_ht->concurrency)
+    {
+        pthread_rwlock_unlock(&p_stripe->lock);
+    }
+    else
+    {
+        pthread_mutex_unlock(&p_ht->hash_lock);
+    }
+} /* ht_unlock() */
+
+/**
+ * @brief Takes every lock of the table, stripes in ascending order
+ * @param hash_table_t* table to lock
+ * @param bool exclusive take the stripes for writing rather than reading
+ */
+void ht_lock_all(hash_table_t * p_ht, bool exclusive);
+
+/**
+ * @brief Releases the locks taken by ht_lock_all
+ * @param hash_table_t* table to unlock
+ */
+void ht_unlock_all(hash_table_t * p_ht);
+
+/**
+ * @brief Prepares an empty slab
+ * @param ht_slab_t* slab to set up
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE on failure
+ */
+int ht_slab_init(ht_slab_t * p_slab);
+
+/**
+ * @brief Frees every chunk of a slab at once, along with every entry and key
+ * ever allocated from it
+ * @param ht_slab_t* slab to tear down
+ */
+void ht_slab_destroy(ht_slab_t * p_slab);
+
+/**
+ * @brief Allocates an entry from the slab of the stripe hash belongs to and
+ * copies key into it, inline when it is short enough
+ * @param hash_table_t* chained table the entry is for
+ * @param const char* key bytes
+ * @param size_t length of the key
+ * @param uint64_t hash of the key
+ * @return entry* with object and next cleared on success
+ * @return NULL on failure
+ */
+entry * ht_entry_new(hash_table_t * p_ht,
+                     const char *   p_key,
+                     size_t         keylen,
+                     uint64_t       hash);
+
+/**
+ * @brief Allocates a copy of an entry. An inline key is copied with it, a
+ * long key is shared, so the original must then go with ht_entry_release.
+ * @return entry* copy on success
+ * @return NULL on failure
+ */
+entry * ht_entry_copy(hash_table_t * p_ht, const entry * p_entry);
+
+/**
+ * @brief Returns the slab bytes an entry with a key of keylen takes
+ */
+size_t ht_entry_bytes(const hash_table_t * p_ht, size_t keylen);
+
+/**
+ * @brief Returns an entry to its slab without freeing a long key
+ */
+void ht_entry_release(hash_table_t * p_ht, entry * p_entry);
+
+/**
+ * @brief Returns an entry and its key to the slab
+ */
+void ht_entry_free(hash_table_t * p_ht, entry * p_entry);
+
+/**
+ * @brief callback used to walk every live entry of a table
+ * @param entry* entry being visited
+ * @param void* caller supplied context
+ * @return SUCCESS_CODE to keep walking, FAIL_CODE to stop
+ */
+typedef int ht_visit_function(entry * p_entry, void * p_ctx);
+
+/**
+ * @brief Calls visit on every entry of the table, whatever its backend. The
+ * caller holds the table, usually with ht_lock_all.
+ * @return SUCCESS_CODE when every entry was visited
+ * @return FAIL_CODE when the walk was stopped early
+ */
+int ht_walk(hash_table_t * p_ht, ht_visit_function * visit, void * p_ctx);
+
+/**
+ * @brief hash_table_insert_ttl for a key already validated and hashed with
+ * ht_hash, so a front-end that routed on the hash does not hash it again
+ * @return SUCCESS_CODE on success or when the key already exists
+ * @return FAIL_CODE on failure
+ */
+int ht_insert_hashed(hash_table_t * p_ht,
+                     const char *   p_key,
+                     size_t         keylen,
+                     uint64_t       hash,
+                     void *         obj,
+                     uint32_t       ttl);
+
+/**
+ * @brief hash_table_lookup_n for a key already validated and hashed
+ * @return void* object on success
+ * @return NULL when the key is not present
+ */
+void * ht_lookup_hashed(hash_table_t * p_ht,
+                        const char *   p_key,
+                        size_t         keylen,
+                        uint64_t       hash);
+
+/**
+ * @brief hash_table_upsert_n for a key already validated and hashed
+ */
+int ht_upsert_hashed(hash_table_t *    p_ht,
+                     const char *      p_key,
+                     size_t            keylen,
+                     uint64_t          hash,
+                     upsert_function * fn,
+                     void *            p_ctx);
+
+/**
+ * @brief hash_table_cas for a key already validated and hashed
+ */
+int ht_cas_hashed(hash_table_t * p_ht,
+                  const char *   p_key,
+                  size_t         keylen,
+                  uint64_t       hash,
+                  void *         expected,
+                  void *         desired);
+
+/**
+ * @brief Unlinks a key already validated and hashed and frees its entry
+ * @param bool destroy pass the object to the cleanup function as well
+ * @param void ** p_object receives the object when destroy is false
+ * @return SUCCESS_CODE when the key was found
+ * @return FAIL_CODE otherwise
+ */
+int ht_take_hashed(hash_table_t * p_ht,
+                   const char *   p_key,
+                   size_t         keylen,
+                   uint64_t       hash,
+                   bool           destroy,
+                   void **        p_object);
+
+/**
+ * @brief Unlinks the entry *pp_link points at from a chained table, logging
+ * the remove and dropping it from the indexes and the cache's byte count.
+ * The caller holds the entry's stripe for writing and hands the entry to
+ * ht_chain_release once it has let go of the stripe.
+ * @param uint64_t * p_lsn receives the log record to commit, left alone when
+ * the table has no log
+ * @return entry* unlinked entry on success
+ * @return NULL when the log refused the record, the entry stays linked
+ */
+entry * ht_chain_unlink(hash_table_t * p_ht,
+                        ht_stripe_t *  p_stripe,
+                        entry **       pp_link,
+                        uint64_t *     p_lsn);
+
+/**
+ * @brief Frees an unlinked entry, after the grace period in lock-free mode
+ * @param bool destroy pass the object to the cleanup function as well
+ */
+void ht_chain_release(hash_table_t * p_ht, entry * p_entry, bool destroy);
+
+/**
+ * @brief Picks a random seed from the kernel, or from the clock if it has none
+ * @return uint64_t seed
+ */
+uint64_t hash_table_seed(void);
+
+/**
+ * @brief Allocates the background dump state of a table
+ * @return ht_bgsave_t* on success
+ * @return NULL on failure
+ */
+ht_bgsave_t * ht_bgsave_new(hash_table_t * p_ht);
+
+/**
+ * @brief Waits for a running background dump and frees the state
+ */
+void ht_bgsave_free(ht_bgsave_t * p_save);
+
+/**
+ * @brief Appends a mutation to the log's current batch. Called while holding
+ * the lock that orders the mutation, so the log replays in table order.
+ * @param ht_wal_t* log to append to
+ * @param uint32_t HT_WAL_INSERT or HT_WAL_REMOVE
+ * @param const char* key bytes
+ * @param size_t length of the key
+ * @param const void* object to encode, inserts only
+ * @return uint64_t log sequence number of the record on success
+ * @return 0 on failure
+ */
+uint64_t ht_wal_log(ht_wal_t *   p_wal,
+                    uint32_t     op,
+                    const char * p_key,
+                    size_t       keylen,
+                    const void * obj);
+
+/**
+ * @brief Waits for a record to reach the disk, when the log was opened with
+ * sync_commit or force is set. Call with no table lock held.
+ * @return SUCCESS_CODE once lsn is durable
+ * @return FAIL_CODE when the log failed to write or sync
+ */
+int ht_wal_commit(ht_wal_t * p_wal, uint64_t lsn, bool force);
+
+/**
+ * @brief Returns the sequence number of the last record logged. With every
+ * writer of the table blocked, it is the last mutation the table holds.
+ */
+uint64_t ht_wal_mark(ht_wal_t * p_wal);
+
+/**
+ * @brief Drops the records up to lsn from the log once a snapshot holding
+ * them is on disk. The rest is copied with the log's lock dropped, writers
+ * only wait for the records logged during the copy to be appended.
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE on failure, the log is left whole
+ */
+int ht_wal_checkpoint(ht_wal_t * p_wal, uint64_t lsn);
+
+/**
+ * @brief Makes every logged record durable, stops the flusher and frees the log
+ */
+void ht_wal_close(ht_wal_t * p_wal);
+
+/**
+ * @brief Allocates an empty substring index
+ * @return ht_trigram_t* on success
+ * @return NULL on failure
+ */
+ht_trigram_t * ht_trigram_new(void);
+
+/**
+ * @brief Frees the index and its copies of the keys
+ */
+void ht_trigram_free(ht_trigram_t * p_index);
+
+/**
+ * @brief Indexes a key the table does not hold yet. Called under the lock
+ * that orders writes to the key, so the index changes in table order.
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE on failure, the index is left unchanged
+ */
+int ht_trigram_add(ht_trigram_t * p_index, const char * p_key, size_t keylen);
+
+/**
+ * @brief Drops a key from the index, called under the same lock as the add
+ */
+void ht_trigram_remove(ht_trigram_t * p_index, const char * p_key, size_t keylen);
+
+/**
+ * @brief callback of ht_trigram_search
+ * @return SUCCESS_CODE to keep searching, FAIL_CODE to stop
+ */
+typedef int ht_match_function(const char * p_key, size_t keylen, void * p_ctx);
+
+/**
+ * @brief Calls visit on every indexed key that contains the needle
+ * @return SUCCESS_CODE when the search ran
+ * @return FAIL_CODE when it could not allocate its candidate list
+ */
+int ht_trigram_search(ht_trigram_t *      p_index,
+                      const char *        p_needle,
+                      size_t              needle_len,
+                      ht_match_function * visit,
+                      void *              p_ctx);
+
+/**
+ * @brief Finds the first occurrence of needle in hay, 16 positions a step
+ * where SSE2 is available
+ * @return const char* start of the match
+ * @return NULL when hay does not contain needle
+ */
+const char * ht_substr_find(const char * p_hay,
+                            size_t       hay_len,
+                            const char * p_needle,
+                            size_t       needle_len);
+
+/**
+ * @brief Allocates an empty prefix index
+ * @return ht_art_t* on success
+ * @return NULL on failure
+ */
+ht_art_t * ht_art_new(void);
+
+/**
+ * @brief Frees the index, the keys it points at belong to the table
+ */
+void ht_art_free(ht_art_t * p_art);
+
+/**
+ * @brief Indexes a key the table does not hold yet. The index keeps p_key
+ * itself, which must stay in place until the key is removed.
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE on failure, the index is left unchanged
+ */
+int ht_art_insert(ht_art_t * p_art, const char * p_key, size_t keylen);
+
+/**
+ * @brief Drops a key from the index, before the table frees its bytes
+ */
+void ht_art_remove(ht_art_t * p_art, const char * p_key, size_t keylen);
+
+/**
+ * @brief Calls visit on every indexed key starting with prefix, ascending
+ * @return SUCCESS_CODE when every such key was visited
+ * @return FAIL_CODE when visit stopped the iteration
+ */
+int ht_art_prefix(ht_art_t *        p_art,
+                  const char *      p_prefix,
+                  size_t            prefix_len,
+                  ht_key_function * visit,
+                  void *            p_ctx);
+
+/**
+ * @brief Calls visit on every indexed key k with start <= k < end, ascending
+ * @param const char* end of the range, NULL for none
+ * @return SUCCESS_CODE when every such key was visited
+ * @return FAIL_CODE when visit stopped the iteration
+ */
+int ht_art_range(ht_art_t *        p_art,
+                 const char *      p_start,
+                 size_t            start_len,
+                 const char *      p_end,
+                 size_t            end_len,
+                 ht_key_function * visit,
+                 void *            p_ctx);
+
+/**
+ * @brief Returns the table's own copy of a key, NULL when it is not present
+ */
+const char * ht_open_key(hash_table_t * p_ht,
+                         const char *   p_key,
+                         size_t         keylen,
+                         uint64_t       hash);
+
+/**
+ * @brief Allocates the slot and control arrays of an open addressing table
+ * @param hash_table_t* table being created
+ * @param uint32_t requested number of slots, rounded up to a power of two
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE on failure
+ */
+int ht_open_init(hash_table_t * p_ht, uint32_t size);
+
+/**
+ * @brief Frees every key and object and the slot arrays
+ * @param hash_table_t* table being destroyed
+ */
+void ht_open_destroy(hash_table_t * p_ht);
+
+/**
+ * @brief Inserts a key that is not yet present
+ * @param hash_table_t* table to insert into
+ * @param const char* key to store
+ * @param size_t length of the key
+ * @param uint64_t hash of the key
+ * @param void* object to store
+ * @return SUCCESS_CODE on success or when the key already exists
+ * @return FAIL_CODE on failure
+ */
+int ht_open_insert(hash_table_t * p_ht,
+                   const char *   p_key,
+                   size_t         keylen,
+                   uint64_t       hash,
+                   void *         obj);
+
+/**
+ * @brief Finds the object stored under key
+ * @return void* object on success
+ * @return NULL when the key is not present
+ */
+void * ht_open_lookup(hash_table_t * p_ht,
+                      const char *   p_key,
+                      size_t         keylen,
+                      uint64_t       hash);
+
+/**
+ * @brief Starts loading the control group and first slots a hash probes
+ * first, so a batch of lookups overlaps their cache misses
+ */
+void ht_open_prefetch(hash_table_t * p_ht, uint64_t hash);
+
+/**
+ * @brief Removes key and returns its object, which the caller must free
+ * @return void* object on success
+ * @return NULL when the key is not present
+ */
+void * ht_open_remove(hash_table_t * p_ht,
+                      const char *   p_key,
+                      size_t         keylen,
+                      uint64_t       hash);
+
+/**
+ * @brief Calls visit on every live slot until it returns FAIL_CODE
+ * @return SUCCESS_CODE when every slot was visited
+ * @return FAIL_CODE when the walk was stopped early
+ */
+int ht_open_for_each(hash_table_t * p_ht, ht_visit_function * visit, void * p_ctx);
+
+/**
+ * @brief Calls visit on every live slot from *p_index on
+ * @param size_t * p_index slot to start at, left at the slot visit stopped on
+ * @return SUCCESS_CODE when every slot was visited
+ * @return FAIL_CODE when the walk was stopped early
+ */
+int ht_open_for_each_from(hash_table_t *      p_ht,
+                          size_t *            p_index,
+                          ht_visit_function * visit,
+                          void *              p_ctx);
+
+/**
+ * @brief Returns the slot holding a key, for callers that update its object
+ * in place while holding hash_lock
+ * @return entry* slot on success
+ * @return NULL when the key is not present
+ */
+entry * ht_open_find(hash_table_t * p_ht,
+                     const char *   p_key,
+                     size_t         keylen,
+                     uint64_t       hash);
+
+/**
+ * @brief Returns how many groups a lookup of a stored slot's key probes
+ * @param entry* live slot of the table
+ * @return uint32_t groups, 1 when the key sits in its home group
+ */
+uint32_t ht_open_probe_length(const hash_table_t * p_ht, const entry * p_slot);
+
+/**
+ * @brief what a cache counter records, see ht_cache_count
+ */
+typedef enum ht_cache_event
+{
+    HT_CACHE_HIT = 0,
+    HT_CACHE_MISS,
+    HT_CACHE_EXPIRED,
+    HT_CACHE_EVICTED,
+    HT_CACHE_EVENTS, // number of counters
+} ht_cache_event_t;
+
+/**
+ * @brief Sets up the byte budget, counters and sweeper of a chained table
+ * created with a memory_limit or sweep_interval_ms and attaches them to it.
+ * Called once the stripes exist.
+ * @return ht_cache_t* on success
+ * @return NULL on failure
+ */
+ht_cache_t * ht_cache_new(hash_table_t * p_ht, const hash_table_opts_t * p_opts);
+
+/**
+ * @brief Stops the sweeper and frees the cache state, before the table goes
+ */
+void ht_cache_free(ht_cache_t * p_cache);
+
+/**
+ * @brief Adds an event to the counters of the stripe hash belongs to
+ */
+void ht_cache_count(hash_table_t * p_ht, uint64_t hash, ht_cache_event_t event);
+
+/**
+ * @brief Charges a linked entry to the byte budget, or refunds it when sign is
+ * -1. The caller holds the entry's stripe for writing.
+ */
+void ht_cache_charge(hash_table_t * p_ht,
+                     ht_stripe_t *  p_stripe,
+                     const entry *  p_entry,
+                     long           sign);
+
+/**
+ * @brief Moves the CLOCK hand until the table is back within its budget.
+ * Called with no lock held, after an insert.
+ */
+void ht_cache_evict(hash_table_t * p_ht);
+
+/**
+ * @brief Allocates a filter per stripe of a chained table created with
+ * opts.bloom_filter and attaches them to it. Called once the stripes exist.
+ * @return ht_bloom_t* on success
+ * @return NULL on failure
+ */
+ht_bloom_t * ht_bloom_new(hash_table_t * p_ht);
+
+/**
+ * @brief Frees the filters of a table, if it keeps any
+ */
+void ht_bloom_free(hash_table_t * p_ht);
+
+/**
+ * @brief Counts a key about to be linked. The caller holds its stripe for
+ * writing and may see the stripe's filter rebuilt larger.
+ */
+void ht_bloom_add(hash_table_t * p_ht, uint64_t hash);
+
+/**
+ * @brief Uncounts a key that was just unlinked. The caller holds its stripe
+ * for writing.
+ */
+void ht_bloom_remove(hash_table_t * p_ht, uint64_t hash);
+
+/**
+ * @brief Checks whether a key may be stored. The caller holds its stripe, or
+ * is in a read section of a lock-free table.
+ * @return false when the key is certainly not stored
+ */
+bool ht_bloom_maybe(const hash_table_t * p_ht, uint64_t hash);
+
+/**
+ * @brief Prefetches the filter block ht_bloom_maybe reads for a key
+ */
+void ht_bloom_prefetch(const hash_table_t * p_ht, uint64_t hash);
+
+#endif /* HSH_TABLE_INTERNAL_H */
@@ -0,0 +1,422 @@
+/* @file hashtable_open.c
+ *
+ * Open addressing backend for the hash table. Entries live in a flat slot
+ * array next to an array of control bytes, one per slot. A full control byte
+ * holds 7 bits of the key's hash, so a group of 16 slots is filtered with a
+ * single SSE2 compare before any key is touched.
+ *
+ */
+
+#include "hashtable_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#    include <emmintrin.h>
+#endif
+
+#define CTRL_EMPTY        ((uint8_t)0x80)
+#define CTRL_DELETED      ((uint8_t)0xFE)
+#define GROUP_WIDTH       16
+
+/**
+ * @brief bitmask with one bit per slot of a group
+ */
+typedef uint32_t group_mask_t;
+
+static inline uint8_t open_h2(uint64_t mixed)
+{
+    return (uint8_t)(mixed & 0x7F);
+} /* open_h2() */
+
+static inline size_t open_h1(uint64_t mixed)
+{
+    return (size_t)(mixed >> 7);
+} /* open_h1() */
+
+static inline group_mask_t group_match(const uint8_t * p_group, uint8_t h2)
+{
+#if defined(__SSE2__)
+    __m128i ctrl = _mm_load_si128((const __m128i *)p_group);
+    return (group_mask_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)h2)));
+#else
+    group_mask_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++)
+    {
+        if (p_group[i] == h2)
+        {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+#endif
+} /* group_match() */
+
+static inline group_mask_t group_match_empty(const uint8_t * p_group)
+{
+    return group_match(p_group, CTRL_EMPTY);
+} /* group_match_empty() */
+
+static inline group_mask_t group_match_free(const uint8_t * p_group)
+{
+#if defined(__SSE2__)
+    // EMPTY and DELETED are the only control bytes with the high bit set
+    __m128i ctrl = _mm_load_si128((const __m128i *)p_group);
+    return (group_mask_t)_mm_movemask_epi8(ctrl);
+#else
+    group_mask_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++)
+    {
+        if (p_group[i] & 0x80)
+        {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+#endif
+} /* group_match_free() */
+
+static inline size_t open_max_load(size_t capacity)
+{
+    return capacity - (capacity / 8);
+} /* open_max_load() */
+
+/**
+ * @brief Allocates a control array with every byte EMPTY and a zeroed slot array
+ */
+static int open_alloc(uint8_t ** pp_ctrl, entry ** pp_slots, size_t capacity)
+{
+    int ret_code = FAIL_CODE;
+
+    uint8_t * p_ctrl = aligned_alloc(GROUP_WIDTH, capacity);
+    if (NULL == p_ctrl)
+    {
+        fprintf(stderr, "open_alloc: aligned_alloc failed\n");
+        goto EXIT;
+    }
+    entry * p_slots = calloc(capacity, sizeof(entry));
+    if (NULL == p_slots)
+    {
+        fprintf(stderr, "open_alloc: calloc failed\n");
+        free(p_ctrl);
+        goto EXIT;
+    }
+    memset(p_ctrl, CTRL_EMPTY, capacity);
+
+    *pp_ctrl  = p_ctrl;
+    *pp_slots = p_slots;
+    ret_code  = SUCCESS_CODE;
+EXIT:
+    return ret_code;
+} /* open_alloc() */
+
+/**
+ * @brief Finds the first EMPTY or DELETED slot on the probe sequence of mixed
+ */
+static size_t open_find_free(const uint8_t * p_ctrl, size_t capacity, uint64_t mixed)
+{
+    size_t group_mask = (capacity / GROUP_WIDTH) - 1;
+    size_t group      = open_h1(mixed) & group_mask;
+
+    // triangular probing visits every group once when the group count is a
+    // power of two, and the table is never full, so this always terminates
+    for (size_t step = 1;; step++)
+    {
+        group_mask_t free_mask = group_match_free(p_ctrl + (group * GROUP_WIDTH));
+        if (0 != free_mask)
+        {
+            return (group * GROUP_WIDTH) + (size_t)__builtin_ctz(free_mask);
+        }
+        group = (group + step) & group_mask;
+    }
+} /* open_find_free() */
+
+/**
+ * @brief Returns the slot holding key or NULL when it is not present
+ */
+static entry * open_find(hash_table_t * p_ht,
+                         const char *   p_key,
+                         size_t         keylen,
+                         uint64_t       hash,
+                         size_t *       p_index)
+{
+    uint64_t mixed       = ht_mix(hash);
+    size_t   group_count = p_ht->size / GROUP_WIDTH;
+    size_t   group_mask  = group_count - 1;
+    size_t   group       = open_h1(mixed) & group_mask;
+    uint8_t  h2          = open_h2(mixed);
+
+    for (size_t step = 1; step <= group_count; step++)
+    {
+        const uint8_t * p_group = p_ht->ctrl + (group * GROUP_WIDTH);
+        group_mask_t    match   = group_match(p_group, h2);
+        while (0 != match)
+        {
+            size_t  index  = (group * GROUP_WIDTH) + (size_t)__builtin_ctz(match);
+            entry * p_slot = &p_ht->slots[index];
+            if ((p_slot->hash == hash) && (p_slot->keylength == keylen) &&
+                (0 == memcmp(p_slot->key, p_key, keylen)))
+            {
+                if (NULL != p_index)
+                {
+                    *p_index = index;
+                }
+                return p_slot;
+            }
+            match &= match - 1;
+        }
+        if (0 != group_match_empty(p_group))
+        {
+            break;
+        }
+        group = (group + step) & group_mask;
+    }
+    return NULL;
+} /* open_find() */
+
+/**
+ * @brief Moves every live slot into freshly allocated arrays of new_capacity.
+ * Also used at the same capacity to clear out DELETED markers.
+ */
+static int open_rehash(hash_table_t * p_ht, size_t new_capacity)
+{
+    int       ret_code  = FAIL_CODE;
+    uint8_t * p_ctrl    = NULL;
+    entry *   p_slots   = NULL;
+
+    if (SUCCESS_CODE != open_alloc(&p_ctrl, &p_slots, new_capacity))
+    {
+        fprintf(stderr, "open_rehash: open_alloc failed\n");
+        goto EXIT;
+    }
+
+    for (size_t i = 0; i < p_ht->size; i++)
+    {
+        if (p_ht->ctrl[i] & 0x80)
+        {
+            continue;
+        }
+        entry *  p_old = &p_ht->slots[i];
+        uint64_t mixed = ht_mix(p_old->hash);
+        size_t   index = open_find_free(p_ctrl, new_capacity, mixed);
+        p_ctrl[index]  = open_h2(mixed);
+        p_slots[index] = *p_old;
+    }
+
+    free(p_ht->ctrl);
+    free(p_ht->slots);
+    p_ht->ctrl        = p_ctrl;
+    p_ht->slots       = p_slots;
+    p_ht->size        = (uint32_t)new_capacity;
+    p_ht->growth_left = open_max_load(new_capacity) -
+                        atomic_load_explicit(&p_ht->count, memory_order_relaxed);
+    ret_code          = SUCCESS_CODE;
+EXIT:
+    return ret_code;
+} /* open_rehash() */
+
+int ht_open_init(hash_table_t * p_ht, uint32_t size)
+{
+    int    ret_code = FAIL_CODE;
+    // HT_MIN_BUCKETS keeps the capacity a whole number of groups
+    size_t capacity = ht_round_size(size);
+
+    if (SUCCESS_CODE != open_alloc(&p_ht->ctrl, &p_ht->slots, capacity))
+    {
+        fprintf(stderr, "ht_open_init: open_alloc failed\n");
+        goto EXIT;
+    }
+    p_ht->size        = (uint32_t)capacity;
+    p_ht->growth_left = open_max_load(capacity);
+    ret_code          = SUCCESS_CODE;
+EXIT:
+    return ret_code;
+} /* ht_open_init() */
+
+void ht_open_destroy(hash_table_t * p_ht)
+{
+    for (size_t i = 0; i < p_ht->size; i++)
+    {
+        if (p_ht->ctrl[i] & 0x80)
+        {
+            continue;
+        }
+        free(p_ht->slots[i].key);
+        p_ht->slots[i].key = NULL;
+        p_ht->cleanup(p_ht->slots[i].object);
+        p_ht->slots[i].object = NULL;
+    }
+    free(p_ht->ctrl);
+    p_ht->ctrl = NULL;
+    free(p_ht->slots);
+    p_ht->slots = NULL;
+} /* ht_open_destroy() */
+
+int ht_open_insert(hash_table_t * p_ht,
+                   const char *   p_key,
+                   size_t         keylen,
+                   uint64_t       hash,
+                   void *         obj)
+{
+    int      ret_code = FAIL_CODE;
+    uint64_t mixed    = ht_mix(hash);
+
+    if (NULL != open_find(p_ht, p_key, keylen, hash, NULL))
+    {
+        fprintf(stderr, "hash_table_insert: entry already exists\n");
+        // Same contract as the chained backend: a duplicate is not an error
+        ret_code = SUCCESS_CODE;
+        goto EXIT;
+    }
+
+    if (0 == p_ht->growth_left)
+    {
+        // Grow when at least half of the load is live, otherwise the table is
+        // mostly DELETED markers and rebuilding at the same size is enough
+        size_t new_capacity = p_ht->size;
+        if (atomic_load_explicit(&p_ht->count, memory_order_relaxed) >=
+            (open_max_load(p_ht->size) / 2))
+        {
+            new_capacity *= 2;
+        }
+        if (SUCCESS_CODE != open_rehash(p_ht, new_capacity))
+        {
+            fprintf(stderr, "ht_open_insert: open_rehash failed\n");
+            goto EXIT;
+        }
+    }
+
+    char * p_copy = ht_key_dup(p_key, keylen);
+    if (NULL == p_copy)
+    {
+        fprintf(stderr, "ht_open_insert: ht_key_dup failed\n");
+        goto EXIT;
+    }
+
+    size_t index = open_find_free(p_ht->ctrl, p_ht->size, mixed);
+    if (CTRL_EMPTY == p_ht->ctrl[index])
+    {
+        p_ht->growth_left--;
+    }
+    p_ht->ctrl[index]            = open_h2(mixed);
+    p_ht->slots[index].key       = p_copy;
+    p_ht->slots[index].keylength = keylen;
+    p_ht->slots[index].hash      = hash;
+    p_ht->slots[index].object    = obj;
+    p_ht->slots[index].next      = NULL;
+    atomic_fetch_add_explicit(&p_ht->count, 1, memory_order_relaxed);
+    ret_code = SUCCESS_CODE;
+EXIT:
+    return ret_code;
+} /* ht_open_insert() */
+
+void * ht_open_lookup(hash_table_t * p_ht,
+                      const char *   p_key,
+                      size_t         keylen,
+                      uint64_t       hash)
+{
+    entry * p_slot = open_find(p_ht, p_key, keylen, hash, NULL);
+    return (NULL == p_slot) ? NULL : p_slot->object;
+} /* ht_open_lookup() */
+
+const char * ht_open_key(hash_table_t * p_ht,
+                         const char *   p_key,
+                         size_t         keylen,
+                         uint64_t       hash)
+{
+    entry * p_slot = open_find(p_ht, p_key, keylen, hash, NULL);
+    return (NULL == p_slot) ? NULL : p_slot->key;
+} /* ht_open_key() */
+
+entry * ht_open_find(hash_table_t * p_ht,
+                     const char *   p_key,
+                     size_t         keylen,
+                     uint64_t       hash)
+{
+    return open_find(p_ht, p_key, keylen, hash, NULL);
+} /* ht_open_find() */
+
+void ht_open_prefetch(hash_table_t * p_ht, uint64_t hash)
+{
+    uint64_t mixed = ht_mix(hash);
+    size_t   group = open_h1(mixed) & ((p_ht->size / GROUP_WIDTH) - 1);
+    __builtin_prefetch(p_ht->ctrl + (group * GROUP_WIDTH));
+    __builtin_prefetch(&p_ht->slots[group * GROUP_WIDTH]);
+} /* ht_open_prefetch() */
+
+void * ht_open_remove(hash_table_t * p_ht,
+                      const char *   p_key,
+                      size_t         keylen,
+                      uint64_t       hash)
+{
+    void *  removed_object = NULL;
+    size_t  index          = 0;
+    entry * p_slot         = open_find(p_ht, p_key, keylen, hash, &index);
+    if (NULL == p_slot)
+    {
+        goto EXIT;
+    }
+
+    removed_object = p_slot->object;
+    free(p_slot->key);
+    memset(p_slot, 0, sizeof(*p_slot));
+
+    // A group that still has an EMPTY slot was never full, so no probe ever
+    // continued past it and the slot can go straight back to EMPTY
+    const uint8_t * p_group = p_ht->ctrl + ((index / GROUP_WIDTH) * GROUP_WIDTH);
+    if (0 != group_match_empty(p_group))
+    {
+        p_ht->ctrl[index] = CTRL_EMPTY;
+        p_ht->growth_left++;
+    }
+    else
+    {
+        p_ht->ctrl[index] = CTRL_DELETED;
+    }
+    atomic_fetch_sub_explicit(&p_ht->count, 1, memory_order_relaxed);
+EXIT:
+    return removed_object;
+} /* ht_open_remove() */
+
+int ht_open_for_each_from(hash_table_t *      p_ht,
+                          size_t *            p_index,
+                          ht_visit_function * visit,
+                          void *              p_ctx)
+{
+    for (; *p_index < p_ht->size; (*p_index)++)
+    {
+        if (p_ht->ctrl[*p_index] & 0x80)
+        {
+            continue;
+        }
+        if (SUCCESS_CODE != visit(&p_ht->slots[*p_index], p_ctx))
+        {
+            return FAIL_CODE;
+        }
+    }
+    return SUCCESS_CODE;
+} /* ht_open_for_each_from() */
+
+int ht_open_for_each(hash_table_t * p_ht, ht_visit_function * visit, void * p_ctx)
+{
+    size_t index = 0;
+    return ht_open_for_each_from(p_ht, &index, visit, p_ctx);
+} /* ht_open_for_each() */
+
+uint32_t ht_open_probe_length(const hash_table_t * p_ht, const entry * p_slot)
+{
+    size_t group_count = p_ht->size / GROUP_WIDTH;
+    size_t group_mask  = group_count - 1;
+    size_t group       = open_h1(ht_mix(p_slot->hash)) & group_mask;
+    size_t target      = (size_t)(p_slot - p_ht->slots) / GROUP_WIDTH;
+
+    // Replays the probe sequence of open_find up to the slot's group
+    uint32_t step = 1;
+    while ((group != target) && (step < group_count))
+    {
+        group = (group + step) & group_mask;
+        step++;
+    }
+    return step;
+} /* ht_open_probe_length() */
+
+/*** end of file ***/
@@ -0,0 +1,339 @@
+/* @file hashtable_scan.c
+ *
+ * Incremental and parallel scans that run while writers are active.
+ *
+ * A chained table is scanned with a reverse binary cursor: the cursor names
+ * a bucket of the smaller array and is advanced by incrementing its bits
+ * from the top down. Buckets split on growth and merge on shrink along the
+ * high bits, so every bucket reachable from a cursor value in one size is
+ * reachable from it in any other. A key present for the whole scan is
+ * returned at least once whatever the table resizes to in between, although
+ * it may be returned more than once.
+ *
+ * Each step only visits buckets that share the cursor's low bits, which all
+ * belong to one stripe, so a step holds a single stripe for reading.
+ *
+ */
+
+#include "hashtable_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SCAN_MAX_PARTS  1024 // most cursor ranges a parallel scan splits into
+#define SCAN_OPEN_SHIFT 56   // open backend cursors keep log2(size) + 1 here
+#define SCAN_OPEN_INDEX ((1ULL << SCAN_OPEN_SHIFT) - 1)
+
+static inline uint64_t scan_reverse(uint64_t v)
+{
+    v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+    v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    return __builtin_bswap64(v);
+} /* scan_reverse() */
+
+/**
+ * @brief Increments the masked bits of a cursor from the top bit down
+ */
+static inline uint64_t scan_next(uint64_t v, uint64_t mask)
+{
+    v |= ~mask;
+    return scan_reverse(scan_reverse(v) + 1);
+} /* scan_next() */
+
+static int scan_bucket(entry * p_entry, ht_visit_function * visit, void * p_ctx)
+{
+    for (; NULL != p_entry; p_entry = p_entry->next)
+    {
+        if (SUCCESS_CODE != visit(p_entry, p_ctx))
+        {
+            return FAIL_CODE;
+        }
+    }
+    return SUCCESS_CODE;
+} /* scan_bucket() */
+
+static inline ht_stripe_t * scan_stripe(hash_table_t * p_ht, uint64_t v)
+{
+    return &p_ht->stripes[v & (p_ht->stripe_count - 1)];
+} /* scan_stripe() */
+
+/**
+ * @brief Visits every bucket cursor v covers, in both arrays while resizing.
+ * The caller holds the stripe of v.
+ *
+ * @param int * p_ret FAIL_CODE when visit stopped the step
+ * @return uint64_t cursor of the next step, 0 once the scan is complete
+ */
+static uint64_t scan_step(hash_table_t *      p_ht,
+                          uint64_t            v,
+                          ht_visit_function * visit,
+                          void *              p_ctx,
+                          int *               p_ret)
+{
+    if (NULL == p_ht->old_elements)
+    {
+        uint64_t mask = p_ht->size - 1;
+        *p_ret        = scan_bucket(p_ht->elements[v & mask], visit, p_ctx);
+        return scan_next(v, mask);
+    }
+
+    entry ** small      = p_ht->elements;
+    entry ** large      = p_ht->old_elements;
+    uint64_t small_mask = p_ht->size - 1;
+    uint64_t large_mask = p_ht->old_size - 1;
+    if (small_mask > large_mask)
+    {
+        small      = p_ht->old_elements;
+        large      = p_ht->elements;
+        small_mask = p_ht->old_size - 1;
+        large_mask = p_ht->size - 1;
+    }
+    *p_ret = scan_bucket(small[v & small_mask], visit, p_ctx);
+    // Then every bucket of the larger array that splits off that one
+    do
+    {
+        if (SUCCESS_CODE == *p_ret)
+        {
+            *p_ret = scan_bucket(large[v & large_mask], visit, p_ctx);
+        }
+        v = scan_next(v, large_mask);
+    } while (0 != (v & (small_mask ^ large_mask)));
+    return v;
+} /* scan_step() */
+
+/**
+ * @brief Keys copied into a caller's buffer, each followed by a null byte
+ */
+typedef struct scan_copy
+{
+    char * buf;
+    size_t buf_len;
+    size_t used;
+} scan_copy_t;
+
+static int scan_size_visit(entry * p_entry, void * p_ctx)
+{
+    *(size_t *)p_ctx += p_entry->keylength + 1;
+    return SUCCESS_CODE;
+} /* scan_size_visit() */
+
+static int scan_copy_visit(entry * p_entry, void * p_ctx)
+{
+    scan_copy_t * p_copy = p_ctx;
+    if (p_entry->keylength + 1 > p_copy->buf_len - p_copy->used)
+    {
+        return FAIL_CODE;
+    }
+    memcpy(p_copy->buf + p_copy->used, p_entry->key, p_entry->keylength);
+    p_copy->used += p_entry->keylength;
+    p_copy->buf[p_copy->used++] = '\0';
+    return SUCCESS_CODE;
+} /* scan_copy_visit() */
+
+/**
+ * @brief hash_table_scan for the open backend. The cursor is a slot index
+ * tagged with the table size. A rehash moves keys between slots, so the scan
+ * starts over when it sees a different size.
+ */
+static int scan_open(hash_table_t * p_ht, uint64_t * p_cursor, scan_copy_t * p_copy)
+{
+    int ret_code = SUCCESS_CODE;
+    ht_hash_lock(p_ht);
+    uint64_t tag   = (uint64_t)(__builtin_ctzll(p_ht->size) + 1) << SCAN_OPEN_SHIFT;
+    size_t   index = 0;
+    if ((0 != *p_cursor) && (tag == (*p_cursor & ~SCAN_OPEN_INDEX)))
+    {
+        index = (size_t)(*p_cursor & SCAN_OPEN_INDEX);
+    }
+    if (SUCCESS_CODE == ht_open_for_each_from(p_ht, &index, scan_copy_visit, p_copy))
+    {
+        *p_cursor = 0;
+    }
+    else if (0 == p_copy->used)
+    {
+        fprintf(stderr, "hash_table_scan: buffer too small for one key\n");
+        ret_code = FAIL_CODE;
+    }
+    else
+    {
+        *p_cursor = tag | index;
+    }
+    pthread_mutex_unlock(&p_ht->hash_lock);
+    return ret_code;
+} /* scan_open() */
+
+int hash_table_scan(hash_table_t * p_ht,
+                    uint64_t *     p_cursor,
+                    char *         buf,
+                    size_t         buf_len,
+                    size_t *       p_used)
+{
+    int         ret_code = FAIL_CODE;
+    scan_copy_t copy     = { .buf = buf, .buf_len = buf_len, .used = 0 };
+    if ((NULL == p_ht) || (NULL == p_cursor) || (NULL == buf) || (NULL == p_used))
+    {
+        fprintf(stderr, "hash_table_scan: an argument is NULL\n");
+        goto EXIT;
+    }
+    if (HT_BACKEND_OPEN == p_ht->backend)
+    {
+        ret_code = scan_open(p_ht, p_cursor, &copy);
+        goto EXIT;
+    }
+
+    uint64_t v = *p_cursor;
+    do
+    {
+        ht_stripe_t * p_stripe = scan_stripe(p_ht, v);
+        size_t        need     = 0;
+        int           result   = SUCCESS_CODE;
+        ht_read_lock(p_ht, p_stripe);
+        scan_step(p_ht, v, scan_size_visit, &need, &result);
+        if (need > buf_len - copy.used)
+        {
+            // A step is all or nothing, so the cursor stays valid
+            ht_unlock(p_ht, p_stripe);
+            if (0 == copy.used)
+            {
+                fprintf(stderr, "hash_table_scan: buffer too small for one bucket\n");
+                goto EXIT;
+            }
+            break;
+        }
+        v = scan_step(p_ht, v, scan_copy_visit, &copy, &result);
+        ht_unlock(p_ht, p_stripe);
+    } while (0 != v);
+    *p_cursor = v;
+    ret_code  = SUCCESS_CODE;
+EXIT:
+    if (NULL != p_used)
+    {
+        *p_used = copy.used;
+    }
+    return ret_code;
+} /* hash_table_scan() */
+
+/**
+ * @brief state shared by the workers of a parallel scan
+ * @NOTE: the cursor's low bits change slowest, so the cursors sharing their
+ * low bits form one contiguous run starting at the value of those bits.
+ * Each run is a part, and workers claim parts until none are left.
+ */
+typedef struct scan_shared
+{
+    hash_table_t *     p_ht;
+    ht_scan_function * visit;
+    void *             p_ctx;
+    uint64_t           parts;     // power of two, never above the table size
+    _Atomic uint64_t   next_part;
+    atomic_bool        stop;      // visit asked to stop
+} scan_shared_t;
+
+static int scan_parallel_visit(entry * p_entry, void * p_ctx)
+{
+    scan_shared_t * p_shared = p_ctx;
+    if (atomic_load_explicit(&p_shared->stop, memory_order_relaxed))
+    {
+        return FAIL_CODE;
+    }
+    void * p_user = p_shared->p_ctx;
+    if (SUCCESS_CODE !=
+        p_shared->visit(p_entry->key, p_entry->keylength, p_entry->object, p_user))
+    {
+        atomic_store(&p_shared->stop, true);
+        return FAIL_CODE;
+    }
+    return SUCCESS_CODE;
+} /* scan_parallel_visit() */
+
+static void * scan_worker(void * arg)
+{
+    scan_shared_t * p_shared = arg;
+    hash_table_t *  p_ht     = p_shared->p_ht;
+    uint64_t        mask     = p_shared->parts - 1;
+    for (;;)
+    {
+        uint64_t part = atomic_fetch_add(&p_shared->next_part, 1);
+        if ((part >= p_shared->parts) || atomic_load(&p_shared->stop))
+        {
+            break;
+        }
+        uint64_t v = part;
+        do
+        {
+            ht_stripe_t * p_stripe = scan_stripe(p_ht, v);
+            int           result   = SUCCESS_CODE;
+            ht_read_lock(p_ht, p_stripe);
+            v = scan_step(p_ht, v, scan_parallel_visit, p_shared, &result);
+            ht_unlock(p_ht, p_stripe);
+        } while ((0 != v) && (part == (v & mask)) && !atomic_load(&p_shared->stop));
+    }
+    return NULL;
+} /* scan_worker() */
+
+int hash_table_scan_parallel(hash_table_t *     p_ht,
+                             uint32_t           threads,
+                             ht_scan_function * visit,
+                             void *             p_ctx)
+{
+    int        ret_code  = FAIL_CODE;
+    pthread_t* p_threads = NULL;
+    uint32_t   started   = 0;
+    if ((NULL == p_ht) || (NULL == visit))
+    {
+        fprintf(stderr, "hash_table_scan_parallel: p_ht or visit is NULL\n");
+        goto EXIT;
+    }
+
+    scan_shared_t shared = { .p_ht = p_ht, .visit = visit, .p_ctx = p_ctx };
+    atomic_init(&shared.next_part, 0);
+    atomic_init(&shared.stop, false);
+    if (HT_BACKEND_OPEN == p_ht->backend)
+    {
+        // One lock guards every slot, so there is nothing to split
+        ht_hash_lock(p_ht);
+        ht_open_for_each(p_ht, scan_parallel_visit, &shared);
+        pthread_mutex_unlock(&p_ht->hash_lock);
+        goto DONE;
+    }
+
+    // Every size the table can take is at least min_size
+    shared.parts = (p_ht->min_size < SCAN_MAX_PARTS) ? p_ht->min_size : SCAN_MAX_PARTS;
+    if (0 == threads)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads     = (0 < online) ? (uint32_t)online : 1;
+    }
+    if (threads > shared.parts)
+    {
+        threads = (uint32_t)shared.parts;
+    }
+    // The calling thread is one of the workers
+    p_threads = malloc(threads * sizeof(pthread_t));
+    if (NULL == p_threads)
+    {
+        fprintf(stderr, "hash_table_scan_parallel: malloc failed\n");
+        goto EXIT;
+    }
+    for (; started + 1 < threads; started++)
+    {
+        if (0 != pthread_create(&p_threads[started], NULL, scan_worker, &shared))
+        {
+            fprintf(stderr, "hash_table_scan_parallel: pthread_create failed\n");
+            break;
+        }
+    }
+    scan_worker(&shared);
+    for (uint32_t i = 0; i < started; i++)
+    {
+        pthread_join(p_threads[i], NULL);
+    }
+DONE:
+    ret_code = atomic_load(&shared.stop) ? FAIL_CODE : SUCCESS_CODE;
+EXIT:
+    free(p_threads);
+    return ret_code;
+} /* hash_table_scan_parallel() */
+
+/*** end of file ***/
@@ -0,0 +1,434 @@
+/* @file hashtable_shard.c
+ *
+ * Sharded front-end over independent hash tables. Each shard has its own
+ * locks, counters and arrays, so threads working on different shards share
+ * no cache lines. Keys are routed by the high bits of the mixed hash while
+ * every shard picks buckets with the low bits, so the two choices stay
+ * independent and every shard fills evenly.
+ *
+ * Shards are spread over the NUMA nodes that have CPUs, and each is created
+ * by a thread pinned to its home node. The kernel places a page on the node
+ * of the thread that first touches it, so the bucket array of a shard starts
+ * out local to its node. hash_shards_node lets a dispatcher hand each key to
+ * a worker on that node, which keeps the shard's traffic on one socket.
+ *
+ */
+
+#define _GNU_SOURCE // pthread_attr_setaffinity_np, CPU_SET
+
+#include "hashtable_internal.h"
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SHARD_MAX      1024 // most shards a front-end creates
+#define SHARD_NODE_DIR "/sys/devices/system/node"
+
+struct hash_shards
+{
+    hash_table_t ** shards;
+    int *           nodes; // home NUMA node of each shard, -1 when unknown
+    uint32_t        count; // power of two
+    uint32_t        shift; // a key's shard is ht_mix(hash) >> shift
+};
+
+/**
+ * @brief Parses a kernel list such as "0-3,8,10-11" into a set
+ * @return int number of members read, 0 when the file is missing
+ */
+static int shard_read_list(const char * p_path, cpu_set_t * p_set)
+{
+    int    members = 0;
+    char   text[4096];
+    FILE * fp = fopen(p_path, "r");
+    CPU_ZERO(p_set);
+    if (NULL == fp)
+    {
+        goto EXIT;
+    }
+    if (NULL == fgets(text, sizeof(text), fp))
+    {
+        goto CLOSE;
+    }
+    char * p_pos = text;
+    while (('0' <= *p_pos) && ('9' >= *p_pos))
+    {
+        long first = strtol(p_pos, &p_pos, 10);
+        long last  = first;
+        if ('-' == *p_pos)
+        {
+            last = strtol(p_pos + 1, &p_pos, 10);
+        }
+        for (long i = first; (i <= last) && (i < CPU_SETSIZE); i++)
+        {
+            CPU_SET((int)i, p_set);
+            members++;
+        }
+        if (',' != *p_pos)
+        {
+            break;
+        }
+        p_pos++;
+    }
+CLOSE:
+    fclose(fp);
+EXIT:
+    return members;
+} /* shard_read_list() */
+
+/**
+ * @brief arguments and result of a shard created on its home node
+ */
+typedef struct shard_build
+{
+    uint32_t                  size;
+    hashfunction *            p_hf;
+    cleanup_function *        p_cf;
+    const hash_table_opts_t * p_opts;
+    hash_table_t *            p_ht;
+} shard_build_t;
+
+static void * shard_build(void * arg)
+{
+    shard_build_t * p_build = arg;
+    hash_table_t *  p_ht    = hash_table_create_ex(
+        p_build->size, p_build->p_hf, p_build->p_cf, p_build->p_opts);
+    if (NULL != p_ht)
+    {
+        // calloc hands back untouched pages for large arrays, so write them
+        // here to place them on this thread's node
+        if (HT_BACKEND_OPEN == p_ht->backend)
+        {
+            memset(p_ht->slots, 0, p_ht->size * sizeof(entry));
+        }
+        else
+        {
+            memset(p_ht->elements, 0, p_ht->size * sizeof(entry *));
+        }
+    }
+    p_build->p_ht = p_ht;
+    return NULL;
+} /* shard_build() */
+
+/**
+ * @brief Creates one shard from a thread running on the CPUs of its node, or
+ * from the calling thread when the node is unknown or pinning fails
+ */
+static hash_table_t * shard_create(shard_build_t * p_build, const cpu_set_t * p_cpus)
+{
+    pthread_attr_t attr;
+    pthread_t      thread;
+    bool           built = false;
+    if ((NULL != p_cpus) && (0 == pthread_attr_init(&attr)))
+    {
+        if ((0 == pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), p_cpus)) &&
+            (0 == pthread_create(&thread, &attr, shard_build, p_build)))
+        {
+            pthread_join(thread, NULL);
+            built = true;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    if (!built)
+    {
+        shard_build(p_build);
+    }
+    return p_build->p_ht;
+} /* shard_create() */
+
+hash_shards_t * hash_shards_create(uint32_t                  shard_count,
+                                   uint32_t                  size,
+                                   hashfunction *            p_hf,
+                                   cleanup_function *        p_cf,
+                                   const hash_table_opts_t * p_opts)
+{
+    hash_shards_t * p_hs      = NULL;
+    cpu_set_t *     p_cpus    = NULL;
+    int *           p_node_id = NULL;
+    int             nodes     = 0;
+    if (0 == shard_count)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        shard_count = (0 < online) ? (uint32_t)online : 1;
+    }
+    if (SHARD_MAX < shard_count)
+    {
+        shard_count = SHARD_MAX;
+    }
+
+    p_hs = calloc(1, sizeof(hash_shards_t));
+    if (NULL == p_hs)
+    {
+        fprintf(stderr, "hash_shards_create: calloc failed\n");
+        goto EXIT;
+    }
+    p_hs->count = 1;
+    while (p_hs->count < shard_count)
+    {
+        p_hs->count <<= 1;
+    }
+    p_hs->shift  = 64 - (uint32_t)__builtin_ctz(p_hs->count);
+    p_hs->shards = calloc(p_hs->count, sizeof(hash_table_t *));
+    p_hs->nodes  = calloc(p_hs->count, sizeof(int));
+    if ((NULL == p_hs->shards) || (NULL == p_hs->nodes))
+    {
+        fprintf(stderr, "hash_shards_create: calloc failed\n");
+        goto ERR;
+    }
+
+    // Home nodes are the online nodes that have CPUs to pin to
+    cpu_set_t online_nodes;
+    int       node_total = shard_read_list(SHARD_NODE_DIR "/online", &online_nodes);
+    if (0 < node_total)
+    {
+        p_cpus    = malloc(node_total * sizeof(cpu_set_t));
+        p_node_id = malloc(node_total * sizeof(int));
+        if ((NULL == p_cpus) || (NULL == p_node_id))
+        {
+            fprintf(stderr, "hash_shards_create: malloc failed\n");
+            goto ERR;
+        }
+    }
+    for (int node = 0; (0 < node_total) && (node < CPU_SETSIZE); node++)
+    {
+        char path[64];
+        if (!CPU_ISSET(node, &online_nodes))
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), SHARD_NODE_DIR "/node%d/cpulist", node);
+        if (0 < shard_read_list(path, &p_cpus[nodes]))
+        {
+            p_node_id[nodes++] = node;
+        }
+    }
+
+    shard_build_t build = { .p_hf = p_hf, .p_cf = p_cf, .p_opts = p_opts };
+    build.size          = size / p_hs->count;
+    for (uint32_t i = 0; i < p_hs->count; i++)
+    {
+        p_hs->nodes[i] = -1;
+        if (0 < nodes)
+        {
+            p_hs->nodes[i] = p_node_id[i % nodes];
+        }
+        const cpu_set_t * p_node_cpus = (0 < nodes) ? &p_cpus[i % nodes] : NULL;
+        p_hs->shards[i] = shard_create(&build, p_node_cpus);
+        if (NULL == p_hs->shards[i])
+        {
+            fprintf(stderr, "hash_shards_create: hash_table_create_ex failed\n");
+            goto ERR;
+        }
+        // Every shard hashes alike so a key is hashed once, before routing
+        p_hs->shards[i]->seed = p_hs->shards[0]->seed;
+    }
+    goto EXIT;
+
+ERR:
+    hash_shards_destroy(p_hs);
+    p_hs = NULL;
+EXIT:
+    free(p_cpus);
+    free(p_node_id);
+    return p_hs;
+} /* hash_shards_create() */
+
+void hash_shards_destroy(hash_shards_t * p_hs)
+{
+    if (NULL == p_hs)
+    {
+        return;
+    }
+    for (uint32_t i = 0; (NULL != p_hs->shards) && (i < p_hs->count); i++)
+    {
+        if (NULL != p_hs->shards[i])
+        {
+            hash_table_destroy(p_hs->shards[i]);
+        }
+    }
+    free(p_hs->shards);
+    free(p_hs->nodes);
+    free(p_hs);
+} /* hash_shards_destroy() */
+
+/**
+ * @brief Validates a key, hashes it and picks its shard
+ * @param uint64_t * p_hash receives the hash to hand to the shard
+ * @return uint32_t index of the shard
+ * @return UINT32_MAX when the key is invalid
+ */
+static uint32_t shard_route(hash_shards_t * p_hs,
+                            const char *    p_key,
+                            size_t          keylen,
+                            uint64_t *      p_hash)
+{
+    if ((NULL == p_hs) || (NULL == p_key))
+    {
+        fprintf(stderr, "shard_route: p_hs or p_key is NULL\n");
+        return UINT32_MAX;
+    }
+    if (keylen > MAX_KEY_LENGTH)
+    {
+        fprintf(stderr, "shard_route: p_key is invalid\n");
+        return UINT32_MAX;
+    }
+    *p_hash = ht_hash(p_hs->shards[0], p_key, keylen);
+    if (1 == p_hs->count)
+    {
+        return 0;
+    }
+    return (uint32_t)(ht_mix(*p_hash) >> p_hs->shift);
+} /* shard_route() */
+
+int hash_shards_insert_n(hash_shards_t * p_hs,
+                         const char *    key,
+                         size_t          keylen,
+                         void *          obj)
+{
+    uint64_t hash  = 0;
+    uint32_t shard = shard_route(p_hs, key, keylen, &hash);
+    if (UINT32_MAX == shard)
+    {
+        return FAIL_CODE;
+    }
+    return ht_insert_hashed(p_hs->shards[shard], key, keylen, hash, obj, 0);
+} /* hash_shards_insert_n() */
+
+int hash_shards_insert(hash_shards_t * p_hs, const char * key, void * obj)
+{
+    if (NULL == key)
+    {
+        fprintf(stderr, "hash_shards_insert: key is NULL\n");
+        return FAIL_CODE;
+    }
+    return hash_shards_insert_n(p_hs, key, strlen(key), obj);
+} /* hash_shards_insert() */
+
+void * hash_shards_lookup_n(hash_shards_t * p_hs, const char * key, size_t keylen)
+{
+    uint64_t hash  = 0;
+    uint32_t shard = shard_route(p_hs, key, keylen, &hash);
+    if (UINT32_MAX == shard)
+    {
+        return NULL;
+    }
+    return ht_lookup_hashed(p_hs->shards[shard], key, keylen, hash);
+} /* hash_shards_lookup_n() */
+
+void * hash_shards_lookup(hash_shards_t * p_hs, const char * key)
+{
+    if (NULL == key)
+    {
+        fprintf(stderr, "hash_shards_lookup: key is NULL\n");
+        return NULL;
+    }
+    return hash_shards_lookup_n(p_hs, key, strlen(key));
+} /* hash_shards_lookup() */
+
+void * hash_shards_remove_n(hash_shards_t * p_hs, const char * key, size_t keylen)
+{
+    void *   removed_object = NULL;
+    uint64_t hash           = 0;
+    uint32_t shard          = shard_route(p_hs, key, keylen, &hash);
+    if (UINT32_MAX != shard)
+    {
+        ht_take_hashed(p_hs->shards[shard], key, keylen, hash, false, &removed_object);
+    }
+    return removed_object;
+} /* hash_shards_remove_n() */
+
+void * hash_shards_remove(hash_shards_t * p_hs, const char * key)
+{
+    if (NULL == key)
+    {
+        fprintf(stderr, "hash_shards_remove: key is NULL\n");
+        return NULL;
+    }
+    return hash_shards_remove_n(p_hs, key, strlen(key));
+} /* hash_shards_remove() */
+
+int hash_shards_delete(hash_shards_t * p_hs, const char * key)
+{
+    if (NULL == key)
+    {
+        fprintf(stderr, "hash_shards_delete: key is NULL\n");
+        return FAIL_CODE;
+    }
+    uint64_t hash   = 0;
+    size_t   keylen = strlen(key);
+    uint32_t shard  = shard_route(p_hs, key, keylen, &hash);
+    if (UINT32_MAX == shard)
+    {
+        return FAIL_CODE;
+    }
+    return ht_take_hashed(p_hs->shards[shard], key, keylen, hash, true, NULL);
+} /* hash_shards_delete() */
+
+int hash_shards_upsert_n(hash_shards_t *   p_hs,
+                         const char *      key,
+                         size_t            keylen,
+                         upsert_function * fn,
+                         void *            p_ctx)
+{
+    uint64_t hash  = 0;
+    uint32_t shard = shard_route(p_hs, key, keylen, &hash);
+    if ((UINT32_MAX == shard) || (NULL == fn))
+    {
+        return FAIL_CODE;
+    }
+    return ht_upsert_hashed(p_hs->shards[shard], key, keylen, hash, fn, p_ctx);
+} /* hash_shards_upsert_n() */
+
+int hash_shards_cas(hash_shards_t * p_hs,
+                    const char *    key,
+                    void *          expected,
+                    void *          desired)
+{
+    if (NULL == key)
+    {
+        fprintf(stderr, "hash_shards_cas: key is NULL\n");
+        return FAIL_CODE;
+    }
+    uint64_t hash   = 0;
+    size_t   keylen = strlen(key);
+    uint32_t shard  = shard_route(p_hs, key, keylen, &hash);
+    if (UINT32_MAX == shard)
+    {
+        return FAIL_CODE;
+    }
+    return ht_cas_hashed(p_hs->shards[shard], key, keylen, hash, expected, desired);
+} /* hash_shards_cas() */
+
+uint32_t hash_shards_count(const hash_shards_t * p_hs)
+{
+    return (NULL == p_hs) ? 0 : p_hs->count;
+} /* hash_shards_count() */
+
+hash_table_t * hash_shards_at(hash_shards_t * p_hs, uint32_t index)
+{
+    if ((NULL == p_hs) || (index >= p_hs->count))
+    {
+        fprintf(stderr, "hash_shards_at: no such shard\n");
+        return NULL;
+    }
+    return p_hs->shards[index];
+} /* hash_shards_at() */
+
+int hash_shards_index(hash_shards_t * p_hs, const char * key, size_t keylen)
+{
+    uint64_t hash  = 0;
+    uint32_t shard = shard_route(p_hs, key, keylen, &hash);
+    return (UINT32_MAX == shard) ? FAIL_CODE : (int)shard;
+} /* hash_shards_index() */
+
+int hash_shards_node(hash_shards_t * p_hs, uint32_t index)
+{
+    if ((NULL == p_hs) || (index >= p_hs->count))
+    {
+        return -1;
+    }
+    return p_hs->nodes[index];
+} /* hash_shards_node() */
+
+/*** end of file ***/
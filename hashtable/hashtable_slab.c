@@ -0,0 +1,231 @@
+/* @file hashtable_slab.c
+ *
+ * Entry allocator for chained tables. Each lock stripe carves fixed size
+ * entries out of large chunks and keeps freed ones on a free list. A key that
+ * fits in the entry's inline area is stored right after the entry, longer
+ * keys come from size classes bumped out of the same chunks. Nothing is
+ * returned to malloc until the table is destroyed.
+ *
+ */
+
+#include "hashtable_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SLAB_CHUNK_SIZE  16384 // bytes requested from malloc per chunk
+#define SLAB_CHUNK_HEAD  16    // chunk list link, keeps the payload 16 aligned
+#define SLAB_KEY_CLASS   32    // long keys are stored in multiples of this
+
+/**
+ * @brief Returns the first byte after the entry, where a short key is kept
+ */
+static inline char * slab_inline_key(entry * p_entry)
+{
+    return (char *)(p_entry + 1);
+} /* slab_inline_key() */
+
+static inline size_t slab_key_class(size_t keylen)
+{
+    return keylen / SLAB_KEY_CLASS; // keylen + 1 bytes round up to (class + 1) * 32
+} /* slab_key_class() */
+
+/**
+ * @brief Mallocs a chunk, links it into the slab and returns its payload
+ */
+static char * slab_chunk_new(ht_slab_t * p_slab)
+{
+    char * p_chunk = malloc(SLAB_CHUNK_SIZE);
+    if (NULL == p_chunk)
+    {
+        fprintf(stderr, "slab_chunk_new: malloc failed\n");
+        return NULL;
+    }
+    *(void **)p_chunk = p_slab->chunks;
+    p_slab->chunks    = p_chunk;
+    return p_chunk + SLAB_CHUNK_HEAD;
+} /* slab_chunk_new() */
+
+/**
+ * @brief Takes size bytes from a bump region, refilling it from a new chunk
+ * when it runs out. The tail of the previous region is abandoned.
+ */
+static void * slab_bump(ht_slab_t * p_slab, char ** pp_bump, size_t * p_left, size_t size)
+{
+    if (*p_left < size)
+    {
+        char * p_payload = slab_chunk_new(p_slab);
+        if (NULL == p_payload)
+        {
+            return NULL;
+        }
+        *pp_bump = p_payload;
+        *p_left  = SLAB_CHUNK_SIZE - SLAB_CHUNK_HEAD;
+    }
+    void * ptr = *pp_bump;
+    *pp_bump += size;
+    *p_left -= size;
+    return ptr;
+} /* slab_bump() */
+
+/**
+ * @brief Pops a block from a free list, or bumps a new one
+ */
+static void * slab_take(ht_slab_t * p_slab,
+                        void **     pp_free,
+                        char **     pp_bump,
+                        size_t *    p_left,
+                        size_t      size)
+{
+    void * ptr = *pp_free;
+    if (NULL != ptr)
+    {
+        *pp_free = *(void **)ptr;
+        return ptr;
+    }
+    return slab_bump(p_slab, pp_bump, p_left, size);
+} /* slab_take() */
+
+static inline void slab_give(void ** pp_free, void * ptr)
+{
+    *(void **)ptr = *pp_free;
+    *pp_free      = ptr;
+} /* slab_give() */
+
+int ht_slab_init(ht_slab_t * p_slab)
+{
+    memset(p_slab, 0, sizeof(*p_slab));
+    if (pthread_mutex_init(&p_slab->lock, NULL) != 0)
+    {
+        fprintf(stderr, "ht_slab_init: pthread_mutex_init failed\n");
+        return FAIL_CODE;
+    }
+    return SUCCESS_CODE;
+} /* ht_slab_init() */
+
+void ht_slab_destroy(ht_slab_t * p_slab)
+{
+    while (NULL != p_slab->chunks)
+    {
+        void * p_next = *(void **)p_slab->chunks;
+        free(p_slab->chunks);
+        p_slab->chunks = p_next;
+    }
+    pthread_mutex_destroy(&p_slab->lock);
+} /* ht_slab_destroy() */
+
+entry * ht_entry_new(hash_table_t * p_ht,
+                     const char *   p_key,
+                     size_t         keylen,
+                     uint64_t       hash)
+{
+    ht_slab_t * p_slab  = &ht_stripe_for(p_ht, hash)->slab;
+    entry *     p_entry = NULL;
+    char *      p_copy  = NULL;
+
+    pthread_mutex_lock(&p_slab->lock);
+    p_entry = slab_take(p_slab,
+                        &p_slab->free_entries,
+                        &p_slab->entry_bump,
+                        &p_slab->entry_left,
+                        p_ht->entry_size);
+    if (NULL == p_entry)
+    {
+        goto EXIT;
+    }
+    p_copy = slab_inline_key(p_entry);
+    if (keylen > p_ht->inline_key_max)
+    {
+        size_t key_class = slab_key_class(keylen);
+        p_copy           = slab_take(p_slab,
+                           &p_slab->free_keys[key_class],
+                           &p_slab->key_bump,
+                           &p_slab->key_left,
+                           (key_class + 1) * SLAB_KEY_CLASS);
+        if (NULL == p_copy)
+        {
+            slab_give(&p_slab->free_entries, p_entry);
+            p_entry = NULL;
+            goto EXIT;
+        }
+    }
+EXIT:
+    pthread_mutex_unlock(&p_slab->lock);
+    if (NULL == p_entry)
+    {
+        return NULL;
+    }
+
+    memcpy(p_copy, p_key, keylen);
+    p_copy[keylen]     = '\0';
+    p_entry->key        = p_copy;
+    p_entry->keylength  = keylen;
+    p_entry->hash       = hash;
+    p_entry->object     = NULL;
+    p_entry->next       = NULL;
+    p_entry->expires    = 0;
+    p_entry->referenced = 0;
+    return p_entry;
+} /* ht_entry_new() */
+
+entry * ht_entry_copy(hash_table_t * p_ht, const entry * p_entry)
+{
+    ht_slab_t * p_slab = &ht_stripe_for(p_ht, p_entry->hash)->slab;
+
+    pthread_mutex_lock(&p_slab->lock);
+    entry * p_copy = slab_take(p_slab,
+                               &p_slab->free_entries,
+                               &p_slab->entry_bump,
+                               &p_slab->entry_left,
+                               p_ht->entry_size);
+    pthread_mutex_unlock(&p_slab->lock);
+    if (NULL == p_copy)
+    {
+        return NULL;
+    }
+
+    // Field by field, lock-free lookups may be setting referenced meanwhile
+    p_copy->key        = p_entry->key;
+    p_copy->keylength  = p_entry->keylength;
+    p_copy->hash       = p_entry->hash;
+    p_copy->object     = p_entry->object;
+    p_copy->next       = p_entry->next;
+    p_copy->expires    = p_entry->expires;
+    p_copy->referenced = __atomic_load_n(&p_entry->referenced, __ATOMIC_RELAXED);
+    if (p_entry->keylength <= p_ht->inline_key_max)
+    {
+        p_copy->key = slab_inline_key(p_copy);
+        memcpy(p_copy->key, p_entry->key, p_entry->keylength + 1);
+    }
+    return p_copy;
+} /* ht_entry_copy() */
+
+size_t ht_entry_bytes(const hash_table_t * p_ht, size_t keylen)
+{
+    if (keylen > p_ht->inline_key_max)
+    {
+        return p_ht->entry_size + ((slab_key_class(keylen) + 1) * SLAB_KEY_CLASS);
+    }
+    return p_ht->entry_size;
+} /* ht_entry_bytes() */
+
+void ht_entry_release(hash_table_t * p_ht, entry * p_entry)
+{
+    ht_slab_t * p_slab = &ht_stripe_for(p_ht, p_entry->hash)->slab;
+    pthread_mutex_lock(&p_slab->lock);
+    slab_give(&p_slab->free_entries, p_entry);
+    pthread_mutex_unlock(&p_slab->lock);
+} /* ht_entry_release() */
+
+void ht_entry_free(hash_table_t * p_ht, entry * p_entry)
+{
+    ht_slab_t * p_slab = &ht_stripe_for(p_ht, p_entry->hash)->slab;
+    pthread_mutex_lock(&p_slab->lock);
+    if (p_entry->keylength > p_ht->inline_key_max)
+    {
+        slab_give(&p_slab->free_keys[slab_key_class(p_entry->keylength)], p_entry->key);
+    }
+    slab_give(&p_slab->free_entries, p_entry);
+    pthread_mutex_unlock(&p_slab->lock);
+} /* ht_entry_free() */
+
+/*** end of file ***/
@@ -0,0 +1,1056 @@
+/* @file hashtable_snapshot.c
+ *
+ * Binary snapshots of a hash table. The file is laid out so that it can be
+ * mapped and searched in place:
+ *
+ *   header     snap_header_t, fixed size
+ *   index      bucket_count + 1 record numbers, bucket b owns the records
+ *              [index[b], index[b + 1])
+ *   records    snap_record_t per entry, grouped by bucket
+ *   keys       every key followed by a null byte, padded to 8 bytes
+ *   values     encoded objects, each starting on an 8 byte boundary
+ *   trailer    snap_trailer_t with the checksum of everything in between
+ *
+ * Buckets use the built-in hash with a seed stored in the header, so a
+ * snapshot can be read back whatever hash function the table was using.
+ * Integers are stored in host byte order and the magic number rejects files
+ * written with the other one.
+ *
+ * A background dump forks while every stripe is held. The child writes the
+ * snapshot from its copy-on-write image of the table while the parent goes
+ * on serving requests, and a thread in the parent reaps the child and
+ * installs the file.
+ *
+ */
+
+#include "hashtable_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SNAP_MAGIC          0x3150414e53544841ULL // "AHTSNAP1" read as little endian
+#define SNAP_VERSION        1
+#define SNAP_ALIGN          8
+#define SNAP_CHECKSUM_BLOCK 65536 // bytes hashed per step of the checksum chain
+#define SNAP_MIN_BUCKETS    16
+#define SNAP_PROGRESS_STEP  4096 // entries written between progress updates
+
+typedef struct snap_header
+{
+    uint64_t magic;        // SNAP_MAGIC
+    uint32_t version;      // SNAP_VERSION
+    uint32_t header_size;  // sizeof(snap_header_t)
+    uint64_t seed;         // seed of the built-in hash used for bucket selection
+    uint64_t entry_count;  // number of records
+    uint64_t bucket_count; // power of two
+    uint64_t key_bytes;    // size of the key blob before padding
+    uint64_t value_bytes;  // size of the value blob, a multiple of SNAP_ALIGN
+    uint64_t wal_lsn;      // last log record the snapshot holds, 0 without a log
+    uint64_t header_sum;   // checksum of the fields above
+} snap_header_t;
+
+typedef struct snap_record
+{
+    uint64_t hash;         // built-in hash of the key with the header's seed
+    uint64_t key_offset;   // into the key blob
+    uint64_t value_offset; // into the value blob
+    uint32_t key_length;
+    uint32_t value_length;
+} snap_record_t;
+
+typedef struct snap_trailer
+{
+    uint64_t body_sum; // checksum from the end of the header to the trailer
+    uint64_t magic;    // SNAP_MAGIC, a truncated file has no trailer
+} snap_trailer_t;
+
+/**
+ * @brief progress of a background dump, mapped shared so the child can
+ * report it to the parent
+ */
+typedef struct snap_counters
+{
+    _Atomic uint64_t entries_total;
+    _Atomic uint64_t entries_written;
+    _Atomic uint64_t bytes_written;
+    _Atomic uint32_t finished; // set by the child once the file is synced
+} snap_counters_t;
+
+struct ht_bgsave
+{
+    pthread_mutex_t   lock;        // guards every field below
+    pthread_t         thread;      // reaps the child of the last dump
+    bool              joinable;    // thread has not been joined yet
+    ht_dump_state_t   state;
+    pid_t             pid;         // child writing the running dump
+    hash_table_t *    p_ht;
+    char *            p_path;      // name the running dump is renamed to
+    char *            p_tmp;       // file the child writes
+    uint64_t          wal_lsn;     // last log record the running dump holds
+    struct timespec   started;
+    uint64_t          pause_us;    // writers were held for the fork
+    uint64_t          duration_us; // of the last finished dump
+    snap_counters_t * p_counters;  // shared with the child while it runs
+    snap_counters_t   last;        // copy of p_counters once the child is done
+};
+
+struct ht_snapshot
+{
+    const uint8_t *       p_map; // whole file
+    size_t                map_size;
+    const snap_header_t * p_header;
+    const uint64_t *      p_index;
+    const snap_record_t * p_records;
+    const char *          p_keys;
+    const uint8_t *       p_values;
+};
+
+static inline size_t snap_align(size_t len)
+{
+    return (len + SNAP_ALIGN - 1) & ~(size_t)(SNAP_ALIGN - 1);
+} /* snap_align() */
+
+/**
+ * @brief Computes where each section starts from the header
+ * @return size_t total size the file must have
+ */
+static size_t snap_layout(const snap_header_t * p_header,
+                          size_t *              p_records_at,
+                          size_t *              p_keys_at,
+                          size_t *              p_values_at)
+{
+    size_t index_at = sizeof(snap_header_t);
+    *p_records_at   = index_at + ((p_header->bucket_count + 1) * sizeof(uint64_t));
+    *p_keys_at      = *p_records_at + (p_header->entry_count * sizeof(snap_record_t));
+    *p_values_at    = *p_keys_at + snap_align(p_header->key_bytes);
+    return *p_values_at + p_header->value_bytes + sizeof(snap_trailer_t);
+} /* snap_layout() */
+
+static uint64_t snap_header_sum(const snap_header_t * p_header)
+{
+    return hash_function_seeded(
+        (const char *)p_header, offsetof(snap_header_t, header_sum), SNAP_MAGIC);
+} /* snap_header_sum() */
+
+/**
+ * @brief Buffers writes so the checksum can be chained over fixed blocks,
+ * which the reader recomputes over the mapping with the same block size
+ */
+typedef struct snap_writer
+{
+    FILE *            fp;
+    uint64_t          sum;
+    size_t            used;
+    int               error;
+    snap_counters_t * p_counters; // background dumps only
+    uint8_t           buf[SNAP_CHECKSUM_BLOCK];
+} snap_writer_t;
+
+static void snap_flush(snap_writer_t * p_writer)
+{
+    if (0 == p_writer->used)
+    {
+        return;
+    }
+    p_writer->sum = hash_function_seeded(
+        (const char *)p_writer->buf, p_writer->used, p_writer->sum);
+    if (p_writer->used != fwrite(p_writer->buf, 1, p_writer->used, p_writer->fp))
+    {
+        p_writer->error = 1;
+    }
+    if (NULL != p_writer->p_counters)
+    {
+        atomic_fetch_add(&p_writer->p_counters->bytes_written, p_writer->used);
+    }
+    p_writer->used = 0;
+} /* snap_flush() */
+
+static void snap_write(snap_writer_t * p_writer, const void * p_data, size_t len)
+{
+    const uint8_t * p_bytes = p_data;
+    while (0 < len)
+    {
+        size_t room  = SNAP_CHECKSUM_BLOCK - p_writer->used;
+        size_t chunk = (len < room) ? len : room;
+        memcpy(p_writer->buf + p_writer->used, p_bytes, chunk);
+        p_writer->used += chunk;
+        p_bytes += chunk;
+        len -= chunk;
+        if (SNAP_CHECKSUM_BLOCK == p_writer->used)
+        {
+            snap_flush(p_writer);
+        }
+    }
+} /* snap_write() */
+
+static void snap_pad(snap_writer_t * p_writer, size_t written)
+{
+    static const uint8_t zeros[SNAP_ALIGN] = { 0 };
+    snap_write(p_writer, zeros, snap_align(written) - written);
+} /* snap_pad() */
+
+/**
+ * @brief Chains the checksum over a mapped range the way snap_writer_t does
+ */
+static uint64_t snap_checksum(const uint8_t * p_data, size_t len)
+{
+    uint64_t sum = 0;
+    while (0 < len)
+    {
+        size_t chunk = (len < SNAP_CHECKSUM_BLOCK) ? len : SNAP_CHECKSUM_BLOCK;
+        sum          = hash_function_seeded((const char *)p_data, chunk, sum);
+        p_data += chunk;
+        len -= chunk;
+    }
+    return sum;
+} /* snap_checksum() */
+
+/**
+ * @brief Collects every entry of the table while it is locked
+ */
+typedef struct snap_collect
+{
+    entry ** pp_entries;
+    size_t   count;
+    size_t   capacity;
+    uint64_t          wal_lsn;    // log position of the table when it was collected
+    snap_counters_t * p_counters; // background dumps: progress for the parent
+} snap_collect_t;
+
+static int snap_collect_visit(entry * p_entry, void * p_ctx)
+{
+    snap_collect_t * p_collect = p_ctx;
+    if (p_collect->count == p_collect->capacity)
+    {
+        size_t   capacity = (0 == p_collect->capacity) ? 1024 : p_collect->capacity * 2;
+        entry ** pp_grown = realloc(p_collect->pp_entries, capacity * sizeof(entry *));
+        if (NULL == pp_grown)
+        {
+            fprintf(stderr, "snap_collect_visit: realloc failed\n");
+            return FAIL_CODE;
+        }
+        p_collect->pp_entries = pp_grown;
+        p_collect->capacity   = capacity;
+    }
+    p_collect->pp_entries[p_collect->count++] = p_entry;
+    return SUCCESS_CODE;
+} /* snap_collect_visit() */
+
+/**
+ * @brief Writes the snapshot of entries already collected from a held table
+ */
+static int snap_write_entries(FILE * fp, hash_table_t * p_ht, snap_collect_t * p_collect)
+{
+    int             ret_code  = FAIL_CODE;
+    size_t          count     = p_collect->count;
+    snap_header_t   header    = { 0 };
+    snap_record_t * p_records = NULL;
+    entry **        pp_sorted = NULL;
+    uint64_t *      p_hashes  = NULL;
+    uint64_t *      p_index   = NULL;
+    uint64_t *      p_cursor  = NULL;
+    uint8_t *       p_value   = NULL;
+    size_t          value_cap = 0;
+    snap_writer_t * p_writer  = NULL;
+
+    header.magic        = SNAP_MAGIC;
+    header.version      = SNAP_VERSION;
+    header.header_size  = sizeof(snap_header_t);
+    header.seed         = hash_table_seed();
+    header.entry_count  = count;
+    if (NULL != p_collect->p_counters)
+    {
+        atomic_store(&p_collect->p_counters->entries_total, count);
+    }
+    header.wal_lsn      = p_collect->wal_lsn;
+    header.bucket_count = SNAP_MIN_BUCKETS;
+    while (header.bucket_count < count)
+    {
+        header.bucket_count <<= 1;
+    }
+
+    p_records = malloc((count + 1) * sizeof(snap_record_t));
+    pp_sorted = malloc((count + 1) * sizeof(entry *));
+    p_hashes  = malloc((count + 1) * sizeof(uint64_t));
+    p_index   = calloc(header.bucket_count + 1, sizeof(uint64_t));
+    p_cursor  = malloc(header.bucket_count * sizeof(uint64_t));
+    p_writer  = malloc(sizeof(snap_writer_t));
+    if ((NULL == p_records) || (NULL == pp_sorted) || (NULL == p_hashes) ||
+        (NULL == p_index) || (NULL == p_cursor) || (NULL == p_writer))
+    {
+        fprintf(stderr, "write_hash_to_file: malloc failed\n");
+        goto EXIT;
+    }
+
+    // Counting sort by bucket, p_index[b + 1] first counts bucket b
+    uint64_t bucket_mask = header.bucket_count - 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        entry * p_entry = p_collect->pp_entries[i];
+        p_hashes[i] = hash_function_seeded(p_entry->key, p_entry->keylength, header.seed);
+        p_index[(ht_mix(p_hashes[i]) & bucket_mask) + 1]++;
+    }
+    for (uint64_t b = 0; b < header.bucket_count; b++)
+    {
+        p_index[b + 1] += p_index[b];
+        p_cursor[b] = p_index[b];
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t slot        = p_cursor[ht_mix(p_hashes[i]) & bucket_mask]++;
+        pp_sorted[slot]      = p_collect->pp_entries[i];
+        p_records[slot].hash = p_hashes[i];
+    }
+
+    // Offsets of every key and value, in record order
+    for (size_t i = 0; i < count; i++)
+    {
+        entry * p_entry = pp_sorted[i];
+        size_t  len     = p_ht->encode(p_entry->object, NULL, 0);
+        if (UINT32_MAX < len)
+        {
+            fprintf(stderr, "write_hash_to_file: value too large\n");
+            goto EXIT;
+        }
+        p_records[i].key_offset   = header.key_bytes;
+        p_records[i].key_length   = (uint32_t)p_entry->keylength;
+        p_records[i].value_offset = header.value_bytes;
+        p_records[i].value_length = (uint32_t)len;
+        header.key_bytes += p_entry->keylength + 1;
+        header.value_bytes += snap_align(len);
+        if (value_cap < len)
+        {
+            value_cap = len;
+        }
+    }
+    header.header_sum = snap_header_sum(&header);
+
+    p_value = malloc(value_cap + 1);
+    if (NULL == p_value)
+    {
+        fprintf(stderr, "write_hash_to_file: malloc failed\n");
+        goto EXIT;
+    }
+    if (1 != fwrite(&header, sizeof(header), 1, fp))
+    {
+        fprintf(stderr, "write_hash_to_file: fwrite failed\n");
+        goto EXIT;
+    }
+
+    memset(p_writer, 0, offsetof(snap_writer_t, buf));
+    p_writer->fp         = fp;
+    p_writer->p_counters = p_collect->p_counters;
+    snap_write(p_writer, p_index, (header.bucket_count + 1) * sizeof(uint64_t));
+    snap_write(p_writer, p_records, count * sizeof(snap_record_t));
+    for (size_t i = 0; i < count; i++)
+    {
+        snap_write(p_writer, pp_sorted[i]->key, pp_sorted[i]->keylength + 1);
+    }
+    snap_pad(p_writer, header.key_bytes);
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t len = p_records[i].value_length;
+        if (len != p_ht->encode(pp_sorted[i]->object, p_value, len))
+        {
+            fprintf(stderr, "write_hash_to_file: encode changed size\n");
+            goto EXIT;
+        }
+        snap_write(p_writer, p_value, len);
+        snap_pad(p_writer, len);
+        if ((NULL != p_collect->p_counters) && (0 == (i + 1) % SNAP_PROGRESS_STEP))
+        {
+            atomic_store(&p_collect->p_counters->entries_written, i + 1);
+        }
+    }
+    snap_flush(p_writer);
+    if (NULL != p_collect->p_counters)
+    {
+        atomic_store(&p_collect->p_counters->entries_written, count);
+    }
+
+    snap_trailer_t trailer = { .body_sum = p_writer->sum, .magic = SNAP_MAGIC };
+    if ((0 != p_writer->error) || (1 != fwrite(&trailer, sizeof(trailer), 1, fp)) ||
+        (0 != fflush(fp)))
+    {
+        fprintf(stderr, "write_hash_to_file: fwrite failed\n");
+        goto EXIT;
+    }
+    ret_code = SUCCESS_CODE;
+EXIT:
+    free(p_writer);
+    free(p_value);
+    free(p_cursor);
+    free(p_index);
+    free(p_hashes);
+    free(pp_sorted);
+    free(p_records);
+    return ret_code;
+} /* snap_write_entries() */
+
+/**
+ * @brief Writes a snapshot and reports the last log record it holds
+ */
+static int snap_write_table(FILE * fp, hash_table_t * p_ht, uint64_t * p_wal_lsn)
+{
+    int            ret_code = FAIL_CODE;
+    snap_collect_t collect  = { 0 };
+    if ((NULL == fp) || (NULL == p_ht))
+    {
+        fprintf(stderr, "write_hash_to_file: fp or p_ht is NULL\n");
+        goto EXIT;
+    }
+    if (NULL == p_ht->encode)
+    {
+        fprintf(stderr, "write_hash_to_file: table has no encode function\n");
+        goto EXIT;
+    }
+
+    ht_lock_all(p_ht, false);
+    // Writers log while holding their stripe, so none is between its log
+    // record and its change to the table now
+    if (NULL != p_ht->wal)
+    {
+        collect.wal_lsn = ht_wal_mark(p_ht->wal);
+    }
+    if (SUCCESS_CODE == ht_walk(p_ht, snap_collect_visit, &collect))
+    {
+        ret_code = snap_write_entries(fp, p_ht, &collect);
+    }
+    ht_unlock_all(p_ht);
+    free(collect.pp_entries);
+    *p_wal_lsn = collect.wal_lsn;
+EXIT:
+    return ret_code;
+} /* snap_write_table() */
+
+int write_hash_to_file(FILE * fp, hash_table_t * p_ht)
+{
+    uint64_t wal_lsn = 0;
+    return snap_write_table(fp, p_ht, &wal_lsn);
+} /* write_hash_to_file() */
+
+/**
+ * @brief Returns name with ".tmp" appended, to free with free()
+ */
+static char * snap_tmp_path(const char * name)
+{
+    size_t name_len = strlen(name);
+    char * p_tmp    = malloc(name_len + sizeof(".tmp"));
+    if (NULL == p_tmp)
+    {
+        fprintf(stderr, "dump_keys_to_file: malloc failed\n");
+        return NULL;
+    }
+    memcpy(p_tmp, name, name_len);
+    memcpy(p_tmp + name_len, ".tmp", sizeof(".tmp"));
+    return p_tmp;
+} /* snap_tmp_path() */
+
+/**
+ * @brief Renames a synced snapshot into place and drops the log records it
+ * holds. A failed checkpoint just leaves records that replay skips. The
+ * checkpoint copies the rest of the log without holding it, so running it
+ * from the reaper of a background dump does not stall the table's writers.
+ */
+static int snap_install(hash_table_t * p_ht,
+                        const char *   p_tmp,
+                        const char *   dump_file_name,
+                        uint64_t       wal_lsn)
+{
+    if (0 != rename(p_tmp, dump_file_name))
+    {
+        fprintf(stderr, "dump_keys_to_file: rename failed\n");
+        unlink(p_tmp);
+        return FAIL_CODE;
+    }
+    if ((NULL != p_ht->wal) && (SUCCESS_CODE != ht_wal_checkpoint(p_ht->wal, wal_lsn)))
+    {
+        fprintf(stderr, "dump_keys_to_file: ht_wal_checkpoint failed\n");
+    }
+    return SUCCESS_CODE;
+} /* snap_install() */
+
+static uint64_t snap_elapsed_us(const struct timespec * p_since)
+{
+    struct timespec now = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - p_since->tv_sec) * 1000000 +
+           (uint64_t)((now.tv_nsec - p_since->tv_nsec) / 1000);
+} /* snap_elapsed_us() */
+
+/**
+ * @brief Body of the forked child. The table it sees is frozen at the fork,
+ * so it is walked without locks. Never returns.
+ */
+static void snap_bgsave_child(ht_bgsave_t * p_save)
+{
+    int            ok      = 0;
+    snap_collect_t collect = { .wal_lsn = p_save->wal_lsn };
+    FILE *         fp      = fopen(p_save->p_tmp, "wb");
+    collect.p_counters     = p_save->p_counters;
+    if ((NULL != fp) &&
+        (SUCCESS_CODE == ht_walk(p_save->p_ht, snap_collect_visit, &collect)) &&
+        (SUCCESS_CODE == snap_write_entries(fp, p_save->p_ht, &collect)) &&
+        (0 == fsync(fileno(fp))))
+    {
+        ok = 1;
+    }
+    if ((NULL != fp) && (0 != fclose(fp)))
+    {
+        ok = 0;
+    }
+    atomic_store(&p_save->p_counters->finished, ok);
+    _exit(ok ? 0 : 1);
+} /* snap_bgsave_child() */
+
+/**
+ * @brief Waits for the child of a background dump, installs its file and
+ * records how the dump went
+ */
+static void * snap_bgsave_reap(void * arg)
+{
+    ht_bgsave_t * p_save = arg;
+    int           status = 0;
+    while ((0 > waitpid(p_save->pid, &status, 0)) && (EINTR == errno))
+    {
+    }
+    // The child's own flag, so a process that reaps children itself or
+    // ignores SIGCHLD still gets the right answer here
+    bool ok = (1 == atomic_load(&p_save->p_counters->finished));
+    if (!ok)
+    {
+        fprintf(stderr, "dump_keys_to_file: background dump failed\n");
+        unlink(p_save->p_tmp);
+    }
+    else
+    {
+        ok = (SUCCESS_CODE ==
+              snap_install(p_save->p_ht, p_save->p_tmp, p_save->p_path, p_save->wal_lsn));
+    }
+
+    pthread_mutex_lock(&p_save->lock);
+    snap_counters_t * p_counters = p_save->p_counters;
+    atomic_init(&p_save->last.entries_total, atomic_load(&p_counters->entries_total));
+    atomic_init(&p_save->last.entries_written, atomic_load(&p_counters->entries_written));
+    atomic_init(&p_save->last.bytes_written, atomic_load(&p_counters->bytes_written));
+    munmap(p_save->p_counters, sizeof(snap_counters_t));
+    p_save->p_counters  = NULL;
+    p_save->duration_us = snap_elapsed_us(&p_save->started);
+    p_save->state       = ok ? HT_DUMP_DONE : HT_DUMP_FAILED;
+    free(p_save->p_tmp);
+    free(p_save->p_path);
+    p_save->p_tmp  = NULL;
+    p_save->p_path = NULL;
+    pthread_mutex_unlock(&p_save->lock);
+    return NULL;
+} /* snap_bgsave_reap() */
+
+/**
+ * @brief Forks a child that writes the snapshot and starts a thread that
+ * waits for it. Writers are only held while the fork copies the page tables.
+ */
+static int snap_bgsave_start(char * dump_file_name, hash_table_t * p_ht)
+{
+    int           ret_code = FAIL_CODE;
+    ht_bgsave_t * p_save   = p_ht->bgsave;
+    bool          reap_now = false;
+
+    pthread_mutex_lock(&p_save->lock);
+    if (HT_DUMP_RUNNING == p_save->state)
+    {
+        fprintf(stderr, "dump_keys_to_file: a background dump is already running\n");
+        goto EXIT;
+    }
+    if (p_save->joinable)
+    {
+        pthread_join(p_save->thread, NULL);
+        p_save->joinable = false;
+    }
+    p_save->p_tmp  = snap_tmp_path(dump_file_name);
+    p_save->p_path = ht_key_dup(dump_file_name, strlen(dump_file_name));
+    if ((NULL == p_save->p_tmp) || (NULL == p_save->p_path))
+    {
+        fprintf(stderr, "dump_keys_to_file: malloc failed\n");
+        goto ERR;
+    }
+    p_save->p_counters = mmap(NULL,
+                              sizeof(snap_counters_t),
+                              PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS,
+                              -1,
+                              0);
+    if (MAP_FAILED == p_save->p_counters)
+    {
+        p_save->p_counters = NULL;
+        fprintf(stderr, "dump_keys_to_file: mmap failed\n");
+        goto ERR;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &p_save->started);
+    ht_lock_all(p_ht, false);
+    // No writer is part way through a change, so the child's copy is a
+    // consistent point in time that matches this log position
+    p_save->wal_lsn = (NULL == p_ht->wal) ? 0 : ht_wal_mark(p_ht->wal);
+    pid_t pid       = fork();
+    if (0 == pid)
+    {
+        snap_bgsave_child(p_save);
+    }
+    ht_unlock_all(p_ht);
+    p_save->pause_us = snap_elapsed_us(&p_save->started);
+    if (0 > pid)
+    {
+        fprintf(stderr, "dump_keys_to_file: fork failed\n");
+        goto ERR;
+    }
+
+    p_save->pid   = pid;
+    p_save->state = HT_DUMP_RUNNING;
+    if (0 == pthread_create(&p_save->thread, NULL, snap_bgsave_reap, p_save))
+    {
+        p_save->joinable = true;
+    }
+    else
+    {
+        fprintf(stderr, "dump_keys_to_file: pthread_create failed, waiting here\n");
+        reap_now = true;
+    }
+    ret_code = SUCCESS_CODE;
+    goto EXIT;
+
+ERR:
+    if (NULL != p_save->p_counters)
+    {
+        munmap(p_save->p_counters, sizeof(snap_counters_t));
+        p_save->p_counters = NULL;
+    }
+    free(p_save->p_tmp);
+    free(p_save->p_path);
+    p_save->p_tmp  = NULL;
+    p_save->p_path = NULL;
+EXIT:
+    pthread_mutex_unlock(&p_save->lock);
+    if (reap_now)
+    {
+        snap_bgsave_reap(p_save);
+    }
+    return ret_code;
+} /* snap_bgsave_start() */
+
+int dump_keys_to_file_ex(char * dump_file_name, hash_table_t * p_ht, int flags)
+{
+    int      ret_code = FAIL_CODE;
+    char *   p_tmp    = NULL;
+    FILE *   fp       = NULL;
+    uint64_t wal_lsn  = 0;
+    if ((NULL == dump_file_name) || (NULL == p_ht))
+    {
+        fprintf(stderr, "dump_keys_to_file: dump_file_name or p_ht is NULL\n");
+        goto EXIT;
+    }
+    if (NULL == p_ht->encode)
+    {
+        fprintf(stderr, "dump_keys_to_file: table has no encode function\n");
+        goto EXIT;
+    }
+    if (HT_DUMP_BACKGROUND & flags)
+    {
+        ret_code = snap_bgsave_start(dump_file_name, p_ht);
+        goto EXIT;
+    }
+
+    p_tmp = snap_tmp_path(dump_file_name);
+    if (NULL == p_tmp)
+    {
+        goto EXIT;
+    }
+    fp = fopen(p_tmp, "wb");
+    if (NULL == fp)
+    {
+        fprintf(stderr, "dump_keys_to_file: fopen failed\n");
+        goto EXIT;
+    }
+    if ((SUCCESS_CODE != snap_write_table(fp, p_ht, &wal_lsn)) ||
+        (0 != fsync(fileno(fp))))
+    {
+        fprintf(stderr, "dump_keys_to_file: write_hash_to_file failed\n");
+        goto ERR;
+    }
+    if (0 != fclose(fp))
+    {
+        fp = NULL;
+        fprintf(stderr, "dump_keys_to_file: fclose failed\n");
+        goto ERR;
+    }
+    fp       = NULL;
+    ret_code = snap_install(p_ht, p_tmp, dump_file_name, wal_lsn);
+    goto EXIT;
+
+ERR:
+    if (NULL != fp)
+    {
+        fclose(fp);
+        fp = NULL;
+    }
+    unlink(p_tmp);
+EXIT:
+    free(p_tmp);
+    return ret_code;
+} /* dump_keys_to_file_ex() */
+
+int dump_keys_to_file(char * dump_file_name, hash_table_t * p_ht)
+{
+    return dump_keys_to_file_ex(dump_file_name, p_ht, 0);
+} /* dump_keys_to_file() */
+
+int hash_table_dump_progress(hash_table_t * p_ht, ht_dump_progress_t * p_progress)
+{
+    if ((NULL == p_ht) || (NULL == p_progress))
+    {
+        fprintf(stderr, "hash_table_dump_progress: p_ht or p_progress is NULL\n");
+        return FAIL_CODE;
+    }
+    ht_bgsave_t * p_save = p_ht->bgsave;
+    pthread_mutex_lock(&p_save->lock);
+    const snap_counters_t * p_counters = &p_save->last;
+    p_progress->duration_us            = p_save->duration_us;
+    if (HT_DUMP_RUNNING == p_save->state)
+    {
+        p_counters              = p_save->p_counters;
+        p_progress->duration_us = snap_elapsed_us(&p_save->started);
+    }
+    p_progress->state           = p_save->state;
+    p_progress->entries_total   = atomic_load(&p_counters->entries_total);
+    p_progress->entries_written = atomic_load(&p_counters->entries_written);
+    p_progress->bytes_written   = atomic_load(&p_counters->bytes_written);
+    p_progress->pause_us        = p_save->pause_us;
+    pthread_mutex_unlock(&p_save->lock);
+    return SUCCESS_CODE;
+} /* hash_table_dump_progress() */
+
+int hash_table_dump_wait(hash_table_t * p_ht)
+{
+    if (NULL == p_ht)
+    {
+        fprintf(stderr, "hash_table_dump_wait: p_ht is NULL\n");
+        return FAIL_CODE;
+    }
+    ht_bgsave_t * p_save = p_ht->bgsave;
+    pthread_mutex_lock(&p_save->lock);
+    bool      join   = p_save->joinable;
+    pthread_t thread = p_save->thread;
+    p_save->joinable = false;
+    pthread_mutex_unlock(&p_save->lock);
+    if (join)
+    {
+        pthread_join(thread, NULL);
+    }
+
+    pthread_mutex_lock(&p_save->lock);
+    int ret_code = (HT_DUMP_FAILED == p_save->state) ? FAIL_CODE : SUCCESS_CODE;
+    pthread_mutex_unlock(&p_save->lock);
+    return ret_code;
+} /* hash_table_dump_wait() */
+
+ht_bgsave_t * ht_bgsave_new(hash_table_t * p_ht)
+{
+    ht_bgsave_t * p_save = calloc(1, sizeof(ht_bgsave_t));
+    if (NULL == p_save)
+    {
+        fprintf(stderr, "ht_bgsave_new: calloc failed\n");
+        return NULL;
+    }
+    if (0 != pthread_mutex_init(&p_save->lock, NULL))
+    {
+        fprintf(stderr, "ht_bgsave_new: pthread_mutex_init failed\n");
+        free(p_save);
+        return NULL;
+    }
+    p_save->p_ht  = p_ht;
+    p_save->state = HT_DUMP_IDLE;
+    return p_save;
+} /* ht_bgsave_new() */
+
+void ht_bgsave_free(ht_bgsave_t * p_save)
+{
+    if (NULL == p_save)
+    {
+        return;
+    }
+    hash_table_dump_wait(p_save->p_ht);
+    pthread_mutex_destroy(&p_save->lock);
+    free(p_save);
+} /* ht_bgsave_free() */
+
+/**
+ * @brief Maps an open snapshot file and checks its header and trailer
+ */
+static ht_snapshot_t * snap_map(int fd, int flags)
+{
+    ht_snapshot_t * p_snap = NULL;
+    void *          p_map  = MAP_FAILED;
+    struct stat     info   = { 0 };
+
+    if ((0 != fstat(fd, &info)) || !S_ISREG(info.st_mode))
+    {
+        fprintf(stderr, "hash_table_snapshot_open: not a regular file\n");
+        goto EXIT;
+    }
+    size_t map_size = (size_t)info.st_size;
+    if (map_size < sizeof(snap_header_t) + sizeof(snap_trailer_t))
+    {
+        fprintf(stderr, "hash_table_snapshot_open: file too short\n");
+        goto EXIT;
+    }
+    p_map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == p_map)
+    {
+        fprintf(stderr, "hash_table_snapshot_open: mmap failed\n");
+        goto EXIT;
+    }
+
+    const snap_header_t * p_header = p_map;
+    if ((SNAP_MAGIC != p_header->magic) || (SNAP_VERSION != p_header->version) ||
+        (sizeof(snap_header_t) != p_header->header_size) ||
+        (snap_header_sum(p_header) != p_header->header_sum))
+    {
+        fprintf(stderr, "hash_table_snapshot_open: bad header\n");
+        goto ERR;
+    }
+    // Bound every count before computing offsets so the sums cannot wrap
+    if ((p_header->bucket_count < SNAP_MIN_BUCKETS) ||
+        (0 != (p_header->bucket_count & (p_header->bucket_count - 1))) ||
+        (p_header->bucket_count > map_size) || (p_header->entry_count > map_size) ||
+        (p_header->key_bytes > map_size) || (p_header->value_bytes > map_size))
+    {
+        fprintf(stderr, "hash_table_snapshot_open: bad header\n");
+        goto ERR;
+    }
+    size_t records_at = 0;
+    size_t keys_at    = 0;
+    size_t values_at  = 0;
+    if (map_size != snap_layout(p_header, &records_at, &keys_at, &values_at))
+    {
+        fprintf(stderr, "hash_table_snapshot_open: size does not match header\n");
+        goto ERR;
+    }
+    const uint8_t *        p_bytes   = p_map;
+    const snap_trailer_t * p_trailer =
+        (const snap_trailer_t *)(p_bytes + map_size - sizeof(snap_trailer_t));
+    if (SNAP_MAGIC != p_trailer->magic)
+    {
+        fprintf(stderr, "hash_table_snapshot_open: missing trailer\n");
+        goto ERR;
+    }
+    if ((HT_SNAP_VERIFY & flags) &&
+        (p_trailer->body_sum !=
+         snap_checksum(p_bytes + sizeof(snap_header_t),
+                       map_size - sizeof(snap_header_t) - sizeof(snap_trailer_t))))
+    {
+        fprintf(stderr, "hash_table_snapshot_open: checksum mismatch\n");
+        goto ERR;
+    }
+
+    p_snap = calloc(1, sizeof(ht_snapshot_t));
+    if (NULL == p_snap)
+    {
+        fprintf(stderr, "hash_table_snapshot_open: calloc failed\n");
+        goto ERR;
+    }
+    // Lookups touch a few scattered pages each, read-ahead would only waste IO
+    madvise(p_map, map_size, MADV_RANDOM);
+    p_snap->p_map     = p_map;
+    p_snap->map_size  = map_size;
+    p_snap->p_header  = p_header;
+    p_snap->p_index   = (const uint64_t *)(p_snap->p_map + sizeof(snap_header_t));
+    p_snap->p_records = (const snap_record_t *)(p_snap->p_map + records_at);
+    p_snap->p_keys    = (const char *)(p_snap->p_map + keys_at);
+    p_snap->p_values  = p_snap->p_map + values_at;
+    goto EXIT;
+
+ERR:
+    munmap(p_map, map_size);
+EXIT:
+    return p_snap;
+} /* snap_map() */
+
+ht_snapshot_t * hash_table_snapshot_open(const char * path, int flags)
+{
+    ht_snapshot_t * p_snap = NULL;
+    if (NULL == path)
+    {
+        fprintf(stderr, "hash_table_snapshot_open: path is NULL\n");
+        goto EXIT;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (0 > fd)
+    {
+        fprintf(stderr, "hash_table_snapshot_open: open failed\n");
+        goto EXIT;
+    }
+    // The mapping keeps the file alive on its own
+    p_snap = snap_map(fd, flags);
+    close(fd);
+EXIT:
+    return p_snap;
+} /* hash_table_snapshot_open() */
+
+/**
+ * @brief Returns the record at index if its key and value lie inside the
+ * mapping. Only the header was checked at open, so every record is checked
+ * when it is used.
+ */
+static const snap_record_t * snap_record(const ht_snapshot_t * p_snap, uint64_t index)
+{
+    const snap_header_t * p_header = p_snap->p_header;
+    const snap_record_t * p_record = &p_snap->p_records[index];
+    if ((p_record->key_offset >= p_header->key_bytes) ||
+        (p_record->key_length >= p_header->key_bytes - p_record->key_offset) ||
+        (p_record->value_offset > p_header->value_bytes) ||
+        (p_record->value_length > p_header->value_bytes - p_record->value_offset))
+    {
+        return NULL;
+    }
+    return p_record;
+} /* snap_record() */
+
+const void * hash_table_snapshot_lookup(const ht_snapshot_t * p_snap,
+                                        const char *          key,
+                                        size_t                keylen,
+                                        size_t *              p_len)
+{
+    if ((NULL == p_snap) || (NULL == key))
+    {
+        fprintf(stderr, "hash_table_snapshot_lookup: p_snap or key is NULL\n");
+        return NULL;
+    }
+
+    const snap_header_t * p_header = p_snap->p_header;
+    uint64_t              hash     = hash_function_seeded(key, keylen, p_header->seed);
+    uint64_t              bucket   = ht_mix(hash) & (p_header->bucket_count - 1);
+    uint64_t              first    = p_snap->p_index[bucket];
+    uint64_t              last     = p_snap->p_index[bucket + 1];
+    if ((first > last) || (last > p_header->entry_count))
+    {
+        fprintf(stderr, "hash_table_snapshot_lookup: corrupt index\n");
+        return NULL;
+    }
+
+    for (uint64_t i = first; i < last; i++)
+    {
+        const snap_record_t * p_record = &p_snap->p_records[i];
+        if ((p_record->hash != hash) || (p_record->key_length != keylen))
+        {
+            continue;
+        }
+        p_record = snap_record(p_snap, i);
+        if ((NULL != p_record) &&
+            (0 == memcmp(p_snap->p_keys + p_record->key_offset, key, keylen)))
+        {
+            if (NULL != p_len)
+            {
+                *p_len = p_record->value_length;
+            }
+            return p_snap->p_values + p_record->value_offset;
+        }
+    }
+    return NULL;
+} /* hash_table_snapshot_lookup() */
+
+size_t hash_table_snapshot_count(const ht_snapshot_t * p_snap)
+{
+    return (NULL == p_snap) ? 0 : (size_t)p_snap->p_header->entry_count;
+} /* hash_table_snapshot_count() */
+
+uint64_t hash_table_snapshot_lsn(const ht_snapshot_t * p_snap)
+{
+    return (NULL == p_snap) ? 0 : p_snap->p_header->wal_lsn;
+} /* hash_table_snapshot_lsn() */
+
+int hash_table_snapshot_promote(const ht_snapshot_t * p_snap, hash_table_t * p_ht)
+{
+    int ret_code = FAIL_CODE;
+    if ((NULL == p_snap) || (NULL == p_ht))
+    {
+        fprintf(stderr, "hash_table_snapshot_promote: p_snap or p_ht is NULL\n");
+        goto EXIT;
+    }
+    if (NULL == p_ht->decode)
+    {
+        fprintf(stderr, "hash_table_snapshot_promote: table has no decode function\n");
+        goto EXIT;
+    }
+
+    // Every record is visited once in file order
+    madvise((void *)p_snap->p_map, p_snap->map_size, MADV_SEQUENTIAL);
+    for (uint64_t i = 0; i < p_snap->p_header->entry_count; i++)
+    {
+        const snap_record_t * p_record = snap_record(p_snap, i);
+        if (NULL == p_record)
+        {
+            fprintf(stderr, "hash_table_snapshot_promote: corrupt record\n");
+            goto DONE;
+        }
+        const char * p_key = p_snap->p_keys + p_record->key_offset;
+        if (NULL != hash_table_lookup_n(p_ht, p_key, p_record->key_length))
+        {
+            continue; // the live table wins
+        }
+        void * obj = p_ht->decode(p_snap->p_values + p_record->value_offset,
+                                  p_record->value_length);
+        if (NULL == obj)
+        {
+            fprintf(stderr, "hash_table_snapshot_promote: decode failed\n");
+            goto DONE;
+        }
+        if (SUCCESS_CODE != hash_table_insert_n(p_ht, p_key, p_record->key_length, obj))
+        {
+            p_ht->cleanup(obj);
+            goto DONE;
+        }
+    }
+    ret_code = SUCCESS_CODE;
+DONE:
+    madvise((void *)p_snap->p_map, p_snap->map_size, MADV_RANDOM);
+EXIT:
+    return ret_code;
+} /* hash_table_snapshot_promote() */
+
+void hash_table_snapshot_close(ht_snapshot_t * p_snap)
+{
+    if (NULL == p_snap)
+    {
+        return;
+    }
+    munmap((void *)p_snap->p_map, p_snap->map_size);
+    free(p_snap);
+} /* hash_table_snapshot_close() */
+
+int load_file_to_hash(FILE * fp, hash_table_t * p_ht)
+{
+    int ret_code = FAIL_CODE;
+    if ((NULL == fp) || (NULL == p_ht))
+    {
+        fprintf(stderr, "load_file_to_hash: fp or p_ht is NULL\n");
+        goto EXIT;
+    }
+
+    ht_snapshot_t * p_snap = snap_map(fileno(fp), HT_SNAP_VERIFY);
+    if (NULL == p_snap)
+    {
+        fprintf(stderr, "load_file_to_hash: not a valid snapshot\n");
+        goto EXIT;
+    }
+    ret_code = hash_table_snapshot_promote(p_snap, p_ht);
+    hash_table_snapshot_close(p_snap);
+EXIT:
+    return ret_code;
+} /* load_file_to_hash() */
+
+/*** end of file ***/
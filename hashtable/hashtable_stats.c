@@ -0,0 +1,213 @@
+/* @file hashtable_stats.c
+ *
+ * Shape measurements and operation counters for tuning a table in production.
+ *
+ * Counters live in HT_STATS_SLOTS cache lines per table. Every thread is
+ * numbered once and always counts in the slot its number maps to, so the
+ * first threads never share a line and the counters add no contention of
+ * their own. Reading the counters sums every slot.
+ *
+ * Lock waits are measured without touching the clock on the fast path: a
+ * lock is tried first and only a try that fails times the blocking wait.
+ *
+ * Chain and probe lengths are not tracked as the table changes. They are
+ * measured when asked for, a stripe and a few hundred buckets at a time.
+ *
+ */
+
+#include "hashtable_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define STATS_WALK_CHUNK 256 // buckets measured per lock hold
+
+__thread uint32_t  t_ht_stats_slot = 0;
+static atomic_uint g_stats_threads = 0;
+
+uint32_t ht_stats_claim(void)
+{
+    uint32_t number =
+        atomic_fetch_add_explicit(&g_stats_threads, 1, memory_order_relaxed);
+    t_ht_stats_slot = (number & (HT_STATS_SLOTS - 1)) + 1;
+    return t_ht_stats_slot;
+} /* ht_stats_claim() */
+
+ht_stats_slot_t * ht_stats_new(void)
+{
+    ht_stats_slot_t * p_slots =
+        aligned_alloc(HT_CACHE_LINE, HT_STATS_SLOTS * sizeof(ht_stats_slot_t));
+    if (NULL == p_slots)
+    {
+        fprintf(stderr, "ht_stats_new: aligned_alloc failed\n");
+        return NULL;
+    }
+    memset(p_slots, 0, HT_STATS_SLOTS * sizeof(ht_stats_slot_t));
+    return p_slots;
+} /* ht_stats_new() */
+
+static inline uint64_t stats_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000) + (uint64_t)now.tv_nsec;
+} /* stats_now_ns() */
+
+void ht_stats_wait(hash_table_t * p_ht, ht_wait_t kind, void * p_lock)
+{
+    uint64_t start = stats_now_ns();
+    switch (kind)
+    {
+        case HT_WAIT_MUTEX:
+            pthread_mutex_lock(p_lock);
+            break;
+        case HT_WAIT_READ:
+            pthread_rwlock_rdlock(p_lock);
+            break;
+        case HT_WAIT_WRITE:
+            pthread_rwlock_wrlock(p_lock);
+            break;
+    }
+    ht_stat_add(p_ht, HT_STAT_LOCK_WAIT, 1);
+    ht_stat_add(p_ht, HT_STAT_LOCK_WAIT_NS, stats_now_ns() - start);
+} /* ht_stats_wait() */
+
+/**
+ * @brief Adds one chain or probe length to the histogram
+ * @param uint32_t bin histogram slot for the length, clamped to the last one
+ */
+static void stats_record(ht_stats_t * p_stats, uint32_t bin, uint32_t length)
+{
+    p_stats->histogram[(bin < HT_STATS_HISTOGRAM) ? bin : HT_STATS_HISTOGRAM - 1]++;
+    if (p_stats->longest < length)
+    {
+        p_stats->longest = length;
+    }
+} /* stats_record() */
+
+static void stats_chain(ht_stats_t * p_stats, const entry * p_entry)
+{
+    uint32_t length = 0;
+    for (; NULL != p_entry; p_entry = p_entry->next)
+    {
+        length++;
+    }
+    stats_record(p_stats, length, length);
+    p_stats->count += length;
+} /* stats_chain() */
+
+/**
+ * @brief Measures and counts every chain of a chained table. Buckets are
+ * visited the way cache_sweep visits them, so each lock hold covers one
+ * stripe's buckets only. Entries are counted here because p_ht->count lags
+ * behind by the count_delta each stripe has not published yet.
+ */
+static void stats_walk_chains(hash_table_t * p_ht, ht_stats_t * p_stats)
+{
+    uint64_t stride = p_ht->stripe_count;
+    for (uint64_t first = 0; first < stride; first++)
+    {
+        ht_stripe_t * p_stripe = &p_ht->stripes[first];
+        bool          more     = true;
+        for (uint64_t run = 0; more; run += STATS_WALK_CHUNK)
+        {
+            more = false;
+            ht_read_lock(p_ht, p_stripe);
+            for (uint64_t i = run; i < run + STATS_WALK_CHUNK; i++)
+            {
+                uint64_t bucket = first + (i * stride);
+                if (bucket < p_ht->size)
+                {
+                    stats_chain(p_stats, p_ht->elements[bucket]);
+                    more = true;
+                }
+                if ((NULL != p_ht->old_elements) && (bucket < p_ht->old_size))
+                {
+                    stats_chain(p_stats, p_ht->old_elements[bucket]);
+                    more = true;
+                }
+            }
+            ht_unlock(p_ht, p_stripe);
+        }
+    }
+} /* stats_walk_chains() */
+
+typedef struct stats_probe_ctx
+{
+    hash_table_t * p_ht;
+    ht_stats_t *   p_stats;
+} stats_probe_ctx_t;
+
+static int stats_probe_visit(entry * p_slot, void * p_ctx)
+{
+    stats_probe_ctx_t * p_probe = p_ctx;
+    uint32_t            length  = ht_open_probe_length(p_probe->p_ht, p_slot);
+    // No probe is shorter than one group, so histogram[0] counts length 1
+    stats_record(p_probe->p_stats, length - 1, length);
+    return SUCCESS_CODE;
+} /* stats_probe_visit() */
+
+int hash_table_stats(hash_table_t * p_ht, ht_stats_t * p_stats)
+{
+    if ((NULL == p_ht) || (NULL == p_stats))
+    {
+        fprintf(stderr, "hash_table_stats: p_ht or p_stats is NULL\n");
+        return FAIL_CODE;
+    }
+    memset(p_stats, 0, sizeof(*p_stats));
+
+    if (HT_BACKEND_OPEN == p_ht->backend)
+    {
+        stats_probe_ctx_t probe = { .p_ht = p_ht, .p_stats = p_stats };
+        ht_hash_lock(p_ht);
+        p_stats->buckets = p_ht->size;
+        ht_open_for_each(p_ht, stats_probe_visit, &probe);
+        p_stats->count = atomic_load_explicit(&p_ht->count, memory_order_relaxed);
+        pthread_mutex_unlock(&p_ht->hash_lock);
+    }
+    else
+    {
+        stats_walk_chains(p_ht, p_stats);
+        for (uint32_t i = 0; i < HT_STATS_HISTOGRAM; i++)
+        {
+            p_stats->buckets += p_stats->histogram[i];
+        }
+    }
+    p_stats->load_factor = (0 == p_stats->buckets)
+                               ? 0.0
+                               : (double)p_stats->count / (double)p_stats->buckets;
+
+    for (uint32_t i = 0; (NULL != p_ht->stats) && (i < HT_STATS_SLOTS); i++)
+    {
+        atomic_uint_fast64_t * counts = p_ht->stats[i].counts;
+        p_stats->inserts += atomic_load_explicit(&counts[HT_STAT_INSERT],
+                                                 memory_order_relaxed);
+        p_stats->hits += atomic_load_explicit(&counts[HT_STAT_HIT], memory_order_relaxed);
+        p_stats->misses +=
+            atomic_load_explicit(&counts[HT_STAT_MISS], memory_order_relaxed);
+        p_stats->removes +=
+            atomic_load_explicit(&counts[HT_STAT_REMOVE], memory_order_relaxed);
+        p_stats->lock_waits +=
+            atomic_load_explicit(&counts[HT_STAT_LOCK_WAIT], memory_order_relaxed);
+        p_stats->lock_wait_ns +=
+            atomic_load_explicit(&counts[HT_STAT_LOCK_WAIT_NS], memory_order_relaxed);
+    }
+    return SUCCESS_CODE;
+} /* hash_table_stats() */
+
+void hash_table_stats_reset(hash_table_t * p_ht)
+{
+    if ((NULL == p_ht) || (NULL == p_ht->stats))
+    {
+        fprintf(stderr, "hash_table_stats_reset: table keeps no counters\n");
+        return;
+    }
+    for (uint32_t i = 0; i < HT_STATS_SLOTS; i++)
+    {
+        for (int stat = 0; stat < HT_STATS; stat++)
+        {
+            atomic_store_explicit(&p_ht->stats[i].counts[stat], 0, memory_order_relaxed);
+        }
+    }
+} /* hash_table_stats_reset() */
+
+/*** end of file ***/
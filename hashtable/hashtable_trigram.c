@@ -0,0 +1,532 @@
+/* @file hashtable_trigram.c
+ *
+ * Trigram index answering "which keys contain this string" queries.
+ *
+ * Every indexed key gets an id, and each of the 2^24 possible trigrams keeps
+ * the ids of the keys it occurs in. Ids are handed out in increasing order,
+ * so every posting list is sorted just by appending to it. A query intersects
+ * the lists of its trigrams, smallest first, and checks the few candidates
+ * left with a substring search.
+ *
+ * Removing a key only clears its id. Posting lists keep the stale id until
+ * the dead ids outnumber the live ones, when every list is rewritten with the
+ * ids renumbered, so removes cost amortised O(key length).
+ *
+ */
+
+#define _GNU_SOURCE // memmem
+#include "hashtable_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#    include <emmintrin.h>
+#endif
+
+#define TG_ROOT       (1u << 16) // lists are grouped by their first two bytes
+#define TG_LEAF       256        // and then indexed by the third
+#define TG_MIN_DEAD   1024       // dead ids tolerated before compacting at all
+#define TG_NO_ID      UINT32_MAX
+#define TG_MAX_GRAMS  (MAX_KEY_LENGTH - 2)
+
+/**
+ * @brief ids of the keys one trigram occurs in, ascending
+ */
+typedef struct tg_posting
+{
+    uint32_t * ids;
+    uint32_t   count;
+    uint32_t   cap;
+} tg_posting_t;
+
+/**
+ * @brief copy of an indexed key, key is NULL once it was removed
+ */
+typedef struct tg_key
+{
+    char *   key;
+    uint32_t keylen;
+} tg_key_t;
+
+struct ht_trigram
+{
+    pthread_rwlock_t lock;       // writers add and remove, searches read
+    tg_posting_t **  root;       // TG_ROOT leaves of TG_LEAF lists, made on demand
+    tg_key_t *       keys;       // indexed by id
+    uint32_t         key_count;  // ids handed out
+    uint32_t         key_cap;
+    uint32_t         dead;       // ids whose key was removed
+    uint32_t *       short_ids;  // keys too short to hold a trigram, ascending
+    uint32_t         short_count;
+    uint32_t         short_cap;
+};
+
+static inline uint32_t tg_gram(const char * p_key)
+{
+    const uint8_t * p = (const uint8_t *)p_key;
+    return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+} /* tg_gram() */
+
+static inline tg_posting_t * tg_find(const ht_trigram_t * p_index, uint32_t gram)
+{
+    tg_posting_t * p_leaf = p_index->root[gram >> 8];
+    return (NULL == p_leaf) ? NULL : &p_leaf[gram & 0xFF];
+} /* tg_find() */
+
+/**
+ * @brief Appends an id to a sorted id array, growing it as needed
+ */
+static int tg_append(uint32_t ** pp_ids,
+                     uint32_t *  p_count,
+                     uint32_t *  p_cap,
+                     uint32_t    id)
+{
+    if (*p_count == *p_cap)
+    {
+        uint32_t   cap   = (0 == *p_cap) ? 4 : *p_cap * 2;
+        uint32_t * p_ids = realloc(*pp_ids, cap * sizeof(uint32_t));
+        if (NULL == p_ids)
+        {
+            fprintf(stderr, "ht_trigram_add: realloc failed\n");
+            return FAIL_CODE;
+        }
+        *pp_ids = p_ids;
+        *p_cap  = cap;
+    }
+    (*pp_ids)[(*p_count)++] = id;
+    return SUCCESS_CODE;
+} /* tg_append() */
+
+const char * ht_substr_find(const char * p_hay,
+                            size_t       hay_len,
+                            const char * p_needle,
+                            size_t       needle_len)
+{
+    if (0 == needle_len)
+    {
+        return p_hay;
+    }
+    if (needle_len > hay_len)
+    {
+        return NULL;
+    }
+    size_t i = 0;
+#if defined(__SSE2__)
+    // Compare 16 start positions at once on the needle's first and last bytes
+    // and only run memcmp where both match
+    const __m128i first = _mm_set1_epi8(p_needle[0]);
+    const __m128i last  = _mm_set1_epi8(p_needle[needle_len - 1]);
+    for (; i + needle_len - 1 + 16 <= hay_len; i += 16)
+    {
+        const char * p_last      = p_hay + i + needle_len - 1;
+        __m128i      block_first = _mm_loadu_si128((const __m128i *)(p_hay + i));
+        __m128i      block_last  = _mm_loadu_si128((const __m128i *)p_last);
+        uint32_t     mask        = (uint32_t)_mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+        while (0 != mask)
+        {
+            size_t at = i + (size_t)__builtin_ctz(mask);
+            if (0 == memcmp(p_hay + at, p_needle, needle_len))
+            {
+                return p_hay + at;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    return memmem(p_hay + i, hay_len - i, p_needle, needle_len);
+} /* ht_substr_find() */
+
+ht_trigram_t * ht_trigram_new(void)
+{
+    ht_trigram_t * p_index = calloc(1, sizeof(ht_trigram_t));
+    if (NULL == p_index)
+    {
+        fprintf(stderr, "ht_trigram_new: calloc failed\n");
+        goto EXIT;
+    }
+    p_index->root = calloc(TG_ROOT, sizeof(tg_posting_t *));
+    if (NULL == p_index->root)
+    {
+        fprintf(stderr, "ht_trigram_new: calloc failed\n");
+        goto ERR;
+    }
+    if (pthread_rwlock_init(&p_index->lock, NULL) != 0)
+    {
+        fprintf(stderr, "ht_trigram_new: pthread_rwlock_init failed\n");
+        goto ERR;
+    }
+    goto EXIT;
+
+ERR:
+    free(p_index->root);
+    free(p_index);
+    p_index = NULL;
+EXIT:
+    return p_index;
+} /* ht_trigram_new() */
+
+void ht_trigram_free(ht_trigram_t * p_index)
+{
+    if (NULL == p_index)
+    {
+        return;
+    }
+    for (uint32_t i = 0; i < TG_ROOT; i++)
+    {
+        for (uint32_t j = 0; (NULL != p_index->root[i]) && (j < TG_LEAF); j++)
+        {
+            free(p_index->root[i][j].ids);
+        }
+        free(p_index->root[i]);
+    }
+    for (uint32_t id = 0; id < p_index->key_count; id++)
+    {
+        free(p_index->keys[id].key);
+    }
+    free(p_index->root);
+    free(p_index->keys);
+    free(p_index->short_ids);
+    pthread_rwlock_destroy(&p_index->lock);
+    free(p_index);
+} /* ht_trigram_free() */
+
+/**
+ * @brief Renumbers the live ids densely and drops the dead ones from every
+ * list. The new ids keep the order of the old ones, so lists stay sorted.
+ */
+static void tg_compact(ht_trigram_t * p_index)
+{
+    uint32_t   live  = 0;
+    uint32_t * p_map = malloc((p_index->key_count + 1) * sizeof(uint32_t));
+    if (NULL == p_map)
+    {
+        return; // stale ids only cost memory, try again on the next remove
+    }
+    for (uint32_t id = 0; id < p_index->key_count; id++)
+    {
+        p_map[id] = TG_NO_ID;
+        if (NULL != p_index->keys[id].key)
+        {
+            p_map[id]             = live;
+            p_index->keys[live++] = p_index->keys[id];
+        }
+    }
+    for (uint32_t i = 0; i < TG_ROOT; i++)
+    {
+        for (uint32_t j = 0; (NULL != p_index->root[i]) && (j < TG_LEAF); j++)
+        {
+            tg_posting_t * p_list = &p_index->root[i][j];
+            uint32_t       kept   = 0;
+            for (uint32_t k = 0; k < p_list->count; k++)
+            {
+                if (TG_NO_ID != p_map[p_list->ids[k]])
+                {
+                    p_list->ids[kept++] = p_map[p_list->ids[k]];
+                }
+            }
+            p_list->count = kept;
+            if (0 == kept)
+            {
+                free(p_list->ids);
+                p_list->ids = NULL;
+                p_list->cap = 0;
+            }
+        }
+    }
+    uint32_t kept = 0;
+    for (uint32_t k = 0; k < p_index->short_count; k++)
+    {
+        if (TG_NO_ID != p_map[p_index->short_ids[k]])
+        {
+            p_index->short_ids[kept++] = p_map[p_index->short_ids[k]];
+        }
+    }
+    p_index->short_count = kept;
+    p_index->key_count   = live;
+    p_index->dead        = 0;
+    free(p_map);
+} /* tg_compact() */
+
+int ht_trigram_add(ht_trigram_t * p_index, const char * p_key, size_t keylen)
+{
+    int ret_code = FAIL_CODE;
+    pthread_rwlock_wrlock(&p_index->lock);
+    if (TG_NO_ID - 1 <= p_index->key_count)
+    {
+        tg_compact(p_index);
+        if (TG_NO_ID - 1 <= p_index->key_count)
+        {
+            fprintf(stderr, "ht_trigram_add: index is full\n");
+            goto EXIT;
+        }
+    }
+    if (p_index->key_count == p_index->key_cap)
+    {
+        uint32_t   cap    = (0 == p_index->key_cap) ? 64 : p_index->key_cap * 2;
+        tg_key_t * p_keys = realloc(p_index->keys, (size_t)cap * sizeof(tg_key_t));
+        if (NULL == p_keys)
+        {
+            fprintf(stderr, "ht_trigram_add: realloc failed\n");
+            goto EXIT;
+        }
+        p_index->keys    = p_keys;
+        p_index->key_cap = cap;
+    }
+    uint32_t id  = p_index->key_count;
+    char *   key = ht_key_dup(p_key, keylen);
+    if (NULL == key)
+    {
+        fprintf(stderr, "ht_trigram_add: ht_key_dup failed\n");
+        goto EXIT;
+    }
+
+    if (keylen < 3)
+    {
+        if (SUCCESS_CODE != tg_append(&p_index->short_ids,
+                                      &p_index->short_count,
+                                      &p_index->short_cap,
+                                      id))
+        {
+            free(key);
+            goto EXIT;
+        }
+    }
+    for (size_t i = 0; i + 3 <= keylen; i++)
+    {
+        uint32_t        gram   = tg_gram(p_key + i);
+        tg_posting_t ** p_leaf = &p_index->root[gram >> 8];
+        if (NULL == *p_leaf)
+        {
+            *p_leaf = calloc(TG_LEAF, sizeof(tg_posting_t));
+        }
+        tg_posting_t * p_list = (NULL == *p_leaf) ? NULL : &(*p_leaf)[gram & 0xFF];
+        // A repeated trigram already ends its list with this id
+        if ((NULL != p_list) && (0 != p_list->count) &&
+            (id == p_list->ids[p_list->count - 1]))
+        {
+            continue;
+        }
+        if ((NULL == p_list) ||
+            (SUCCESS_CODE != tg_append(&p_list->ids, &p_list->count, &p_list->cap, id)))
+        {
+            // Take the id back out of the lists it already reached
+            for (size_t j = 0; j < i; j++)
+            {
+                p_list = tg_find(p_index, tg_gram(p_key + j));
+                if ((0 != p_list->count) && (id == p_list->ids[p_list->count - 1]))
+                {
+                    p_list->count--;
+                }
+            }
+            free(key);
+            goto EXIT;
+        }
+    }
+    p_index->keys[id].key    = key;
+    p_index->keys[id].keylen = (uint32_t)keylen;
+    p_index->key_count++;
+    ret_code = SUCCESS_CODE;
+EXIT:
+    pthread_rwlock_unlock(&p_index->lock);
+    return ret_code;
+} /* ht_trigram_add() */
+
+/**
+ * @brief Finds the live id of a key in one of its id lists, newest first
+ */
+static uint32_t tg_lookup(const ht_trigram_t * p_index,
+                          const uint32_t *     ids,
+                          uint32_t             count,
+                          const char *         p_key,
+                          size_t               keylen)
+{
+    for (uint32_t k = count; k > 0; k--)
+    {
+        const tg_key_t * p_entry = &p_index->keys[ids[k - 1]];
+        if ((NULL != p_entry->key) && (keylen == p_entry->keylen) &&
+            (0 == memcmp(p_entry->key, p_key, keylen)))
+        {
+            return ids[k - 1];
+        }
+    }
+    return TG_NO_ID;
+} /* tg_lookup() */
+
+void ht_trigram_remove(ht_trigram_t * p_index, const char * p_key, size_t keylen)
+{
+    pthread_rwlock_wrlock(&p_index->lock);
+    uint32_t id = TG_NO_ID;
+    if (keylen < 3)
+    {
+        id = tg_lookup(
+            p_index, p_index->short_ids, p_index->short_count, p_key, keylen);
+    }
+    else
+    {
+        // The key's id is in each of its lists, search the shortest
+        tg_posting_t * p_best = NULL;
+        for (size_t i = 0; i + 3 <= keylen; i++)
+        {
+            tg_posting_t * p_list = tg_find(p_index, tg_gram(p_key + i));
+            if ((NULL != p_list) && ((NULL == p_best) || (p_list->count < p_best->count)))
+            {
+                p_best = p_list;
+            }
+        }
+        if (NULL != p_best)
+        {
+            id = tg_lookup(p_index, p_best->ids, p_best->count, p_key, keylen);
+        }
+    }
+    if (TG_NO_ID == id)
+    {
+        goto EXIT;
+    }
+    free(p_index->keys[id].key);
+    p_index->keys[id].key = NULL;
+    p_index->dead++;
+    uint32_t live = p_index->key_count - p_index->dead;
+    if ((TG_MIN_DEAD < p_index->dead) && (live < p_index->dead))
+    {
+        tg_compact(p_index);
+    }
+EXIT:
+    pthread_rwlock_unlock(&p_index->lock);
+} /* ht_trigram_remove() */
+
+/**
+ * @brief Returns the position of the first id >= target at or after from,
+ * galloping ahead before the binary search since candidates are sparse
+ */
+static uint32_t tg_seek(const tg_posting_t * p_list, uint32_t from, uint32_t target)
+{
+    uint32_t step = 1;
+    uint32_t high = from;
+    while ((high < p_list->count) && (p_list->ids[high] < target))
+    {
+        from = high + 1;
+        high += step;
+        step *= 2;
+    }
+    if (high > p_list->count)
+    {
+        high = p_list->count;
+    }
+    while (from < high)
+    {
+        uint32_t mid = from + (high - from) / 2;
+        if (p_list->ids[mid] < target)
+        {
+            from = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return from;
+} /* tg_seek() */
+
+/**
+ * @brief Passes a candidate to visit if it is live and contains the needle
+ * @return SUCCESS_CODE to keep searching, FAIL_CODE when visit stopped
+ */
+static int tg_verify(const ht_trigram_t * p_index,
+                     uint32_t             id,
+                     const char *         p_needle,
+                     size_t               needle_len,
+                     ht_match_function *  visit,
+                     void *               p_ctx)
+{
+    const tg_key_t * p_entry = &p_index->keys[id];
+    if ((NULL == p_entry->key) ||
+        (NULL == ht_substr_find(p_entry->key, p_entry->keylen, p_needle, needle_len)))
+    {
+        return SUCCESS_CODE;
+    }
+    return visit(p_entry->key, p_entry->keylen, p_ctx);
+} /* tg_verify() */
+
+int ht_trigram_search(ht_trigram_t *      p_index,
+                      const char *        p_needle,
+                      size_t              needle_len,
+                      ht_match_function * visit,
+                      void *              p_ctx)
+{
+    int        ret_code   = SUCCESS_CODE;
+    uint32_t * candidates = NULL;
+    pthread_rwlock_rdlock(&p_index->lock);
+    if (needle_len < 3)
+    {
+        // Too short to have a trigram, every key is a candidate
+        for (uint32_t id = 0; id < p_index->key_count; id++)
+        {
+            if (SUCCESS_CODE !=
+                tg_verify(p_index, id, p_needle, needle_len, visit, p_ctx))
+            {
+                break;
+            }
+        }
+        goto EXIT;
+    }
+
+    // Every list the needle's trigrams name, shortest first
+    const tg_posting_t * lists[TG_MAX_GRAMS];
+    size_t               list_count = 0;
+    for (size_t i = 0; (i + 3 <= needle_len) && (list_count < TG_MAX_GRAMS); i++)
+    {
+        const tg_posting_t * p_list = tg_find(p_index, tg_gram(p_needle + i));
+        if ((NULL == p_list) || (0 == p_list->count))
+        {
+            goto EXIT; // some trigram occurs in no key at all
+        }
+        size_t at = list_count++;
+        for (; (0 < at) && (lists[at - 1]->count > p_list->count); at--)
+        {
+            lists[at] = lists[at - 1];
+        }
+        lists[at] = p_list;
+    }
+
+    uint32_t count = lists[0]->count;
+    candidates     = malloc(count * sizeof(uint32_t));
+    if (NULL == candidates)
+    {
+        fprintf(stderr, "ht_trigram_search: malloc failed\n");
+        ret_code = FAIL_CODE;
+        goto EXIT;
+    }
+    memcpy(candidates, lists[0]->ids, count * sizeof(uint32_t));
+    for (size_t l = 1; (l < list_count) && (0 < count); l++)
+    {
+        if (lists[l] == lists[l - 1])
+        {
+            continue; // a trigram the needle repeats
+        }
+        uint32_t kept = 0;
+        uint32_t at   = 0;
+        for (uint32_t k = 0; (k < count) && (at < lists[l]->count); k++)
+        {
+            at = tg_seek(lists[l], at, candidates[k]);
+            if ((at < lists[l]->count) && (lists[l]->ids[at] == candidates[k]))
+            {
+                candidates[kept++] = candidates[k];
+            }
+        }
+        count = kept;
+    }
+    for (uint32_t k = 0; k < count; k++)
+    {
+        if (SUCCESS_CODE !=
+            tg_verify(p_index, candidates[k], p_needle, needle_len, visit, p_ctx))
+        {
+            break;
+        }
+    }
+EXIT:
+    pthread_rwlock_unlock(&p_index->lock);
+    free(candidates);
+    return ret_code;
+} /* ht_trigram_search() */
+
+/*** end of file ***/
@@ -0,0 +1,689 @@
+/* @file hashtable_wal.c
+ *
+ * Write-ahead log of hash table mutations. Writers append records to an
+ * in-memory batch while they hold their stripe, so log order matches the
+ * order the table changed in. A flusher thread swaps the batch out and makes
+ * it durable with a single write and fdatasync, so every writer that logged
+ * during one sync shares the next (group commit).
+ *
+ * The file is a wal_file_header_t followed by 8 byte aligned records. Each
+ * record carries its log sequence number (LSN) and a checksum, so replay
+ * stops cleanly at a record torn by a crash.
+ *
+ * A checkpoint copies the records a snapshot does not hold into a new file
+ * while writers keep logging to the old one. Only the records the flusher
+ * wrote during the copy are appended with the lock held, before the new file
+ * replaces the old.
+ *
+ */
+
+#include "hashtable_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WAL_MAGIC         0x314c41574854ULL // "HTWAL1" read as little endian
+#define WAL_VERSION       1
+#define WAL_ALIGN         8
+#define WAL_INITIAL_BATCH 65536
+#define WAL_COPY_CHUNK    65536 // bytes a checkpoint copies per read
+
+typedef struct wal_file_header
+{
+    uint64_t magic;   // WAL_MAGIC
+    uint32_t version; // WAL_VERSION
+    uint32_t unused;
+} wal_file_header_t;
+
+typedef struct wal_record
+{
+    uint64_t sum;          // checksum of the rest of the record
+    uint64_t lsn;          // strictly increasing through the file
+    uint32_t op;           // HT_WAL_INSERT or HT_WAL_REMOVE
+    uint32_t key_length;   // key bytes follow the record
+    uint32_t value_length; // encoded object follows the key, inserts only
+    uint32_t unused;
+} wal_record_t;
+
+struct ht_wal
+{
+    pthread_mutex_t   lock;
+    pthread_cond_t    wake;        // the flusher has work or must stop
+    pthread_cond_t    flushed;     // durable_lsn moved or the log failed
+    pthread_t         thread;
+    int               fd;
+    char *            path;
+    encode_function * encode;
+    uint8_t *         batch;       // records waiting for the next sync
+    size_t            batch_used;
+    size_t            batch_cap;
+    uint8_t *         spare;       // batch being written by the flusher
+    size_t            spare_cap;
+    uint64_t          next_lsn;    // LSN of the next record
+    uint64_t          durable_lsn; // every record up to here is on disk
+    uint64_t          file_size;   // bytes written to fd so far
+    uint32_t          interval_us; // time a batch gathers records
+    bool              sync_commit; // writers wait for their record to be durable
+    bool              busy;        // the flusher is writing the spare batch
+    bool              checkpoint;  // a checkpoint is copying the log
+    bool              stop;
+    bool              failed;      // a write or sync failed, nothing is durable now
+};
+
+static inline size_t wal_align(size_t len)
+{
+    return (len + WAL_ALIGN - 1) & ~(size_t)(WAL_ALIGN - 1);
+} /* wal_align() */
+
+static uint64_t wal_sum(const uint8_t * p_record, size_t size)
+{
+    return hash_function_seeded((const char *)p_record + sizeof(uint64_t),
+                                size - sizeof(uint64_t),
+                                WAL_MAGIC);
+} /* wal_sum() */
+
+/**
+ * @brief Writes all of len bytes, retrying short writes
+ */
+static int wal_write_all(int fd, const uint8_t * p_data, size_t len)
+{
+    while (0 < len)
+    {
+        ssize_t written = write(fd, p_data, len);
+        if (0 > written)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            return FAIL_CODE;
+        }
+        p_data += written;
+        len -= (size_t)written;
+    }
+    return SUCCESS_CODE;
+} /* wal_write_all() */
+
+/**
+ * @brief Copies len bytes at offset of from to the current position of to
+ */
+static int wal_copy_range(int from, int to, off_t offset, size_t len)
+{
+    uint8_t buffer[WAL_COPY_CHUNK];
+    while (0 < len)
+    {
+        size_t  chunk = (len < sizeof(buffer)) ? len : sizeof(buffer);
+        ssize_t got   = pread(from, buffer, chunk, offset);
+        if (0 > got)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            return FAIL_CODE;
+        }
+        if ((0 == got) || (SUCCESS_CODE != wal_write_all(to, buffer, (size_t)got)))
+        {
+            return FAIL_CODE;
+        }
+        offset += got;
+        len -= (size_t)got;
+    }
+    return SUCCESS_CODE;
+} /* wal_copy_range() */
+
+/**
+ * @brief Finds the offset of the first record past lsn in the first size
+ * bytes of the log. Those are durable, so no writer changes them.
+ * @return SUCCESS_CODE with *p_offset set
+ * @return FAIL_CODE when the log cannot be mapped
+ */
+static int wal_find_after(int fd, size_t size, uint64_t lsn, size_t * p_offset)
+{
+    struct stat info = { 0 };
+    if ((0 != fstat(fd, &info)) || ((uint64_t)info.st_size < size))
+    {
+        fprintf(stderr, "ht_wal_checkpoint: log size changed\n");
+        return FAIL_CODE;
+    }
+    uint8_t * p_map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == p_map)
+    {
+        fprintf(stderr, "ht_wal_checkpoint: mmap failed\n");
+        return FAIL_CODE;
+    }
+    size_t offset = sizeof(wal_file_header_t);
+    while (offset < size)
+    {
+        const wal_record_t * p_record = (const wal_record_t *)(p_map + offset);
+        if (p_record->lsn > lsn)
+        {
+            break;
+        }
+        offset += wal_align(sizeof(wal_record_t) + p_record->key_length +
+                            p_record->value_length);
+    }
+    munmap(p_map, size);
+    *p_offset = offset;
+    return SUCCESS_CODE;
+} /* wal_find_after() */
+
+/**
+ * @brief Flusher thread. Waits for records, lets a batch gather for the
+ * flush interval, then writes and syncs it with the lock dropped so writers
+ * can fill the next batch meanwhile.
+ */
+static void * wal_flusher(void * arg)
+{
+    ht_wal_t * p_wal = arg;
+
+    pthread_mutex_lock(&p_wal->lock);
+    for (;;)
+    {
+        while ((0 == p_wal->batch_used) && !p_wal->stop)
+        {
+            pthread_cond_wait(&p_wal->wake, &p_wal->lock);
+        }
+        if (0 == p_wal->batch_used)
+        {
+            break;
+        }
+        if ((0 != p_wal->interval_us) && !p_wal->stop)
+        {
+            struct timespec deadline = { 0 };
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long)p_wal->interval_us * 1000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            int wait_code = 0;
+            while (!p_wal->stop && (ETIMEDOUT != wait_code))
+            {
+                wait_code = pthread_cond_timedwait(&p_wal->wake, &p_wal->lock, &deadline);
+            }
+        }
+
+        uint8_t * p_batch   = p_wal->batch;
+        size_t    used      = p_wal->batch_used;
+        uint64_t  batch_lsn = p_wal->next_lsn - 1;
+        p_wal->batch        = p_wal->spare;
+        p_wal->spare        = p_batch;
+        size_t    cap       = p_wal->batch_cap;
+        p_wal->batch_cap    = p_wal->spare_cap;
+        p_wal->spare_cap    = cap;
+        p_wal->batch_used   = 0;
+        p_wal->busy         = true;
+        pthread_mutex_unlock(&p_wal->lock);
+
+        int ret_code = wal_write_all(p_wal->fd, p_batch, used);
+        if ((SUCCESS_CODE == ret_code) && (0 != fdatasync(p_wal->fd)))
+        {
+            ret_code = FAIL_CODE;
+        }
+
+        pthread_mutex_lock(&p_wal->lock);
+        p_wal->busy = false;
+        if (SUCCESS_CODE != ret_code)
+        {
+            fprintf(stderr, "wal_flusher: write or fdatasync failed\n");
+            p_wal->failed = true;
+        }
+        else
+        {
+            p_wal->file_size += used;
+            p_wal->durable_lsn = batch_lsn;
+        }
+        pthread_cond_broadcast(&p_wal->flushed);
+    }
+    pthread_mutex_unlock(&p_wal->lock);
+    return NULL;
+} /* wal_flusher() */
+
+uint64_t ht_wal_log(ht_wal_t *   p_wal,
+                    uint32_t     op,
+                    const char * p_key,
+                    size_t       keylen,
+                    const void * obj)
+{
+    uint64_t lsn       = 0;
+    size_t   value_len = (HT_WAL_INSERT == op) ? p_wal->encode(obj, NULL, 0) : 0;
+    size_t   size      = wal_align(sizeof(wal_record_t) + keylen + value_len);
+    if (UINT32_MAX < value_len)
+    {
+        fprintf(stderr, "ht_wal_log: value too large\n");
+        return 0;
+    }
+
+    pthread_mutex_lock(&p_wal->lock);
+    if (p_wal->failed)
+    {
+        fprintf(stderr, "ht_wal_log: log is failed\n");
+        goto EXIT;
+    }
+    if (p_wal->batch_cap - p_wal->batch_used < size)
+    {
+        size_t    cap     = (p_wal->batch_used + size) * 2;
+        uint8_t * p_batch = realloc(p_wal->batch, cap);
+        if (NULL == p_batch)
+        {
+            fprintf(stderr, "ht_wal_log: realloc failed\n");
+            goto EXIT;
+        }
+        p_wal->batch     = p_batch;
+        p_wal->batch_cap = cap;
+    }
+
+    uint8_t *      p_out    = p_wal->batch + p_wal->batch_used;
+    wal_record_t * p_record = (wal_record_t *)p_out;
+    memset(p_out, 0, size);
+    p_record->lsn          = p_wal->next_lsn;
+    p_record->op           = op;
+    p_record->key_length   = (uint32_t)keylen;
+    p_record->value_length = (uint32_t)value_len;
+    memcpy(p_out + sizeof(wal_record_t), p_key, keylen);
+    if (0 != value_len)
+    {
+        p_wal->encode(obj, p_out + sizeof(wal_record_t) + keylen, value_len);
+    }
+    p_record->sum = wal_sum(p_out, size);
+
+    if (0 == p_wal->batch_used)
+    {
+        pthread_cond_signal(&p_wal->wake);
+    }
+    p_wal->batch_used += size;
+    lsn = p_wal->next_lsn++;
+EXIT:
+    pthread_mutex_unlock(&p_wal->lock);
+    return lsn;
+} /* ht_wal_log() */
+
+/**
+ * @brief Blocks until lsn is durable. Caller holds p_wal->lock.
+ */
+static int wal_wait_locked(ht_wal_t * p_wal, uint64_t lsn)
+{
+    while ((p_wal->durable_lsn < lsn) && !p_wal->failed)
+    {
+        pthread_cond_signal(&p_wal->wake);
+        pthread_cond_wait(&p_wal->flushed, &p_wal->lock);
+    }
+    return p_wal->failed ? FAIL_CODE : SUCCESS_CODE;
+} /* wal_wait_locked() */
+
+int ht_wal_commit(ht_wal_t * p_wal, uint64_t lsn, bool force)
+{
+    if (!force && !p_wal->sync_commit)
+    {
+        return SUCCESS_CODE;
+    }
+    pthread_mutex_lock(&p_wal->lock);
+    int ret_code = wal_wait_locked(p_wal, lsn);
+    pthread_mutex_unlock(&p_wal->lock);
+    return ret_code;
+} /* ht_wal_commit() */
+
+uint64_t ht_wal_mark(ht_wal_t * p_wal)
+{
+    pthread_mutex_lock(&p_wal->lock);
+    uint64_t lsn = p_wal->next_lsn - 1;
+    pthread_mutex_unlock(&p_wal->lock);
+    return lsn;
+} /* ht_wal_mark() */
+
+int ht_wal_checkpoint(ht_wal_t * p_wal, uint64_t lsn)
+{
+    int    ret_code = FAIL_CODE;
+    int    fd       = -1;
+    char * p_tmp    = NULL;
+
+    pthread_mutex_lock(&p_wal->lock);
+    while (p_wal->checkpoint)
+    {
+        pthread_cond_wait(&p_wal->flushed, &p_wal->lock);
+    }
+    if (SUCCESS_CODE != wal_wait_locked(p_wal, lsn))
+    {
+        pthread_mutex_unlock(&p_wal->lock);
+        return FAIL_CODE;
+    }
+    // The first size bytes hold every record up to lsn and are durable. The
+    // flusher only appends past them, and no other checkpoint swaps the fd.
+    p_wal->checkpoint = true;
+    size_t size       = p_wal->file_size;
+    pthread_mutex_unlock(&p_wal->lock);
+
+    size_t offset   = 0;
+    size_t path_len = strlen(p_wal->path);
+    if (SUCCESS_CODE != wal_find_after(p_wal->fd, size, lsn, &offset))
+    {
+        goto EXIT;
+    }
+    p_tmp = malloc(path_len + sizeof(".tmp"));
+    if (NULL == p_tmp)
+    {
+        fprintf(stderr, "ht_wal_checkpoint: malloc failed\n");
+        goto EXIT;
+    }
+    memcpy(p_tmp, p_wal->path, path_len);
+    memcpy(p_tmp + path_len, ".tmp", sizeof(".tmp"));
+
+    // Read and write, the next checkpoint maps it
+    fd = open(p_tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if ((0 > fd) ||
+        (SUCCESS_CODE != wal_copy_range(p_wal->fd, fd, 0, sizeof(wal_file_header_t))) ||
+        (SUCCESS_CODE != wal_copy_range(p_wal->fd, fd, (off_t)offset, size - offset)) ||
+        (0 != fdatasync(fd)))
+    {
+        fprintf(stderr, "ht_wal_checkpoint: copying the log failed\n");
+        goto EXIT;
+    }
+
+    // The records synced meanwhile are durable in the old file, so they have
+    // to be in the new one before it replaces the old
+    pthread_mutex_lock(&p_wal->lock);
+    while (p_wal->busy)
+    {
+        pthread_cond_wait(&p_wal->flushed, &p_wal->lock);
+    }
+    size_t delta = p_wal->file_size - size;
+    // A crash before the rename leaves the full log, replay skips what the
+    // snapshot already holds, so the rename needs no directory sync
+    if ((SUCCESS_CODE != wal_copy_range(p_wal->fd, fd, (off_t)size, delta)) ||
+        ((0 != delta) && (0 != fdatasync(fd))) || (0 != rename(p_tmp, p_wal->path)))
+    {
+        pthread_mutex_unlock(&p_wal->lock);
+        fprintf(stderr, "ht_wal_checkpoint: rewriting the log failed\n");
+        goto EXIT;
+    }
+    int old_fd       = p_wal->fd;
+    p_wal->fd        = fd;
+    p_wal->file_size = sizeof(wal_file_header_t) + (size - offset) + delta;
+    fd               = -1;
+    ret_code         = SUCCESS_CODE;
+    pthread_mutex_unlock(&p_wal->lock);
+    // The last close frees the old file's blocks, which can take a while
+    close(old_fd);
+EXIT:
+    if (0 <= fd)
+    {
+        close(fd);
+        unlink(p_tmp);
+    }
+    pthread_mutex_lock(&p_wal->lock);
+    p_wal->checkpoint = false;
+    pthread_cond_broadcast(&p_wal->flushed);
+    pthread_mutex_unlock(&p_wal->lock);
+    free(p_tmp);
+    return ret_code;
+} /* ht_wal_checkpoint() */
+
+void ht_wal_close(ht_wal_t * p_wal)
+{
+    if (NULL == p_wal)
+    {
+        return;
+    }
+    pthread_mutex_lock(&p_wal->lock);
+    p_wal->stop = true;
+    pthread_cond_signal(&p_wal->wake);
+    pthread_mutex_unlock(&p_wal->lock);
+    pthread_join(p_wal->thread, NULL);
+
+    close(p_wal->fd);
+    pthread_cond_destroy(&p_wal->flushed);
+    pthread_cond_destroy(&p_wal->wake);
+    pthread_mutex_destroy(&p_wal->lock);
+    free(p_wal->batch);
+    free(p_wal->spare);
+    free(p_wal->path);
+    free(p_wal);
+} /* ht_wal_close() */
+
+/**
+ * @brief Applies one logged mutation to a table that has no log attached
+ */
+static int wal_apply(hash_table_t * p_ht, const wal_record_t * p_record)
+{
+    const char * p_key = (const char *)(p_record + 1);
+    if (HT_WAL_REMOVE == p_record->op)
+    {
+        void * obj = hash_table_remove_n(p_ht, p_key, p_record->key_length);
+        if (NULL != obj)
+        {
+            p_ht->cleanup(obj);
+        }
+        return SUCCESS_CODE;
+    }
+
+    void * obj = p_ht->decode(p_key + p_record->key_length, p_record->value_length);
+    if (NULL == obj)
+    {
+        fprintf(stderr, "wal_apply: decode failed\n");
+        return FAIL_CODE;
+    }
+    // The last record for a key wins
+    void * p_old = hash_table_remove_n(p_ht, p_key, p_record->key_length);
+    if (NULL != p_old)
+    {
+        p_ht->cleanup(p_old);
+    }
+    if (SUCCESS_CODE != hash_table_insert_n(p_ht, p_key, p_record->key_length, obj))
+    {
+        p_ht->cleanup(obj);
+        return FAIL_CODE;
+    }
+    return SUCCESS_CODE;
+} /* wal_apply() */
+
+/**
+ * @brief Replays every valid record after after_lsn. Stops at the first torn
+ * or corrupt record, which a crash during a write leaves at the tail.
+ *
+ * @return SUCCESS_CODE with *p_end at the end of the last valid record and
+ * *p_last_lsn raised to its LSN
+ * @return FAIL_CODE when the file is not a log or a record cannot be applied
+ */
+static int wal_replay(hash_table_t * p_ht,
+                      int            fd,
+                      uint64_t       after_lsn,
+                      uint64_t *     p_end,
+                      uint64_t *     p_last_lsn)
+{
+    int         ret_code = FAIL_CODE;
+    struct stat info     = { 0 };
+    if (0 != fstat(fd, &info))
+    {
+        fprintf(stderr, "hash_table_wal_open: fstat failed\n");
+        return FAIL_CODE;
+    }
+    size_t size = (size_t)info.st_size;
+    if (size < sizeof(wal_file_header_t))
+    {
+        // A new log, or one that died before its header was written
+        *p_end = 0;
+        return SUCCESS_CODE;
+    }
+
+    uint8_t * p_map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == p_map)
+    {
+        fprintf(stderr, "hash_table_wal_open: mmap failed\n");
+        return FAIL_CODE;
+    }
+    madvise(p_map, size, MADV_SEQUENTIAL);
+    const wal_file_header_t * p_header = (const wal_file_header_t *)p_map;
+    if ((WAL_MAGIC != p_header->magic) || (WAL_VERSION != p_header->version))
+    {
+        fprintf(stderr, "hash_table_wal_open: not a log file\n");
+        goto EXIT;
+    }
+
+    uint64_t prev_lsn = 0;
+    size_t   offset   = sizeof(wal_file_header_t);
+    while (sizeof(wal_record_t) <= size - offset)
+    {
+        const wal_record_t * p_record = (const wal_record_t *)(p_map + offset);
+        uint64_t length = (uint64_t)p_record->key_length + p_record->value_length;
+        if ((MAX_KEY_LENGTH < p_record->key_length) ||
+            (length > size - offset - sizeof(wal_record_t)))
+        {
+            break;
+        }
+        size_t record_size = wal_align(sizeof(wal_record_t) + length);
+        if ((record_size > size - offset) ||
+            (wal_sum(p_map + offset, record_size) != p_record->sum) ||
+            (p_record->lsn <= prev_lsn) ||
+            ((HT_WAL_INSERT != p_record->op) && (HT_WAL_REMOVE != p_record->op)))
+        {
+            break;
+        }
+        if ((p_record->lsn > after_lsn) && (SUCCESS_CODE != wal_apply(p_ht, p_record)))
+        {
+            goto EXIT;
+        }
+        prev_lsn = p_record->lsn;
+        offset += record_size;
+    }
+    if (offset != size)
+    {
+        fprintf(stderr, "hash_table_wal_open: dropping a torn record at the tail\n");
+    }
+    if (*p_last_lsn < prev_lsn)
+    {
+        *p_last_lsn = prev_lsn;
+    }
+    *p_end   = offset;
+    ret_code = SUCCESS_CODE;
+EXIT:
+    munmap(p_map, size);
+    return ret_code;
+} /* wal_replay() */
+
+int hash_table_wal_open(hash_table_t *                p_ht,
+                        const char *                  path,
+                        uint64_t                      after_lsn,
+                        const hash_table_wal_opts_t * p_opts)
+{
+    int        ret_code = FAIL_CODE;
+    ht_wal_t * p_wal    = NULL;
+    if ((NULL == p_ht) || (NULL == path))
+    {
+        fprintf(stderr, "hash_table_wal_open: p_ht or path is NULL\n");
+        goto EXIT;
+    }
+    if ((NULL == p_ht->encode) || (NULL == p_ht->decode) || (NULL != p_ht->wal))
+    {
+        fprintf(stderr, "hash_table_wal_open: needs encode and decode, and no log\n");
+        goto EXIT;
+    }
+
+    p_wal = calloc(1, sizeof(ht_wal_t));
+    if (NULL == p_wal)
+    {
+        fprintf(stderr, "hash_table_wal_open: calloc failed\n");
+        goto EXIT;
+    }
+    p_wal->fd   = -1;
+    p_wal->path = ht_key_dup(path, strlen(path));
+    if (NULL == p_wal->path)
+    {
+        fprintf(stderr, "hash_table_wal_open: malloc failed\n");
+        goto ERR;
+    }
+    p_wal->encode = p_ht->encode;
+    if (NULL != p_opts)
+    {
+        p_wal->interval_us = p_opts->flush_interval_us;
+        p_wal->sync_commit = (0 != p_opts->sync_commit);
+    }
+    p_wal->batch_cap = WAL_INITIAL_BATCH;
+    p_wal->spare_cap = WAL_INITIAL_BATCH;
+    p_wal->batch     = malloc(p_wal->batch_cap);
+    p_wal->spare     = malloc(p_wal->spare_cap);
+    if ((NULL == p_wal->batch) || (NULL == p_wal->spare))
+    {
+        fprintf(stderr, "hash_table_wal_open: malloc failed\n");
+        goto ERR;
+    }
+
+    p_wal->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (0 > p_wal->fd)
+    {
+        fprintf(stderr, "hash_table_wal_open: open failed\n");
+        goto ERR;
+    }
+    uint64_t end      = 0;
+    uint64_t last_lsn = after_lsn;
+    if (SUCCESS_CODE != wal_replay(p_ht, p_wal->fd, after_lsn, &end, &last_lsn))
+    {
+        goto ERR;
+    }
+    if (0 == end)
+    {
+        wal_file_header_t header = { .magic = WAL_MAGIC, .version = WAL_VERSION };
+        if ((0 != ftruncate(p_wal->fd, 0)) ||
+            (SUCCESS_CODE !=
+             wal_write_all(p_wal->fd, (uint8_t *)&header, sizeof(header))))
+        {
+            fprintf(stderr, "hash_table_wal_open: writing the header failed\n");
+            goto ERR;
+        }
+        end = sizeof(header);
+    }
+    // Appends must follow the last good record, not a torn one
+    if ((0 != ftruncate(p_wal->fd, (off_t)end)) ||
+        ((off_t)end != lseek(p_wal->fd, 0, SEEK_END)) || (0 != fdatasync(p_wal->fd)))
+    {
+        fprintf(stderr, "hash_table_wal_open: truncating the log failed\n");
+        goto ERR;
+    }
+    p_wal->file_size   = end;
+    p_wal->next_lsn    = last_lsn + 1;
+    p_wal->durable_lsn = last_lsn;
+
+    if (0 != pthread_mutex_init(&p_wal->lock, NULL))
+    {
+        fprintf(stderr, "hash_table_wal_open: pthread_mutex_init failed\n");
+        goto ERR;
+    }
+    if ((0 != pthread_cond_init(&p_wal->wake, NULL)) ||
+        (0 != pthread_cond_init(&p_wal->flushed, NULL)) ||
+        (0 != pthread_create(&p_wal->thread, NULL, wal_flusher, p_wal)))
+    {
+        fprintf(stderr, "hash_table_wal_open: starting the flusher failed\n");
+        pthread_mutex_destroy(&p_wal->lock);
+        goto ERR;
+    }
+    p_ht->wal = p_wal;
+    ret_code  = SUCCESS_CODE;
+    goto EXIT;
+
+ERR:
+    if (0 <= p_wal->fd)
+    {
+        close(p_wal->fd);
+    }
+    free(p_wal->batch);
+    free(p_wal->spare);
+    free(p_wal->path);
+    free(p_wal);
+EXIT:
+    return ret_code;
+} /* hash_table_wal_open() */
+
+int hash_table_wal_sync(hash_table_t * p_ht)
+{
+    if ((NULL == p_ht) || (NULL == p_ht->wal))
+    {
+        fprintf(stderr, "hash_table_wal_sync: no log attached\n");
+        return FAIL_CODE;
+    }
+    return ht_wal_commit(p_ht->wal, ht_wal_mark(p_ht->wal), true);
+} /* hash_table_wal_sync() */
+
+/*** end of file ***/
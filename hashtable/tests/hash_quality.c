@@ -0,0 +1,306 @@
+/* @file hash_quality.c
+ *
+ * Distribution test and throughput benchmark for the built-in hash.
+ *
+ * Hashes a few generated key sets, and optionally the keys of a file with
+ * one key per line, into a power of two number of buckets and reports how
+ * far the chain lengths are from those of a uniformly random hash. The
+ * legacy (h + c) * c hash is run on the same keys for comparison. Then times
+ * hash_function_seeded over keys of several lengths.
+ *
+ * Build and run from the hashtable directory:
+ *     make -C tests test
+ * or with a key file:
+ *     make -C tests
+ *     ./tests/hash_quality [key_file]
+ *
+ */
+
+#include "hashtable.h"
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define QUALITY_KEYS    (1u << 20) // keys per generated set
+#define QUALITY_BUCKETS (1u << 16) // buckets the keys are spread over
+#define QUALITY_KEY_MAX 256        // longest key read from a key file
+#define BENCH_BYTES     (1u << 28) // bytes hashed per benchmarked key length
+#define BENCH_BUFFER    (1u << 20) // bytes keys are read from, stays in cache
+
+typedef struct key_set
+{
+    char **  keys;
+    size_t * lengths;
+    size_t   count;
+} key_set_t;
+
+/**
+ * @brief the hash_function this tree shipped before the seeded hash
+ */
+static uint64_t legacy_hash(const char * key, size_t length)
+{
+    uint64_t hash = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash + (unsigned char)key[i]) * (unsigned char)key[i];
+    }
+    return hash;
+} /* legacy_hash() */
+
+static uint64_t seeded_hash(const char * key, size_t length)
+{
+    return hash_function_seeded(key, length, 0x243f6a8885a308d3ULL);
+} /* seeded_hash() */
+
+static double now_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + ((double)now.tv_nsec * 1e-9);
+} /* now_seconds() */
+
+static int key_set_add(key_set_t * p_set, const char * key, size_t length)
+{
+    char * p_copy = malloc(length + 1);
+    if (NULL == p_copy)
+    {
+        fprintf(stderr, "key_set_add: malloc failed\n");
+        return -1;
+    }
+    memcpy(p_copy, key, length);
+    p_copy[length]                 = '\0';
+    p_set->keys[p_set->count]      = p_copy;
+    p_set->lengths[p_set->count++] = length;
+    return 0;
+} /* key_set_add() */
+
+static int key_set_init(key_set_t * p_set, size_t capacity)
+{
+    p_set->keys    = calloc(capacity, sizeof(char *));
+    p_set->lengths = calloc(capacity, sizeof(size_t));
+    p_set->count   = 0;
+    if ((NULL == p_set->keys) || (NULL == p_set->lengths))
+    {
+        fprintf(stderr, "key_set_init: calloc failed\n");
+        return -1;
+    }
+    return 0;
+} /* key_set_init() */
+
+static void key_set_free(key_set_t * p_set)
+{
+    for (size_t i = 0; i < p_set->count; i++)
+    {
+        free(p_set->keys[i]);
+    }
+    free(p_set->keys);
+    free(p_set->lengths);
+} /* key_set_free() */
+
+/**
+ * @brief Builds one of the generated key sets: 0 "user:N", 1 URLs sharing a
+ * long prefix, 2 random 12 byte strings, 3 consecutive 8 byte integers
+ */
+static int key_set_generate(key_set_t * p_set, int kind)
+{
+    char     key[QUALITY_KEY_MAX];
+    uint64_t rng = 0x9e3779b97f4a7c15ULL;
+    if (0 != key_set_init(p_set, QUALITY_KEYS))
+    {
+        return -1;
+    }
+    for (uint32_t i = 0; i < QUALITY_KEYS; i++)
+    {
+        int length = 0;
+        switch (kind)
+        {
+            case 0:
+                length = snprintf(key, sizeof(key), "user:%" PRIu32, i);
+                break;
+            case 1:
+                length = snprintf(key, sizeof(key),
+                                  "https://www.example.com/catalogue/items/%" PRIu32
+                                  "/details",
+                                  i);
+                break;
+            case 2:
+                for (length = 0; length < 12; length++)
+                {
+                    rng ^= rng << 13;
+                    rng ^= rng >> 7;
+                    rng ^= rng << 17;
+                    key[length] = (char)(' ' + (rng % 95));
+                }
+                break;
+            default:
+                length = sizeof(uint64_t);
+                memcpy(key, &(uint64_t){ i }, sizeof(uint64_t));
+                break;
+        }
+        if (0 != key_set_add(p_set, key, (size_t)length))
+        {
+            return -1;
+        }
+    }
+    return 0;
+} /* key_set_generate() */
+
+static int key_set_load(key_set_t * p_set, const char * path)
+{
+    FILE * p_file = fopen(path, "r");
+    if (NULL == p_file)
+    {
+        fprintf(stderr, "key_set_load: could not open %s\n", path);
+        return -1;
+    }
+    size_t capacity = 1024;
+    char   key[QUALITY_KEY_MAX];
+    int    result   = key_set_init(p_set, capacity);
+    while ((0 == result) && (NULL != fgets(key, sizeof(key), p_file)))
+    {
+        size_t length = strcspn(key, "\r\n");
+        if (p_set->count == capacity)
+        {
+            capacity *= 2;
+            char **  p_keys    = realloc(p_set->keys, capacity * sizeof(char *));
+            size_t * p_lengths = (NULL == p_keys)
+                                     ? NULL
+                                     : realloc(p_set->lengths, capacity * sizeof(size_t));
+            p_set->keys = (NULL == p_keys) ? p_set->keys : p_keys;
+            if (NULL == p_lengths)
+            {
+                fprintf(stderr, "key_set_load: realloc failed\n");
+                result = -1;
+                break;
+            }
+            p_set->lengths = p_lengths;
+        }
+        result = key_set_add(p_set, key, length);
+    }
+    fclose(p_file);
+    return result;
+} /* key_set_load() */
+
+/**
+ * @brief Spreads a key set over QUALITY_BUCKETS by the low bits of the hash,
+ * as a table indexes its buckets, and prints how the chain lengths compare
+ * with a uniformly random hash
+ * @return bool true when chi squared is within five standard deviations of
+ * its expected value
+ */
+static bool quality_report(const char *   name,
+                           const char *   hash_name,
+                           hashfunction * hf,
+                           const key_set_t * p_set)
+{
+    static uint32_t chains[QUALITY_BUCKETS];
+    memset(chains, 0, sizeof(chains));
+    for (size_t i = 0; i < p_set->count; i++)
+    {
+        chains[hf(p_set->keys[i], p_set->lengths[i]) & (QUALITY_BUCKETS - 1)]++;
+    }
+
+    double   expected = (double)p_set->count / QUALITY_BUCKETS;
+    double   chi2     = 0.0;
+    uint32_t longest  = 0;
+    uint32_t empty    = 0;
+    for (uint32_t i = 0; i < QUALITY_BUCKETS; i++)
+    {
+        double diff = (double)chains[i] - expected;
+        chi2 += (diff * diff) / expected;
+        longest = (chains[i] > longest) ? chains[i] : longest;
+        empty += (0 == chains[i]);
+    }
+    // chi squared over k - 1 degrees of freedom has that mean and variance 2(k - 1)
+    double dof   = QUALITY_BUCKETS - 1;
+    double sigma = (chi2 - dof) / sqrt(2.0 * dof);
+    printf("%-10s %-7s keys %8zu  chi2 %12.0f (%+8.1f sigma)  longest %6" PRIu32
+           "  empty %5.2f%% (random %5.2f%%)\n",
+           name,
+           hash_name,
+           p_set->count,
+           chi2,
+           sigma,
+           longest,
+           100.0 * empty / QUALITY_BUCKETS,
+           100.0 * exp(-expected));
+    return fabs(sigma) < 5.0;
+} /* quality_report() */
+
+/**
+ * @brief Times hash_function_seeded over keys of each length in turn
+ */
+static void bench_report(void)
+{
+    static const size_t lengths[] = { 4, 8, 16, 32, 64, 256, 4096 };
+    char *              p_buffer  = malloc(BENCH_BUFFER + 4096 + 8);
+    if (NULL == p_buffer)
+    {
+        fprintf(stderr, "bench_report: malloc failed\n");
+        return;
+    }
+    for (size_t i = 0; i < BENCH_BUFFER + 4096 + 8; i++)
+    {
+        p_buffer[i] = (char)(i * 131);
+    }
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+    {
+        size_t            length = lengths[l];
+        size_t            keys   = BENCH_BYTES / length;
+        volatile uint64_t sink   = 0;
+        uint64_t          acc    = 0;
+        double            start  = now_seconds();
+        for (size_t k = 0; k < keys; k++)
+        {
+            // Offsets shift by a byte so every key is read unaligned once in a while
+            size_t offset = ((k * length) % BENCH_BUFFER) + (k & 7);
+            acc ^= hash_function_seeded(&p_buffer[offset], length, k);
+        }
+        double elapsed = now_seconds() - start;
+        sink           = acc;
+        (void)sink;
+        printf("bench      %5zu byte keys  %7.2f ns/key  %7.2f GB/s\n",
+               length,
+               elapsed * 1e9 / keys,
+               BENCH_BYTES / elapsed / 1e9);
+    }
+    free(p_buffer);
+} /* bench_report() */
+
+int main(int argc, char ** argv)
+{
+    static const char * names[] = { "user:N", "url", "random12", "uint64" };
+    bool                passed  = true;
+    for (int kind = 0; kind < 4; kind++)
+    {
+        key_set_t set = { 0 };
+        if (0 != key_set_generate(&set, kind))
+        {
+            key_set_free(&set);
+            return EXIT_FAILURE;
+        }
+        passed = quality_report(names[kind], "seeded", seeded_hash, &set) && passed;
+        quality_report(names[kind], "legacy", legacy_hash, &set);
+        key_set_free(&set);
+    }
+    if (1 < argc)
+    {
+        key_set_t set = { 0 };
+        if (0 != key_set_load(&set, argv[1]))
+        {
+            key_set_free(&set);
+            return EXIT_FAILURE;
+        }
+        passed = quality_report(argv[1], "seeded", seeded_hash, &set) && passed;
+        quality_report(argv[1], "legacy", legacy_hash, &set);
+        key_set_free(&set);
+    }
+    bench_report();
+    printf("%s\n", passed ? "distribution ok" : "distribution FAILED");
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+} /* main() */
+
+/*** end of file ***/
@@ -0,0 +1,136 @@
+/* @file steal_priority.c
+ *
+ * Checks that a high priority job does not wait behind a backlog of low
+ * priority work in a work-stealing pool, with either shared queue.
+ *
+ * A one thread pool is given a backlog of slow low priority jobs, which the
+ * thread batches onto its deque, then one high priority job. The high job
+ * has to start within a few low jobs, as it does in a FIFO pool, instead of
+ * after the whole batch.
+ *
+ * Build and run from the tpool directory:
+ *     make -C tests
+ *     ./tests/steal_priority
+ *
+ */
+
+#include "thread_pool.h"
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BACKLOG_JOBS  200 // low priority jobs queued ahead of the high one
+#define BACKLOG_US    5000 // time each of them runs for
+#define LATENCY_LIMIT 50   // ms the high job may wait, a batch took ~150
+
+volatile sig_atomic_t shutdown_flag = 0;
+
+void execute_job(int socket, threadpool_t * p_pool)
+{
+    (void)socket;
+    (void)p_pool;
+} /* execute_job() */
+
+static atomic_bool g_done;
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+} /* now_ns() */
+
+static void * backlog_task(void * arg)
+{
+    (void)arg;
+    if (!atomic_load(&g_done))
+    {
+        usleep(BACKLOG_US);
+    }
+    return NULL;
+} /* backlog_task() */
+
+static void * latency_task(void * arg)
+{
+    uint64_t * p_started = arg;
+    *p_started           = now_ns();
+    return arg;
+} /* latency_task() */
+
+/**
+ * @brief Measures how long the high job waits behind the backlog
+ * @return double ms from its submit until it started, negative on failure
+ */
+static double high_latency(thpool_mode_t mode, thpool_queue_t queue)
+{
+    thpool_opts_t  opts    = { .mode = mode, .queue = queue };
+    threadpool_t * p_pool  = thpool_init_ex(1, &opts);
+    double         latency = -1.0;
+    if (NULL == p_pool)
+    {
+        fprintf(stderr, "steal_priority: thpool_init_ex failed\n");
+        return latency;
+    }
+    atomic_store(&g_done, false);
+
+    thpool_job_opts_t low = { .priority = THPOOL_PRIORITY_LOW };
+    for (int i = 0; i < BACKLOG_JOBS; i++)
+    {
+        thpool_future_t * p_future = thpool_submit_ex(p_pool, backlog_task, NULL, &low);
+        if (NULL == p_future)
+        {
+            fprintf(stderr, "steal_priority: low submit failed\n");
+            goto EXIT;
+        }
+        thpool_future_release(p_future);
+    }
+    // Long enough for the thread to have moved a batch onto its deque
+    usleep(3 * BACKLOG_US);
+
+    thpool_job_opts_t high    = { .priority = THPOOL_PRIORITY_HIGH };
+    uint64_t          started = 0;
+    uint64_t          queued  = now_ns();
+    thpool_future_t * p_high  = thpool_submit_ex(p_pool, latency_task, &started, &high);
+    if (NULL == p_high)
+    {
+        fprintf(stderr, "steal_priority: high submit failed\n");
+        goto EXIT;
+    }
+    thpool_future_wait(p_high);
+    thpool_future_release(p_high);
+    latency = (double)(started - queued) / 1e6;
+EXIT:
+    // The rest of the backlog returns at once, or is discarded
+    atomic_store(&g_done, true);
+    thpool_destroy(p_pool);
+    return latency;
+} /* high_latency() */
+
+int main(void)
+{
+    static const struct
+    {
+        const char *   name;
+        thpool_mode_t  mode;
+        thpool_queue_t queue;
+    } cases[] = {
+        { "fifo list", THPOOL_MODE_FIFO, THPOOL_QUEUE_LIST },
+        { "stealing list", THPOOL_MODE_STEALING, THPOOL_QUEUE_LIST },
+        { "stealing ring", THPOOL_MODE_STEALING, THPOOL_QUEUE_RING },
+    };
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        double latency = high_latency(cases[i].mode, cases[i].queue);
+        bool   ok      = (0.0 <= latency) && (latency < LATENCY_LIMIT);
+        printf("%-14s high job waited %7.2f ms  %s\n",
+               cases[i].name,
+               latency,
+               ok ? "ok" : "FAIL");
+        failed += !ok;
+    }
+    return (0 == failed) ? 0 : 1;
+} /* main() */
+
+/*** end of file ***/
@@ -6,27 +6,566 @@
  *
  */
 
-#include "thread_pool.h"
+#include "thread_pool_internal.h"
+#include <errno.h>
 #include <signal.h>
-
-#define POOL_SIZE_MIN 1
-#define FAIL_CODE     -1
-#define SUCCESS_CODE  1
+#include <time.h>
 
 extern volatile sig_atomic_t shutdown_flag;
 
+__thread thpool_worker_t *     t_thpool_worker = NULL; // set on work-stealing threads
+static __thread threadpool_t * t_thpool        = NULL; // set on every pool thread
+
+static void * thread_steal_function(void * arg);
+static bool   thread_wait(threadpool_t * p_pool);
+
+static inline uint64_t thpool_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+} /* thpool_now() */
+
+static inline bool thpool_elastic(const threadpool_t * p_pool)
+{
+    return p_pool->thread_min < p_pool->pool_size;
+} /* thpool_elastic() */
+
+// Classes tried when the one whose turn it is has no job
+static const unsigned char queue_order[THPOOL_PRIORITIES] = {
+    THPOOL_PRIORITY_HIGH, THPOOL_PRIORITY_NORMAL, THPOOL_PRIORITY_LOW
+};
+
+/**
+ * @brief Lays out one round of turns, weights[c] of them for class c, spread
+ * out by smooth weighted round robin so a class with a large weight does not
+ * take all its turns back to back
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE on failure
+ */
+static int schedule_init(threadpool_t * p_pool, const uint8_t * p_weights)
+{
+    static const uint8_t defaults[THPOOL_PRIORITIES] = { 4, 8, 1 };
+    int                  weight[THPOOL_PRIORITIES];
+    int                  current[THPOOL_PRIORITIES] = { 0 };
+    int                  total                      = 0;
+    for (int c = 0; c < THPOOL_PRIORITIES; c++)
+    {
+        weight[c] = (0 == p_weights[c]) ? defaults[c] : p_weights[c];
+        total += weight[c];
+    }
+    p_pool->schedule = calloc(total, sizeof(unsigned char));
+    if (NULL == p_pool->schedule)
+    {
+        fprintf(stderr, "Could not allocate memory for schedule\n");
+        return FAIL_CODE;
+    }
+    for (int i = 0; i < total; i++)
+    {
+        int best = 0;
+        for (int c = 0; c < THPOOL_PRIORITIES; c++)
+        {
+            current[c] += weight[c];
+            if (current[c] > current[best])
+            {
+                best = c;
+            }
+        }
+        current[best] -= total;
+        p_pool->schedule[i] = (unsigned char)best;
+    }
+    p_pool->schedule_len = (unsigned int)total;
+    return SUCCESS_CODE;
+} /* schedule_init() */
+
+/**
+ * @brief Returns the class whose turn it is to give up a job
+ */
+static inline int queue_turn(threadpool_t * p_pool)
+{
+    unsigned int turn = __atomic_fetch_add(&p_pool->schedule_pos, 1, __ATOMIC_RELAXED);
+    return p_pool->schedule[turn % p_pool->schedule_len];
+} /* queue_turn() */
+
+/**
+ * @brief Appends a job to the list of its class. The caller holds the pool lock.
+ * @return int jobs queued
+ */
+static int list_put(threadpool_t * p_pool, job_t * p_job)
+{
+    int cls     = p_job->priority;
+    p_job->next = NULL;
+    if (NULL == p_pool->tail[cls])
+    {
+        p_pool->head[cls] = p_job;
+    }
+    else
+    {
+        p_pool->tail[cls]->next = p_job;
+    }
+    p_pool->tail[cls] = p_job;
+    __atomic_add_fetch(&p_pool->class_size[cls], 1, __ATOMIC_RELAXED);
+    return ++p_pool->queue_size;
+} /* list_put() */
+
+/**
+ * @brief Puts a job just taken back at the front of its class's list. The
+ * caller holds the pool lock.
+ */
+static void list_untake(threadpool_t * p_pool, job_t * p_job)
+{
+    int cls           = p_job->priority;
+    p_job->next       = p_pool->head[cls];
+    p_pool->head[cls] = p_job;
+    if (NULL == p_pool->tail[cls])
+    {
+        p_pool->tail[cls] = p_job;
+    }
+    __atomic_add_fetch(&p_pool->class_size[cls], 1, __ATOMIC_RELAXED);
+    p_pool->queue_size++;
+} /* list_untake() */
+
+/**
+ * @brief Takes the oldest job of one class. The caller holds the pool lock.
+ * @return job_t* on success
+ * @return NULL when the class has no job
+ */
+static job_t * list_take_class(threadpool_t * p_pool, int cls)
+{
+    job_t * p_job = p_pool->head[cls];
+    if (NULL == p_job)
+    {
+        return NULL;
+    }
+    p_pool->head[cls] = p_job->next;
+    if (NULL == p_pool->head[cls])
+    {
+        p_pool->tail[cls] = NULL;
+    }
+    __atomic_sub_fetch(&p_pool->class_size[cls], 1, __ATOMIC_RELAXED);
+    p_pool->queue_size--;
+    return p_job;
+} /* list_take_class() */
+
+/**
+ * @brief Takes the oldest job of the class whose turn it is, or of the
+ * highest class that has one. The caller holds the pool lock.
+ * @return job_t* on success
+ * @return NULL when the list queue is empty
+ */
+static job_t * list_take(threadpool_t * p_pool)
+{
+    int cls = queue_turn(p_pool);
+    for (int i = 0; (i < THPOOL_PRIORITIES) && (NULL == p_pool->head[cls]); i++)
+    {
+        cls = queue_order[i];
+    }
+    return list_take_class(p_pool, cls);
+} /* list_take() */
+
+/**
+ * @brief list_take for a ring queue, which takes no lock
+ */
+static job_t * ring_take(threadpool_t * p_pool)
+{
+    job_t * p_job = thpool_ring_pop(&p_pool->ring[queue_turn(p_pool)]);
+    for (int i = 0; (i < THPOOL_PRIORITIES) && (NULL == p_job); i++)
+    {
+        p_job = thpool_ring_pop(&p_pool->ring[queue_order[i]]);
+    }
+    return p_job;
+} /* ring_take() */
+
+/**
+ * @brief Returns roughly how many jobs the rings of a ring queue hold
+ */
+static size_t ring_count(threadpool_t * p_pool)
+{
+    size_t count = 0;
+    for (int c = 0; c < THPOOL_PRIORITIES; c++)
+    {
+        count += thpool_ring_count(&p_pool->ring[c]);
+    }
+    return count;
+} /* ring_count() */
+
+/**
+ * @brief Checks, without the pool lock, whether the shared queue holds a job
+ * of a class served before cls
+ */
+static bool shared_waiting_above(threadpool_t * p_pool, int cls)
+{
+    for (int i = 0; queue_order[i] != cls; i++)
+    {
+        int  above   = queue_order[i];
+        bool waiting = (NULL != p_pool->ring)
+                           ? !thpool_ring_empty(&p_pool->ring[above])
+                           : (0 != __atomic_load_n(&p_pool->class_size[above],
+                                                   __ATOMIC_RELAXED));
+        if (waiting)
+        {
+            return true;
+        }
+    }
+    return false;
+} /* shared_waiting_above() */
+
+/**
+ * @brief Starts the thread of a free slot. The caller holds the pool lock.
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE on failure
+ */
+static int thread_start(threadpool_t * p_pool, int slot)
+{
+    void * (*p_start)(void *) = thread_function;
+    void * p_arg              = p_pool;
+    if (THPOOL_MODE_STEALING == p_pool->mode)
+    {
+        p_start = thread_steal_function;
+        p_arg   = &p_pool->workers[slot];
+    }
+    // Counted first, the thread divides the queue by the count
+    __atomic_add_fetch(&p_pool->thread_count, 1, __ATOMIC_RELAXED);
+    if (pthread_create(&(p_pool->threads[slot]), NULL, p_start, p_arg) != 0)
+    {
+        __atomic_sub_fetch(&p_pool->thread_count, 1, __ATOMIC_RELAXED);
+        return FAIL_CODE;
+    }
+    p_pool->thread_state[slot] = THPOOL_THREAD_RUNNING;
+    return SUCCESS_CODE;
+} /* thread_start() */
+
+/**
+ * @brief Adds a thread to an elastic pool that runs fewer than pool_size,
+ * unless one of its threads is idle and about to take the work anyway
+ */
+static void thread_grow(threadpool_t * p_pool)
+{
+    if ((p_pool->pool_size <= __atomic_load_n(&p_pool->thread_count, __ATOMIC_RELAXED)) ||
+        (0 < __atomic_load_n(&p_pool->idle, __ATOMIC_RELAXED)))
+    {
+        return;
+    }
+    pthread_mutex_lock(&(p_pool->lock));
+    for (int i = 0; (i < p_pool->pool_size) && !p_pool->shutdown &&
+                    (p_pool->thread_count < p_pool->pool_size);
+         i++)
+    {
+        if (THPOOL_THREAD_RUNNING == p_pool->thread_state[i])
+        {
+            continue;
+        }
+        if (THPOOL_THREAD_EXITED == p_pool->thread_state[i])
+        {
+            // Retired under the lock, it no longer needs it to finish
+            pthread_join(p_pool->threads[i], NULL);
+            p_pool->thread_state[i] = THPOOL_THREAD_NONE;
+        }
+        if (SUCCESS_CODE != thread_start(p_pool, i))
+        {
+            fprintf(stderr, "Could not add thread to pool\n");
+        }
+        __atomic_store_n(&p_pool->grown, thpool_now(), __ATOMIC_RELAXED);
+        break;
+    }
+    pthread_mutex_unlock(&(p_pool->lock));
+} /* thread_grow() */
+
+/**
+ * @brief Grows an elastic pool when more than grow_depth jobs per thread
+ * wait in the shared queue
+ */
+static void thread_check_depth(threadpool_t * p_pool, uint64_t depth)
+{
+    if (thpool_elastic(p_pool) &&
+        (depth > p_pool->grow_depth *
+                     (uint64_t)__atomic_load_n(&p_pool->thread_count, __ATOMIC_RELAXED)))
+    {
+        thread_grow(p_pool);
+    }
+} /* thread_check_depth() */
+
+/**
+ * @brief Deals with a job taken after its deadline: discards it, or for
+ * THPOOL_EXPIRY_DEMOTE queues it again behind everything but other low
+ * priority work. A demoted job that does not fit the ring runs right away.
+ * The calling thread looks at the queues next, so none needs waking.
+ */
+static void thread_expire(threadpool_t * p_pool, job_t * job)
+{
+    if (THPOOL_EXPIRY_DEMOTE != job->expiry)
+    {
+        thpool_job_discard(job);
+        return;
+    }
+    job->priority = THPOOL_PRIORITY_LOW;
+    job->deadline = 0;
+    if (NULL != p_pool->ring)
+    {
+        if (SUCCESS_CODE != thpool_ring_push(&p_pool->ring[THPOOL_PRIORITY_LOW], job))
+        {
+            thpool_job_run(job);
+        }
+        return;
+    }
+    pthread_mutex_lock(&(p_pool->lock));
+    list_put(p_pool, job);
+    pthread_mutex_unlock(&(p_pool->lock));
+} /* thread_expire() */
+
+/**
+ * @brief Runs a job unless its deadline has passed, first growing an elastic
+ * pool when the job waited longer than grow_wait. Waits grow it by one
+ * thread per grow_wait at most, so the thread added last gets to take its
+ * share of the backlog first.
+ */
+static void thread_run(threadpool_t * p_pool, job_t * job)
+{
+    uint64_t now = 0;
+    if (0 != job->deadline)
+    {
+        now = thpool_now();
+        if (now > job->deadline)
+        {
+            thread_expire(p_pool, job);
+            return;
+        }
+    }
+    if (thpool_elastic(p_pool))
+    {
+        now = (0 == now) ? thpool_now() : now;
+        if ((now - job->queued > p_pool->grow_wait) &&
+            (now - __atomic_load_n(&p_pool->grown, __ATOMIC_RELAXED) > p_pool->grow_wait))
+        {
+            thread_grow(p_pool);
+        }
+    }
+    thpool_job_run(job);
+} /* thread_run() */
+
+/**
+ * @brief Sets the time until which an idle thread of an elastic pool waits
+ * before it retires
+ */
+static void thread_deadline(threadpool_t * p_pool, struct timespec * p_deadline)
+{
+    uint64_t deadline   = thpool_now() + p_pool->linger;
+    p_deadline->tv_sec  = (time_t)(deadline / 1000000000ULL);
+    p_deadline->tv_nsec = (long)(deadline % 1000000000ULL);
+} /* thread_deadline() */
+
+/**
+ * @brief Waits on not_empty. The caller holds the pool lock. A thread of an
+ * elastic pool waits until its deadline at most.
+ * @return true when the deadline passed and the thread may retire, once the
+ * caller has checked again that there is no work
+ * @return false otherwise
+ */
+static bool thread_sleep(threadpool_t * p_pool, struct timespec * p_deadline)
+{
+    if (!thpool_elastic(p_pool))
+    {
+        pthread_cond_wait(&(p_pool->not_empty), &(p_pool->lock));
+        return false;
+    }
+    if (ETIMEDOUT !=
+        pthread_cond_timedwait(&(p_pool->not_empty), &(p_pool->lock), p_deadline))
+    {
+        return false;
+    }
+    if (p_pool->shutdown || (p_pool->thread_count <= p_pool->thread_min))
+    {
+        // Stays, and lingers again before it looks at the count next
+        thread_deadline(p_pool, p_deadline);
+        return false;
+    }
+    return true;
+} /* thread_sleep() */
+
+/**
+ * @brief Marks the calling thread's slot for the next thread_grow or
+ * thpool_destroy to join. The caller holds the pool lock and exits next.
+ */
+static void thread_retire(threadpool_t * p_pool)
+{
+    for (int i = 0; i < p_pool->pool_size; i++)
+    {
+        if ((THPOOL_THREAD_RUNNING == p_pool->thread_state[i]) &&
+            pthread_equal(p_pool->threads[i], pthread_self()))
+        {
+            p_pool->thread_state[i] = THPOOL_THREAD_EXITED;
+            break;
+        }
+    }
+    __atomic_sub_fetch(&p_pool->thread_count, 1, __ATOMIC_RELAXED);
+} /* thread_retire() */
+
+/**
+ * @brief Gives every thread of a work-stealing pool its deque
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE on failure
+ */
+static int workers_init(threadpool_t * p_pool)
+{
+    p_pool->workers = aligned_alloc(THPOOL_CACHE_LINE,
+                                    p_pool->pool_size * sizeof(thpool_worker_t));
+    if (NULL == p_pool->workers)
+    {
+        fprintf(stderr, "Could not allocate memory for workers\n");
+        return FAIL_CODE;
+    }
+    memset(p_pool->workers, 0, p_pool->pool_size * sizeof(thpool_worker_t));
+    for (int i = 0; i < p_pool->pool_size; i++)
+    {
+        thpool_worker_t * p_worker = &p_pool->workers[i];
+        p_worker->p_pool           = p_pool;
+        p_worker->rng              = (uint64_t)(i + 1) * 0x9e3779b97f4a7c15ULL;
+        if (SUCCESS_CODE != thpool_deque_init(&p_worker->deque, THPOOL_DEQUE_SIZE))
+        {
+            fprintf(stderr, "Could not allocate memory for worker deque\n");
+            return FAIL_CODE;
+        }
+    }
+    return SUCCESS_CODE;
+} /* workers_init() */
+
+/**
+ * @brief Discards the jobs left on the deques and frees them, once the
+ * threads are gone
+ */
+static void workers_free(threadpool_t * p_pool)
+{
+    for (int i = 0; (NULL != p_pool->workers) && (i < p_pool->pool_size); i++)
+    {
+        thpool_deque_t * p_deque = &p_pool->workers[i].deque;
+        if (NULL == atomic_load(&p_deque->array))
+        {
+            continue;
+        }
+        job_t * job = NULL;
+        while (NULL != (job = thpool_deque_take(p_deque)))
+        {
+            thpool_job_discard(job);
+        }
+        thpool_deque_destroy(p_deque);
+    }
+    free(p_pool->workers);
+    p_pool->workers = NULL;
+} /* workers_free() */
+
+/**
+ * @brief Sets up the rings of a ring queue, one per class, and the ring of
+ * free jobs that lets submits to them take a job without the pool lock
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE on failure
+ */
+static int rings_init(threadpool_t * p_pool, uint32_t capacity)
+{
+    size_t size = 2;
+    while (size < ((0 == capacity) ? THPOOL_RING_SIZE : capacity))
+    {
+        size <<= 1;
+    }
+    // Cleared as soon as allocated, rings_free looks at the slots of both
+    // even when only one of them could be allocated
+    p_pool->ring =
+        aligned_alloc(THPOOL_CACHE_LINE, THPOOL_PRIORITIES * sizeof(thpool_ring_t));
+    if (NULL != p_pool->ring)
+    {
+        memset(p_pool->ring, 0, THPOOL_PRIORITIES * sizeof(thpool_ring_t));
+    }
+    p_pool->free_ring = aligned_alloc(THPOOL_CACHE_LINE, sizeof(thpool_ring_t));
+    if (NULL != p_pool->free_ring)
+    {
+        memset(p_pool->free_ring, 0, sizeof(thpool_ring_t));
+    }
+    if ((NULL == p_pool->ring) || (NULL == p_pool->free_ring))
+    {
+        fprintf(stderr, "Could not allocate memory for ring queue\n");
+        return FAIL_CODE;
+    }
+    for (int c = 0; c < THPOOL_PRIORITIES; c++)
+    {
+        if (SUCCESS_CODE != thpool_ring_init(&p_pool->ring[c], size))
+        {
+            return FAIL_CODE;
+        }
+    }
+    // Jobs outlive their slot while they run and while a future holds them,
+    // so the free ring has room for a queue's worth more than all classes
+    size_t free_size = size;
+    while (free_size < size * (THPOOL_PRIORITIES + 1))
+    {
+        free_size <<= 1;
+    }
+    if (SUCCESS_CODE != thpool_ring_init(p_pool->free_ring, free_size))
+    {
+        return FAIL_CODE;
+    }
+    // Prefilled up to the default size, a larger ring fills as jobs come back
+    for (size_t i = 0; (i < size) && (i < THPOOL_RING_SIZE); i++)
+    {
+        job_t * p_job = thpool_job_alloc_locked(p_pool);
+        if (NULL == p_job)
+        {
+            return FAIL_CODE;
+        }
+        thpool_ring_push(p_pool->free_ring, p_job);
+    }
+    return SUCCESS_CODE;
+} /* rings_init() */
+
+/**
+ * @brief Frees the rings of a pool, once the threads are gone. Jobs left in
+ * the queues are discarded.
+ */
+static void rings_free(threadpool_t * p_pool)
+{
+    for (int c = 0; (NULL != p_pool->ring) && (c < THPOOL_PRIORITIES); c++)
+    {
+        if (NULL == p_pool->ring[c].slots)
+        {
+            continue;
+        }
+        job_t * job = NULL;
+        while (NULL != (job = thpool_ring_pop(&p_pool->ring[c])))
+        {
+            thpool_job_discard(job);
+        }
+        thpool_ring_destroy(&p_pool->ring[c]);
+    }
+    if (NULL != p_pool->free_ring)
+    {
+        thpool_ring_destroy(p_pool->free_ring);
+    }
+    free(p_pool->ring);
+    p_pool->ring = NULL;
+    free(p_pool->free_ring);
+    p_pool->free_ring = NULL;
+} /* rings_free() */
+
 threadpool_t * thpool_init(int pool_size)
+{
+    return thpool_init_ex(pool_size, NULL);
+} /* thpool_init() */
+
+threadpool_t * thpool_init_ex(int pool_size, const thpool_opts_t * p_opts)
 {
     threadpool_t * pool = NULL;
+    thpool_opts_t  opts = { 0 };
+    if (NULL != p_opts)
+    {
+        opts = *p_opts;
+    }
 
     if (POOL_SIZE_MIN > pool_size)
     {
         fprintf(stderr, "Pool size too small\n");
         goto EXIT;
     }
-    if (MAX_CONNECTIONS < pool_size)
+    if ((0 != opts.max_threads) && (opts.max_threads < pool_size))
     {
-        fprintf(stderr, "Pool size too large\n");
+        fprintf(stderr, "Pool size above max_threads\n");
         goto EXIT;
     }
     pool = calloc(1, sizeof(threadpool_t));
@@ -37,9 +576,8 @@ threadpool_t * thpool_init(int pool_size)
     }
 
     pool->queue_size = 0;
-    pool->head       = NULL;
-    pool->tail       = NULL;
     pool->shutdown   = false;
+    pool->mode       = opts.mode;
 
     // int hash_success = create_tpool_hashtable(pool);
     // if (FAIL_CODE == hash_success)
@@ -48,13 +586,29 @@ threadpool_t * thpool_init(int pool_size)
     //     goto PATH_ERROR;
     // }
 
-    pool->pool_size = pool_size;
-    pool->threads   = calloc(pool_size, sizeof(pthread_t));
+    pool->thread_min = pool_size;
+    pool->pool_size  = (0 == opts.max_threads) ? pool_size : opts.max_threads;
+    pool->grow_depth = (0 == opts.grow_depth) ? THPOOL_GROW_DEPTH : opts.grow_depth;
+    pool->grow_wait  = (0 == opts.grow_wait_ms) ? THPOOL_GROW_WAIT_MS : opts.grow_wait_ms;
+    pool->grow_wait *= 1000000ULL;
+    pool->linger     = (0 == opts.linger_ms) ? THPOOL_LINGER_MS : opts.linger_ms;
+    pool->linger    *= 1000000ULL;
+    pool->threads    = calloc(pool->pool_size, sizeof(pthread_t));
     if (NULL == pool->threads)
     {
         fprintf(stderr, "Could not allocate memory for threads\n");
         goto PATH_ERROR;
     }
+    pool->thread_state = calloc(pool->pool_size, sizeof(unsigned char));
+    if (NULL == pool->thread_state)
+    {
+        fprintf(stderr, "Could not allocate memory for threads\n");
+        goto THREAD_ERROR;
+    }
+    if (SUCCESS_CODE != schedule_init(pool, opts.weights))
+    {
+        goto THREAD_ERROR;
+    }
     if (pthread_mutex_init(&(pool->lock), NULL) != 0)
     {
         fprintf(stderr, "Could not initialize mutex\n");
@@ -65,7 +619,14 @@ threadpool_t * thpool_init(int pool_size)
         fprintf(stderr, "Could not initialize mutex\n");
         goto THREAD_ERROR;
     }
-    if (pthread_cond_init(&(pool->not_empty), NULL) != 0)
+    // Monotonic, so the linger time of an elastic pool's threads does not
+    // jump with the wall clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int cond_status = pthread_cond_init(&(pool->not_empty), &attr);
+    pthread_condattr_destroy(&attr);
+    if (cond_status != 0)
     {
         fprintf(stderr, "Could not initialize cond_t\n");
         goto THREAD_ERROR;
@@ -75,30 +636,264 @@ threadpool_t * thpool_init(int pool_size)
         fprintf(stderr, "Could not initialize cond_t\n");
         goto THREAD_ERROR;
     }
-    for (int i = 0; i < pool_size; i++)
+    if (pthread_mutex_init(&(pool->done_lock), NULL) != 0)
     {
-        if (pthread_create(&(pool->threads[i]), NULL, thread_function, (void *)pool) != 0)
-        {
-            fprintf(stderr, "Could not create thread pool\n");
-            thpool_destroy(pool);
-            goto EXIT;
-        }
+        fprintf(stderr, "Could not initialize mutex\n");
+        goto THREAD_ERROR;
+    }
+    if (pthread_cond_init(&(pool->done), NULL) != 0)
+    {
+        fprintf(stderr, "Could not initialize cond_t\n");
+        goto THREAD_ERROR;
+    }
+    if ((THPOOL_QUEUE_RING == opts.queue) &&
+        (SUCCESS_CODE != rings_init(pool, opts.queue_capacity)))
+    {
+        rings_free(pool);
+        thpool_jobs_free(pool);
+        goto THREAD_ERROR;
+    }
+    if ((THPOOL_MODE_STEALING == pool->mode) && (SUCCESS_CODE != workers_init(pool)))
+    {
+        workers_free(pool);
+        rings_free(pool);
+        thpool_jobs_free(pool);
+        goto THREAD_ERROR;
+    }
+    // Held so the threads see every slot and the full count from the start
+    pthread_mutex_lock(&(pool->lock));
+    int started = 0;
+    while ((started < pool_size) && (SUCCESS_CODE == thread_start(pool, started)))
+    {
+        started++;
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    if (started < pool_size)
+    {
+        fprintf(stderr, "Could not create thread pool\n");
+        thpool_destroy(pool);
+        pool = NULL;
     }
     goto EXIT;
 THREAD_ERROR:
     free(pool->threads);
     pool->threads = NULL;
+    free(pool->thread_state);
+    pool->thread_state = NULL;
+    free(pool->schedule);
+    pool->schedule = NULL;
 PATH_ERROR:
     free(pool);
     pool = NULL;
 EXIT:
     return pool;
-} /* thpool_init() */
+} /* thpool_init_ex() */
+
+/**
+ * @brief Wakes a waiting thread of a pool whose threads wait in thread_wait,
+ * if there is one. The caller has just made a job visible with a
+ * sequentially consistent store.
+ */
+static void thpool_wake(threadpool_t * p_pool)
+{
+    if (0 < __atomic_load_n(&p_pool->idle, __ATOMIC_SEQ_CST))
+    {
+        // Taken so the signal cannot slip in between a waiter's last look
+        // at the queues and its wait
+        pthread_mutex_lock(&(p_pool->lock));
+        pthread_cond_signal(&(p_pool->not_empty));
+        pthread_mutex_unlock(&(p_pool->lock));
+    }
+} /* thpool_wake() */
+
+/**
+ * @brief Fills in a job taken for a submit
+ */
+static void job_fill(job_t *                   p_job,
+                     threadpool_t *            p_pool,
+                     thpool_function *         function,
+                     void *                    arg,
+                     void (*discard)(void *),
+                     unsigned int              refs,
+                     const thpool_job_opts_t * p_opts)
+{
+    p_job->function = function;
+    p_job->arg      = arg;
+    p_job->discard  = discard;
+    p_job->result   = NULL;
+    p_job->then     = NULL;
+    p_job->then_ctx = NULL;
+    p_job->p_pool   = p_pool;
+    p_job->state    = 0;
+    p_job->refs     = refs;
+    p_job->next     = NULL;
+    p_job->deadline = 0;
+    p_job->priority = THPOOL_PRIORITY_NORMAL;
+    p_job->expiry   = THPOOL_EXPIRY_DROP;
+    if (NULL != p_opts)
+    {
+        p_job->priority = (unsigned char)p_opts->priority;
+        p_job->expiry   = (unsigned char)p_opts->expiry;
+    }
+    if (thpool_elastic(p_pool) || ((NULL != p_opts) && (0 != p_opts->deadline_ms)))
+    {
+        p_job->queued = thpool_now();
+    }
+    if ((NULL != p_opts) && (0 != p_opts->deadline_ms))
+    {
+        p_job->deadline = p_job->queued + ((uint64_t)p_opts->deadline_ms * 1000000ULL);
+    }
+} /* job_fill() */
+
+/**
+ * @brief Queues a task: on the caller's own deque when it is a thread of a
+ * work-stealing pool, on the shared queue otherwise. A list queue takes the
+ * job under the lock it needs anyway, a ring queue takes it from the ring of
+ * free jobs.
+ * @param unsigned int refs 2 when the caller keeps the job as a future
+ * @return job_t* on success, only valid after return when refs is 2
+ * @return NULL on failure, and once thpool_destroy has started
+ */
+static job_t * submit_job(threadpool_t *            p_pool,
+                          thpool_function *         function,
+                          void *                    arg,
+                          void (*discard)(void *),
+                          unsigned int              refs,
+                          const thpool_job_opts_t * p_opts)
+{
+    thpool_worker_t * p_worker = t_thpool_worker;
+    job_t *           newjob   = NULL;
+    // Checked again under the lock before a job goes on the list queue, a
+    // job the deques or rings take late is still discarded once the threads
+    // are gone
+    if (__atomic_load_n(&p_pool->shutdown, __ATOMIC_ACQUIRE))
+    {
+        fprintf(stderr, "Pool is shutting down\n");
+        return NULL;
+    }
+    if ((NULL != p_worker) && (p_pool == p_worker->p_pool))
+    {
+        newjob = thpool_job_alloc_local(p_worker);
+        if (NULL == newjob)
+        {
+            return NULL;
+        }
+        job_fill(newjob, p_pool, function, arg, discard, refs, p_opts);
+        if (SUCCESS_CODE == thpool_deque_push(&p_worker->deque, newjob))
+        {
+            thpool_wake(p_pool);
+            return newjob;
+        }
+    }
+    if (NULL != p_pool->ring)
+    {
+        if (NULL == newjob)
+        {
+            newjob = thpool_job_alloc_shared(p_pool);
+            if (NULL == newjob)
+            {
+                return NULL;
+            }
+            job_fill(newjob, p_pool, function, arg, discard, refs, p_opts);
+        }
+        if (SUCCESS_CODE != thpool_ring_push(&p_pool->ring[newjob->priority], newjob))
+        {
+            fprintf(stderr, "Job queue is full\n");
+            newjob->refs = 1;
+            thpool_job_release(newjob);
+            return NULL;
+        }
+        thpool_wake(p_pool);
+        thread_check_depth(p_pool, ring_count(p_pool));
+        return newjob;
+    }
+    pthread_mutex_lock(&(p_pool->lock));
+    if (p_pool->shutdown)
+    {
+        // dequeue_all has emptied the list already, nothing would run or
+        // discard the job and its future would never complete
+        pthread_mutex_unlock(&(p_pool->lock));
+        fprintf(stderr, "Pool is shutting down\n");
+        if (NULL != newjob)
+        {
+            newjob->refs = 1;
+            thpool_job_release(newjob);
+        }
+        return NULL;
+    }
+    if (NULL == newjob)
+    {
+        newjob = thpool_job_alloc_locked(p_pool);
+        if (NULL == newjob)
+        {
+            pthread_mutex_unlock(&(p_pool->lock));
+            return NULL;
+        }
+        job_fill(newjob, p_pool, function, arg, discard, refs, p_opts);
+    }
+    int depth = list_put(p_pool, newjob);
+    pthread_mutex_unlock(&(p_pool->lock));
+    if (THPOOL_MODE_STEALING == p_pool->mode)
+    {
+        thpool_wake(p_pool);
+    }
+    else
+    {
+        pthread_cond_signal(&(p_pool->not_empty));
+    }
+    thread_check_depth(p_pool, (uint64_t)depth);
+    return newjob;
+} /* submit_job() */
+
+thpool_future_t * thpool_submit(threadpool_t *    p_pool,
+                                thpool_function * function,
+                                void *            arg)
+{
+    if ((NULL == p_pool) || (NULL == function))
+    {
+        fprintf(stderr, "Invalid arguments to thpool_submit\n");
+        return NULL;
+    }
+    return submit_job(p_pool, function, arg, NULL, 2, NULL);
+} /* thpool_submit() */
+
+thpool_future_t * thpool_submit_ex(threadpool_t *            p_pool,
+                                   thpool_function *         function,
+                                   void *                    arg,
+                                   const thpool_job_opts_t * p_opts)
+{
+    if ((NULL == p_pool) || (NULL == function) ||
+        ((NULL != p_opts) && ((THPOOL_PRIORITIES <= p_opts->priority) ||
+                              (THPOOL_EXPIRY_DEMOTE < p_opts->expiry))))
+    {
+        fprintf(stderr, "Invalid arguments to thpool_submit_ex\n");
+        return NULL;
+    }
+    return submit_job(p_pool, function, arg, NULL, 2, p_opts);
+} /* thpool_submit_ex() */
+
+static void * socket_task(void * arg)
+{
+    execute_job((int)(intptr_t)arg, t_thpool);
+    return NULL;
+} /* socket_task() */
+
+static void socket_discard(void * arg)
+{
+    close((int)(intptr_t)arg);
+} /* socket_discard() */
 
 int enqueue_job(threadpool_t * p_pool, int socket)
+{
+    return enqueue_job_ex(p_pool, socket, NULL);
+} /* enqueue_job() */
+
+int enqueue_job_ex(threadpool_t * p_pool, int socket, const thpool_job_opts_t * p_opts)
 {
     int enqueue_success = FAIL_CODE;
-    if (0 > socket)
+    if ((0 > socket) ||
+        ((NULL != p_opts) && ((THPOOL_PRIORITIES <= p_opts->priority) ||
+                              (THPOOL_EXPIRY_DEMOTE < p_opts->expiry))))
     {
         fprintf(stderr, "invalid args\n");
         goto EXIT;
@@ -108,31 +903,16 @@ int enqueue_job(threadpool_t * p_pool, int socket)
         fprintf(stderr, "pool is null\n");
         goto EXIT;
     }
-    job_t * newjob = calloc(1, sizeof(job_t));
-    if (NULL == newjob)
+    void * arg = (void *)(intptr_t)socket;
+    if (NULL == submit_job(p_pool, socket_task, arg, socket_discard, 1, p_opts))
     {
-        fprintf(stderr, "Could not allocate memory for new job\n");
+        fprintf(stderr, "Could not queue new job\n");
         goto EXIT;
     }
-    pthread_mutex_lock(&(p_pool->lock));
-    newjob->socket = socket;
-    newjob->next   = NULL;
-    if (NULL == p_pool->tail)
-    {
-        p_pool->head = newjob;
-    }
-    else
-    {
-        p_pool->tail->next = newjob;
-    }
-    p_pool->tail = newjob;
-    p_pool->queue_size++;
-    pthread_mutex_unlock(&(p_pool->lock));
-    pthread_cond_signal(&(p_pool->not_empty));
     enqueue_success = SUCCESS_CODE;
 EXIT:
     return enqueue_success;
-} /* enqueue_job() */
+} /* enqueue_job_ex() */
 
 int dequeue_all(threadpool_t * p_pool)
 {
@@ -142,24 +922,43 @@ int dequeue_all(threadpool_t * p_pool)
         fprintf(stderr, "Invalid arguments to dequeue_all\n");
         goto EXIT;
     }
+    job_t * job = NULL;
+    while ((NULL != p_pool->ring) && (NULL != (job = ring_take(p_pool))))
+    {
+        thpool_job_discard(job);
+    }
+    job_t * lists[THPOOL_PRIORITIES];
     pthread_mutex_lock(&(p_pool->lock));
-    for (int i = 0; i < p_pool->queue_size; i++)
+    for (int c = 0; c < THPOOL_PRIORITIES; c++)
     {
-        job_t * job  = p_pool->head;
-        p_pool->head = p_pool->head->next;
-        close(job->socket);
-        free(job);
-        job = NULL;
+        lists[c]        = p_pool->head[c];
+        p_pool->head[c] = NULL;
+        p_pool->tail[c] = NULL;
+        __atomic_store_n(&p_pool->class_size[c], 0, __ATOMIC_RELAXED);
     }
     p_pool->queue_size = 0;
-    p_pool->head       = NULL;
-    p_pool->tail       = NULL;
     pthread_mutex_unlock(&(p_pool->lock));
+    // Discarded outside the lock, continuations may submit again
+    for (int c = 0; c < THPOOL_PRIORITIES; c++)
+    {
+        job = lists[c];
+        while (NULL != job)
+        {
+            job_t * next = job->next;
+            thpool_job_discard(job);
+            job = next;
+        }
+    }
     dequeue_all_success = SUCCESS_CODE;
 EXIT:
     return dequeue_all_success;
 } /* dequeue_all() */
 
+static void thread_unlock(void * arg)
+{
+    pthread_mutex_unlock(&(((threadpool_t *)arg)->lock));
+} /* thread_unlock() */
+
 void * thread_function(void * arg)
 {
     if (NULL == arg)
@@ -168,41 +967,352 @@ void * thread_function(void * arg)
         return NULL;
     }
     threadpool_t * p_pool = (threadpool_t *)arg;
+    t_thpool              = p_pool;
 
     job_t * job = NULL;
 
+    while ((NULL != p_pool->ring) && !shutdown_flag)
+    {
+        job = ring_take(p_pool);
+        if (NULL != job)
+        {
+            thread_run(p_pool, job);
+        }
+        else if (!thread_wait(p_pool))
+        {
+            goto EXIT;
+        }
+    }
+
     while (!shutdown_flag)
     {
         p_pool->queue_size = p_pool->queue_size;
         pthread_mutex_lock(&(p_pool->lock));
+        struct timespec deadline;
+        bool            linger = false;
+        if (0 == p_pool->queue_size)
+        {
+            thread_deadline(p_pool, &deadline);
+        }
         while (0 == p_pool->queue_size)
         {
-            pthread_cond_wait(&(p_pool->not_empty), &(p_pool->lock));
+            if (linger)
+            {
+                thread_retire(p_pool);
+                pthread_mutex_unlock(&(p_pool->lock));
+                goto EXIT;
+            }
+            __atomic_add_fetch(&p_pool->idle, 1, __ATOMIC_RELAXED);
+            // A thread cancelled while waiting wakes up holding the lock
+            pthread_cleanup_push(thread_unlock, p_pool);
+            linger = thread_sleep(p_pool, &deadline);
+            pthread_cleanup_pop(0);
+            __atomic_sub_fetch(&p_pool->idle, 1, __ATOMIC_RELAXED);
             if (p_pool->shutdown)
             {
                 pthread_mutex_unlock(&(p_pool->lock));
                 goto EXIT;
             }
         }
-        job = p_pool->head;
-        p_pool->queue_size--;
-        if (p_pool->queue_size == 0)
+        job = list_take(p_pool);
+        pthread_mutex_unlock(&(p_pool->lock));
+
+        thread_run(p_pool, job);
+        job = NULL;
+    }
+EXIT:
+    return NULL;
+} /* thread_function() */
+
+/**
+ * @brief Checks every queue of a pool for jobs. The caller holds the pool lock.
+ */
+static bool work_visible(threadpool_t * p_pool)
+{
+    if (0 < p_pool->queue_size)
+    {
+        return true;
+    }
+    for (int c = 0; (NULL != p_pool->ring) && (c < THPOOL_PRIORITIES); c++)
+    {
+        if (!thpool_ring_empty(&p_pool->ring[c]))
         {
-            p_pool->head = NULL;
-            p_pool->tail = NULL;
+            return true;
         }
-        else
+    }
+    for (int i = 0; (NULL != p_pool->workers) && (i < p_pool->pool_size); i++)
+    {
+        if (!thpool_deque_empty(&p_pool->workers[i].deque))
+        {
+            return true;
+        }
+    }
+    return false;
+} /* work_visible() */
+
+/**
+ * @brief steal_from_queue for a ring queue, which takes no lock
+ */
+static job_t * steal_from_ring(thpool_worker_t * p_worker)
+{
+    threadpool_t * p_pool = p_worker->p_pool;
+    job_t *        job    = ring_take(p_pool);
+    int            moved  = 0;
+    if ((NULL == job) || shared_waiting_above(p_pool, job->priority))
+    {
+        return job;
+    }
+    thpool_ring_t * p_ring = &p_pool->ring[job->priority];
+    int             count  = __atomic_load_n(&p_pool->thread_count, __ATOMIC_RELAXED);
+    size_t          batch  = (thpool_ring_count(p_ring) / (size_t)count) + 1;
+    for (size_t i = 1; i < batch && i < THPOOL_INJECT_BATCH; i++)
+    {
+        job_t * next = thpool_ring_pop(p_ring);
+        if (NULL == next)
+        {
+            break;
+        }
+        if (SUCCESS_CODE != thpool_deque_push(&p_worker->deque, next))
         {
-            p_pool->head = job->next;
+            // Popped already and there is no room to put it back
+            thread_run(p_pool, next);
+            break;
         }
+        moved++;
+    }
+    if (0 < moved)
+    {
+        thpool_wake(p_pool);
+    }
+    return job;
+} /* steal_from_ring() */
+
+/**
+ * @brief Takes a share of the shared queue: one job to run now and up to
+ * THPOOL_INJECT_BATCH - 1 more of the same class onto the worker's deque,
+ * where idle threads can steal them. One lock hold serves a whole batch of
+ * submissions. Nothing is batched while a higher class waits, and the
+ * deque gives way to higher classes again in steal_preempt.
+ * @return job_t* job to run on success
+ * @return NULL when the shared queue is empty
+ */
+static job_t * steal_from_queue(thpool_worker_t * p_worker)
+{
+    threadpool_t * p_pool = p_worker->p_pool;
+    job_t *        job    = NULL;
+    int            moved  = 0;
+
+    if (NULL != p_pool->ring)
+    {
+        return steal_from_ring(p_worker);
+    }
+    pthread_mutex_lock(&(p_pool->lock));
+    job = list_take(p_pool);
+    if ((NULL == job) || shared_waiting_above(p_pool, job->priority))
+    {
         pthread_mutex_unlock(&(p_pool->lock));
+        return job;
+    }
+    int cls   = job->priority;
+    int batch = ((int)p_pool->class_size[cls] / p_pool->thread_count) + 1;
+    if (THPOOL_INJECT_BATCH < batch)
+    {
+        batch = THPOOL_INJECT_BATCH;
+    }
+    for (int i = 1; i < batch; i++)
+    {
+        job_t * next = list_take_class(p_pool, cls);
+        if (NULL == next)
+        {
+            break;
+        }
+        if (SUCCESS_CODE != thpool_deque_push(&p_worker->deque, next))
+        {
+            list_untake(p_pool, next);
+            break;
+        }
+        moved++;
+    }
+    pthread_mutex_unlock(&(p_pool->lock));
 
-        execute_job(job, p_pool);
-        job = NULL;
+    if (0 < moved)
+    {
+        thpool_wake(p_pool);
+    }
+    return job;
+} /* steal_from_queue() */
+
+/**
+ * @brief Checks whether class cls is served before class other
+ */
+static bool queue_before(int cls, int other)
+{
+    for (int i = 0; i < THPOOL_PRIORITIES; i++)
+    {
+        if ((queue_order[i] == cls) || (queue_order[i] == other))
+        {
+            return (queue_order[i] == cls) && (cls != other);
+        }
+    }
+    return false;
+} /* queue_before() */
+
+/**
+ * @brief Lets a class served before the job a worker took off its own deque
+ * go first, when one waits in the shared queue and the turn is a class
+ * above the job's. The deque job counts as queued in its class, so higher
+ * work does not sit behind a batch and lower work still gets its turns.
+ * @return job_t* job to run, job itself unless a higher one was taken
+ */
+static job_t * steal_preempt(thpool_worker_t * p_worker, job_t * job)
+{
+    threadpool_t * p_pool = p_worker->p_pool;
+    if (!shared_waiting_above(p_pool, job->priority) ||
+        !queue_before(queue_turn(p_pool), job->priority))
+    {
+        return job;
+    }
+    job_t * first = NULL;
+    for (int i = 0; (NULL == first) && (queue_order[i] != job->priority); i++)
+    {
+        int cls = queue_order[i];
+        if (NULL != p_pool->ring)
+        {
+            first = thpool_ring_pop(&p_pool->ring[cls]);
+            continue;
+        }
+        pthread_mutex_lock(&(p_pool->lock));
+        first = list_take_class(p_pool, cls);
+        pthread_mutex_unlock(&(p_pool->lock));
+    }
+    if (NULL == first)
+    {
+        return job;
+    }
+    if (SUCCESS_CODE != thpool_deque_push(&p_worker->deque, job))
+    {
+        // Taken off the deque already and there is no room to put it back
+        thread_run(p_pool, job);
+    }
+    return first;
+} /* steal_preempt() */
+
+static inline uint64_t steal_random(thpool_worker_t * p_worker)
+{
+    uint64_t x = p_worker->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    p_worker->rng = x;
+    return x;
+} /* steal_random() */
+
+/**
+ * @brief Steals from the other threads, starting at a random victim so
+ * thieves spread out instead of all hitting the same deque
+ * @return job_t* on success
+ * @return NULL once a full pass finds every deque empty
+ */
+static job_t * steal_from_workers(thpool_worker_t * p_worker)
+{
+    threadpool_t * p_pool = p_worker->p_pool;
+    int            count  = p_pool->pool_size;
+    bool           lost   = true;
+
+    while (lost)
+    {
+        lost      = false;
+        int start = (int)(steal_random(p_worker) % (uint64_t)count);
+        for (int i = 0; i < count; i++)
+        {
+            thpool_worker_t * p_victim = &p_pool->workers[(start + i) % count];
+            if (p_victim == p_worker)
+            {
+                continue;
+            }
+            job_t * job = thpool_deque_steal(&p_victim->deque, &lost);
+            if (NULL != job)
+            {
+                return job;
+            }
+        }
     }
-EXIT:
     return NULL;
-} /* thread_function() */
+} /* steal_from_workers() */
+
+/**
+ * @brief Waits until a job shows up in any queue of a pool that queues
+ * without its lock, a work-stealing pool or one with a ring queue
+ * @return true when there may be work
+ * @return false when the pool is shutting down
+ */
+static bool thread_wait(threadpool_t * p_pool)
+{
+    struct timespec deadline;
+    bool            linger  = false;
+    bool            running = true;
+    pthread_mutex_lock(&(p_pool->lock));
+    thread_deadline(p_pool, &deadline);
+    // Counted before looking, so a submitter that misses the count pushed
+    // early enough for the look to find its job
+    __atomic_add_fetch(&p_pool->idle, 1, __ATOMIC_SEQ_CST);
+    while (!p_pool->shutdown && !shutdown_flag && !work_visible(p_pool))
+    {
+        if (linger)
+        {
+            thread_retire(p_pool);
+            running = false;
+            break;
+        }
+        pthread_cleanup_push(thread_unlock, p_pool);
+        linger = thread_sleep(p_pool, &deadline);
+        pthread_cleanup_pop(0);
+    }
+    __atomic_sub_fetch(&p_pool->idle, 1, __ATOMIC_SEQ_CST);
+    running = running && !p_pool->shutdown;
+    pthread_mutex_unlock(&(p_pool->lock));
+    return running;
+} /* thread_wait() */
+
+/**
+ * @brief Runs the jobs of a work-stealing pool: its own deque first, newest
+ * job first while it is cache hot, unless a higher class waits in the shared
+ * queue, then the shared queue, then other deques
+ */
+static void * thread_steal_function(void * arg)
+{
+    thpool_worker_t * p_worker = arg;
+    t_thpool_worker            = p_worker;
+    t_thpool                   = p_worker->p_pool;
+
+    while (!shutdown_flag)
+    {
+        job_t * job = thpool_deque_take(&p_worker->deque);
+        if (NULL != job)
+        {
+            job = steal_preempt(p_worker, job);
+        }
+        else
+        {
+            job = steal_from_queue(p_worker);
+        }
+        if (NULL == job)
+        {
+            job = steal_from_workers(p_worker);
+        }
+        if (NULL != job)
+        {
+            thread_run(p_worker->p_pool, job);
+            continue;
+        }
+        if (!thread_wait(p_worker->p_pool))
+        {
+            break;
+        }
+    }
+    t_thpool_worker = NULL;
+    return NULL;
+} /* thread_steal_function() */
 
 int thpool_destroy(threadpool_t * p_pool)
 {
@@ -213,7 +1323,10 @@ int thpool_destroy(threadpool_t * p_pool)
         goto EXIT;
     }
 
-    p_pool->shutdown = true;
+    pthread_mutex_lock(&(p_pool->lock));
+    // Stored atomically, submit_job looks at it without the lock first
+    __atomic_store_n(&p_pool->shutdown, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&(p_pool->lock));
 
     // hash_table_print(p_pool->hash_table);
 
@@ -239,15 +1352,30 @@ int thpool_destroy(threadpool_t * p_pool)
     pthread_mutex_unlock(&(p_pool->lock));
     for (int i = 0; i < p_pool->pool_size; i++)
     {
-        pthread_cancel(p_pool->threads[i]);
-        pthread_join(p_pool->threads[i], NULL);
+        if (THPOOL_THREAD_RUNNING == p_pool->thread_state[i])
+        {
+            pthread_cancel(p_pool->threads[i]);
+        }
+        if (THPOOL_THREAD_NONE != p_pool->thread_state[i])
+        {
+            pthread_join(p_pool->threads[i], NULL);
+        }
     }
+    workers_free(p_pool);
+    rings_free(p_pool);
+    thpool_jobs_free(p_pool);
     free(p_pool->threads);
     p_pool->threads = NULL;
+    free(p_pool->thread_state);
+    p_pool->thread_state = NULL;
+    free(p_pool->schedule);
+    p_pool->schedule = NULL;
     pthread_mutex_destroy(&(p_pool->file_lock));
     pthread_mutex_destroy(&(p_pool->lock));
     pthread_cond_destroy(&(p_pool->not_empty));
     pthread_cond_destroy(&(p_pool->empty));
+    pthread_mutex_destroy(&(p_pool->done_lock));
+    pthread_cond_destroy(&(p_pool->done));
     free(p_pool);
     p_pool   = NULL;
     err_code = SUCCESS_CODE;
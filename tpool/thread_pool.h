@@ -14,37 +14,174 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 
-#define MAX_CONNECTIONS 10
 
+/*
+ * @brief task run by a pool thread
+ * @param void* arg given to thpool_submit
+ * @return void* result handed to the future's waiters and continuation
+ */
+typedef void * thpool_function(void * arg);
 
+/*
+ * @brief callback run once a task has finished, see thpool_future_then
+ * @param void* result returned by the task, NULL when the task was discarded
+ * @param void* p_ctx given to thpool_future_then
+ */
+typedef void thpool_continuation(void * result, void * p_ctx);
 
 /*
  * @brief struct that defines a job in the queue
+ * @NOTE: jobs are the pool's task descriptors and double as the futures
+ * thpool_submit returns. They are carved out of chunks the pool owns and
+ * recycled once both the pool and the future's holder are done with them,
+ * so submitting allocates nothing in the steady state.
  */
 typedef struct job_t
 {
-    int            socket;
-    struct job_t * next;
+    thpool_function *     function; // task to run
+    void *                arg;      // argument to function
+    void (*discard)(void *);        // releases arg if the task never runs
+    void *                result;   // what function returned, once done
+    thpool_continuation * then;     // run once done, see thpool_future_then
+    void *                then_ctx; // argument to then
+    struct threadpool_t * p_pool;   // pool the job returns to
+    unsigned int          state;    // THPOOL_JOB_* bits, accessed atomically
+    unsigned int          refs;     // the pool's and the future holder's
+    struct job_t *        next;     // queue and free list link
+    uint64_t              queued;   // elastic pools: monotonic ns it was queued at
+    uint64_t              deadline; // monotonic ns it expires at, 0 for never
+    unsigned char         priority; // thpool_priority_t, class of its queue
+    unsigned char         expiry;   // thpool_expiry_t, applied past deadline
 } job_t;
 
+/*
+ * @brief handle on a submitted task, see thpool_submit
+ */
+typedef job_t thpool_future_t;
+
+/*
+ * @brief how the threads of a pool find their jobs
+ */
+typedef enum thpool_mode
+{
+    THPOOL_MODE_FIFO = 0, // one queue under the pool lock (default)
+    THPOOL_MODE_STEALING, // a deque per thread, idle threads steal from the others
+} thpool_mode_t;
+
+/*
+ * @brief what holds the jobs submitted from outside the pool
+ */
+typedef enum thpool_queue
+{
+    THPOOL_QUEUE_LIST = 0, // unbounded list under the pool lock (default)
+    THPOOL_QUEUE_RING,     // bounded lock-free ring, submits fail while it is full
+} thpool_queue_t;
+
+/*
+ * @brief priority class of a job. Threads take jobs off the shared queue by
+ * weighted round robin over the classes, see thpool_opts_t weights.
+ */
+typedef enum thpool_priority
+{
+    THPOOL_PRIORITY_NORMAL = 0, // default
+    THPOOL_PRIORITY_HIGH,       // latency sensitive, taken most often
+    THPOOL_PRIORITY_LOW,        // background work, taken least often
+    THPOOL_PRIORITIES,
+} thpool_priority_t;
+
+/*
+ * @brief what becomes of a job that has not started by its deadline
+ */
+typedef enum thpool_expiry
+{
+    THPOOL_EXPIRY_DROP = 0, // discarded without running (default)
+    THPOOL_EXPIRY_DEMOTE,   // queued again as THPOOL_PRIORITY_LOW, without deadline
+} thpool_expiry_t;
+
+/*
+ * @brief optional settings for thpool_submit_ex, zero initialise for defaults
+ */
+typedef struct thpool_job_opts
+{
+    thpool_priority_t priority;    // class of the job
+    uint32_t          deadline_ms; // time it may wait to start, 0 for no limit
+    thpool_expiry_t   expiry;      // what happens once deadline_ms has passed
+} thpool_job_opts_t;
+
+/*
+ * @brief optional settings for thpool_init_ex, zero initialise for defaults
+ */
+typedef struct thpool_opts
+{
+    thpool_mode_t  mode;           // scheduling mode
+    thpool_queue_t queue;          // shared queue implementation
+    uint32_t       queue_capacity; // ring: slots per class, rounded up to a
+                                   // power of two, 0 for 1024
+    int            max_threads;    // elastic: most threads, 0 for a fixed pool
+    uint32_t       grow_depth;     // elastic: queued jobs per thread that add a
+                                   // thread, 0 for 4
+    uint32_t       grow_wait_ms;   // elastic: time a job waited that adds a
+                                   // thread, 0 for 10
+    uint32_t       linger_ms;      // elastic: idle time after which a thread
+                                   // above pool_size exits, 0 for 5000
+    uint8_t        weights[THPOOL_PRIORITIES]; // jobs taken from each class per
+                                               // round, 0 for 4 normal, 8 high, 1 low
+} thpool_opts_t;
+
+/*
+ * @brief bounded lock-free queue of jobs, see thread_pool_internal.h
+ */
+typedef struct thpool_ring thpool_ring_t;
+
+/*
+ * @brief a thread of a work-stealing pool, see thread_pool_internal.h
+ */
+typedef struct thpool_worker thpool_worker_t;
+
 /*
  * @brief struct that defines the threadpool
+ * @NOTE: in THPOOL_MODE_STEALING the head/tail queue only takes jobs enqueued
+ * from outside the pool. Jobs enqueued by a pool thread go on its own deque.
+ * @NOTE: an elastic pool has a slot in threads for each thread it may run,
+ * and runs between thread_min and pool_size of them.
  */
 typedef struct threadpool_t
 {
-    pthread_t *     threads;      // array of threads
-    int             pool_size;    // number of threads
-    pthread_mutex_t lock;         // lock for the threadpool
-    pthread_mutex_t file_lock;    // lock for the file
-    int             shutdown;     // flag to indicate if the threadpool should shutdown
-    int             queue_size;   // number of jobs in queue
-    job_t *         head;         // head of queue
-    job_t *         tail;         // tail of queue
-    pthread_cond_t  not_empty;    // condition variable for queue not empty
-    pthread_cond_t  empty;        // condition variable for queue empty
-    FILE *          data_base;    // file to write to
+    pthread_t *       threads;      // array of threads
+    int               pool_size;    // number of threads, the most for an elastic pool
+    int               thread_min;   // elastic: threads kept however idle
+    int               thread_count; // threads running, changed under lock
+    unsigned char *   thread_state; // THPOOL_THREAD_* of each slot in threads
+    pthread_mutex_t   lock;         // lock for the threadpool
+    pthread_mutex_t   file_lock;    // lock for the file
+    int               shutdown;     // flag to indicate if the threadpool should shutdown
+    int               queue_size;   // number of jobs in queue
+    job_t *           head[THPOOL_PRIORITIES]; // head of each class's queue
+    job_t *           tail[THPOOL_PRIORITIES]; // tail of each class's queue
+    unsigned int      class_size[THPOOL_PRIORITIES]; // jobs per class, read unlocked
+    pthread_cond_t    not_empty;    // condition variable for queue not empty
+    pthread_cond_t    empty;        // condition variable for queue empty
+    FILE *            data_base;    // file to write to
+    thpool_mode_t     mode;         // scheduling mode, fixed at init
+    thpool_worker_t * workers;      // stealing: one per thread, with its deque
+    int               idle;         // stealing: threads waiting on not_empty
+    pthread_mutex_t   done_lock;    // guards waits for a future
+    pthread_cond_t    done;         // a future that has a waiter finished
+    job_t *           free_jobs;    // recycled jobs, taken under lock
+    job_t *           returned;     // jobs released without lock, pushed atomically
+    void *            job_chunks;   // blocks the jobs are carved from
+    thpool_ring_t *   ring;         // ring queue: one per class replacing head/tail
+    unsigned char *   schedule;     // class to take from first, for each turn
+    unsigned int      schedule_len; // turns in a round, the sum of the weights
+    unsigned int      schedule_pos; // next turn, advanced atomically
+    thpool_ring_t *   free_ring;    // ring queue: free jobs, taken without a lock
+    uint64_t          grow_depth;   // elastic: queued jobs per thread that add one
+    uint64_t          grow_wait;    // elastic: ns a job waited that adds a thread
+    uint64_t          linger;       // elastic: ns a thread idles before it exits
+    uint64_t          grown;        // elastic: monotonic ns a thread was last added
     // If you're using a data base this can also be placed in the threadpool, Use mutex locks when modifying any data 
 } threadpool_t;
 
@@ -60,7 +197,103 @@ typedef struct threadpool_t
 threadpool_t * thpool_init(int pool_size);
 
 /**
- * @brief Add work to the job queue
+ * @brief  Initialize threadpool with the settings in opts. With
+ * opts.max_threads above pool_size the pool is elastic: it adds threads up to
+ * max_threads while jobs queue up or wait too long, and lets the threads
+ * above pool_size exit once they have idled for opts.linger_ms.
+ *
+ * @param  int pool_size number of threads to be created in the threadpool
+ * @param  opts settings, NULL for the defaults
+ * @return threadpool created threadpool on success
+ * @return NULL on error
+ */
+threadpool_t * thpool_init_ex(int pool_size, const thpool_opts_t * p_opts);
+
+/**
+ * @brief Runs function(arg) on a pool thread
+ *
+ * @param  threadpool threadpool to which the work will be added
+ * @param  function task to run
+ * @param  arg argument to function
+ * @return thpool_future_t* future to wait on, release with thpool_future_release
+ * @return NULL on error, and once thpool_destroy has started
+ */
+thpool_future_t * thpool_submit(threadpool_t *    tpool,
+                                thpool_function * function,
+                                void *            arg);
+
+/**
+ * @brief Runs function(arg) on a pool thread, in the priority class and with
+ * the deadline in opts. A job still queued past its deadline is dropped,
+ * completing its future with NULL, or demoted to THPOOL_PRIORITY_LOW. Jobs a
+ * thread of a THPOOL_MODE_STEALING pool submits go on its own deque, where
+ * the deadline still applies but the class does not.
+ *
+ * @param  threadpool threadpool to which the work will be added
+ * @param  function task to run
+ * @param  arg argument to function
+ * @param  opts settings, NULL for the defaults
+ * @return thpool_future_t* future to wait on, release with thpool_future_release
+ * @return NULL on error, and once thpool_destroy has started
+ */
+thpool_future_t * thpool_submit_ex(threadpool_t *            tpool,
+                                   thpool_function *         function,
+                                   void *                    arg,
+                                   const thpool_job_opts_t * p_opts);
+
+/**
+ * @brief Checks whether the task of a future has finished, without blocking
+ *
+ * @param  future future returned by thpool_submit
+ * @return true once the task has finished
+ */
+bool thpool_future_poll(thpool_future_t * p_future);
+
+/**
+ * @brief Blocks until the task of a future has finished
+ *
+ * @param  future future returned by thpool_submit
+ * @return void* the task's result, NULL when the pool discarded the task
+ */
+void * thpool_future_wait(thpool_future_t * p_future);
+
+/**
+ * @brief Runs then(result, p_ctx) once the task has finished, on the pool
+ * thread that ran it, or right away on the caller when it already has. A
+ * future takes one continuation.
+ *
+ * @param  future future returned by thpool_submit
+ * @param  then continuation, should be short as it holds up a pool thread
+ * @param  p_ctx argument to then
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE when the future already has a continuation
+ */
+int thpool_future_then(thpool_future_t *     p_future,
+                       thpool_continuation * then,
+                       void *                p_ctx);
+
+/**
+ * @brief Gives a future back. The task still runs if it has not yet. Every
+ * future must be released, and all of them before the pool is destroyed.
+ *
+ * @param  future future returned by thpool_submit
+ */
+void thpool_future_release(thpool_future_t * p_future);
+
+/**
+ * @brief Handles one client connection on a pool thread. Supplied by the
+ * server, enqueue_job submits it for every accepted socket.
+ *
+ * @param  socket socket for the client connection, the handler closes it
+ * @param  threadpool threadpool running the handler
+ */
+void execute_job(int socket, threadpool_t * tpool);
+
+/**
+ * @brief Add work to the job queue: submits execute_job for the socket, and
+ * closes the socket instead if the pool is destroyed before it runs. In
+ * THPOOL_MODE_STEALING a job enqueued by one of the pool's own threads goes
+ * on that thread's deque, as for thpool_submit.
  *
  * @param  threadpool threadpool to which the work will be added
  * @param  socket socket for the client connection
@@ -69,6 +302,18 @@ threadpool_t * thpool_init(int pool_size);
  */
 int enqueue_job(threadpool_t * tpool, int socket);
 
+/**
+ * @brief enqueue_job with the priority class and deadline in opts, see
+ * thpool_submit_ex. A connection dropped at its deadline is closed.
+ *
+ * @param  threadpool threadpool to which the work will be added
+ * @param  socket socket for the client connection
+ * @param  opts settings, NULL for the defaults
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE on error
+ */
+int enqueue_job_ex(threadpool_t * tpool, int socket, const thpool_job_opts_t * p_opts);
+
 /**
  * @brief Destroy the threadpool
  *
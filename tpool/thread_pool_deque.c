@@ -0,0 +1,169 @@
+/** @file thread_pool_deque.c
+ *
+ * @brief Chase-Lev work-stealing deques for the work-stealing pool mode.
+ *
+ * Each worker pushes and takes jobs at the bottom of its own deque without a
+ * lock, and idle workers steal from the top of others. Owner and thieves only
+ * meet on the last job, which they settle with a compare-and-swap on top.
+ *
+ * This follows the C11 formulation of Le, Pop, Cohen and Zappa Nardelli, with
+ * sequentially consistent accesses standing in for its standalone fences.
+ *
+ */
+
+#include "thread_pool_internal.h"
+
+static thpool_deque_array_t * deque_array_new(int64_t size)
+{
+    thpool_deque_array_t * p_array =
+        calloc(1, sizeof(thpool_deque_array_t) + (size * sizeof(job_t *)));
+    if (NULL == p_array)
+    {
+        fprintf(stderr, "deque_array_new: calloc failed\n");
+        return NULL;
+    }
+    p_array->mask = size - 1;
+    return p_array;
+} /* deque_array_new() */
+
+int thpool_deque_init(thpool_deque_t * p_deque, size_t size)
+{
+    thpool_deque_array_t * p_array = deque_array_new((int64_t)size);
+    if (NULL == p_array)
+    {
+        return FAIL_CODE;
+    }
+    atomic_init(&p_deque->top, 0);
+    atomic_init(&p_deque->bottom, 0);
+    atomic_init(&p_deque->array, p_array);
+    return SUCCESS_CODE;
+} /* thpool_deque_init() */
+
+void thpool_deque_destroy(thpool_deque_t * p_deque)
+{
+    thpool_deque_array_t * p_array = atomic_load(&p_deque->array);
+    while (NULL != p_array)
+    {
+        thpool_deque_array_t * p_prev = p_array->p_prev;
+        free(p_array);
+        p_array = p_prev;
+    }
+    atomic_store(&p_deque->array, NULL);
+} /* thpool_deque_destroy() */
+
+/**
+ * @brief Copies the live jobs into an array twice as large and publishes it
+ * @return thpool_deque_array_t* the new array on success
+ * @return NULL on failure, the old array stays in place
+ */
+static thpool_deque_array_t * deque_grow(thpool_deque_t *       p_deque,
+                                         thpool_deque_array_t * p_old,
+                                         int64_t                top,
+                                         int64_t                bottom)
+{
+    thpool_deque_array_t * p_array = deque_array_new((p_old->mask + 1) * 2);
+    if (NULL == p_array)
+    {
+        return NULL;
+    }
+    for (int64_t i = top; i < bottom; i++)
+    {
+        job_t * p_job = atomic_load_explicit(&p_old->jobs[i & p_old->mask],
+                                             memory_order_relaxed);
+        atomic_store_explicit(&p_array->jobs[i & p_array->mask], p_job,
+                              memory_order_relaxed);
+    }
+    p_array->p_prev = p_old;
+    atomic_store_explicit(&p_deque->array, p_array, memory_order_release);
+    return p_array;
+} /* deque_grow() */
+
+int thpool_deque_push(thpool_deque_t * p_deque, job_t * p_job)
+{
+    int64_t bottom = atomic_load_explicit(&p_deque->bottom, memory_order_relaxed);
+    int64_t top    = atomic_load_explicit(&p_deque->top, memory_order_acquire);
+    thpool_deque_array_t * p_array =
+        atomic_load_explicit(&p_deque->array, memory_order_relaxed);
+    if (bottom - top > p_array->mask)
+    {
+        p_array = deque_grow(p_deque, p_array, top, bottom);
+        if (NULL == p_array)
+        {
+            return FAIL_CODE;
+        }
+    }
+    atomic_store_explicit(&p_array->jobs[bottom & p_array->mask], p_job,
+                          memory_order_relaxed);
+    // Publishes the job and its contents to thieves, and orders the store
+    // before the idle count a waking submitter reads next
+    atomic_store_explicit(&p_deque->bottom, bottom + 1, memory_order_seq_cst);
+    return SUCCESS_CODE;
+} /* thpool_deque_push() */
+
+job_t * thpool_deque_take(thpool_deque_t * p_deque)
+{
+    int64_t bottom = atomic_load_explicit(&p_deque->bottom, memory_order_relaxed) - 1;
+    thpool_deque_array_t * p_array =
+        atomic_load_explicit(&p_deque->array, memory_order_relaxed);
+    // Claims the bottom slot before looking at top, so a thief that reads top
+    // after this either sees the claim or loses the race for the last job
+    atomic_store_explicit(&p_deque->bottom, bottom, memory_order_seq_cst);
+    int64_t top   = atomic_load_explicit(&p_deque->top, memory_order_seq_cst);
+    job_t * p_job = NULL;
+    if (top <= bottom)
+    {
+        p_job = atomic_load_explicit(&p_array->jobs[bottom & p_array->mask],
+                                     memory_order_relaxed);
+        if (top == bottom)
+        {
+            // The last job, a thief may be taking it at the same time
+            if (!atomic_compare_exchange_strong_explicit(&p_deque->top,
+                                                         &top,
+                                                         top + 1,
+                                                         memory_order_seq_cst,
+                                                         memory_order_relaxed))
+            {
+                p_job = NULL;
+            }
+            atomic_store_explicit(&p_deque->bottom, bottom + 1, memory_order_relaxed);
+        }
+    }
+    else
+    {
+        atomic_store_explicit(&p_deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return p_job;
+} /* thpool_deque_take() */
+
+job_t * thpool_deque_steal(thpool_deque_t * p_deque, bool * p_lost)
+{
+    int64_t top    = atomic_load_explicit(&p_deque->top, memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&p_deque->bottom, memory_order_seq_cst);
+    if (top >= bottom)
+    {
+        return NULL;
+    }
+    thpool_deque_array_t * p_array =
+        atomic_load_explicit(&p_deque->array, memory_order_acquire);
+    job_t * p_job =
+        atomic_load_explicit(&p_array->jobs[top & p_array->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&p_deque->top,
+                                                 &top,
+                                                 top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed))
+    {
+        *p_lost = true;
+        return NULL;
+    }
+    return p_job;
+} /* thpool_deque_steal() */
+
+bool thpool_deque_empty(thpool_deque_t * p_deque)
+{
+    int64_t top    = atomic_load_explicit(&p_deque->top, memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&p_deque->bottom, memory_order_seq_cst);
+    return top >= bottom;
+} /* thpool_deque_empty() */
+
+/*** end of file ***/
@@ -0,0 +1,292 @@
+/** @file thread_pool_future.c
+ *
+ * @brief Task descriptors and the futures thpool_submit hands out for them.
+ *
+ * A job is both the queue entry and the future: the task, its result and its
+ * continuation all live in the one descriptor. Jobs are carved out of chunks
+ * of THPOOL_JOB_CHUNK and hold two references, the pool's until the task has
+ * run and the caller's until the future is released. The last reference puts
+ * the job back on a free list, so a busy pool stops allocating once it has as
+ * many jobs as it keeps in flight.
+ *
+ * Free jobs are kept four ways:
+ * - free_jobs is popped by submits that already hold the pool lock to queue;
+ * - a pool with a ring queue keeps a second ring of free jobs, so submits to
+ *   it take and give back jobs without any lock;
+ * - returned is pushed by any thread without a lock, and only ever emptied as
+ *   a whole, so it needs no protection against ABA;
+ * - each thread of a work-stealing pool keeps its own list for the jobs it
+ *   submits and hands it back once it grows past THPOOL_FREE_LOCAL.
+ *
+ * Waiting threads sleep on the pool's done condition, and only a task whose
+ * future has a waiter takes done_lock to wake them.
+ *
+ */
+
+#include "thread_pool_internal.h"
+
+/**
+ * @brief block of jobs, freed with the pool
+ */
+typedef struct job_chunk
+{
+    struct job_chunk * next;
+    job_t              jobs[THPOOL_JOB_CHUNK];
+} job_chunk_t;
+
+/**
+ * @brief Pushes a list of released jobs onto the pool's returned stack
+ */
+static void jobs_return(threadpool_t * p_pool, job_t * p_first)
+{
+    job_t * p_last = p_first;
+    while (NULL != p_last->next)
+    {
+        p_last = p_last->next;
+    }
+    job_t * p_head = __atomic_load_n(&p_pool->returned, __ATOMIC_RELAXED);
+    do
+    {
+        p_last->next = p_head;
+    } while (!__atomic_compare_exchange_n(
+        &p_pool->returned, &p_head, p_first, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+} /* jobs_return() */
+
+job_t * thpool_job_alloc_locked(threadpool_t * p_pool)
+{
+    if (NULL == p_pool->free_jobs)
+    {
+        p_pool->free_jobs =
+            __atomic_exchange_n(&p_pool->returned, NULL, __ATOMIC_ACQUIRE);
+    }
+    if (NULL == p_pool->free_jobs)
+    {
+        job_chunk_t * p_chunk = calloc(1, sizeof(job_chunk_t));
+        if (NULL == p_chunk)
+        {
+            fprintf(stderr, "Could not allocate memory for jobs\n");
+            return NULL;
+        }
+        p_chunk->next      = p_pool->job_chunks;
+        p_pool->job_chunks = p_chunk;
+        for (int i = 0; i < THPOOL_JOB_CHUNK; i++)
+        {
+            p_chunk->jobs[i].next = p_pool->free_jobs;
+            p_pool->free_jobs     = &p_chunk->jobs[i];
+        }
+    }
+    job_t * p_job     = p_pool->free_jobs;
+    p_pool->free_jobs = p_job->next;
+    return p_job;
+} /* thpool_job_alloc_locked() */
+
+job_t * thpool_job_alloc_shared(threadpool_t * p_pool)
+{
+    job_t * p_job = thpool_ring_pop(p_pool->free_ring);
+    if (NULL == p_job)
+    {
+        pthread_mutex_lock(&(p_pool->lock));
+        p_job = thpool_job_alloc_locked(p_pool);
+        pthread_mutex_unlock(&(p_pool->lock));
+    }
+    return p_job;
+} /* thpool_job_alloc_shared() */
+
+job_t * thpool_job_alloc_local(thpool_worker_t * p_worker)
+{
+    threadpool_t * p_pool = p_worker->p_pool;
+    if (NULL == p_worker->free_jobs)
+    {
+        p_worker->free_jobs =
+            __atomic_exchange_n(&p_pool->returned, NULL, __ATOMIC_ACQUIRE);
+        p_worker->free_count = 0;
+    }
+    if (NULL == p_worker->free_jobs)
+    {
+        pthread_mutex_lock(&(p_pool->lock));
+        job_t * p_job = thpool_job_alloc_locked(p_pool);
+        pthread_mutex_unlock(&(p_pool->lock));
+        return p_job;
+    }
+    job_t * p_job       = p_worker->free_jobs;
+    p_worker->free_jobs = p_job->next;
+    if (0 < p_worker->free_count)
+    {
+        p_worker->free_count--;
+    }
+    return p_job;
+} /* thpool_job_alloc_local() */
+
+void thpool_job_release(job_t * p_job)
+{
+    if (1 != __atomic_fetch_sub(&p_job->refs, 1, __ATOMIC_ACQ_REL))
+    {
+        return;
+    }
+    threadpool_t *    p_pool   = p_job->p_pool;
+    thpool_worker_t * p_worker = t_thpool_worker;
+    if ((NULL != p_worker) && (p_pool == p_worker->p_pool))
+    {
+        p_job->next         = p_worker->free_jobs;
+        p_worker->free_jobs = p_job;
+        if (THPOOL_FREE_LOCAL > ++p_worker->free_count)
+        {
+            return;
+        }
+        // Handed back whole, so a thread that only runs jobs others submit
+        // does not sit on every job it has run
+        p_worker->free_jobs  = NULL;
+        p_worker->free_count = 0;
+    }
+    else
+    {
+        p_job->next = NULL;
+    }
+    // A ring queue's free ring is refilled first, so its submits stay lock-free
+    while ((NULL != p_job) && (NULL != p_pool->free_ring))
+    {
+        job_t * p_next = p_job->next;
+        if (SUCCESS_CODE != thpool_ring_push(p_pool->free_ring, p_job))
+        {
+            break;
+        }
+        p_job = p_next;
+    }
+    if (NULL != p_job)
+    {
+        jobs_return(p_pool, p_job);
+    }
+} /* thpool_job_release() */
+
+/**
+ * @brief Publishes a job's result, runs its continuation, wakes its waiters
+ * and drops the pool's reference
+ */
+static void job_finish(job_t * p_job, void * result)
+{
+    threadpool_t * p_pool = p_job->p_pool;
+    p_job->result         = result;
+    unsigned int state =
+        __atomic_fetch_or(&p_job->state, THPOOL_JOB_DONE, __ATOMIC_ACQ_REL);
+    if (state & THPOOL_JOB_THEN)
+    {
+        p_job->then(result, p_job->then_ctx);
+    }
+    if (state & THPOOL_JOB_WAITER)
+    {
+        pthread_mutex_lock(&(p_pool->done_lock));
+        pthread_cond_broadcast(&(p_pool->done));
+        pthread_mutex_unlock(&(p_pool->done_lock));
+    }
+    thpool_job_release(p_job);
+} /* job_finish() */
+
+void thpool_job_run(job_t * p_job)
+{
+    job_finish(p_job, p_job->function(p_job->arg));
+} /* thpool_job_run() */
+
+void thpool_job_discard(job_t * p_job)
+{
+    if (NULL != p_job->discard)
+    {
+        p_job->discard(p_job->arg);
+    }
+    job_finish(p_job, NULL);
+} /* thpool_job_discard() */
+
+void thpool_jobs_free(threadpool_t * p_pool)
+{
+    job_chunk_t * p_chunk = p_pool->job_chunks;
+    while (NULL != p_chunk)
+    {
+        job_chunk_t * p_next = p_chunk->next;
+        free(p_chunk);
+        p_chunk = p_next;
+    }
+    p_pool->job_chunks = NULL;
+    p_pool->free_jobs  = NULL;
+    p_pool->returned   = NULL;
+} /* thpool_jobs_free() */
+
+bool thpool_future_poll(thpool_future_t * p_future)
+{
+    if (NULL == p_future)
+    {
+        fprintf(stderr, "Invalid arguments to thpool_future_poll\n");
+        return false;
+    }
+    return 0 != (__atomic_load_n(&p_future->state, __ATOMIC_ACQUIRE) & THPOOL_JOB_DONE);
+} /* thpool_future_poll() */
+
+void * thpool_future_wait(thpool_future_t * p_future)
+{
+    if (NULL == p_future)
+    {
+        fprintf(stderr, "Invalid arguments to thpool_future_wait\n");
+        return NULL;
+    }
+    if (thpool_future_poll(p_future))
+    {
+        return p_future->result;
+    }
+    threadpool_t * p_pool = p_future->p_pool;
+    pthread_mutex_lock(&(p_pool->done_lock));
+    // Set under done_lock, so a task finishing after this cannot broadcast
+    // before the wait below has started
+    __atomic_fetch_or(&p_future->state, THPOOL_JOB_WAITER, __ATOMIC_ACQ_REL);
+    while (!thpool_future_poll(p_future))
+    {
+        pthread_cond_wait(&(p_pool->done), &(p_pool->done_lock));
+    }
+    pthread_mutex_unlock(&(p_pool->done_lock));
+    return p_future->result;
+} /* thpool_future_wait() */
+
+int thpool_future_then(thpool_future_t *     p_future,
+                       thpool_continuation * then,
+                       void *                p_ctx)
+{
+    if ((NULL == p_future) || (NULL == then))
+    {
+        fprintf(stderr, "Invalid arguments to thpool_future_then\n");
+        return FAIL_CODE;
+    }
+    unsigned int state = __atomic_load_n(&p_future->state, __ATOMIC_ACQUIRE);
+    if (state & THPOOL_JOB_THEN)
+    {
+        fprintf(stderr, "thpool_future_then: future already has a continuation\n");
+        return FAIL_CODE;
+    }
+    p_future->then     = then;
+    p_future->then_ctx = p_ctx;
+    while (0 == (state & THPOOL_JOB_DONE))
+    {
+        // Published with the flag, the finishing thread reads them after it
+        if (__atomic_compare_exchange_n(&p_future->state,
+                                        &state,
+                                        state | THPOOL_JOB_THEN,
+                                        true,
+                                        __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE))
+        {
+            return SUCCESS_CODE;
+        }
+    }
+    // Flagged anyway, so a second continuation is refused either way
+    __atomic_fetch_or(&p_future->state, THPOOL_JOB_THEN, __ATOMIC_RELAXED);
+    then(p_future->result, p_ctx);
+    return SUCCESS_CODE;
+} /* thpool_future_then() */
+
+void thpool_future_release(thpool_future_t * p_future)
+{
+    if (NULL == p_future)
+    {
+        fprintf(stderr, "Invalid arguments to thpool_future_release\n");
+        return;
+    }
+    thpool_job_release(p_future);
+} /* thpool_future_release() */
+
+/*** end of file ***/
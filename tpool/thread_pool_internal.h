@@ -0,0 +1,214 @@
+/* @file thread_pool_internal.h
+ * Private definitions shared by the thread pool translation units
+ */
+
+#ifndef THREAD_POOL_INTERNAL_H
+#define THREAD_POOL_INTERNAL_H
+
+#include "thread_pool.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define POOL_SIZE_MIN 1
+#define FAIL_CODE     -1
+#define SUCCESS_CODE  1
+
+#define THPOOL_CACHE_LINE   64
+#define THPOOL_DEQUE_SIZE   256 // jobs a worker's deque starts with, a power of two
+#define THPOOL_INJECT_BATCH 32  // most jobs a worker moves off the shared queue at once
+#define THPOOL_JOB_CHUNK    64  // jobs allocated together when none are free
+#define THPOOL_FREE_LOCAL   64  // jobs a worker keeps before handing them back
+#define THPOOL_RING_SIZE    1024 // ring queue slots when opts.queue_capacity is 0
+#define THPOOL_GROW_DEPTH   4    // opts.grow_depth default
+#define THPOOL_GROW_WAIT_MS 10   // opts.grow_wait_ms default
+#define THPOOL_LINGER_MS    5000 // opts.linger_ms default
+
+#define THPOOL_JOB_DONE    0x1u // function returned or the job was discarded
+#define THPOOL_JOB_WAITER  0x2u // a thread sleeps on done for this job
+#define THPOOL_JOB_THEN    0x4u // then and then_ctx are set
+
+#define THPOOL_THREAD_NONE    0 // slot has no thread
+#define THPOOL_THREAD_RUNNING 1 // slot's thread runs jobs
+#define THPOOL_THREAD_EXITED  2 // slot's thread retired and waits to be joined
+
+/**
+ * @brief jobs of one Chase-Lev deque, replaced by one twice as large when full
+ * @NOTE: a stealer may still be reading the array a grow replaced, so replaced
+ * arrays stay chained to their successor until the deque is destroyed.
+ */
+typedef struct thpool_deque_array
+{
+    int64_t                     mask;   // size - 1, the size is a power of two
+    struct thpool_deque_array * p_prev; // array this one replaced, or NULL
+    _Atomic(job_t *)            jobs[];
+} thpool_deque_array_t;
+
+/**
+ * @brief work-stealing deque of one worker. The owner pushes and takes at the
+ * bottom, any other worker steals from the top.
+ */
+typedef struct thpool_deque
+{
+    _Alignas(THPOOL_CACHE_LINE) atomic_int_fast64_t top;    // next job to steal
+    _Alignas(THPOOL_CACHE_LINE) atomic_int_fast64_t bottom; // next free slot
+    _Atomic(thpool_deque_array_t *)                 array;
+} thpool_deque_t;
+
+/**
+ * @brief one slot of a ring, see thread_pool_ring.c
+ */
+typedef struct thpool_ring_slot
+{
+    atomic_size_t sequence; // position the slot is next written or read at
+    job_t *       job;
+} thpool_ring_slot_t;
+
+/**
+ * @brief bounded lock-free queue of jobs, any thread may push and pop
+ */
+struct thpool_ring
+{
+    _Alignas(THPOOL_CACHE_LINE) atomic_size_t enqueue_pos; // next push position
+    _Alignas(THPOOL_CACHE_LINE) atomic_size_t dequeue_pos; // next pop position
+    _Alignas(THPOOL_CACHE_LINE) size_t        mask;        // slots - 1
+    thpool_ring_slot_t *                      slots;
+};
+
+/**
+ * @brief a thread of a work-stealing pool, see thread_steal_function
+ */
+struct thpool_worker
+{
+    thpool_deque_t deque;
+    threadpool_t * p_pool;
+    uint64_t       rng;        // xorshift state for picking victims
+    job_t *        free_jobs;  // released jobs kept for this thread's submits
+    int            free_count; // jobs released onto free_jobs since the last hand back
+} __attribute__((aligned(THPOOL_CACHE_LINE)));
+
+extern __thread thpool_worker_t * t_thpool_worker; // set on work-stealing threads
+
+/**
+ * @brief Takes a free job for a submit. The caller holds the pool lock.
+ * @return job_t* on success
+ * @return NULL when no job was free and no chunk could be allocated
+ */
+job_t * thpool_job_alloc_locked(threadpool_t * p_pool);
+
+/**
+ * @brief Takes a free job for a submit to a ring queue, from the ring of free
+ * jobs while it lasts and under the pool lock after that
+ * @return job_t* on success
+ * @return NULL on failure
+ */
+job_t * thpool_job_alloc_shared(threadpool_t * p_pool);
+
+/**
+ * @brief Takes a free job for a submit from a thread of a work-stealing
+ * pool, without the pool lock while its own free list lasts
+ * @return job_t* on success
+ * @return NULL on failure
+ */
+job_t * thpool_job_alloc_local(thpool_worker_t * p_worker);
+
+/**
+ * @brief Drops one reference to a job, recycling it with the last one
+ */
+void thpool_job_release(job_t * p_job);
+
+/**
+ * @brief Runs a job's task, completes its future and drops the pool's reference
+ */
+void thpool_job_run(job_t * p_job);
+
+/**
+ * @brief Completes a job's future without running the task, for jobs still
+ * queued when the pool is destroyed, and drops the pool's reference
+ */
+void thpool_job_discard(job_t * p_job);
+
+/**
+ * @brief Frees every chunk of jobs, once the threads are gone
+ */
+void thpool_jobs_free(threadpool_t * p_pool);
+
+/**
+ * @brief Sets up an empty ring
+ * @param size_t number of slots, a power of two
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE on failure
+ */
+int thpool_ring_init(thpool_ring_t * p_ring, size_t size);
+
+/**
+ * @brief Frees the slots of a ring. Jobs still in it are not touched.
+ */
+void thpool_ring_destroy(thpool_ring_t * p_ring);
+
+/**
+ * @brief Appends a job
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE when the ring is full
+ */
+int thpool_ring_push(thpool_ring_t * p_ring, job_t * p_job);
+
+/**
+ * @brief Takes the oldest job
+ * @return job_t* on success
+ * @return NULL when the ring is empty
+ */
+job_t * thpool_ring_pop(thpool_ring_t * p_ring);
+
+/**
+ * @brief Checks whether the next job to pop is ready, racing with producers
+ */
+bool thpool_ring_empty(thpool_ring_t * p_ring);
+
+/**
+ * @brief Returns roughly how many jobs a ring holds
+ */
+size_t thpool_ring_count(thpool_ring_t * p_ring);
+
+/**
+ * @brief Sets up an empty deque
+ * @param size_t initial number of slots, a power of two
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE on failure
+ */
+int thpool_deque_init(thpool_deque_t * p_deque, size_t size);
+
+/**
+ * @brief Frees the arrays of a deque. Jobs still in it are not touched.
+ */
+void thpool_deque_destroy(thpool_deque_t * p_deque);
+
+/**
+ * @brief Pushes a job at the bottom, growing the deque when it is full.
+ * Only the owner may call it.
+ * @return SUCCESS_CODE on success
+ * @return FAIL_CODE when the deque is full and could not grow
+ */
+int thpool_deque_push(thpool_deque_t * p_deque, job_t * p_job);
+
+/**
+ * @brief Takes the job pushed last. Only the owner may call it.
+ * @return job_t* on success
+ * @return NULL when the deque is empty
+ */
+job_t * thpool_deque_take(thpool_deque_t * p_deque);
+
+/**
+ * @brief Steals the job pushed first. Any thread may call it.
+ * @param bool* set when the deque was not empty but another thread won the
+ * job, so trying again may succeed
+ * @return job_t* on success
+ * @return NULL when there was nothing to steal
+ */
+job_t * thpool_deque_steal(thpool_deque_t * p_deque, bool * p_lost);
+
+/**
+ * @brief Checks whether a deque holds jobs, racing with its owner and thieves
+ */
+bool thpool_deque_empty(thpool_deque_t * p_deque);
+
+#endif /* THREAD_POOL_INTERNAL_H */
@@ -0,0 +1,131 @@
+/** @file thread_pool_ring.c
+ *
+ * @brief Bounded multi-producer multi-consumer ring of jobs, after Dmitry
+ * Vyukov's design, for pools created with THPOOL_QUEUE_RING.
+ *
+ * Every slot carries a sequence number that says whose turn it is: a slot at
+ * position pos is free for the producer of pos when its sequence is pos, and
+ * holds a job for the consumer of pos once it is pos + 1. A producer or
+ * consumer claims its position with one compare-and-swap on the shared
+ * counter and then hands the slot on with one store to its sequence, so a job
+ * passes between threads in a couple of atomic operations and nothing is
+ * allocated or locked.
+ *
+ */
+
+#include "thread_pool_internal.h"
+
+int thpool_ring_init(thpool_ring_t * p_ring, size_t size)
+{
+    p_ring->slots = aligned_alloc(THPOOL_CACHE_LINE, size * sizeof(thpool_ring_slot_t));
+    if (NULL == p_ring->slots)
+    {
+        fprintf(stderr, "thpool_ring_init: aligned_alloc failed\n");
+        return FAIL_CODE;
+    }
+    p_ring->mask = size - 1;
+    for (size_t i = 0; i < size; i++)
+    {
+        atomic_init(&p_ring->slots[i].sequence, i);
+        p_ring->slots[i].job = NULL;
+    }
+    atomic_init(&p_ring->enqueue_pos, 0);
+    atomic_init(&p_ring->dequeue_pos, 0);
+    return SUCCESS_CODE;
+} /* thpool_ring_init() */
+
+void thpool_ring_destroy(thpool_ring_t * p_ring)
+{
+    free(p_ring->slots);
+    p_ring->slots = NULL;
+} /* thpool_ring_destroy() */
+
+int thpool_ring_push(thpool_ring_t * p_ring, job_t * p_job)
+{
+    thpool_ring_slot_t * p_slot = NULL;
+    size_t pos = atomic_load_explicit(&p_ring->enqueue_pos, memory_order_relaxed);
+    for (;;)
+    {
+        p_slot       = &p_ring->slots[pos & p_ring->mask];
+        size_t  seq  = atomic_load_explicit(&p_slot->sequence, memory_order_acquire);
+        int64_t diff = (int64_t)seq - (int64_t)pos;
+        if (0 == diff)
+        {
+            if (atomic_compare_exchange_weak_explicit(&p_ring->enqueue_pos,
+                                                      &pos,
+                                                      pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (0 > diff)
+        {
+            // The consumer of the previous lap has not freed the slot yet
+            return FAIL_CODE;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&p_ring->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    p_slot->job = p_job;
+    // Sequentially consistent so a submitter's next look at the idle count
+    // cannot move ahead of it, see thpool_wake
+    atomic_store_explicit(&p_slot->sequence, pos + 1, memory_order_seq_cst);
+    return SUCCESS_CODE;
+} /* thpool_ring_push() */
+
+job_t * thpool_ring_pop(thpool_ring_t * p_ring)
+{
+    thpool_ring_slot_t * p_slot = NULL;
+    size_t pos = atomic_load_explicit(&p_ring->dequeue_pos, memory_order_relaxed);
+    for (;;)
+    {
+        p_slot       = &p_ring->slots[pos & p_ring->mask];
+        size_t  seq  = atomic_load_explicit(&p_slot->sequence, memory_order_acquire);
+        int64_t diff = (int64_t)seq - (int64_t)(pos + 1);
+        if (0 == diff)
+        {
+            if (atomic_compare_exchange_weak_explicit(&p_ring->dequeue_pos,
+                                                      &pos,
+                                                      pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (0 > diff)
+        {
+            return NULL;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&p_ring->dequeue_pos, memory_order_relaxed);
+        }
+    }
+    job_t * p_job = p_slot->job;
+    // Frees the slot for the producer one lap ahead
+    atomic_store_explicit(
+        &p_slot->sequence, pos + p_ring->mask + 1, memory_order_release);
+    return p_job;
+} /* thpool_ring_pop() */
+
+bool thpool_ring_empty(thpool_ring_t * p_ring)
+{
+    size_t pos = atomic_load_explicit(&p_ring->dequeue_pos, memory_order_seq_cst);
+    size_t seq = atomic_load_explicit(&p_ring->slots[pos & p_ring->mask].sequence,
+                                      memory_order_seq_cst);
+    return seq != pos + 1;
+} /* thpool_ring_empty() */
+
+size_t thpool_ring_count(thpool_ring_t * p_ring)
+{
+    size_t dequeued = atomic_load_explicit(&p_ring->dequeue_pos, memory_order_relaxed);
+    size_t enqueued = atomic_load_explicit(&p_ring->enqueue_pos, memory_order_relaxed);
+    return (enqueued > dequeued) ? enqueued - dequeued : 0;
+} /* thpool_ring_count() */
+
+/*** end of file ***/